@@ -0,0 +1,165 @@
+// Benchmarks the hash table on its own, without the vm.
+//
+// Build it with every source file except main.c:
+//
+//   gcc -O2 -std=c11 -Isrc benchmarks/hash_table.c $(ls src/*.c | grep -v main.c) -lm
+//
+// The keys are created with malloc instead of the vm's allocator,
+// which is fine because the table never looks at anything
+// but the length, the hash and the characters of a key.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/hash_table.h"
+#include "../src/obj.h"
+
+#define KEY_COUNT 200000
+#define ROUNDS 20
+
+// http://www.isthe.com/chongo/tech/comp/fnv/
+static uint32_t hash_string(const char *string, int length)
+{
+  uint32_t hash = 2166136261u;
+
+  for (int i = 0; i < length; i++)
+  {
+    hash ^= (uint8_t)string[i];
+    hash *= 16777619;
+  }
+
+  return hash;
+}
+
+static ObjString *new_key(const char *prefix, int i)
+{
+  char chars[32];
+  int length = snprintf(chars, sizeof(chars), "%s%d", prefix, i);
+  ObjString *key = (ObjString *)calloc(1, sizeof(ObjString) + length + 1);
+
+  if (key == NULL)
+  {
+    exit(1);
+  }
+
+  key->obj.type = OBJ_STRING;
+  key->length = length;
+  key->hash = hash_string(chars, length);
+  key->is_interned = true;
+  memcpy(key->chars, chars, length + 1);
+  return key;
+}
+
+static double seconds(clock_t start)
+{
+  return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main(void)
+{
+  ObjString **keys = (ObjString **)malloc(sizeof(ObjString *) * KEY_COUNT);
+  ObjString **missing = (ObjString **)malloc(sizeof(ObjString *) * KEY_COUNT);
+
+  for (int i = 0; i < KEY_COUNT; i++)
+  {
+    keys[i] = new_key("key", i);
+    missing[i] = new_key("missing", i);
+  }
+
+  // Keeps the compiler from removing the lookups.
+  size_t found = 0;
+  clock_t start = clock();
+
+  for (int round = 0; round < ROUNDS; round++)
+  {
+    HashTable table = new_hash_table();
+
+    for (int i = 0; i < KEY_COUNT; i++)
+    {
+      hash_table_set(&table, keys[i], NUMBER_VAL(i));
+    }
+
+    free_hash_table(&table);
+  }
+
+  printf("insert       %.3fs\n", seconds(start));
+
+  HashTable table = new_hash_table();
+
+  for (int i = 0; i < KEY_COUNT; i++)
+  {
+    hash_table_set(&table, keys[i], NUMBER_VAL(i));
+  }
+
+  start = clock();
+
+  for (int round = 0; round < ROUNDS; round++)
+  {
+    for (int i = 0; i < KEY_COUNT; i++)
+    {
+      found += hash_table_get(&table, keys[i]) != NULL;
+    }
+  }
+
+  printf("lookup hit   %.3fs\n", seconds(start));
+  start = clock();
+
+  for (int round = 0; round < ROUNDS; round++)
+  {
+    for (int i = 0; i < KEY_COUNT; i++)
+    {
+      found += hash_table_get(&table, missing[i]) != NULL;
+    }
+  }
+
+  printf("lookup miss  %.3fs\n", seconds(start));
+  start = clock();
+
+  // Interning looks strings up by their characters.
+  for (int round = 0; round < ROUNDS; round++)
+  {
+    for (int i = 0; i < KEY_COUNT; i++)
+    {
+      ObjString *key = (i & 1) ? keys[i] : missing[i];
+      found += hash_table_find_string(&table, key->chars, key->length, key->hash) != NULL;
+    }
+  }
+
+  printf("find string  %.3fs\n", seconds(start));
+  start = clock();
+
+  // Deleting and inserting keys over and over
+  // without the table growing.
+  for (int round = 0; round < ROUNDS; round++)
+  {
+    for (int i = 0; i < KEY_COUNT; i++)
+    {
+      hash_table_delete(&table, keys[i]);
+      hash_table_set(&table, missing[i], NUMBER_VAL(i));
+    }
+
+    for (int i = 0; i < KEY_COUNT; i++)
+    {
+      hash_table_delete(&table, missing[i]);
+      hash_table_set(&table, keys[i], NUMBER_VAL(i));
+    }
+  }
+
+  printf("delete heavy %.3fs\n", seconds(start));
+
+  free_hash_table(&table);
+  printf("found %zu\n", found);
+
+  for (int i = 0; i < KEY_COUNT; i++)
+  {
+    free(keys[i]);
+    free(missing[i]);
+  }
+
+  free(keys);
+  free(missing);
+
+  return 0;
+}
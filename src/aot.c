@@ -0,0 +1,653 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aot.h"
+#include "compiler.h"
+
+// Compiling
+//
+// The C is written straight from the bytecode, one macro per
+// instruction. Jump targets get a label and number constants are
+// written as C literals, so the C compiler can fold them.
+
+// Writes [chars] as a C string literal. Everything but letters,
+// digits and a few safe characters is escaped, in octal with three
+// digits so the next character never extends the escape.
+static void write_string_literal(FILE *output, const char *chars, int length)
+{
+  fputc('"', output);
+
+  for (int i = 0; i < length; i++)
+  {
+    unsigned char c = (unsigned char)chars[i];
+
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+        (c != '\0' && strchr(" _-+*/=<>!.,:;()[]{}#&|^~%@$'", c) != NULL))
+    {
+      fputc(c, output);
+    }
+    else
+    {
+      fprintf(output, "\\%03o", c);
+    }
+  }
+
+  fputc('"', output);
+}
+
+// Numbers are written in hexadecimal,
+// which reads back as the exact same double.
+static void write_number(FILE *output, double number)
+{
+  if (isnan(number))
+  {
+    fprintf(output, signbit(number) ? "-NAN" : "NAN");
+  }
+  else if (isinf(number))
+  {
+    fprintf(output, number > 0 ? "INFINITY" : "-INFINITY");
+  }
+  else
+  {
+    fprintf(output, "%a", number);
+  }
+}
+
+// Writes the Value expression for constant [index].
+static void write_constant(FILE *output, Chunk *chunk, uint8_t index)
+{
+  Value value = chunk->constants.values[index];
+
+  if (IS_NUMBER(value))
+  {
+    fprintf(output, "NUMBER_VAL(");
+    write_number(output, AS_NUMBER(value));
+    fprintf(output, ")");
+  }
+  else
+  {
+    fprintf(output, "AOT_CONSTANT(%d)", index);
+  }
+}
+
+static uint16_t read_short(const uint8_t *code)
+{
+  return (uint16_t)((code[1] << 8) | code[2]);
+}
+
+// Marks the offsets jumps go to, only they get a label.
+static bool *find_jump_targets(Chunk *chunk)
+{
+  bool *targets = (bool *)calloc(chunk->count + 1, sizeof(bool));
+
+  if (targets == NULL)
+  {
+    exit(1);
+  }
+
+  for (size_t offset = 0; offset < chunk->count;)
+  {
+    const uint8_t *code = &chunk->code[offset];
+    size_t next = offset + instruction_length(code[0]);
+
+    switch (unquickened_opcode(code[0]))
+    {
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP:
+      targets[next + read_short(code)] = true;
+      break;
+    case OP_LOOP:
+      targets[next - read_short(code)] = true;
+      break;
+    default:
+      break;
+    }
+
+    offset = next;
+  }
+
+  return targets;
+}
+
+static void write_binary_constant(FILE *output, Chunk *chunk, const char *value_type,
+                                  const char *op, const uint8_t *code, size_t next)
+{
+  fprintf(output, "  AOT_BINARY_CONSTANT(%s, %s, ", value_type, op);
+  write_constant(output, chunk, code[1]);
+  fprintf(output, ", %zu);\n", next);
+}
+
+// Writes the C for the instruction at [offset], returns false
+// if it has no C translation.
+static bool write_instruction(FILE *output, Chunk *chunk, size_t offset, size_t next)
+{
+  const uint8_t *code = &chunk->code[offset];
+
+  switch (unquickened_opcode(code[0]))
+  {
+  case OP_CONSTANT:
+    fprintf(output, "  AOT_PUSH(");
+    write_constant(output, chunk, code[1]);
+    fprintf(output, ");\n");
+    break;
+  case OP_NIL:
+    fprintf(output, "  AOT_PUSH(NIL_VAL);\n");
+    break;
+  case OP_TRUE:
+    fprintf(output, "  AOT_PUSH(BOOL_VAL(true));\n");
+    break;
+  case OP_FALSE:
+    fprintf(output, "  AOT_PUSH(BOOL_VAL(false));\n");
+    break;
+  case OP_RETURN:
+    fprintf(output, "  AOT_RETURN(%zu);\n", next);
+    break;
+  case OP_NEGATE:
+    fprintf(output, "  AOT_NEGATE(%zu);\n", next);
+    break;
+  case OP_ADD:
+    fprintf(output, "  AOT_ADD(%zu);\n", next);
+    break;
+  case OP_SUBTRACT:
+    fprintf(output, "  AOT_BINARY(NUMBER_VAL, -, %zu);\n", next);
+    break;
+  case OP_MULTIPLY:
+    fprintf(output, "  AOT_BINARY(NUMBER_VAL, *, %zu);\n", next);
+    break;
+  case OP_DIVIDE:
+    fprintf(output, "  AOT_BINARY(NUMBER_VAL, /, %zu);\n", next);
+    break;
+  case OP_NOT:
+    fprintf(output, "  AOT_NOT();\n");
+    break;
+  case OP_EQUAL:
+    fprintf(output, "  AOT_EQUAL(==, vm_equal, %zu);\n", next);
+    break;
+  case OP_NOT_EQUAL:
+    fprintf(output, "  AOT_EQUAL(!=, vm_not_equal, %zu);\n", next);
+    break;
+  case OP_GREATER:
+    fprintf(output, "  AOT_BINARY(BOOL_VAL, >, %zu);\n", next);
+    break;
+  case OP_LESS:
+    fprintf(output, "  AOT_BINARY(BOOL_VAL, <, %zu);\n", next);
+    break;
+  // `a >= b` is `!(a < b)` and `a <= b` is `!(a > b)`, like in [run].
+  case OP_GREATER_EQUAL:
+    fprintf(output, "  AOT_BINARY(AOT_NOT_BOOL_VAL, <, %zu);\n", next);
+    break;
+  case OP_LESS_EQUAL:
+    fprintf(output, "  AOT_BINARY(AOT_NOT_BOOL_VAL, >, %zu);\n", next);
+    break;
+  case OP_PRINT:
+    fprintf(output, "  AOT_PRINT(%zu);\n", next);
+    break;
+  case OP_POP:
+    fprintf(output, "  AOT_POP();\n");
+    break;
+  case OP_POPN:
+    fprintf(output, "  AOT_POPN(%d);\n", code[1]);
+    break;
+  case OP_DEFINE_GLOBAL:
+    fprintf(output, "  AOT_DEFINE_GLOBAL(%d, %zu);\n", read_short(code), next);
+    break;
+  case OP_GET_GLOBAL:
+    fprintf(output, "  AOT_GET_GLOBAL(%d, %zu);\n", read_short(code), next);
+    break;
+  case OP_SET_GLOBAL:
+    fprintf(output, "  AOT_SET_GLOBAL(%d, %zu);\n", read_short(code), next);
+    break;
+  case OP_SET_GLOBAL_POP:
+    fprintf(output, "  AOT_SET_GLOBAL(%d, %zu);\n  AOT_POP();\n", read_short(code), next);
+    break;
+  case OP_GET_LOCAL:
+    fprintf(output, "  AOT_GET_LOCAL(%d);\n", code[1]);
+    break;
+  case OP_SET_LOCAL:
+    fprintf(output, "  AOT_SET_LOCAL(%d);\n", code[1]);
+    break;
+  case OP_SET_LOCAL_POP:
+    fprintf(output, "  AOT_SET_LOCAL_POP(%d);\n", code[1]);
+    break;
+  case OP_JUMP_IF_FALSE:
+    fprintf(output, "  AOT_JUMP_IF_FALSE(L%zu);\n", next + read_short(code));
+    break;
+  case OP_POP_JUMP_IF_FALSE:
+    fprintf(output, "  AOT_POP_JUMP_IF_FALSE(L%zu);\n", next + read_short(code));
+    break;
+  case OP_JUMP:
+    fprintf(output, "  goto L%zu;\n", next + read_short(code));
+    break;
+  case OP_LOOP:
+    fprintf(output, "  AOT_LOOP(L%zu, %zu);\n", next - read_short(code), next);
+    break;
+  case OP_CALL:
+    fprintf(output, "  AOT_CALL(%d, %zu);\n", code[1], next);
+    break;
+  case OP_TAIL_CALL:
+    fprintf(output, "  AOT_TAIL_CALL(%d, %zu);\n", code[1], next);
+    break;
+  case OP_CLOSURE:
+    fprintf(output, "  AOT_CLOSURE(%d, %zu);\n", code[1], next);
+    break;
+  case OP_GET_UPVALUE:
+    fprintf(output, "  AOT_GET_UPVALUE(%d);\n", code[1]);
+    break;
+  case OP_SET_UPVALUE:
+    fprintf(output, "  AOT_SET_UPVALUE(%d, %zu);\n", code[1], next);
+    break;
+  case OP_CLOSE_UPVALUE:
+    fprintf(output, "  AOT_CLOSE_UPVALUE(%zu);\n", next);
+    break;
+  case OP_SQRT:
+    fprintf(output, "  AOT_SQRT(%d, %zu);\n", read_short(code), next);
+    break;
+  case OP_FLOOR:
+    fprintf(output, "  AOT_FLOOR(%d, %zu);\n", read_short(code), next);
+    break;
+  case OP_ABS:
+    fprintf(output, "  AOT_ABS(%d, %zu);\n", read_short(code), next);
+    break;
+  case OP_MIN:
+    fprintf(output, "  AOT_MIN(%d, %zu);\n", read_short(code), next);
+    break;
+  case OP_MAX:
+    fprintf(output, "  AOT_MAX(%d, %zu);\n", read_short(code), next);
+    break;
+  case OP_POW:
+    fprintf(output, "  AOT_POW(%d, %zu);\n", read_short(code), next);
+    break;
+  case OP_ADD_CONSTANT:
+    fprintf(output, "  AOT_ADD_CONSTANT(");
+    write_constant(output, chunk, code[1]);
+    fprintf(output, ", %zu);\n", next);
+    break;
+  case OP_SUBTRACT_CONSTANT:
+    write_binary_constant(output, chunk, "NUMBER_VAL", "-", code, next);
+    break;
+  case OP_MULTIPLY_CONSTANT:
+    write_binary_constant(output, chunk, "NUMBER_VAL", "*", code, next);
+    break;
+  case OP_DIVIDE_CONSTANT:
+    write_binary_constant(output, chunk, "NUMBER_VAL", "/", code, next);
+    break;
+  case OP_LESS_CONSTANT:
+    write_binary_constant(output, chunk, "BOOL_VAL", "<", code, next);
+    break;
+  case OP_GREATER_CONSTANT:
+    write_binary_constant(output, chunk, "BOOL_VAL", ">", code, next);
+    break;
+  case OP_EQUAL_CONSTANT:
+    fprintf(output, "  AOT_EQUAL_CONSTANT(");
+    write_constant(output, chunk, code[1]);
+    fprintf(output, ", %zu);\n", next);
+    break;
+  case OP_ADD_LOCAL_CONSTANT:
+    fprintf(output, "  AOT_ADD_LOCAL_CONSTANT(%d, ", code[1]);
+    write_constant(output, chunk, code[2]);
+    fprintf(output, ", %zu);\n", next);
+    break;
+  default:
+    fprintf(stderr, "Opcode %d can not be compiled to C\n", code[0]);
+    return false;
+  }
+
+  return true;
+}
+
+// Writes the AotFunction of [chunk] as `run_<id>`.
+static bool write_function(FILE *output, Chunk *chunk, int id)
+{
+  bool *targets = find_jump_targets(chunk);
+
+  fprintf(output, "static bool run_%d(Vm *vm)\n{\n", id);
+  fprintf(output, "  Value *stack_top = vm->stack_top;\n");
+  fprintf(output, "  Value *slots = vm->frames[vm->frame_count - 1].slots;\n");
+  fprintf(output, "  Value *globals = vm->global_values.values;\n");
+  fprintf(output, "  (void)slots;\n");
+  fprintf(output, "  (void)globals;\n\n");
+
+  for (size_t offset = 0; offset < chunk->count;)
+  {
+    size_t next = offset + instruction_length(chunk->code[offset]);
+
+    if (targets[offset])
+    {
+      fprintf(output, "L%zu:\n", offset);
+    }
+
+    if (!write_instruction(output, chunk, offset, next))
+    {
+      free(targets);
+      return false;
+    }
+
+    offset = next;
+  }
+
+  fprintf(output, "}\n\n");
+  free(targets);
+  return true;
+}
+
+// Writes the arrays, the AotFunction and the AotChunk of [function]
+// as `chunk_<id>`, after the chunks of the functions among its
+// constants, which are numbered from [*next_id]. Returns false if a
+// constant or an instruction can not be written.
+static bool write_chunk_definition(FILE *output, ObjFunction *function, int id, int *next_id)
+{
+  Chunk *chunk = &function->chunk;
+  int *function_ids = (int *)calloc(chunk->constants.count + 1, sizeof(int));
+
+  if (function_ids == NULL)
+  {
+    exit(1);
+  }
+
+  for (size_t i = 0; i < chunk->constants.count; i++)
+  {
+    Value value = chunk->constants.values[i];
+
+    if (IS_FUNCTION(value))
+    {
+      function_ids[i] = (*next_id)++;
+
+      if (!write_chunk_definition(output, AS_FUNCTION(value), function_ids[i], next_id))
+      {
+        free(function_ids);
+        return false;
+      }
+    }
+  }
+
+  fprintf(output, "static const uint8_t code_%d[] = {", id);
+
+  for (size_t i = 0; i < chunk->count; i++)
+  {
+    fprintf(output, "%s%d,", i % 16 == 0 ? "\n    " : " ", chunk->code[i]);
+  }
+
+  fprintf(output, "\n};\n\nstatic const size_t lines_%d[] = {", id);
+
+  for (size_t i = 0; i < chunk->count; i++)
+  {
+    fprintf(output, "%s%zu,", i % 16 == 0 ? "\n    " : " ", chunk->lines[i]);
+  }
+
+  fprintf(output, "\n};\n\nstatic const AotConstant constants_%d[] = {\n", id);
+
+  for (size_t i = 0; i < chunk->constants.count; i++)
+  {
+    Value value = chunk->constants.values[i];
+    fprintf(output, "    {");
+
+    if (IS_NUMBER(value))
+    {
+      fprintf(output, "AOT_NUMBER, ");
+      write_number(output, AS_NUMBER(value));
+      fprintf(output, ", NULL, 0, NULL");
+    }
+    else if (IS_STRING(value))
+    {
+      ObjString *string = AS_OBJSTRING(value);
+      fprintf(output, "AOT_STRING, 0, ");
+      write_string_literal(output, string->chars, string->length);
+      fprintf(output, ", %d, NULL", string->length);
+    }
+    else if (IS_NIL(value))
+    {
+      fprintf(output, "AOT_NIL, 0, NULL, 0, NULL");
+    }
+    else if (IS_BOOL(value))
+    {
+      fprintf(output, "%s, 0, NULL, 0, NULL", AS_BOOL(value) ? "AOT_TRUE" : "AOT_FALSE");
+    }
+    else if (IS_FUNCTION(value))
+    {
+      fprintf(output, "AOT_FUNCTION, 0, NULL, 0, &chunk_%d", function_ids[i]);
+    }
+    else
+    {
+      fprintf(stderr, "Constant %zu can not be compiled to C\n", i);
+      free(function_ids);
+      return false;
+    }
+
+    fprintf(output, "},\n");
+  }
+
+  // An empty initializer is not valid C.
+  if (chunk->constants.count == 0)
+  {
+    fprintf(output, "    {AOT_NIL, 0, NULL, 0, NULL},\n");
+  }
+
+  fprintf(output, "};\n\n");
+
+  if (!write_function(output, chunk, id))
+  {
+    free(function_ids);
+    return false;
+  }
+
+  if (function->upvalue_count > 0)
+  {
+    fprintf(output, "static const Capture captures_%d[] = {\n", id);
+
+    for (int i = 0; i < function->upvalue_count; i++)
+    {
+      Capture *capture = &function->captures[i];
+      fprintf(output, "    {%s, %d},\n", capture->is_local ? "true" : "false", capture->index);
+    }
+
+    fprintf(output, "};\n\n");
+  }
+
+  fprintf(output, "static const AotChunk chunk_%d = {\n    ", id);
+
+  if (function->name == NULL)
+  {
+    fprintf(output, "NULL");
+  }
+  else
+  {
+    write_string_literal(output, function->name->chars, function->name->length);
+  }
+
+  fprintf(output, ", %d, code_%d, lines_%d, %zu, constants_%d, %zu,\n", function->arity, id,
+          id, chunk->count, id, chunk->constants.count);
+
+  if (function->upvalue_count > 0)
+  {
+    fprintf(output, "    %d, captures_%d, run_%d,\n};\n\n", function->upvalue_count, id, id);
+  }
+  else
+  {
+    fprintf(output, "    0, NULL, run_%d,\n};\n\n", id);
+  }
+
+  free(function_ids);
+  return true;
+}
+
+static void write_globals(FILE *output, Vm *vm)
+{
+  fprintf(output, "static const char *const globals[] = {\n");
+
+  for (size_t i = 0; i < vm->global_names.count; i++)
+  {
+    ObjString *name = AS_OBJSTRING(vm->global_names.values[i]);
+    fprintf(output, "    ");
+    write_string_literal(output, name->chars, name->length);
+    fprintf(output, ",\n");
+  }
+
+  if (vm->global_names.count == 0)
+  {
+    fprintf(output, "    NULL,\n");
+  }
+
+  fprintf(output, "};\n\n");
+}
+
+bool aot_compile(Vm *vm, const char *source_code, const char *path, FILE *output)
+{
+  // The generated code is written for the stack machine.
+  vm->register_machine = false;
+
+  ObjFunction *function = compile(vm, source_code);
+
+  if (function == NULL)
+  {
+    return false;
+  }
+
+  // Writing the C does not allocate,
+  // so the function can not move or be freed.
+  fprintf(output, "// Compiled from %s by `-C`, see aot.h.\n\n", path);
+  fprintf(output, "#include \"aot.h\"\n\n");
+  write_globals(output, vm);
+
+  // The script is chunk 0, its functions are numbered from 1.
+  int next_id = 1;
+
+  if (!write_chunk_definition(output, function, 0, &next_id))
+  {
+    return false;
+  }
+
+  fprintf(output, "int main(void)\n{\n");
+  fprintf(output, "  static const AotScript script = {\n");
+  fprintf(output, "      &chunk_0, globals, %zu,\n", vm->global_names.count);
+  fprintf(output, "  };\n\n");
+  fprintf(output, "  return aot_main(&script);\n}\n");
+  return true;
+}
+
+// Running
+
+static Value constant_value(Vm *vm, const AotConstant *constant)
+{
+  switch (constant->type)
+  {
+  case AOT_NUMBER:
+    return NUMBER_VAL(constant->number);
+  case AOT_STRING:
+    return OBJ_VAL((Obj *)copy_string(vm, constant->chars, constant->length));
+  case AOT_TRUE:
+    return BOOL_VAL(true);
+  case AOT_FALSE:
+    return BOOL_VAL(false);
+  default:
+    return NIL_VAL;
+  }
+}
+
+// Rebuilds the function of [chunk] and pushes it. Functions among
+// its constants are rebuilt first, the same way.
+static void load_chunk(Vm *vm, const AotChunk *chunk)
+{
+  push(vm, OBJ_VAL((Obj *)new_function(vm)));
+  // Allocating may move the function, it is read
+  // from its stack slot after every allocation.
+  Value *slot = vm->stack_top - 1;
+  AS_FUNCTION(*slot)->arity = chunk->arity;
+  AS_FUNCTION(*slot)->aot = chunk->run;
+
+  if (chunk->name != NULL)
+  {
+    ObjString *name = copy_string(vm, chunk->name, (int)strlen(chunk->name));
+    AS_FUNCTION(*slot)->name = name;
+    write_barrier(vm, AS_OBJ(*slot), OBJ_VAL((Obj *)name));
+  }
+
+  for (size_t i = 0; i < chunk->count; i++)
+  {
+    write_chunk(&AS_FUNCTION(*slot)->chunk, chunk->code[i], chunk->lines[i]);
+  }
+
+  if (chunk->upvalue_count > 0)
+  {
+    Capture *captures = ALLOCATE(Capture, chunk->upvalue_count);
+    memcpy(captures, chunk->captures, sizeof(Capture) * chunk->upvalue_count);
+    AS_FUNCTION(*slot)->upvalue_count = chunk->upvalue_count;
+    AS_FUNCTION(*slot)->captures = captures;
+  }
+
+  for (size_t i = 0; i < chunk->constant_count; i++)
+  {
+    const AotConstant *constant = &chunk->constants[i];
+
+    if (constant->type == AOT_FUNCTION)
+    {
+      load_chunk(vm, constant->function);
+    }
+    else
+    {
+      push(vm, constant_value(vm, constant));
+    }
+
+    // Like in [make_constant], growing the constants
+    // array may start a collection.
+    Value value = vm->stack_top[-1];
+    ObjFunction *function = AS_FUNCTION(*slot);
+    add_constant(&function->chunk, value);
+    write_barrier(vm, (Obj *)function, value);
+    pop(vm);
+  }
+}
+
+// Rebuilds the script's function in stack slot zero, where
+// [interpret] would have put it, and gives the global variables
+// the slots the bytecode was compiled with.
+static bool load_script(Vm *vm, const AotScript *script)
+{
+  load_chunk(vm, script->chunk);
+
+  for (size_t i = 0; i < script->global_count; i++)
+  {
+    const char *name = script->globals[i];
+
+    if (resolve_global(vm, copy_string(vm, name, (int)strlen(name))) != (int)i)
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int aot_main(const AotScript *script)
+{
+  // [vm.stack_top] points into [vm.stack], so the vm must be
+  // initialized in place instead of being returned by value.
+  Vm vm;
+  init_vm(&vm);
+
+  if (!load_script(&vm, script))
+  {
+    fprintf(stderr, "The global variables do not match the compiled script\n");
+    free_vm(&vm);
+    return 70;
+  }
+
+  vm.frames[0].function = AS_FUNCTION(vm.stack[0]);
+  vm.frames[0].slots = vm.stack;
+  vm.frame_count = 1;
+  vm.chunk = &vm.frames[0].function->chunk;
+  vm.ip = vm.chunk->code;
+
+  // The script can not make a tail call, it runs to its
+  // OP_RETURN without handing its frame to another function.
+  bool ok = script->chunk->run(&vm);
+
+  vm.stack_top = vm.stack;
+  vm.frame_count = 0;
+  vm.chunk = NULL;
+  vm.ip = NULL;
+  free_vm(&vm);
+
+  return ok ? 0 : 70;
+}
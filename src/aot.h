@@ -0,0 +1,427 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include <math.h>
+#include <stdio.h>
+
+#include "common.h"
+#include "chunk.h"
+#include "memory.h"
+#include "obj.h"
+#include "vm.h"
+
+// Ahead-of-time compilation of scripts to C.
+//
+// `-C script.c` compiles the script and writes a C translation unit
+// instead of running it. The chunk of the script and of every function
+// becomes a C function where every instruction is expanded inline into
+// the macros below, jumps become gotos and numbers are added and
+// compared without leaving the generated code. The rest is left to
+// the same C functions the JIT calls.
+//
+// A call goes through [vm_call], which runs the C function of the
+// callee's chunk in the frame it pushes.
+//
+// The generated file has its own `main` and is built with every
+// file in src except main.c:
+//
+//   cc -O2 -I src script.c $(ls src/*.c | grep -v main.c) -lm
+//
+// The executable rebuilds the chunks, their constants and the global
+// slots when it starts, so runtime errors report the same lines,
+// and then runs like [run_file] would.
+
+typedef enum
+{
+  AOT_NUMBER,
+  AOT_STRING,
+  AOT_NIL,
+  AOT_TRUE,
+  AOT_FALSE,
+  AOT_FUNCTION,
+} AotConstantType;
+
+typedef struct AotChunk AotChunk;
+
+typedef struct
+{
+  AotConstantType type;
+  double number;
+  const char *chars;
+  int length;
+  const AotChunk *function;
+} AotConstant;
+
+// The chunk of the script or of a function. [name] is NULL for the script.
+struct AotChunk
+{
+  const char *name;
+  int arity;
+  const uint8_t *code;
+  const size_t *lines;
+  size_t count;
+  const AotConstant *constants;
+  size_t constant_count;
+  // What the function captures, see ObjFunction.
+  int upvalue_count;
+  const Capture *captures;
+  // The C the chunk was compiled to.
+  AotFunction run;
+};
+
+// Everything the generated file knows about the compiled script.
+typedef struct
+{
+  const AotChunk *chunk;
+  // The names of the global variables in the order of their slots.
+  const char *const *globals;
+  size_t global_count;
+} AotScript;
+
+// Compiles [source_code] and writes it to [output] as C. [path] is
+// only used in a comment. Returns false if the script does not compile.
+bool aot_compile(Vm *vm, const char *source_code, const char *path, FILE *output);
+// The `main` of a generated file. Loads [script] into a new vm,
+// runs it and returns the exit status [run_file] would exit with.
+int aot_main(const AotScript *script);
+
+// Used by the generated code, which keeps [vm->stack_top] in
+// [stack_top], the stack window of its frame in [slots] and the
+// global values in [globals]. [next] is the offset of the instruction
+// after the one being run, where [vm->ip] points when C is called,
+// like in [run].
+
+#define AOT_SAVE(next) (vm->stack_top = stack_top, vm->ip = vm->chunk->code + (next))
+#define AOT_RELOAD() (stack_top = vm->stack_top)
+#define AOT_ERROR(message, next)             \
+  do                                         \
+  {                                          \
+    AOT_SAVE(next);                          \
+    vm_runtime_error(vm, message);           \
+    return false;                            \
+  } while (false)
+
+// Constants that are not numbers are read from the chunk,
+// the collector may move them.
+#define AOT_CONSTANT(index) (vm->chunk->constants.values[index])
+// Booleans are tested without calling [is_truthy].
+#define AOT_IS_FALSEY(value) (IS_BOOL(value) ? !AS_BOOL(value) : !is_truthy(value))
+#define AOT_NOT_BOOL_VAL(value) BOOL_VAL(!(value))
+
+#define AOT_PUSH(value) (*stack_top++ = (value))
+#define AOT_POP() (stack_top -= 1)
+#define AOT_POPN(count) (stack_top -= (count))
+#define AOT_NOT() (stack_top[-1] = BOOL_VAL(value_not(stack_top[-1])))
+#define AOT_NEGATE(next)                                      \
+  do                                                          \
+  {                                                           \
+    if (!IS_NUMBER(stack_top[-1]))                            \
+    {                                                         \
+      AOT_ERROR("Operand must be a number", next);            \
+    }                                                         \
+    stack_top[-1] = NUMBER_VAL(-AS_NUMBER(stack_top[-1]));    \
+  } while (false)
+
+// `a op b` on the two numbers on top of the stack,
+// or on the top of the stack and [constant].
+#define AOT_BINARY(value_type, op, next)                        \
+  do                                                            \
+  {                                                             \
+    Value a = stack_top[-2];                                    \
+    Value b = stack_top[-1];                                    \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b))                         \
+    {                                                           \
+      AOT_ERROR("Operands must be numbers", next);              \
+    }                                                           \
+    stack_top -= 1;                                             \
+    stack_top[-1] = value_type(AS_NUMBER(a) op AS_NUMBER(b));   \
+  } while (false)
+#define AOT_BINARY_CONSTANT(value_type, op, constant, next)     \
+  do                                                            \
+  {                                                             \
+    Value a = stack_top[-1];                                    \
+    Value b = (constant);                                       \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b))                         \
+    {                                                           \
+      AOT_ERROR("Operands must be numbers", next);              \
+    }                                                           \
+    stack_top[-1] = value_type(AS_NUMBER(a) op AS_NUMBER(b));   \
+  } while (false)
+
+// Strings are concatenated by [vm_add].
+#define AOT_SLOW_ADD(next)             \
+  do                                   \
+  {                                    \
+    AOT_SAVE(next);                    \
+    if (!vm_add(vm))                   \
+    {                                  \
+      return false;                    \
+    }                                  \
+    AOT_RELOAD();                      \
+  } while (false)
+#define AOT_ADD(next)                                               \
+  do                                                                \
+  {                                                                 \
+    Value a = stack_top[-2];                                        \
+    Value b = stack_top[-1];                                        \
+    if (IS_NUMBER(a) && IS_NUMBER(b))                               \
+    {                                                               \
+      stack_top -= 1;                                               \
+      stack_top[-1] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));      \
+    }                                                               \
+    else                                                            \
+    {                                                               \
+      AOT_SLOW_ADD(next);                                           \
+    }                                                               \
+  } while (false)
+#define AOT_ADD_CONSTANT(constant, next)                            \
+  do                                                                \
+  {                                                                 \
+    Value a = stack_top[-1];                                        \
+    Value b = (constant);                                           \
+    if (IS_NUMBER(a) && IS_NUMBER(b))                               \
+    {                                                               \
+      stack_top[-1] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));      \
+    }                                                               \
+    else                                                            \
+    {                                                               \
+      AOT_PUSH(b);                                                  \
+      AOT_SLOW_ADD(next);                                           \
+    }                                                               \
+  } while (false)
+#define AOT_ADD_LOCAL_CONSTANT(slot, constant, next)                \
+  do                                                                \
+  {                                                                 \
+    Value a = slots[slot];                                          \
+    Value b = (constant);                                           \
+    if (IS_NUMBER(a) && IS_NUMBER(b))                               \
+    {                                                               \
+      slots[slot] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));        \
+    }                                                               \
+    else                                                            \
+    {                                                               \
+      AOT_PUSH(a);                                                  \
+      AOT_PUSH(b);                                                  \
+      AOT_SLOW_ADD(next);                                           \
+      slots[slot] = *--stack_top;                                   \
+    }                                                               \
+  } while (false)
+
+// Ropes are flattened and strings compared by [vm_equal].
+#define AOT_EQUAL(op, function, next)                               \
+  do                                                                \
+  {                                                                 \
+    Value a = stack_top[-2];                                        \
+    Value b = stack_top[-1];                                        \
+    if (IS_NUMBER(a) && IS_NUMBER(b))                               \
+    {                                                               \
+      stack_top -= 1;                                               \
+      stack_top[-1] = BOOL_VAL(AS_NUMBER(a) op AS_NUMBER(b));       \
+    }                                                               \
+    else                                                            \
+    {                                                               \
+      AOT_SAVE(next);                                               \
+      function(vm);                                                 \
+      AOT_RELOAD();                                                 \
+    }                                                               \
+  } while (false)
+#define AOT_EQUAL_CONSTANT(constant, next)                          \
+  do                                                                \
+  {                                                                 \
+    Value a = stack_top[-1];                                        \
+    Value b = (constant);                                           \
+    if (IS_NUMBER(a) && IS_NUMBER(b))                               \
+    {                                                               \
+      stack_top[-1] = BOOL_VAL(AS_NUMBER(a) == AS_NUMBER(b));       \
+    }                                                               \
+    else                                                            \
+    {                                                               \
+      AOT_PUSH(b);                                                  \
+      AOT_SAVE(next);                                               \
+      vm_equal(vm);                                                 \
+      AOT_RELOAD();                                                 \
+    }                                                               \
+  } while (false)
+
+#define AOT_PRINT(next)  \
+  do                     \
+  {                      \
+    AOT_SAVE(next);      \
+    vm_print(vm);        \
+    AOT_RELOAD();        \
+  } while (false)
+
+#define AOT_DEFINE_GLOBAL(slot, next)  \
+  do                                   \
+  {                                    \
+    AOT_SAVE(next);                    \
+    vm_define_global(vm, slot);        \
+    AOT_RELOAD();                      \
+  } while (false)
+#define AOT_GET_GLOBAL(slot, next)                 \
+  do                                               \
+  {                                                \
+    Value value = globals[slot];                   \
+    if (IS_UNDEFINED(value))                       \
+    {                                              \
+      AOT_SAVE(next);                              \
+      vm_undefined_variable(vm, slot);             \
+      return false;                                \
+    }                                              \
+    AOT_PUSH(value);                               \
+  } while (false)
+// Storing a value that is not an object needs no write barrier.
+#define AOT_SET_GLOBAL(slot, next)                 \
+  do                                               \
+  {                                                \
+    if (IS_UNDEFINED(globals[slot]))               \
+    {                                              \
+      AOT_SAVE(next);                              \
+      vm_undefined_variable(vm, slot);             \
+      return false;                                \
+    }                                              \
+    Value value = stack_top[-1];                   \
+    if (IS_OBJ(value))                             \
+    {                                              \
+      AOT_SAVE(next);                              \
+      vm_store_global(vm, slot, value);            \
+    }                                              \
+    else                                           \
+    {                                              \
+      globals[slot] = value;                       \
+    }                                              \
+  } while (false)
+
+#define AOT_GET_LOCAL(slot) AOT_PUSH(slots[slot])
+#define AOT_SET_LOCAL(slot) (slots[slot] = stack_top[-1])
+#define AOT_SET_LOCAL_POP(slot) (slots[slot] = *--stack_top)
+
+#define AOT_JUMP_IF_FALSE(target)         \
+  do                                      \
+  {                                       \
+    if (AOT_IS_FALSEY(stack_top[-1]))     \
+    {                                     \
+      goto target;                        \
+    }                                     \
+  } while (false)
+#define AOT_POP_JUMP_IF_FALSE(target)     \
+  do                                      \
+  {                                       \
+    Value condition = *--stack_top;       \
+    if (AOT_IS_FALSEY(condition))         \
+    {                                     \
+      goto target;                        \
+    }                                     \
+  } while (false)
+// Like OP_LOOP, every iteration gives the collection
+// in progress a chance to advance.
+#define AOT_LOOP(target, next)            \
+  do                                      \
+  {                                       \
+    if (vm->gc_state != GC_IDLE)          \
+    {                                     \
+      AOT_SAVE(next);                     \
+      gc_safepoint(vm);                   \
+    }                                     \
+    goto target;                          \
+  } while (false)
+#define AOT_CALL(argument_count, next)                \
+  do                                                  \
+  {                                                   \
+    AOT_SAVE(next);                                   \
+    if (!vm_call(vm, argument_count))                 \
+    {                                                 \
+      return false;                                   \
+    }                                                 \
+    AOT_RELOAD();                                     \
+  } while (false)
+// A function callee takes over the frame, its C is run by the
+// caller of this C, see [vm_tail_call]. Anything else is done when
+// it returns and the OP_RETURN after the call runs.
+#define AOT_TAIL_CALL(argument_count, next)           \
+  do                                                  \
+  {                                                   \
+    AOT_SAVE(next);                                   \
+    if (!vm_tail_call(vm, argument_count))            \
+    {                                                 \
+      return false;                                   \
+    }                                                 \
+    if (vm->ip != vm->chunk->code + (next))           \
+    {                                                 \
+      return true;                                    \
+    }                                                 \
+    AOT_RELOAD();                                     \
+  } while (false)
+#define AOT_CLOSURE(constant, next)       \
+  do                                      \
+  {                                       \
+    AOT_SAVE(next);                       \
+    vm_closure(vm, constant);             \
+    AOT_RELOAD();                         \
+  } while (false)
+// The closure that is running is in slot 0 of its frame.
+#define AOT_GET_UPVALUE(index) AOT_PUSH(*AS_CLOSURE(slots[0])->upvalues[index]->location)
+// Storing a value that is not an object needs no write barrier.
+#define AOT_SET_UPVALUE(index, next)                                \
+  do                                                                \
+  {                                                                 \
+    Value value = stack_top[-1];                                    \
+    if (IS_OBJ(value))                                              \
+    {                                                               \
+      AOT_SAVE(next);                                               \
+      vm_set_upvalue(vm, index);                                    \
+    }                                                               \
+    else                                                            \
+    {                                                               \
+      *AS_CLOSURE(slots[0])->upvalues[index]->location = value;     \
+    }                                                               \
+  } while (false)
+#define AOT_CLOSE_UPVALUE(next)           \
+  do                                      \
+  {                                       \
+    AOT_SAVE(next);                       \
+    vm_close_upvalue(vm);                 \
+    AOT_RELOAD();                         \
+  } while (false)
+// Computes the native of a math instruction on [a] and [b] like [run],
+// or calls what global [slot] holds.
+#define AOT_MATH(opcode, arity, result, slot, next)                         \
+  do                                                                        \
+  {                                                                         \
+    Value callee = globals[slot];                                           \
+    Value a = stack_top[-(arity)];                                          \
+    Value b = stack_top[-1];                                                \
+    if (!IS_OBJ(callee) ||                                                  \
+        AS_OBJ(callee) != AS_OBJ(vm->intrinsics[(opcode) - OP_SQRT]) ||     \
+        !IS_NUMBER(a) || !IS_NUMBER(b))                                     \
+    {                                                                       \
+      AOT_SAVE(next);                                                       \
+      if (!vm_call_global(vm, slot, arity))                                 \
+      {                                                                     \
+        return false;                                                       \
+      }                                                                     \
+      AOT_RELOAD();                                                         \
+    }                                                                       \
+    else                                                                    \
+    {                                                                       \
+      stack_top -= (arity) - 1;                                             \
+      stack_top[-1] = NUMBER_VAL(result);                                   \
+    }                                                                       \
+  } while (false)
+#define AOT_SQRT(slot, next) AOT_MATH(OP_SQRT, 1, sqrt(AS_NUMBER(a)), slot, next)
+#define AOT_FLOOR(slot, next) AOT_MATH(OP_FLOOR, 1, floor(AS_NUMBER(a)), slot, next)
+#define AOT_ABS(slot, next) AOT_MATH(OP_ABS, 1, fabs(AS_NUMBER(a)), slot, next)
+#define AOT_MIN(slot, next) \
+  AOT_MATH(OP_MIN, 2, AS_NUMBER(a) < AS_NUMBER(b) ? AS_NUMBER(a) : AS_NUMBER(b), slot, next)
+#define AOT_MAX(slot, next) \
+  AOT_MATH(OP_MAX, 2, AS_NUMBER(a) > AS_NUMBER(b) ? AS_NUMBER(a) : AS_NUMBER(b), slot, next)
+#define AOT_POW(slot, next) AOT_MATH(OP_POW, 2, pow(AS_NUMBER(a), AS_NUMBER(b)), slot, next)
+#define AOT_RETURN(next)                  \
+  do                                      \
+  {                                       \
+    AOT_SAVE(next);                       \
+    vm_return(vm);                        \
+    return true;                          \
+  } while (false)
+
+#endif
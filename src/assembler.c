@@ -0,0 +1,384 @@
+// MAP_ANONYMOUS is not part of POSIX.
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "assembler.h"
+
+#ifdef USE_JIT
+
+#include <sys/mman.h>
+
+void init_assembler(Assembler *assembler)
+{
+  memset(assembler, 0, sizeof(Assembler));
+  assembler->section = SECTION_HOT;
+}
+
+void free_assembler(Assembler *assembler)
+{
+  free(assembler->sections[SECTION_HOT].bytes);
+  free(assembler->sections[SECTION_COLD].bytes);
+  free(assembler->patches);
+}
+
+Label here(Assembler *assembler)
+{
+  return (Label){assembler->section, assembler->sections[assembler->section].count};
+}
+
+Label cold_label(Assembler *assembler)
+{
+  return (Label){SECTION_COLD, assembler->sections[SECTION_COLD].count};
+}
+
+size_t code_size(Assembler *assembler)
+{
+  return assembler->sections[SECTION_HOT].count + assembler->sections[SECTION_COLD].count;
+}
+
+// The assembler allocates with malloc instead of [reallocate], which
+// could start a collection that moves the function being compiled.
+void emit_byte(Assembler *assembler, uint8_t byte)
+{
+  Buffer *buffer = &assembler->sections[assembler->section];
+
+  if (buffer->count == buffer->capacity)
+  {
+    buffer->capacity = buffer->capacity < 256 ? 256 : buffer->capacity * 2;
+    buffer->bytes = (uint8_t *)realloc(buffer->bytes, buffer->capacity);
+
+    if (buffer->bytes == NULL)
+    {
+      exit(1);
+    }
+  }
+
+  buffer->bytes[buffer->count++] = byte;
+}
+
+void emit_bytes(Assembler *assembler, const uint8_t *bytes, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+  {
+    emit_byte(assembler, bytes[i]);
+  }
+}
+
+// x86-64 is little endian.
+void emit_u32(Assembler *assembler, uint32_t value)
+{
+  for (int i = 0; i < 4; i++)
+  {
+    emit_byte(assembler, (uint8_t)(value >> (8 * i)));
+  }
+}
+
+void emit_u64(Assembler *assembler, uint64_t value)
+{
+  for (int i = 0; i < 8; i++)
+  {
+    emit_byte(assembler, (uint8_t)(value >> (8 * i)));
+  }
+}
+
+// Instruction encoding
+//
+// Most instructions are an optional REX prefix, an opcode and a ModRM
+// byte that names a register operand and either another register
+// or a memory operand. REX.W makes the instruction work on 64 bits
+// and REX.R and REX.B extend the two registers of ModRM to r8-r15
+// and xmm8-xmm15.
+
+void emit_rex(Assembler *assembler, bool wide, int reg, int base)
+{
+  uint8_t rex = 0x40 | (wide ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((base & 8) ? 0x01 : 0);
+
+  if (rex != 0x40)
+  {
+    emit_byte(assembler, rex);
+  }
+}
+
+// ModRM for [base + displacement]. rsp and r12 as a base need
+// a SIB byte, rbp and r13 can not be used without a displacement.
+void emit_memory_operand(Assembler *assembler, int reg, Register base, int32_t displacement)
+{
+  uint8_t mod;
+
+  if (displacement == 0 && (base & 7) != RBP)
+  {
+    mod = 0x00;
+  }
+  else if (displacement >= INT8_MIN && displacement <= INT8_MAX)
+  {
+    mod = 0x40;
+  }
+  else
+  {
+    mod = 0x80;
+  }
+
+  emit_byte(assembler, mod | ((reg & 7) << 3) | (base & 7));
+
+  if ((base & 7) == RSP)
+  {
+    emit_byte(assembler, 0x24);
+  }
+
+  if (mod == 0x40)
+  {
+    emit_byte(assembler, (uint8_t)displacement);
+  }
+  else if (mod == 0x80)
+  {
+    emit_u32(assembler, (uint32_t)displacement);
+  }
+}
+
+void emit_load(Assembler *assembler, Register destination, Register base, int32_t displacement)
+{
+  emit_rex(assembler, true, destination, base);
+  emit_byte(assembler, 0x8b);
+  emit_memory_operand(assembler, destination, base, displacement);
+}
+
+void emit_store(Assembler *assembler, Register base, int32_t displacement, Register source)
+{
+  emit_rex(assembler, true, source, base);
+  emit_byte(assembler, 0x89);
+  emit_memory_operand(assembler, source, base, displacement);
+}
+
+void emit_alu(Assembler *assembler, uint8_t opcode, Register destination, Register source)
+{
+  emit_rex(assembler, true, source, destination);
+  emit_byte(assembler, opcode);
+  emit_byte(assembler, 0xc0 | ((source & 7) << 3) | (destination & 7));
+}
+
+void emit_move(Assembler *assembler, Register destination, Register source)
+{
+  emit_alu(assembler, ALU_MOV, destination, source);
+}
+
+void emit_move_immediate(Assembler *assembler, Register destination, uint64_t immediate)
+{
+  if (immediate <= UINT32_MAX)
+  {
+    // Writing the 32 bit register clears the upper half.
+    emit_rex(assembler, false, 0, destination);
+    emit_byte(assembler, 0xb8 + (destination & 7));
+    emit_u32(assembler, (uint32_t)immediate);
+    return;
+  }
+
+  emit_rex(assembler, true, 0, destination);
+  emit_byte(assembler, 0xb8 + (destination & 7));
+  emit_u64(assembler, immediate);
+}
+
+void emit_add_immediate(Assembler *assembler, Register destination, int32_t immediate)
+{
+  if (immediate == 0)
+  {
+    return;
+  }
+
+  // /0 is add and /5 is sub.
+  int extension = immediate > 0 ? 0 : 5;
+  int32_t magnitude = immediate > 0 ? immediate : -immediate;
+
+  emit_rex(assembler, true, 0, destination);
+
+  if (magnitude <= INT8_MAX)
+  {
+    emit_byte(assembler, 0x83);
+    emit_byte(assembler, 0xc0 | (extension << 3) | (destination & 7));
+    emit_byte(assembler, (uint8_t)magnitude);
+  }
+  else
+  {
+    emit_byte(assembler, 0x81);
+    emit_byte(assembler, 0xc0 | (extension << 3) | (destination & 7));
+    emit_u32(assembler, (uint32_t)magnitude);
+  }
+}
+
+void emit_to_xmm(Assembler *assembler, int xmm, Register source)
+{
+  emit_byte(assembler, 0x66);
+  emit_rex(assembler, true, xmm, source);
+  emit_byte(assembler, 0x0f);
+  emit_byte(assembler, 0x6e);
+  emit_byte(assembler, 0xc0 | ((xmm & 7) << 3) | (source & 7));
+}
+
+void emit_from_xmm(Assembler *assembler, Register destination, int xmm)
+{
+  emit_byte(assembler, 0x66);
+  emit_rex(assembler, true, xmm, destination);
+  emit_byte(assembler, 0x0f);
+  emit_byte(assembler, 0x7e);
+  emit_byte(assembler, 0xc0 | ((xmm & 7) << 3) | (destination & 7));
+}
+
+void emit_sse(Assembler *assembler, uint8_t prefix, uint8_t opcode, int destination, int source)
+{
+  emit_byte(assembler, prefix);
+  emit_rex(assembler, false, destination, source);
+  emit_byte(assembler, 0x0f);
+  emit_byte(assembler, opcode);
+  emit_byte(assembler, 0xc0 | ((destination & 7) << 3) | (source & 7));
+}
+
+void emit_sse_memory(Assembler *assembler, uint8_t prefix, uint8_t opcode,
+                     int xmm, Register base, int32_t displacement)
+{
+  emit_byte(assembler, prefix);
+  emit_rex(assembler, false, xmm, base);
+  emit_byte(assembler, 0x0f);
+  emit_byte(assembler, opcode);
+  emit_memory_operand(assembler, xmm, base, displacement);
+}
+
+void emit_set(Assembler *assembler, Condition condition)
+{
+  emit_bytes(assembler, (const uint8_t[]){0x0f, 0x90 | condition, 0xc0}, 3);
+}
+
+void emit_call(Assembler *assembler, Function function)
+{
+  emit_move_immediate(assembler, RAX, (uint64_t)(uintptr_t)function);
+  // call rax
+  emit_bytes(assembler, (const uint8_t[]){0xff, 0xd0}, 2);
+}
+
+static void add_patch(Assembler *assembler, Label at, Label target)
+{
+  if (assembler->patch_count == assembler->patch_capacity)
+  {
+    assembler->patch_capacity = assembler->patch_capacity < 64 ? 64 : assembler->patch_capacity * 2;
+    assembler->patches = (Patch *)realloc(assembler->patches, sizeof(Patch) * assembler->patch_capacity);
+
+    if (assembler->patches == NULL)
+    {
+      exit(1);
+    }
+  }
+
+  assembler->patches[assembler->patch_count++] = (Patch){at, target};
+}
+
+void emit_jump(Assembler *assembler, Condition condition, Label target)
+{
+  if (condition == CONDITION_ALWAYS)
+  {
+    emit_byte(assembler, 0xe9);
+  }
+  else
+  {
+    emit_byte(assembler, 0x0f);
+    emit_byte(assembler, 0x80 | condition);
+  }
+
+  add_patch(assembler, here(assembler), target);
+  emit_u32(assembler, 0);
+}
+
+int emit_forward_jump(Assembler *assembler, Condition condition)
+{
+  emit_jump(assembler, condition, here(assembler));
+  return assembler->patch_count - 1;
+}
+
+void bind_jump(Assembler *assembler, int jump)
+{
+  assembler->patches[jump].target = here(assembler);
+}
+
+// Converts unconditionally and keeps the result only if the upper
+// half of [value] is the one of integers, without a branch.
+void emit_integer_to_double(Assembler *assembler, Register value, Register scratch, int xmm)
+{
+  emit_move(assembler, scratch, value);
+  // shr scratch, 32
+  emit_rex(assembler, true, 0, scratch);
+  emit_bytes(assembler, (const uint8_t[]){0xc1, 0xe8 | (scratch & 7), 32}, 3);
+  // cmp scratch32, INTEGER_HIGH_BITS
+  emit_rex(assembler, false, 0, scratch);
+  emit_bytes(assembler, (const uint8_t[]){0x81, 0xf8 | (scratch & 7)}, 2);
+  emit_u32(assembler, INTEGER_HIGH_BITS);
+  // cvtsi2sd xmm, value32 and movq scratch, xmm leave the flags alone.
+  emit_byte(assembler, 0xf2);
+  emit_rex(assembler, false, xmm, value);
+  emit_bytes(assembler, (const uint8_t[]){0x0f, 0x2a, 0xc0 | ((xmm & 7) << 3) | (value & 7)}, 3);
+  emit_from_xmm(assembler, scratch, xmm);
+  // cmove value, scratch
+  emit_rex(assembler, true, value, scratch);
+  emit_bytes(assembler, (const uint8_t[]){0x0f, 0x44, 0xc0 | ((value & 7) << 3) | (scratch & 7)}, 3);
+}
+
+static size_t resolve(Assembler *assembler, Label label)
+{
+  switch (label.section)
+  {
+  case SECTION_HOT:
+    return label.offset;
+  case SECTION_COLD:
+    return assembler->sections[SECTION_HOT].count + label.offset;
+  case SECTION_BYTECODE:
+    return assembler->entries[label.offset];
+  }
+
+  return 0;
+}
+
+uint8_t *link_code(Assembler *assembler)
+{
+  size_t size = code_size(assembler);
+  uint8_t *memory = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (memory == MAP_FAILED)
+  {
+    return NULL;
+  }
+
+  Buffer *hot = &assembler->sections[SECTION_HOT];
+  Buffer *cold = &assembler->sections[SECTION_COLD];
+  // An empty section has no buffer to copy from.
+  if (hot->count > 0)
+  {
+    memcpy(memory, hot->bytes, hot->count);
+  }
+  if (cold->count > 0)
+  {
+    memcpy(memory + hot->count, cold->bytes, cold->count);
+  }
+
+  for (int i = 0; i < assembler->patch_count; i++)
+  {
+    Patch *patch = &assembler->patches[i];
+    size_t at = resolve(assembler, patch->at);
+    int32_t displacement = (int32_t)(resolve(assembler, patch->target) - (at + 4));
+    memcpy(memory + at, &displacement, sizeof(displacement));
+  }
+
+  // The memory is never writable and executable at the same time.
+  if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0)
+  {
+    munmap(memory, size);
+    return NULL;
+  }
+
+  return memory;
+}
+
+void free_code(uint8_t *code, size_t size)
+{
+  munmap(code, size);
+}
+
+#endif
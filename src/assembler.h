@@ -0,0 +1,163 @@
+#ifndef ASSEMBLER_H
+#define ASSEMBLER_H
+
+#include "common.h"
+#include "jit.h"
+
+#ifdef USE_JIT
+
+// Emits the x86-64 machine code of the baseline JIT and of traces.
+//
+// Code goes to one of two sections. Slow paths are emitted to the cold
+// section, which ends up after the hot one, so the code for the common
+// case is a straight line. Jumps are emitted with a zero displacement
+// and patched once the size of both sections is known.
+
+typedef enum
+{
+  RAX,
+  RCX,
+  RDX,
+  RBX,
+  RSP,
+  RBP,
+  RSI,
+  RDI,
+  R8,
+  R9,
+  R10,
+  R11,
+  R12,
+  R13,
+  R14,
+  R15,
+} Register;
+
+// Condition codes of jcc and setcc.
+typedef enum
+{
+  CONDITION_EQUAL = 0x4,
+  CONDITION_NOT_EQUAL = 0x5,
+  CONDITION_BELOW_EQUAL = 0x6,
+  CONDITION_ABOVE = 0x7,
+  CONDITION_PARITY = 0xa,
+  CONDITION_ALWAYS = -1,
+} Condition;
+
+typedef enum
+{
+  SECTION_HOT,
+  SECTION_COLD,
+  // Labels in this section are offsets in the bytecode, they resolve
+  // to [entries[offset]], where the instruction at that offset starts.
+  SECTION_BYTECODE,
+} Section;
+
+typedef struct
+{
+  Section section;
+  size_t offset;
+} Label;
+
+// A rel32 at [at] that has to be resolved to [target].
+typedef struct
+{
+  Label at;
+  Label target;
+} Patch;
+
+typedef struct
+{
+  size_t count;
+  size_t capacity;
+  uint8_t *bytes;
+} Buffer;
+
+typedef struct
+{
+  Buffer sections[2];
+  // Where the code is emitted.
+  Section section;
+  int patch_count;
+  int patch_capacity;
+  Patch *patches;
+  uint32_t *entries;
+} Assembler;
+
+// The C functions the compiled code calls have different types,
+// they are only ever called by address.
+typedef void (*Function)(void);
+
+// and, cmp, test and mov between registers take their opcode
+// as [opcode] and their operands the same way.
+#define ALU_AND 0x21
+#define ALU_CMP 0x39
+#define ALU_TEST 0x85
+#define ALU_MOV 0x89
+
+// The prefix and opcode of the scalar double instructions
+// [emit_sse] and [emit_sse_memory] emit.
+#define SSE_MOVE 0x66, 0x28
+#define SSE_LOAD 0xf2, 0x10
+#define SSE_STORE 0xf2, 0x11
+#define SSE_ADD 0xf2, 0x58
+#define SSE_SUBTRACT 0xf2, 0x5c
+#define SSE_MULTIPLY 0xf2, 0x59
+#define SSE_DIVIDE 0xf2, 0x5e
+#define SSE_COMPARE 0x66, 0x2e
+
+void init_assembler(Assembler *assembler);
+void free_assembler(Assembler *assembler);
+
+Label here(Assembler *assembler);
+// Where the next slow path starts.
+Label cold_label(Assembler *assembler);
+size_t code_size(Assembler *assembler);
+
+void emit_byte(Assembler *assembler, uint8_t byte);
+void emit_bytes(Assembler *assembler, const uint8_t *bytes, size_t count);
+void emit_u32(Assembler *assembler, uint32_t value);
+void emit_u64(Assembler *assembler, uint64_t value);
+void emit_rex(Assembler *assembler, bool wide, int reg, int base);
+void emit_memory_operand(Assembler *assembler, int reg, Register base, int32_t displacement);
+// mov destination, [base + displacement]
+void emit_load(Assembler *assembler, Register destination, Register base, int32_t displacement);
+// mov [base + displacement], source
+void emit_store(Assembler *assembler, Register base, int32_t displacement, Register source);
+// op destination, source
+void emit_alu(Assembler *assembler, uint8_t opcode, Register destination, Register source);
+void emit_move(Assembler *assembler, Register destination, Register source);
+void emit_move_immediate(Assembler *assembler, Register destination, uint64_t immediate);
+// add or sub destination, immediate
+void emit_add_immediate(Assembler *assembler, Register destination, int32_t immediate);
+// movq xmm, source
+void emit_to_xmm(Assembler *assembler, int xmm, Register source);
+// movq destination, xmm
+void emit_from_xmm(Assembler *assembler, Register destination, int xmm);
+// op destination, source on two xmm registers.
+void emit_sse(Assembler *assembler, uint8_t prefix, uint8_t opcode, int destination, int source);
+// op xmm, [base + displacement] or op [base + displacement], xmm
+void emit_sse_memory(Assembler *assembler, uint8_t prefix, uint8_t opcode,
+                     int xmm, Register base, int32_t displacement);
+// setcc al
+void emit_set(Assembler *assembler, Condition condition);
+void emit_call(Assembler *assembler, Function function);
+// jmp or jcc to [target], resolved by [link_code].
+void emit_jump(Assembler *assembler, Condition condition, Label target);
+// jmp or jcc forward to where [bind_jump] is called with
+// what it returns, for targets that are not emitted yet.
+int emit_forward_jump(Assembler *assembler, Condition condition);
+void bind_jump(Assembler *assembler, int jump);
+// Replaces the integer in [value], see value.h, with the double that
+// has its value and leaves any other value alone. Clobbers [scratch]
+// and [xmm].
+void emit_integer_to_double(Assembler *assembler, Register value, Register scratch, int xmm);
+
+// Copies the code to executable memory and resolves the jumps.
+// Returns NULL if the memory could not be allocated.
+uint8_t *link_code(Assembler *assembler);
+void free_code(uint8_t *code, size_t size);
+
+#endif
+
+#endif
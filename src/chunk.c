@@ -1,6 +1,8 @@
 #include <stdlib.h>
 #include "chunk.h"
 #include "memory.h"
+#include "jit.h"
+#include "trace.h"
 
 Chunk new_chunk()
 {
@@ -15,6 +17,14 @@ void init_chunk(Chunk *chunk)
   chunk->capacity = 0;
   chunk->code = NULL;
   chunk->lines = NULL;
+  chunk->registers.count = 0;
+  chunk->registers.capacity = 0;
+  chunk->registers.code = NULL;
+  chunk->registers.lines = NULL;
+  chunk->registers.register_count = 0;
+  chunk->hotness = 0;
+  chunk->jit = NULL;
+  chunk->traces = NULL;
 
   init_value_array(&chunk->constants);
 }
@@ -43,12 +53,135 @@ void free_chunk(Chunk *chunk)
 {
   FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
   FREE_ARRAY(size_t, chunk->lines, chunk->capacity);
-  init_chunk(chunk);
+  FREE_ARRAY(uint32_t, chunk->registers.code, chunk->registers.capacity);
+  FREE_ARRAY(size_t, chunk->registers.lines, chunk->registers.capacity);
   free_value_array(&chunk->constants);
+  free_jit_code(chunk->jit);
+  free_traces(chunk->traces);
+  init_chunk(chunk);
+}
+
+int instruction_length(uint8_t opcode)
+{
+  switch (opcode)
+  {
+  case OP_CONSTANT:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_POPN:
+  case OP_ADD_CONSTANT:
+  case OP_SUBTRACT_CONSTANT:
+  case OP_MULTIPLY_CONSTANT:
+  case OP_DIVIDE_CONSTANT:
+  case OP_LESS_CONSTANT:
+  case OP_GREATER_CONSTANT:
+  case OP_EQUAL_CONSTANT:
+  case OP_SET_LOCAL_POP:
+  case OP_CALL:
+  case OP_TAIL_CALL:
+  case OP_CLOSURE:
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_ADD_CONSTANT_NUMBER:
+  case OP_SUBTRACT_CONSTANT_NUMBER:
+  case OP_MULTIPLY_CONSTANT_NUMBER:
+  case OP_DIVIDE_CONSTANT_NUMBER:
+  case OP_LESS_CONSTANT_NUMBER:
+  case OP_GREATER_CONSTANT_NUMBER:
+  case OP_EQUAL_CONSTANT_NUMBER:
+  case OP_ADD_CONSTANT_INTEGER:
+  case OP_SUBTRACT_CONSTANT_INTEGER:
+  case OP_MULTIPLY_CONSTANT_INTEGER:
+  case OP_LESS_CONSTANT_INTEGER:
+  case OP_GREATER_CONSTANT_INTEGER:
+  case OP_EQUAL_CONSTANT_INTEGER:
+    return 2;
+  case OP_DEFINE_GLOBAL:
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP:
+  case OP_LOOP:
+  case OP_SET_GLOBAL_POP:
+  case OP_ADD_LOCAL_CONSTANT:
+  case OP_POP_JUMP_IF_FALSE:
+  case OP_ADD_LOCAL_CONSTANT_NUMBER:
+  case OP_ADD_LOCAL_CONSTANT_INTEGER:
+  case OP_SQRT:
+  case OP_FLOOR:
+  case OP_ABS:
+  case OP_MIN:
+  case OP_MAX:
+  case OP_POW:
+    return 3;
+  default:
+    return 1;
+  }
+}
+
+uint8_t unquickened_opcode(uint8_t opcode)
+{
+  switch (opcode)
+  {
+  case OP_ADD_NUMBER:
+  case OP_ADD_INTEGER:
+  case OP_ADD_STRING:
+    return OP_ADD;
+  case OP_SUBTRACT_NUMBER:
+  case OP_SUBTRACT_INTEGER:
+    return OP_SUBTRACT;
+  case OP_MULTIPLY_NUMBER:
+  case OP_MULTIPLY_INTEGER:
+    return OP_MULTIPLY;
+  case OP_EQUAL_NUMBER:
+    return OP_EQUAL;
+  case OP_NOT_EQUAL_NUMBER:
+    return OP_NOT_EQUAL;
+  case OP_ADD_CONSTANT_NUMBER:
+  case OP_ADD_CONSTANT_INTEGER:
+    return OP_ADD_CONSTANT;
+  case OP_SUBTRACT_CONSTANT_NUMBER:
+  case OP_SUBTRACT_CONSTANT_INTEGER:
+    return OP_SUBTRACT_CONSTANT;
+  case OP_MULTIPLY_CONSTANT_NUMBER:
+  case OP_MULTIPLY_CONSTANT_INTEGER:
+    return OP_MULTIPLY_CONSTANT;
+  case OP_DIVIDE_CONSTANT_NUMBER:
+    return OP_DIVIDE_CONSTANT;
+  case OP_LESS_CONSTANT_NUMBER:
+  case OP_LESS_CONSTANT_INTEGER:
+    return OP_LESS_CONSTANT;
+  case OP_GREATER_CONSTANT_NUMBER:
+  case OP_GREATER_CONSTANT_INTEGER:
+    return OP_GREATER_CONSTANT;
+  case OP_EQUAL_CONSTANT_NUMBER:
+  case OP_EQUAL_CONSTANT_INTEGER:
+    return OP_EQUAL_CONSTANT;
+  case OP_ADD_LOCAL_CONSTANT_NUMBER:
+  case OP_ADD_LOCAL_CONSTANT_INTEGER:
+    return OP_ADD_LOCAL_CONSTANT;
+  default:
+    return opcode;
+  }
 }
 
 size_t add_constant(Chunk *chunk, Value value)
 {
   write_value_array(&chunk->constants, value);
   return chunk->constants.count - 1;
+}
+
+void write_register_code(RegisterCode *code, uint32_t instruction, size_t line)
+{
+  if (code->capacity < code->count + 1)
+  {
+    size_t old_capacity = code->capacity;
+    code->capacity = GROW_CAPACITY(old_capacity);
+    code->code = GROW_ARRAY(uint32_t, code->code, old_capacity, code->capacity);
+    code->lines = GROW_ARRAY(size_t, code->lines, old_capacity, code->capacity);
+  }
+
+  code->code[code->count] = instruction;
+  code->lines[code->count] = line;
+  code->count += 1;
 }
\ No newline at end of file
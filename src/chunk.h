@@ -20,8 +20,15 @@ typedef enum
   OP_EQUAL,
   OP_GREATER,
   OP_LESS,
+  // Emitted by the peephole optimizer in place of
+  // OP_EQUAL OP_NOT, OP_LESS OP_NOT and OP_GREATER OP_NOT.
+  OP_NOT_EQUAL,
+  OP_GREATER_EQUAL,
+  OP_LESS_EQUAL,
   OP_PRINT,
   OP_POP,
+  // Pops as many values as its operand says.
+  OP_POPN,
   OP_DEFINE_GLOBAL,
   OP_GET_GLOBAL,
   OP_SET_GLOBAL,
@@ -30,8 +37,209 @@ typedef enum
   OP_JUMP_IF_FALSE,
   OP_JUMP,
   OP_LOOP,
+  // Calls the value below as many arguments as its operand says.
+  OP_CALL,
+  // OP_CALL in tail position, always followed by an OP_RETURN.
+  // A function callee takes over the frame of the caller.
+  OP_TAIL_CALL,
+  // Pushes a closure of the function in the constant operand,
+  // with the upvalues the function's [captures] ask for.
+  OP_CLOSURE,
+  OP_GET_UPVALUE,
+  OP_SET_UPVALUE,
+  // Closes the upvalue of the local on top of the stack,
+  // if it has one, and pops it.
+  OP_CLOSE_UPVALUE,
+  // Calls to the math natives, emitted for a call to a global of that
+  // name. The operand is the slot of the global. The native is computed
+  // inline when the global still holds it and the arguments are
+  // numbers, otherwise what the global holds is called like by OP_CALL.
+  // See [intrinsics] in natives.h.
+  OP_SQRT,
+  OP_FLOOR,
+  OP_ABS,
+  OP_MIN,
+  OP_MAX,
+  OP_POW,
+  // Superinstructions emitted by the peephole optimizer.
+  //
+  // OP_CONSTANT followed by the instruction without the suffix,
+  // the constant is the operand.
+  OP_ADD_CONSTANT,
+  OP_SUBTRACT_CONSTANT,
+  OP_MULTIPLY_CONSTANT,
+  OP_DIVIDE_CONSTANT,
+  OP_LESS_CONSTANT,
+  OP_GREATER_CONSTANT,
+  OP_EQUAL_CONSTANT,
+  // OP_SET_LOCAL or OP_SET_GLOBAL followed by OP_POP.
+  OP_SET_LOCAL_POP,
+  OP_SET_GLOBAL_POP,
+  // `x = x + constant` for a local x, the operands are
+  // the slot of x and the constant.
+  OP_ADD_LOCAL_CONSTANT,
+  // OP_JUMP_IF_FALSE that pops the condition.
+  OP_POP_JUMP_IF_FALSE,
+  // Quickened instructions, see QUICKENING in common.h.
+  //
+  // The vm rewrites a generic instruction into one of these once it
+  // has run on operands of a single type. They check that the operands
+  // still have that type and otherwise turn back into the generic one.
+  //
+  // The _NUMBER variants compute on doubles, the _INTEGER ones run
+  // on two integers, see [add_numbers].
+  //
+  // OP_ADD on two numbers, two integers or two strings.
+  OP_ADD_NUMBER,
+  OP_ADD_INTEGER,
+  OP_ADD_STRING,
+  // OP_SUBTRACT and OP_MULTIPLY on two numbers or two integers.
+  OP_SUBTRACT_NUMBER,
+  OP_SUBTRACT_INTEGER,
+  OP_MULTIPLY_NUMBER,
+  OP_MULTIPLY_INTEGER,
+  // OP_EQUAL and OP_NOT_EQUAL on two numbers.
+  OP_EQUAL_NUMBER,
+  OP_NOT_EQUAL_NUMBER,
+  // Superinstructions whose constant is a number, only the
+  // operand on the stack or in the local has to be checked.
+  OP_ADD_CONSTANT_NUMBER,
+  OP_SUBTRACT_CONSTANT_NUMBER,
+  OP_MULTIPLY_CONSTANT_NUMBER,
+  OP_DIVIDE_CONSTANT_NUMBER,
+  OP_LESS_CONSTANT_NUMBER,
+  OP_GREATER_CONSTANT_NUMBER,
+  OP_EQUAL_CONSTANT_NUMBER,
+  OP_ADD_LOCAL_CONSTANT_NUMBER,
+  // Superinstructions whose constant is an integer, on an integer.
+  // Dividing gives a double, it has no variant.
+  OP_ADD_CONSTANT_INTEGER,
+  OP_SUBTRACT_CONSTANT_INTEGER,
+  OP_MULTIPLY_CONSTANT_INTEGER,
+  OP_LESS_CONSTANT_INTEGER,
+  OP_GREATER_CONSTANT_INTEGER,
+  OP_EQUAL_CONSTANT_INTEGER,
+  OP_ADD_LOCAL_CONSTANT_INTEGER,
 } OpCode;
 
+#define INTRINSIC_COUNT (OP_POW - OP_SQRT + 1)
+
+// Opcodes of the register machine, see [RegisterCode].
+//
+// R[x] is register x, K[x] is constant x, G[x] is global slot x
+// and U[x] is upvalue x of the closure in R[0].
+// Jump offsets count instructions from the one after the jump.
+typedef enum
+{
+  // R[A] = R[B]
+  ROP_MOVE,
+  // R[A] = K[Bx]
+  ROP_CONSTANT,
+  // R[A] = nil, true or false
+  ROP_NIL,
+  ROP_TRUE,
+  ROP_FALSE,
+  // R[A] = G[Bx]
+  ROP_GET_GLOBAL,
+  // G[Bx] = R[A], the variable must be defined.
+  ROP_SET_GLOBAL,
+  // G[Bx] = R[A]
+  ROP_DEFINE_GLOBAL,
+  // R[A] = -R[B] and R[A] = !R[B]
+  ROP_NEGATE,
+  ROP_NOT,
+  // R[A] = R[B] op R[C]
+  ROP_ADD,
+  ROP_SUBTRACT,
+  ROP_MULTIPLY,
+  ROP_DIVIDE,
+  ROP_EQUAL,
+  ROP_NOT_EQUAL,
+  ROP_GREATER,
+  ROP_GREATER_EQUAL,
+  ROP_LESS,
+  ROP_LESS_EQUAL,
+  // R[A] = R[B] op K[C]
+  ROP_ADD_CONSTANT,
+  ROP_SUBTRACT_CONSTANT,
+  ROP_MULTIPLY_CONSTANT,
+  ROP_DIVIDE_CONSTANT,
+  ROP_EQUAL_CONSTANT,
+  ROP_NOT_EQUAL_CONSTANT,
+  ROP_GREATER_CONSTANT,
+  ROP_GREATER_EQUAL_CONSTANT,
+  ROP_LESS_CONSTANT,
+  ROP_LESS_EQUAL_CONSTANT,
+  // print R[A]
+  ROP_PRINT,
+  // ip += Bx
+  ROP_JUMP,
+  // if R[A] is falsey or truthy, ip += Bx
+  ROP_JUMP_IF_FALSE,
+  ROP_JUMP_IF_TRUE,
+  // ip -= Bx
+  ROP_LOOP,
+  // R[A] = R[A](R[A + 1], ..., R[A + B]), the callee's registers
+  // start at R[A] and the result takes the place of the callee.
+  ROP_CALL,
+  // return R[A](R[A + 1], ..., R[A + B]), the callee takes
+  // over the frame like OP_TAIL_CALL does.
+  ROP_TAIL_CALL,
+  // R[A] = closure of the function K[Bx]
+  ROP_CLOSURE,
+  // R[A] = U[B] and U[B] = R[A]
+  ROP_GET_UPVALUE,
+  ROP_SET_UPVALUE,
+  // Closes the upvalues of R[A] and the registers above it.
+  ROP_CLOSE_UPVALUES,
+  // return R[A] and return nil
+  ROP_RETURN,
+  ROP_RETURN_NIL,
+} RegisterOpCode;
+
+// Register instructions are 32 bits wide and have one of two layouts:
+//
+//  31      24 23      16 15       8 7        0
+// |    C     |    B     |    A     |  opcode  |
+// |         Bx          |    A     |  opcode  |
+#define REGISTER_ABC(opcode, a, b, c) \
+  ((uint32_t)(opcode) | ((uint32_t)(a) << 8) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 24))
+#define REGISTER_ABX(opcode, a, bx) \
+  ((uint32_t)(opcode) | ((uint32_t)(a) << 8) | ((uint32_t)(bx) << 16))
+#define REGISTER_OPCODE(instruction) ((instruction)&0xff)
+#define REGISTER_A(instruction) (((instruction) >> 8) & 0xff)
+#define REGISTER_B(instruction) (((instruction) >> 16) & 0xff)
+#define REGISTER_C(instruction) ((instruction) >> 24)
+#define REGISTER_BX(instruction) ((instruction) >> 16)
+
+// Code for the register machine, the alternative to the stack machine
+// selected with `-R`.
+//
+// The stack machine moves every operand through the top of the stack,
+// `a = b + c` on locals is OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD and
+// OP_SET_LOCAL_POP. Register instructions name the stack slots
+// they read and write, so the same statement is a single ROP_ADD.
+//
+// The registers are the stack slots of the function, locals live in
+// the same slots they would have on the stack machine and temporaries
+// live above them. A call passes the callee and its arguments in the
+// registers at the top of the caller's, where the window of the
+// callee's registers starts, like the stack machine passes them.
+typedef struct
+{
+  size_t count;
+  size_t capacity;
+  uint32_t *code;
+  size_t *lines;
+  // Number of registers the code uses, including slot zero.
+  int register_count;
+} RegisterCode;
+
+// Machine code the JIT compiled for a chunk, see jit.h.
+typedef struct JitCode JitCode;
+// A trace of a hot loop, see trace.h.
+typedef struct Trace Trace;
+
 typedef struct
 {
   size_t count;
@@ -39,6 +247,16 @@ typedef struct
   uint8_t *code;
   ValueArray constants;
   size_t *lines;
+  // Empty unless the chunk was compiled for the register machine,
+  // in which case [code] is not used. Both share [constants].
+  RegisterCode registers;
+  // How many times the chunk has been entered or has jumped backwards.
+  // The vm compiles it to machine code once it reaches JIT_THRESHOLD.
+  int hotness;
+  // NULL until the chunk is hot.
+  JitCode *jit;
+  // Every loop of the chunk that has jumped back to its header.
+  Trace *traces;
 } Chunk;
 
 Chunk new_chunk();
@@ -47,5 +265,10 @@ void write_chunk(Chunk *chunk, uint8_t byte, size_t line);
 void free_chunk(Chunk *chunk);
 bool is_chunk_full(Chunk *chunk);
 size_t add_constant(Chunk *chunk, Value value);
+// Length in bytes of an instruction, including its operands.
+int instruction_length(uint8_t opcode);
+// The generic instruction a quickened one was rewritten from.
+uint8_t unquickened_opcode(uint8_t opcode);
+void write_register_code(RegisterCode *code, uint32_t instruction, size_t line);
 
 #endif
\ No newline at end of file
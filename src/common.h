@@ -4,7 +4,76 @@
 #define DEBUG_PRINT_CODE
 // #define DEBUG_TRACE_EXECUTION
 
+// Run the garbage collector on every allocation.
+// #define DEBUG_STRESS_GC
+// #define DEBUG_LOG_GC
+// Print a histogram of the garbage collector pauses when the vm is freed.
+// #define DEBUG_PRINT_GC_PAUSES
+// Count how many times each opcode is followed by each other opcode
+// and print the most frequent pairs when the vm is freed.
+// The superinstructions were picked from these counts.
+// #define DEBUG_PROFILE_OPCODES
+
+// Compile every chunk with the JIT before running it instead of
+// waiting for it to get hot. Requires BASELINE_JIT.
+// #define DEBUG_STRESS_JIT
+// Print how many traces were recorded and how often they were left
+// through a side exit when the vm is freed. Requires TRACING_JIT.
+// #define DEBUG_PRINT_TRACE_STATS
+
+// Interleave the marking and sweeping of major collections
+// with the execution of the program instead of stopping it
+// until the collection is done. Embedders can also set
+// [vm->gc_incremental] after the vm has been initialized.
+// #define INCREMENTAL_GC
+
+// Dispatch instructions in the vm with computed gotos
+// instead of a switch when the compiler supports it.
+// Comment it out to use the portable switch dispatch.
+#define DIRECT_THREADED_DISPATCH
+
+// Represent values as NaN boxed 64 bit words
+// instead of a tagged union.
+// Comment it out to use the tagged union.
+#define NAN_BOXING
+
+// Intern only the strings the compiler creates.
+// Strings created at runtime are not hashed or added to
+// [vm->strings], and are compared by their characters.
+// Comment it out to intern every string.
+#define LAZY_STRING_INTERNING
+
+// Probe the slots of hash tables 16 at a time with SSE2
+// when the compiler supports it.
+// Comment it out to use the portable probing.
+#define SIMD_HASH_TABLE
+
+// Run the peephole optimizer over every chunk the compiler finishes.
+// Comment it out to run the bytecode exactly as the compiler emits it.
+#define PEEPHOLE_OPTIMIZER
+
+// Let the peephole optimizer replace frequent sequences of
+// instructions with superinstructions. Requires PEEPHOLE_OPTIMIZER.
+#define SUPERINSTRUCTIONS
+
+// Let the vm rewrite generic arithmetic and comparison instructions
+// into variants for the operand types they run on.
+// Comment it out to always run the generic instructions.
+#define QUICKENING
+
+// Compile the bytecode of hot chunks to x86-64 machine code.
+// Only used with NAN_BOXING on x86-64 Linux, everywhere else the
+// vm interprets. Embedders can also clear [vm->jit_enabled].
+// Comment it out to always interpret.
+#define BASELINE_JIT
+
+// Record the path hot loops take and compile it to machine code that
+// works on unboxed numbers. Requires BASELINE_JIT.
+// Comment it out to compile whole chunks only.
+#define TRACING_JIT
+
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
 
 #include <stdbool.h>
 #include <stddef.h>
@@ -6,6 +6,10 @@
 #include "scanner.h"
 #include "chunk.h"
 #include "obj.h"
+#include "memory.h"
+#include "natives.h"
+#include "optimizer.h"
+#include "peephole.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -39,6 +43,12 @@ typedef struct
   // [depth] will be 0 when the variable is declared
   // in the global scope.
   int depth;
+  // The variable of the local in [Compiler.ir]
+  // when compiling with the optimizing tier.
+  int variable;
+  // Set once a function declared in the scope of the local uses it,
+  // the local is then closed instead of popped when the scope ends.
+  bool is_captured;
 } Local;
 
 typedef enum
@@ -47,8 +57,11 @@ typedef enum
   TYPE_SCRIPT
 } FunctionType;
 
-typedef struct
+typedef struct Compiler
 {
+  // The compiler of the function the function being compiled
+  // is declared in, NULL for the script.
+  struct Compiler *enclosing;
   // We simplify the compiler and VM by placing
   // top-level code inside an automatically defined function,
   // this way the compiler is always within some kind of function body,
@@ -67,14 +80,41 @@ typedef struct
   // that introduce new scopes surrouding the current piece of
   // code that we are compiling.
   int scope_depth;
+  // Offset in the chunk of the first instruction of the left operand
+  // of the infix operator being compiled. Infix rules must read it
+  // before compiling their right operand, which overwrites it.
+  int operand_start;
+  // The program being built when compiling with the optimizing tier,
+  // which builds a tree of nodes instead of emitting bytecode.
+  IrProgram *ir;
+  // The variable whose initializer is being compiled, if any.
+  int initializing_variable;
+  // Set when the script has been lowered to code for the register machine.
+  bool is_register_code;
+  // Offset of the last OP_CALL emitted, -1 if there is none.
+  int last_call;
+  // Where the upvalues of the function come from, the first
+  // [function->upvalue_count] are used.
+  Capture upvalues[UINT8_COUNT];
 } Compiler;
 
+// The compiler that is running, if any. The garbage collector
+// follows it and the compilers it is enclosed in to find the
+// functions that are being compiled.
+static Compiler *current = NULL;
+
 Compiler new_compiler(Vm *vm, FunctionType type)
 {
   Compiler compiler;
 
+  compiler.enclosing = NULL;
   compiler.local_count = 0;
   compiler.scope_depth = 0;
+  compiler.operand_start = 0;
+  compiler.ir = NULL;
+  compiler.initializing_variable = -1;
+  compiler.is_register_code = false;
+  compiler.last_call = -1;
 
   compiler.function = new_function(vm);
   compiler.type = type;
@@ -86,17 +126,24 @@ Compiler new_compiler(Vm *vm, FunctionType type)
   local->depth = 0;
   local->name.start = "";
   local->name.length = 0;
+  local->variable = -1;
+  local->is_captured = false;
 
   return compiler;
 }
 
 typedef void (*ParseFunction)(Compiler *compiler, Parser *parser, Precedence precedence);
+// Builds the node of an expression for the optimizing tier.
+// [left] is the left operand of infix operators.
+typedef Node *(*BuildFunction)(Compiler *compiler, Parser *parser, Node *left, Precedence precedence);
 
 typedef struct
 {
   ParseFunction prefix;
   ParseFunction infix;
   Precedence precedence;
+  BuildFunction prefix_node;
+  BuildFunction infix_node;
 } ParseRule;
 
 static void expression(Compiler *compiler, Parser *parser);
@@ -106,6 +153,7 @@ static void parse_precedence(Compiler *compiler, Parser *parser, const Precedenc
 static void error_at(Parser *parser, const Token *token, const char *message);
 static void advance(Parser *parser);
 static void statement(Compiler *compiler, Parser *parser);
+static Node *declaration_node(Compiler *compiler, Parser *parser);
 static int emit_jump(Compiler *compiler, Parser *parser, uint8_t opcode);
 static void patch_jump(Compiler *compiler, int offset);
 
@@ -137,7 +185,12 @@ static void emit_bytes(Compiler *compiler, Parser *parser, const uint8_t a, cons
 
 static uint8_t make_constant(Compiler *compiler, Parser *parser, const Value value)
 {
+  // Growing the constants array may start a collection
+  // and [value] may not be reachable from any root yet.
+  push(parser->vm, value);
   const size_t constant = add_constant(get_current_chunk(compiler), value);
+  write_barrier(parser->vm, (Obj *)compiler->function, value);
+  pop(parser->vm);
 
   if (constant > UINT8_MAX)
   {
@@ -153,6 +206,107 @@ static void emit_constant(Compiler *compiler, Parser *parser, const Value value)
   emit_bytes(compiler, parser, OP_CONSTANT, make_constant(compiler, parser, value));
 }
 
+// Constant folding
+//
+// When every operand of an operator is a literal, the compiler
+// evaluates the operator and emits the result instead, so `1 + 2 * 3`
+// becomes a single OP_CONSTANT. Operands are folded before
+// the operators that use them, so whole expressions fold bottom up.
+//
+// Operators are only folded when they would succeed at runtime,
+// `1 + "a"` is still compiled so it fails with a runtime error.
+
+// Emits the cheapest instruction that loads [value].
+static void emit_value(Compiler *compiler, Parser *parser, const Value value)
+{
+  if (IS_NIL(value))
+  {
+    emit_byte(compiler, parser, OP_NIL);
+  }
+  else if (IS_BOOL(value))
+  {
+    emit_byte(compiler, parser, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  }
+  else
+  {
+    emit_constant(compiler, parser, value);
+  }
+}
+
+// If the code from [start] to [end] is a single instruction
+// that loads a constant, stores the constant in [value] and returns true.
+static bool is_constant_load(Compiler *compiler, int start, int end, Value *value)
+{
+  Chunk *chunk = get_current_chunk(compiler);
+
+  if (end - start == 2 && chunk->code[start] == OP_CONSTANT)
+  {
+    *value = chunk->constants.values[chunk->code[start + 1]];
+    return true;
+  }
+
+  if (end - start != 1)
+  {
+    return false;
+  }
+
+  switch (chunk->code[start])
+  {
+  case OP_NIL:
+    *value = NIL_VAL;
+    return true;
+  case OP_TRUE:
+    *value = BOOL_VAL(true);
+    return true;
+  case OP_FALSE:
+    *value = BOOL_VAL(false);
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Removes the constant load at [start], which must be the last
+// instruction in the chunk, and its constant if nothing else uses it.
+static void discard_constant_load(Compiler *compiler, int start)
+{
+  Chunk *chunk = get_current_chunk(compiler);
+
+  // Constants are not deduplicated, so the last constant
+  // is only used by the last load that references it.
+  if (chunk->code[start] == OP_CONSTANT && chunk->code[start + 1] == chunk->constants.count - 1)
+  {
+    chunk->constants.count--;
+  }
+
+  chunk->count = start;
+}
+
+// Evaluates the binary operator [operator_type] when both of its operands,
+// which start at [left_start] and [right_start], are constants,
+// and replaces them with the result. Returns true if it did.
+static bool fold_binary(Compiler *compiler, Parser *parser, TokenType operator_type, int left_start, int right_start)
+{
+  Value a;
+  Value b;
+  Value result;
+
+  if (!is_constant_load(compiler, left_start, right_start, &a) ||
+      !is_constant_load(compiler, right_start, get_current_chunk(compiler)->count, &b) ||
+      !fold_binary_values(parser->vm, operator_type, a, b, &result))
+  {
+    return false;
+  }
+
+  // [result] may be a string that is not reachable from any root yet,
+  // but discarding code does not allocate.
+  discard_constant_load(compiler, right_start);
+  discard_constant_load(compiler, left_start);
+  emit_value(compiler, parser, result);
+
+  return true;
+}
+
 static void consume(Parser *parser, const TokenType type)
 {
   if (parser->current.type == type)
@@ -173,8 +327,10 @@ static void consume(Parser *parser, const TokenType type)
   error_at_current(parser, buffer);
 }
 
+// A function that ends without a return statement returns nil.
 static void emit_return(Compiler *compiler, Parser *parser)
 {
+  emit_byte(compiler, parser, OP_NIL);
   emit_byte(compiler, parser, OP_RETURN);
 }
 
@@ -224,6 +380,65 @@ static void add_local(Compiler *compiler, Parser *parser, Token name)
   Local *local = &compiler->locals[compiler->local_count++];
   local->name = name;
   local->depth = compiler->scope_depth;
+  local->variable = -1;
+  local->is_captured = false;
+}
+
+// Returns the upvalue of the function being compiled that captures
+// [index], a local of the enclosing function if [is_local] is set
+// or one of its upvalues otherwise, adding it if there is none.
+static int add_upvalue(Compiler *compiler, Parser *parser, uint8_t index, bool is_local)
+{
+  int upvalue_count = compiler->function->upvalue_count;
+
+  for (int i = 0; i < upvalue_count; i++)
+  {
+    Capture *upvalue = &compiler->upvalues[i];
+
+    if (upvalue->index == index && upvalue->is_local == is_local)
+    {
+      return i;
+    }
+  }
+
+  if (upvalue_count == UINT8_COUNT)
+  {
+    error(parser, "Too many closure variables in function");
+    return 0;
+  }
+
+  compiler->upvalues[upvalue_count].is_local = is_local;
+  compiler->upvalues[upvalue_count].index = index;
+  return compiler->function->upvalue_count++;
+}
+
+// Looks for a local variable of the functions the function being
+// compiled is declared in. If the variable is found, every function
+// in between captures it and the index of the upvalue is returned.
+// If the variable is not found, returns -1.
+static int resolve_upvalue(Compiler *compiler, Parser *parser, Token *name)
+{
+  if (compiler->enclosing == NULL)
+  {
+    return -1;
+  }
+
+  int local = resolve_local(compiler->enclosing, name);
+
+  if (local != -1)
+  {
+    compiler->enclosing->locals[local].is_captured = true;
+    return add_upvalue(compiler, parser, (uint8_t)local, true);
+  }
+
+  int upvalue = resolve_upvalue(compiler->enclosing, parser, name);
+
+  if (upvalue != -1)
+  {
+    return add_upvalue(compiler, parser, (uint8_t)upvalue, false);
+  }
+
+  return -1;
 }
 
 static bool is_compiling_local_scope(Compiler *compiler)
@@ -244,11 +459,10 @@ static void clear_locals_in_the_current_scope(Compiler *compiler, Parser *parser
   while (compiler->local_count > 0 &&
          compiler->locals[compiler->local_count - 1].depth == compiler->scope_depth)
   {
-    // TODO:
-    // A operation that pops n values from the stack
-    // could be an optimization instead of emiting [OP_POP]
-    // n times.
-    emit_byte(compiler, parser, OP_POP);
+    // The peephole optimizer merges these into a single OP_POPN.
+    // Captured locals move to the heap before they go away.
+    bool is_captured = compiler->locals[compiler->local_count - 1].is_captured;
+    emit_byte(compiler, parser, is_captured ? OP_CLOSE_UPVALUE : OP_POP);
     compiler->local_count--;
   }
 }
@@ -319,19 +533,45 @@ Parser new_parser(Vm *vm, const char *source_code)
   return parser;
 }
 
-static void end_compiler(Compiler *compiler, Parser *parser)
+static ObjFunction *end_compiler(Compiler *compiler, Parser *parser)
 {
+#ifdef DEBUG_PRINT_CODE
+  const char *function_name = compiler->function->name != NULL
+                                  ? compiler->function->name->chars
+                                  : "script";
+#endif
+
+  if (compiler->is_register_code)
+  {
+    RegisterCode *code = &get_current_chunk(compiler)->registers;
+    write_register_code(code, REGISTER_ABC(ROP_RETURN_NIL, 0, 0, 0), parser->previous.line);
+
+#ifdef DEBUG_PRINT_CODE
+    if (!parser->had_error)
+    {
+      dissasamble_register_code(get_current_chunk(compiler), function_name);
+    }
+#endif
+    return compiler->function;
+  }
+
   emit_return(compiler, parser);
 
+#ifdef PEEPHOLE_OPTIMIZER
+  if (!parser->had_error)
+  {
+    optimize_chunk(get_current_chunk(compiler));
+  }
+#endif
+
 #ifdef DEBUG_PRINT_CODE
   if (!parser->had_error)
   {
-    const char *function_name = compiler->function->name != NULL
-                                    ? compiler->function->name->chars
-                                    : "script";
     dissasamble_chunk(get_current_chunk(compiler), function_name);
   }
 #endif
+
+  return compiler->function;
 }
 
 static void parse_precedence(Compiler *compiler, Parser *parser, const Precedence precedence)
@@ -346,6 +586,8 @@ static void parse_precedence(Compiler *compiler, Parser *parser, const Precedenc
     return;
   }
 
+  int start = get_current_chunk(compiler)->count;
+
   prefix_rule(compiler, parser, precedence);
 
   while (precedence <= get_rule(parser->current.type)->precedence)
@@ -354,6 +596,8 @@ static void parse_precedence(Compiler *compiler, Parser *parser, const Precedenc
 
     ParseFunction infix_rule = get_rule(parser->previous.type)->infix;
 
+    // Everything compiled since [start] is the left operand.
+    compiler->operand_start = start;
     infix_rule(compiler, parser, precedence);
   }
 }
@@ -365,17 +609,28 @@ static void expression(Compiler *compiler, Parser *parser)
 
 static void grouping(Compiler *compiler, Parser *parser, Precedence _)
 {
+  (void)_;
   expression(compiler, parser);
   consume(parser, TOKEN_RIGHT_PAREN);
 }
 
 static void unary(Compiler *compiler, Parser *parser, Precedence _)
 {
+  (void)_;
+  const TokenType operator_type = parser->previous.type;
+  int operand_start = get_current_chunk(compiler)->count;
+
   parse_precedence(compiler, parser, PREC_UNARY);
 
-  const TokenType operator_type = parser->previous.type;
+  Value value;
 
-  expression(compiler, parser);
+  if (is_constant_load(compiler, operand_start, get_current_chunk(compiler)->count, &value) &&
+      fold_unary_value(operator_type, value, &value))
+  {
+    discard_constant_load(compiler, operand_start);
+    emit_value(compiler, parser, value);
+    return;
+  }
 
   switch (operator_type)
   {
@@ -390,14 +645,83 @@ static void unary(Compiler *compiler, Parser *parser, Precedence _)
   }
 }
 
+// A literal without a fraction is an integer if it fits in one,
+// see [add_numbers]. `1.0` stays a double.
+static Value number_literal(const Token *token)
+{
+  const double value = strtod(token->start, NULL);
+
+  if (memchr(token->start, '.', (size_t)token->length) == NULL && value <= INT32_MAX)
+  {
+    return INTEGER_VAL((int32_t)value);
+  }
+
+  return NUMBER_VAL(value);
+}
+
 static void number(Compiler *compiler, Parser *parser, Precedence _)
 {
-  const double value = strtod(parser->previous.start, NULL);
-  emit_constant(compiler, parser, NUMBER_VAL(value));
+  (void)_;
+  emit_constant(compiler, parser, number_literal(&parser->previous));
+}
+
+// Compiles the right operand of `and` or `or` when the left operand
+// is a constant that decides the result on its own. The operand never
+// runs, it is only compiled to report its errors and then thrown away.
+static void skip_operand(Compiler *compiler, Parser *parser, Precedence precedence)
+{
+  Chunk *chunk = get_current_chunk(compiler);
+  int code_count = chunk->count;
+  int constant_count = chunk->constants.count;
+
+  parse_precedence(compiler, parser, precedence);
+
+  chunk = get_current_chunk(compiler);
+  chunk->count = code_count;
+  chunk->constants.count = constant_count;
+
+  // A call in the operand is gone, the code that takes its place is not one.
+  if (compiler->last_call >= code_count)
+  {
+    compiler->last_call = -1;
+  }
+}
+
+// Folds `and` and `or` when their left operand is a constant.
+// Conditions use [is_truthy], like OP_JUMP_IF_FALSE does.
+static bool fold_logical(Compiler *compiler, Parser *parser, bool is_and, Precedence precedence)
+{
+  int left_start = compiler->operand_start;
+  Value left;
+
+  if (!is_constant_load(compiler, left_start, get_current_chunk(compiler)->count, &left))
+  {
+    return false;
+  }
+
+  // `false and x` is false and `true or x` is true,
+  // otherwise the result is the right operand.
+  if (is_truthy(left) != is_and)
+  {
+    skip_operand(compiler, parser, precedence);
+  }
+  else
+  {
+    discard_constant_load(compiler, left_start);
+    parse_precedence(compiler, parser, precedence);
+  }
+
+  return true;
 }
 
 static void and_(Compiler *compiler, Parser *parser, Precedence _)
 {
+  (void)_;
+  if (fold_logical(compiler, parser, true, PREC_AND))
+  {
+    return;
+  }
+
   int end_jump = emit_jump(compiler, parser, OP_JUMP_IF_FALSE);
 
   emit_byte(compiler, parser, OP_POP);
@@ -409,6 +733,12 @@ static void and_(Compiler *compiler, Parser *parser, Precedence _)
 
 static void or_(Compiler *compiler, Parser *parser, Precedence _)
 {
+  (void)_;
+  if (fold_logical(compiler, parser, false, PREC_OR))
+  {
+    return;
+  }
+
   int else_jump = emit_jump(compiler, parser, OP_JUMP_IF_FALSE);
   int end_jump = emit_jump(compiler, parser, OP_JUMP);
 
@@ -435,6 +765,7 @@ static void or_(Compiler *compiler, Parser *parser, Precedence _)
 
 static void string(Compiler *compiler, Parser *parser, Precedence _)
 {
+  (void)_;
   // Given the following string "hello world":
   // start + 1 removes the first " and
   // previous.length - 2 removes the last ".
@@ -446,17 +777,32 @@ static void string(Compiler *compiler, Parser *parser, Precedence _)
   emit_constant(compiler, parser, OBJ_VAL(string));
 }
 
-static uint8_t identifier_constant(Compiler *compiler, Parser *parser, Token *name)
+// Returns the slot of the global variable called [name].
+//
+// Every global variable gets a slot in the vm global variables array
+// the first time the compiler sees its name, the bytecode
+// references the variable by its slot so accessing a global
+// at runtime is an array index instead of a hash table lookup.
+static uint16_t global_slot(Parser *parser, Token *name)
 {
-  Value string = OBJ_VAL(copy_string(parser, name->start, name->length));
-  // The identifier string is too long to go in the bytecode,
-  // so we add it as a constant to the chunk's
-  // constants and return its index because the index,
-  // which will go in the bytecode.
-  //
-  // At runtime, we will access the chunk constants
-  // using the index that was added to the bytecode.
-  return make_constant(compiler, parser, string);
+  ObjString *string = copy_string(parser->vm, name->start, name->length);
+
+  int slot = resolve_global(parser->vm, string);
+
+  if (slot > UINT16_MAX)
+  {
+    error(parser, "Too many global variables");
+    return 0;
+  }
+
+  return (uint16_t)slot;
+}
+
+static void emit_global(Compiler *compiler, Parser *parser, uint8_t opcode, uint16_t slot)
+{
+  emit_byte(compiler, parser, opcode);
+  emit_byte(compiler, parser, (slot >> 8) & 0xff);
+  emit_byte(compiler, parser, slot & 0xff);
 }
 
 // Returns true when the token that [parser] is currently
@@ -484,37 +830,32 @@ static bool advance_if_current_token_is(Parser *parser, TokenType type)
 
 static void named_variable(Compiler *compiler, Parser *parser, Token name, Precedence precedence)
 {
-  uint8_t get_op, set_op;
-
-  int arg = resolve_local(compiler, &name);
-  if (arg != -1)
-  {
-    get_op = OP_GET_LOCAL;
-    set_op = OP_SET_LOCAL;
-  }
-  else
-  {
-    // We add the identifier to the chunk constants
-    // and add its index to the bytecode.
-    // At runtime we will get the identifier from the chunk
-    // constants using the index that's in the bytecode.
-    arg = identifier_constant(compiler, parser, &name);
-    get_op = OP_GET_GLOBAL;
-    set_op = OP_SET_GLOBAL;
-  }
+  int local = resolve_local(compiler, &name);
+  int upvalue = local == -1 ? resolve_upvalue(compiler, parser, &name) : -1;
 
   // If variable is being used in assigment:
   // α = β
-  if (precedence <= PREC_ASSIGNMENT && advance_if_current_token_is(parser, TOKEN_EQUAL))
+  bool is_assignment = precedence <= PREC_ASSIGNMENT && advance_if_current_token_is(parser, TOKEN_EQUAL);
+
+  if (is_assignment)
   {
     // Compile β since α has already been compiled.
     expression(compiler, parser);
-    emit_bytes(compiler, parser, set_op, arg);
+  }
+
+  if (local != -1)
+  {
+    emit_bytes(compiler, parser, is_assignment ? OP_SET_LOCAL : OP_GET_LOCAL, local);
+  }
+  else if (upvalue != -1)
+  {
+    emit_bytes(compiler, parser, is_assignment ? OP_SET_UPVALUE : OP_GET_UPVALUE, upvalue);
   }
   else
   {
-    // If variable is not being used in assignment
-    emit_bytes(compiler, parser, get_op, arg);
+    // Globals are referenced in the bytecode by their slot
+    // in the vm global variables array.
+    emit_global(compiler, parser, is_assignment ? OP_SET_GLOBAL : OP_GET_GLOBAL, global_slot(parser, &name));
   }
 }
 
@@ -523,14 +864,102 @@ static void variable(Compiler *compiler, Parser *parser, Precedence precedence)
   named_variable(compiler, parser, parser->previous, precedence);
 }
 
+// Compiles the arguments of a call up to the closing parenthesis
+// and returns how many there are.
+static uint8_t argument_list(Compiler *compiler, Parser *parser)
+{
+  uint8_t argument_count = 0;
+
+  if (!current_token_is(parser, TOKEN_RIGHT_PAREN))
+  {
+    do
+    {
+      expression(compiler, parser);
+
+      if (argument_count == UINT8_MAX)
+      {
+        error(parser, "Too many arguments");
+      }
+
+      argument_count++;
+    } while (advance_if_current_token_is(parser, TOKEN_COMMA));
+  }
+
+  consume(parser, TOKEN_RIGHT_PAREN);
+  return argument_count;
+}
+
+// A call whose callee is only the OP_GET_GLOBAL at [callee_start] of
+// a global named like a math native becomes the instruction of the
+// native. The load is dropped and the arguments move down to where
+// it was, the instruction follows them. Returns true if it did.
+static bool emit_intrinsic(Compiler *compiler, Parser *parser, int callee_start, int arguments_start,
+                           uint8_t argument_count)
+{
+  Chunk *chunk = get_current_chunk(compiler);
+
+  if (arguments_start - callee_start != 3 || chunk->code[callee_start] != OP_GET_GLOBAL)
+  {
+    return false;
+  }
+
+  uint16_t slot = (uint16_t)((chunk->code[callee_start + 1] << 8) | chunk->code[callee_start + 2]);
+  ObjString *name = AS_OBJSTRING(parser->vm->global_names.values[slot]);
+  int opcode = intrinsic_opcode(name->chars, name->length, argument_count);
+
+  if (opcode < 0)
+  {
+    return false;
+  }
+
+  // Jumps in the arguments are relative, they move with them.
+  size_t length = chunk->count - arguments_start;
+  memmove(&chunk->code[callee_start], &chunk->code[arguments_start], length);
+  memmove(&chunk->lines[callee_start], &chunk->lines[arguments_start], sizeof(size_t) * length);
+  chunk->count -= 3;
+
+  if (compiler->last_call >= arguments_start)
+  {
+    compiler->last_call -= 3;
+  }
+
+  emit_global(compiler, parser, (uint8_t)opcode, slot);
+  return true;
+}
+
+// The callee has been compiled, the arguments are pushed after it.
+static void call(Compiler *compiler, Parser *parser, Precedence _)
+{
+  (void)_;
+  int callee_start = compiler->operand_start;
+  int arguments_start = get_current_chunk(compiler)->count;
+  uint8_t argument_count = argument_list(compiler, parser);
+
+  if (emit_intrinsic(compiler, parser, callee_start, arguments_start, argument_count))
+  {
+    return;
+  }
+
+  compiler->last_call = get_current_chunk(compiler)->count;
+  emit_bytes(compiler, parser, OP_CALL, argument_count);
+}
+
 static void binary(Compiler *compiler, Parser *parser, Precedence _)
 {
+  (void)_;
   const TokenType operator_type = parser->previous.type;
+  int left_start = compiler->operand_start;
+  int right_start = get_current_chunk(compiler)->count;
 
   ParseRule *rule = get_rule(operator_type);
 
   parse_precedence(compiler, parser, (Precedence)(rule->precedence + 1));
 
+  if (fold_binary(compiler, parser, operator_type, left_start, right_start))
+  {
+    return;
+  }
+
   switch (operator_type)
   {
   case TOKEN_BANG_EQUAL:
@@ -570,6 +999,7 @@ static void binary(Compiler *compiler, Parser *parser, Precedence _)
 
 static void literal(Compiler *compiler, Parser *parser, Precedence _)
 {
+  (void)_;
   switch (parser->previous.type)
   {
   case TOKEN_FALSE:
@@ -586,81 +1016,288 @@ static void literal(Compiler *compiler, Parser *parser, Precedence _)
   }
 }
 
-ParseRule rules[] = {
-    [TOKEN_LEFT_PAREN] = {grouping, NULL, PREC_NONE},
-    [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
-    [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
-    [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
-    [TOKEN_DOT] = {NULL, NULL, PREC_NONE},
-    [TOKEN_MINUS] = {unary, binary, PREC_TERM},
-    [TOKEN_PLUS] = {NULL, binary, PREC_TERM},
-    [TOKEN_SEMICOLON] = {NULL, NULL, PREC_NONE},
-    [TOKEN_SLASH] = {NULL, binary, PREC_FACTOR},
-    [TOKEN_STAR] = {NULL, binary, PREC_FACTOR},
-    [TOKEN_BANG] = {unary, NULL, PREC_NONE},
-    [TOKEN_BANG_EQUAL] = {NULL, binary, PREC_EQUALITY},
-    [TOKEN_EQUAL] = {NULL, NULL, PREC_NONE},
-    [TOKEN_EQUAL_EQUAL] = {NULL, binary, PREC_EQUALITY},
-    [TOKEN_GREATER] = {NULL, binary, PREC_COMPARISON},
-    [TOKEN_GREATER_EQUAL] = {NULL, binary, PREC_COMPARISON},
-    [TOKEN_LESS] = {NULL, binary, PREC_COMPARISON},
-    [TOKEN_LESS_EQUAL] = {NULL, binary, PREC_COMPARISON},
-    [TOKEN_IDENTIFIER] = {variable, NULL, PREC_NONE},
-    [TOKEN_STRING] = {string, NULL, PREC_NONE},
-    [TOKEN_NUMBER] = {number, NULL, PREC_NONE},
-    [TOKEN_AND] = {NULL, and_, PREC_AND},
-    [TOKEN_CLASS] = {NULL, NULL, PREC_NONE},
-    [TOKEN_ELSE] = {NULL, NULL, PREC_NONE},
-    [TOKEN_FALSE] = {literal, NULL, PREC_NONE},
-    [TOKEN_FOR] = {NULL, NULL, PREC_NONE},
-    [TOKEN_FUN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_IF] = {NULL, NULL, PREC_NONE},
-    [TOKEN_NIL] = {literal, NULL, PREC_NONE},
-    [TOKEN_OR] = {NULL, or_, PREC_OR},
-    [TOKEN_PRINT] = {NULL, NULL, PREC_NONE},
-    [TOKEN_RETURN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_SUPER] = {NULL, NULL, PREC_NONE},
-    [TOKEN_THIS] = {NULL, NULL, PREC_NONE},
-    [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
-    [TOKEN_VAR] = {NULL, NULL, PREC_NONE},
-    [TOKEN_WHILE] = {NULL, NULL, PREC_NONE},
-    [TOKEN_ERROR] = {NULL, NULL, PREC_NONE},
-    [TOKEN_EOF] = {NULL, NULL, PREC_NONE},
-};
+// The optimizing tier
+//
+// With `-O` the compiler builds a tree of nodes from the same
+// grammar instead of emitting bytecode, optimizes the tree
+// and lowers it to bytecode, see [ir.h] and [optimize_program].
+//
+// Code for the register machine, selected with `-R`, is also
+// lowered from the tree because allocating registers needs
+// to see whole expressions, see [RegisterCode].
+//
+// Nodes are created where the one pass compiler would emit
+// their instruction, so they get the same line.
 
-static ParseRule *get_rule(const TokenType type)
+static Node *parse_node_precedence(Compiler *compiler, Parser *parser, const Precedence precedence)
 {
-  return &rules[type];
+  advance(parser);
+
+  BuildFunction prefix_rule = get_rule(parser->previous.type)->prefix_node;
+
+  if (prefix_rule == NULL)
+  {
+    error(parser, "expected expression");
+    return NULL;
+  }
+
+  Node *node = prefix_rule(compiler, parser, NULL, precedence);
+
+  while (precedence <= get_rule(parser->current.type)->precedence)
+  {
+    advance(parser);
+
+    BuildFunction infix_rule = get_rule(parser->previous.type)->infix_node;
+    node = infix_rule(compiler, parser, node, precedence);
+  }
+
+  return node;
 }
 
-static void print_statement(Compiler *compiler, Parser *parser)
+static Node *expression_node(Compiler *compiler, Parser *parser)
 {
-  // Given the following expression:
-  //
-  // print α;
-  //
-  // expression will add α to the chunk.
-  expression(compiler, parser);
-  // Consume ; after α
-  consume(parser, TOKEN_SEMICOLON);
-  // Add OP_PRINT to the chunk.
-  //
-  // When we are executing the chunk and find an OP_PRINT,
-  // we will push it into the stack, after having pushed a value,
-  // that will be used by the print operation.
-  //
-  // ┌────────┐
-  // │OP_PRINT│
-  // ├────────┤
-  // │   α    │
-  // ├────────┤
-  // │  ...   │
-  // ├────────┤
-  // │  ...   │
-  // └────────┘
-  //
-  // When we find OP_PRINT in
+  return parse_node_precedence(compiler, parser, PREC_ASSIGNMENT);
+}
+
+static Node *grouping_node(Compiler *compiler, Parser *parser, Node *_, Precedence __)
+{
+  (void)_;
+  (void)__;
+  Node *node = expression_node(compiler, parser);
+  consume(parser, TOKEN_RIGHT_PAREN);
+  return node;
+}
+
+static Node *unary_node(Compiler *compiler, Parser *parser, Node *_, Precedence __)
+{
+  (void)_;
+  (void)__;
+  const TokenType operator_type = parser->previous.type;
+  Node *operand = parse_node_precedence(compiler, parser, PREC_UNARY);
+
+  Node *node = new_node(compiler->ir, NODE_UNARY, parser->previous.line);
+  node->operand = operator_type;
+  node->a = operand;
+  return node;
+}
+
+static Node *binary_node(Compiler *compiler, Parser *parser, Node *left, Precedence _)
+{
+  (void)_;
+  const TokenType operator_type = parser->previous.type;
+  ParseRule *rule = get_rule(operator_type);
+  Node *right = parse_node_precedence(compiler, parser, (Precedence)(rule->precedence + 1));
+
+  Node *node = new_node(compiler->ir, NODE_BINARY, parser->previous.line);
+  node->operand = operator_type;
+  node->a = left;
+  node->b = right;
+  return node;
+}
+
+static Node *logical_node(Compiler *compiler, Parser *parser, Node *left, NodeType type, Precedence precedence)
+{
+  size_t line = parser->previous.line;
+  Node *right = parse_node_precedence(compiler, parser, precedence);
+
+  Node *node = new_node(compiler->ir, type, line);
+  node->a = left;
+  node->b = right;
+  return node;
+}
+
+static Node *and_node(Compiler *compiler, Parser *parser, Node *left, Precedence _)
+{
+  (void)_;
+  return logical_node(compiler, parser, left, NODE_AND, PREC_AND);
+}
+
+static Node *or_node(Compiler *compiler, Parser *parser, Node *left, Precedence _)
+{
+  (void)_;
+  return logical_node(compiler, parser, left, NODE_OR, PREC_OR);
+}
+
+static Node *number_node(Compiler *compiler, Parser *parser, Node *_, Precedence __)
+{
+  (void)_;
+  (void)__;
+  return new_constant_node(parser->vm, compiler->ir, number_literal(&parser->previous),
+                           parser->previous.line);
+}
+
+static Node *string_node(Compiler *compiler, Parser *parser, Node *_, Precedence __)
+{
+  (void)_;
+  (void)__;
+  ObjString *string = copy_string(parser->vm, parser->previous.start + 1, parser->previous.length - 2);
+  return new_constant_node(parser->vm, compiler->ir, OBJ_VAL(string), parser->previous.line);
+}
+
+static Node *literal_node(Compiler *compiler, Parser *parser, Node *_, Precedence __)
+{
+  (void)_;
+  (void)__;
+  Value value;
+
+  switch (parser->previous.type)
+  {
+  case TOKEN_FALSE:
+    value = BOOL_VAL(false);
+    break;
+  case TOKEN_TRUE:
+    value = BOOL_VAL(true);
+    break;
+  default:
+    value = NIL_VAL;
+    break;
+  }
+
+  return new_constant_node(parser->vm, compiler->ir, value, parser->previous.line);
+}
+
+static Node *variable_node(Compiler *compiler, Parser *parser, Node *_, Precedence precedence)
+{
+  (void)_;
+  Token name = parser->previous;
+  int local = resolve_local(compiler, &name);
+  int upvalue = local == -1 ? resolve_upvalue(compiler, parser, &name) : -1;
+  bool is_assignment = precedence <= PREC_ASSIGNMENT && advance_if_current_token_is(parser, TOKEN_EQUAL);
+  Node *value = is_assignment ? expression_node(compiler, parser) : NULL;
+  Node *node;
+
+  if (local != -1)
+  {
+    node = new_node(compiler->ir, is_assignment ? NODE_SET_LOCAL : NODE_GET_LOCAL, parser->previous.line);
+    node->operand = compiler->locals[local].variable;
+
+    if (node->operand == compiler->initializing_variable)
+    {
+      compiler->ir->variables[node->operand].is_read_uninitialized = true;
+    }
+  }
+  else if (upvalue != -1)
+  {
+    node = new_node(compiler->ir, is_assignment ? NODE_SET_UPVALUE : NODE_GET_UPVALUE, parser->previous.line);
+    node->operand = upvalue;
+  }
+  else
+  {
+    uint16_t slot = global_slot(parser, &name);
+    node = new_node(compiler->ir, is_assignment ? NODE_SET_GLOBAL : NODE_GET_GLOBAL, parser->previous.line);
+    node->operand = slot;
+  }
+
+  node->a = value;
+  return node;
+}
+
+// The callee has been built, the arguments follow it.
+static Node *call_node(Compiler *compiler, Parser *parser, Node *callee, Precedence _)
+{
+  (void)_;
+  Node *node = new_node(compiler->ir, NODE_CALL, parser->previous.line);
+  node->a = callee;
+  Node **tail = &node->b;
+
+  if (!current_token_is(parser, TOKEN_RIGHT_PAREN))
+  {
+    do
+    {
+      Node *argument = new_node(compiler->ir, NODE_ARGUMENT, parser->previous.line);
+      argument->a = expression_node(compiler, parser);
+
+      if (node->operand == UINT8_MAX)
+      {
+        error(parser, "Too many arguments");
+      }
+
+      node->operand++;
+      *tail = argument;
+      tail = &argument->b;
+    } while (advance_if_current_token_is(parser, TOKEN_COMMA));
+  }
+
+  consume(parser, TOKEN_RIGHT_PAREN);
+  node->line = parser->previous.line;
+  return node;
+}
+
+ParseRule rules[] = {
+    [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL, grouping_node, call_node},
+    [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE, NULL, NULL},
+    [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE, NULL, NULL},
+    [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE, NULL, NULL},
+    [TOKEN_COMMA] = {NULL, NULL, PREC_NONE, NULL, NULL},
+    [TOKEN_DOT] = {NULL, NULL, PREC_NONE, NULL, NULL},
+    [TOKEN_MINUS] = {unary, binary, PREC_TERM, unary_node, binary_node},
+    [TOKEN_PLUS] = {NULL, binary, PREC_TERM, NULL, binary_node},
+    [TOKEN_SEMICOLON] = {NULL, NULL, PREC_NONE, NULL, NULL},
+    [TOKEN_SLASH] = {NULL, binary, PREC_FACTOR, NULL, binary_node},
+    [TOKEN_STAR] = {NULL, binary, PREC_FACTOR, NULL, binary_node},
+    [TOKEN_BANG] = {unary, NULL, PREC_NONE, unary_node, NULL},
+    [TOKEN_BANG_EQUAL] = {NULL, binary, PREC_EQUALITY, NULL, binary_node},
+    [TOKEN_EQUAL] = {NULL, NULL, PREC_NONE, NULL, NULL},
+    [TOKEN_EQUAL_EQUAL] = {NULL, binary, PREC_EQUALITY, NULL, binary_node},
+    [TOKEN_GREATER] = {NULL, binary, PREC_COMPARISON, NULL, binary_node},
+    [TOKEN_GREATER_EQUAL] = {NULL, binary, PREC_COMPARISON, NULL, binary_node},
+    [TOKEN_LESS] = {NULL, binary, PREC_COMPARISON, NULL, binary_node},
+    [TOKEN_LESS_EQUAL] = {NULL, binary, PREC_COMPARISON, NULL, binary_node},
+    [TOKEN_IDENTIFIER] = {variable, NULL, PREC_NONE, variable_node, NULL},
+    [TOKEN_STRING] = {string, NULL, PREC_NONE, string_node, NULL},
+    [TOKEN_NUMBER] = {number, NULL, PREC_NONE, number_node, NULL},
+    [TOKEN_AND] = {NULL, and_, PREC_AND, NULL, and_node},
+    [TOKEN_CLASS] = {NULL, NULL, PREC_NONE, NULL, NULL},
+    [TOKEN_ELSE] = {NULL, NULL, PREC_NONE, NULL, NULL},
+    [TOKEN_FALSE] = {literal, NULL, PREC_NONE, literal_node, NULL},
+    [TOKEN_FOR] = {NULL, NULL, PREC_NONE, NULL, NULL},
+    [TOKEN_FUN] = {NULL, NULL, PREC_NONE, NULL, NULL},
+    [TOKEN_IF] = {NULL, NULL, PREC_NONE, NULL, NULL},
+    [TOKEN_NIL] = {literal, NULL, PREC_NONE, literal_node, NULL},
+    [TOKEN_OR] = {NULL, or_, PREC_OR, NULL, or_node},
+    [TOKEN_PRINT] = {NULL, NULL, PREC_NONE, NULL, NULL},
+    [TOKEN_RETURN] = {NULL, NULL, PREC_NONE, NULL, NULL},
+    [TOKEN_SUPER] = {NULL, NULL, PREC_NONE, NULL, NULL},
+    [TOKEN_THIS] = {NULL, NULL, PREC_NONE, NULL, NULL},
+    [TOKEN_TRUE] = {literal, NULL, PREC_NONE, literal_node, NULL},
+    [TOKEN_VAR] = {NULL, NULL, PREC_NONE, NULL, NULL},
+    [TOKEN_WHILE] = {NULL, NULL, PREC_NONE, NULL, NULL},
+    [TOKEN_ERROR] = {NULL, NULL, PREC_NONE, NULL, NULL},
+    [TOKEN_EOF] = {NULL, NULL, PREC_NONE, NULL, NULL},
+};
+
+static ParseRule *get_rule(const TokenType type)
+{
+  return &rules[type];
+}
+
+static void print_statement(Compiler *compiler, Parser *parser)
+{
+  // Given the following expression:
+  //
+  // print α;
+  //
+  // expression will add α to the chunk.
+  expression(compiler, parser);
+  // Consume ; after α
+  consume(parser, TOKEN_SEMICOLON);
+  // Add OP_PRINT to the chunk.
+  //
+  // When we are executing the chunk and find an OP_PRINT,
+  // we will push it into the stack, after having pushed a value,
+  // that will be used by the print operation.
+  //
+  // ┌────────┐
+  // │OP_PRINT│
+  // ├────────┤
+  // │   α    │
+  // ├────────┤
+  // │  ...   │
+  // ├────────┤
+  // │  ...   │
+  // └────────┘
+  //
+  // When we find OP_PRINT in
   emit_byte(compiler, parser, OP_PRINT);
 }
 
@@ -699,7 +1336,7 @@ static void declare_variable(Compiler *compiler, Parser *parser)
   add_local(compiler, parser, *name);
 }
 
-static uint8_t parse_variable(Compiler *compiler, Parser *parser)
+static uint16_t parse_variable(Compiler *compiler, Parser *parser)
 {
   consume(parser, TOKEN_IDENTIFIER);
 
@@ -707,33 +1344,30 @@ static uint8_t parse_variable(Compiler *compiler, Parser *parser)
 
   if (is_compiling_local_scope(compiler))
   {
-    // Local variables will not be looked up by name at runtime,
-    // so theres no need to add the variable's name to the constant table.
+    // Local variables live in stack slots,
+    // so they do not need a global variable slot.
     return 0;
   }
 
-  return identifier_constant(compiler, parser, &parser->previous);
+  return global_slot(parser, &parser->previous);
 }
 
-// [global] is the index of the variable in the chunk
-// constants list.
-//
-// At runtime we use [global] to access the actual value
-// thats in the chunk constants list.
-static void define_variable(Compiler *compiler, Parser *parser, uint8_t global)
+// [global] is the slot of the variable in the
+// vm global variables array.
+static void define_variable(Compiler *compiler, Parser *parser, uint16_t global)
 {
   if (is_compiling_local_scope(compiler))
   {
     return;
   }
 
-  emit_bytes(compiler, parser, OP_DEFINE_GLOBAL, global);
+  emit_global(compiler, parser, OP_DEFINE_GLOBAL, global);
 }
 
 // var α = β;
 static void var_declaration(Compiler *compiler, Parser *parser)
 {
-  uint8_t global_variable = parse_variable(compiler, parser);
+  uint16_t global_variable = parse_variable(compiler, parser);
 
   consume(parser, TOKEN_EQUAL);
 
@@ -798,6 +1432,82 @@ static void block(Compiler *compiler, Parser *parser)
   consume(parser, TOKEN_RIGHT_BRACE);
 }
 
+// Compiles the parameters and the body of the function called
+// [parser->previous] with a compiler of its own, and emits the
+// function as a constant of the chunk it is declared in, or
+// a closure of it if it uses variables of the enclosing functions.
+static void function(Compiler *compiler, Parser *parser)
+{
+  Compiler function_compiler = new_compiler(parser->vm, TYPE_FUNCTION);
+  function_compiler.enclosing = compiler;
+  current = &function_compiler;
+
+  ObjString *name = copy_string(parser->vm, parser->previous.start, parser->previous.length);
+  // The function may have been promoted by the collection
+  // that allocating the name started.
+  function_compiler.function->name = name;
+  write_barrier(parser->vm, (Obj *)function_compiler.function, OBJ_VAL((Obj *)name));
+
+  // The parameters are the first locals of the function,
+  // the caller pushes the arguments in their slots.
+  begin_scope(&function_compiler);
+  consume(parser, TOKEN_LEFT_PAREN);
+
+  if (!current_token_is(parser, TOKEN_RIGHT_PAREN))
+  {
+    do
+    {
+      if (function_compiler.function->arity == UINT8_MAX)
+      {
+        error_at_current(parser, "Too many parameters");
+      }
+
+      function_compiler.function->arity++;
+      consume(parser, TOKEN_IDENTIFIER);
+      add_local(&function_compiler, parser, parser->previous);
+    } while (advance_if_current_token_is(parser, TOKEN_COMMA));
+  }
+
+  consume(parser, TOKEN_RIGHT_PAREN);
+  consume(parser, TOKEN_LEFT_BRACE);
+  block(&function_compiler, parser);
+
+  // Returning discards the locals, the scope is not ended.
+  ObjFunction *function = end_compiler(&function_compiler, parser);
+
+  // The captures are kept in the function, which is still
+  // reachable by the collector until [current] is restored,
+  // so OP_CLOSURE only needs the constant.
+  if (function->upvalue_count > 0)
+  {
+    function->captures = ALLOCATE(Capture, function->upvalue_count);
+    memcpy(function->captures, function_compiler.upvalues, sizeof(Capture) * function->upvalue_count);
+  }
+
+  current = compiler;
+
+  if (function->upvalue_count > 0)
+  {
+    emit_bytes(compiler, parser, OP_CLOSURE, make_constant(compiler, parser, OBJ_VAL((Obj *)function)));
+  }
+  else
+  {
+    emit_constant(compiler, parser, OBJ_VAL((Obj *)function));
+  }
+}
+
+// fun α(β, γ) { ... }
+//
+// Declares a variable α, like `var`, whose value is the function.
+static void fun_declaration(Compiler *compiler, Parser *parser)
+{
+  uint16_t global_variable = parse_variable(compiler, parser);
+
+  function(compiler, parser);
+
+  define_variable(compiler, parser, global_variable);
+}
+
 // Emits a jump instruction and returns its index
 // in the chunk being compilled.
 static int emit_jump(Compiler *compiler, Parser *parser, uint8_t opcode)
@@ -951,12 +1661,52 @@ static void for_statement(Compiler *compiler, Parser *parser)
   end_scope(compiler, parser);
 }
 
+// return;
+// return α;
+static void return_statement(Compiler *compiler, Parser *parser)
+{
+  if (compiler->type == TYPE_SCRIPT)
+  {
+    error(parser, "Can't return from top-level code");
+  }
+
+  if (advance_if_current_token_is(parser, TOKEN_SEMICOLON))
+  {
+    emit_return(compiler, parser);
+    return;
+  }
+
+  int expression_start = get_current_chunk(compiler)->count;
+  expression(compiler, parser);
+  consume(parser, TOKEN_SEMICOLON);
+
+  // When the returned value is the result of a call, the call is
+  // the last instruction and becomes a tail call. The OP_RETURN
+  // is still reached by the jumps of `return a and f(a);`.
+  Chunk *chunk = get_current_chunk(compiler);
+
+  if (compiler->last_call >= expression_start && compiler->last_call == (int)chunk->count - 2)
+  {
+    chunk->code[compiler->last_call] = OP_TAIL_CALL;
+  }
+
+  emit_byte(compiler, parser, OP_RETURN);
+}
+
 static void statement(Compiler *compiler, Parser *parser)
 {
   if (advance_if_current_token_is(parser, TOKEN_VAR))
   {
     var_declaration(compiler, parser);
   }
+  else if (advance_if_current_token_is(parser, TOKEN_FUN))
+  {
+    fun_declaration(compiler, parser);
+  }
+  else if (advance_if_current_token_is(parser, TOKEN_RETURN))
+  {
+    return_statement(compiler, parser);
+  }
   else if (advance_if_current_token_is(parser, TOKEN_PRINT))
   {
     print_statement(compiler, parser);
@@ -995,19 +1745,433 @@ static void declaration(Compiler *compiler, Parser *parser)
   }
 }
 
+static Node *statement_node(Compiler *compiler, Parser *parser);
+
+// Ends the current scope without emitting anything,
+// lowering pops the locals of a block at its end.
+static void end_node_scope(Compiler *compiler)
+{
+  while (compiler->local_count > 0 &&
+         compiler->locals[compiler->local_count - 1].depth == compiler->scope_depth)
+  {
+    compiler->local_count--;
+  }
+
+  compiler->scope_depth--;
+}
+
+// Declares the local [name] and returns its variable.
+static int add_local_variable(Compiler *compiler, Parser *parser, Token name)
+{
+  int variable = add_variable(compiler->ir);
+  int local_count = compiler->local_count;
+
+  add_local(compiler, parser, name);
+
+  if (compiler->local_count > local_count)
+  {
+    compiler->locals[local_count].variable = variable;
+  }
+
+  return variable;
+}
+
+// Builds the statement that ends with a `;` out of [value].
+static Node *simple_statement_node(Compiler *compiler, Parser *parser, NodeType type, Node *value)
+{
+  consume(parser, TOKEN_SEMICOLON);
+
+  Node *node = new_node(compiler->ir, type, parser->previous.line);
+  node->a = value;
+  return node;
+}
+
+// var α = β;
+static Node *var_declaration_node(Compiler *compiler, Parser *parser)
+{
+  consume(parser, TOKEN_IDENTIFIER);
+
+  Token name = parser->previous;
+
+  if (!is_compiling_local_scope(compiler))
+  {
+    uint16_t global = global_slot(parser, &name);
+    consume(parser, TOKEN_EQUAL);
+    Node *node = simple_statement_node(compiler, parser, NODE_DEFINE_GLOBAL, expression_node(compiler, parser));
+    node->operand = global;
+    return node;
+  }
+
+  int variable = add_local_variable(compiler, parser, name);
+
+  consume(parser, TOKEN_EQUAL);
+
+  compiler->initializing_variable = variable;
+  Node *value = expression_node(compiler, parser);
+  compiler->initializing_variable = -1;
+
+  Node *node = simple_statement_node(compiler, parser, NODE_VAR, value);
+  node->operand = variable;
+  return node;
+}
+
+// Builds the declarations up to the `}` that ends a block
+// and returns the first, they are linked by [next].
+static Node *declarations_node(Compiler *compiler, Parser *parser)
+{
+  Node *head = NULL;
+  Node **tail = &head;
+
+  while (!current_token_is(parser, TOKEN_RIGHT_BRACE) && !current_token_is(parser, TOKEN_EOF))
+  {
+    *tail = declaration_node(compiler, parser);
+
+    while (*tail != NULL)
+    {
+      tail = &(*tail)->next;
+    }
+  }
+
+  consume(parser, TOKEN_RIGHT_BRACE);
+  return head;
+}
+
+static Node *block_node(Compiler *compiler, Parser *parser)
+{
+  Node *node = new_node(compiler->ir, NODE_BLOCK, parser->previous.line);
+
+  begin_scope(compiler);
+  node->a = declarations_node(compiler, parser);
+  end_node_scope(compiler);
+
+  // The locals are popped when the block ends.
+  node->line = parser->previous.line;
+  return node;
+}
+
+static Node *if_statement_node(Compiler *compiler, Parser *parser)
+{
+  Node *node = new_node(compiler->ir, NODE_IF, parser->previous.line);
+  node->a = expression_node(compiler, parser);
+  node->line = parser->previous.line;
+  node->b = statement_node(compiler, parser);
+
+  if (advance_if_current_token_is(parser, TOKEN_ELSE))
+  {
+    node->c = statement_node(compiler, parser);
+  }
+
+  return node;
+}
+
+static Node *while_statement_node(Compiler *compiler, Parser *parser)
+{
+  Node *node = new_node(compiler->ir, NODE_WHILE, parser->previous.line);
+  node->a = expression_node(compiler, parser);
+  node->line = parser->previous.line;
+  node->b = statement_node(compiler, parser);
+  return node;
+}
+
+// for x = expression; expression; expression { List<statement> }
+//
+// is built as
+//
+// { var x = expression; while expression { List<statement> } }
+//
+// with the increment in the loop node, which runs it after the body.
+static Node *for_statement_node(Compiler *compiler, Parser *parser)
+{
+  Node *node = new_node(compiler->ir, NODE_BLOCK, parser->previous.line);
+
+  begin_scope(compiler);
+
+  node->a = var_declaration_node(compiler, parser);
+
+  Node *loop = new_node(compiler->ir, NODE_WHILE, parser->previous.line);
+  loop->a = expression_node(compiler, parser);
+  consume(parser, TOKEN_SEMICOLON);
+  loop->line = parser->previous.line;
+  loop->c = expression_node(compiler, parser);
+  loop->b = statement_node(compiler, parser);
+  node->a->next = loop;
+
+  end_node_scope(compiler);
+
+  node->line = parser->previous.line;
+  return node;
+}
+
+// Optimizes [program] with `-O` and lowers it to the function
+// being compiled, to register code with `-R`.
+static void lower_tree(Compiler *compiler, Parser *parser, IrProgram *program)
+{
+  if (parser->had_error)
+  {
+    return;
+  }
+
+  if (parser->vm->optimize)
+  {
+    optimize_program(parser->vm, program);
+  }
+
+  // Optimizing may have started a collection that moved the function.
+  bool lowered = compiler->is_register_code
+                     ? lower_program_to_registers(parser->vm, program, compiler->function)
+                     : lower_program(parser->vm, program, compiler->function);
+
+  if (!lowered)
+  {
+    parser->had_error = true;
+  }
+}
+
+// Builds the function called [parser->previous] like [function] does.
+// Its body is a program of its own, which is optimized and lowered
+// once the body ends. Returns the node that creates the function
+// where it is declared, see [ir.h].
+static Node *function_node(Compiler *compiler, Parser *parser)
+{
+  Compiler function_compiler = new_compiler(parser->vm, TYPE_FUNCTION);
+  function_compiler.enclosing = compiler;
+  function_compiler.is_register_code = compiler->is_register_code;
+  current = &function_compiler;
+
+  ObjString *name = copy_string(parser->vm, parser->previous.start, parser->previous.length);
+  function_compiler.function->name = name;
+  write_barrier(parser->vm, (Obj *)function_compiler.function, OBJ_VAL((Obj *)name));
+
+  IrProgram program;
+  init_ir_program(&program);
+  function_compiler.ir = &program;
+  program.root = new_node(&program, NODE_BLOCK, parser->previous.line);
+
+  // The parameters are the first variables of the program.
+  begin_scope(&function_compiler);
+  consume(parser, TOKEN_LEFT_PAREN);
+
+  if (!current_token_is(parser, TOKEN_RIGHT_PAREN))
+  {
+    do
+    {
+      if (function_compiler.function->arity == UINT8_MAX)
+      {
+        error_at_current(parser, "Too many parameters");
+      }
+
+      function_compiler.function->arity++;
+      consume(parser, TOKEN_IDENTIFIER);
+      add_local_variable(&function_compiler, parser, parser->previous);
+      program.parameter_count++;
+    } while (advance_if_current_token_is(parser, TOKEN_COMMA));
+  }
+
+  consume(parser, TOKEN_RIGHT_PAREN);
+  consume(parser, TOKEN_LEFT_BRACE);
+  program.root->a = declarations_node(&function_compiler, parser);
+
+  lower_tree(&function_compiler, parser, &program);
+  ObjFunction *function = end_compiler(&function_compiler, parser);
+
+  // The captured locals only get their slot when the
+  // closure is lowered, see [set_captures].
+  if (function->upvalue_count > 0)
+  {
+    function->captures = ALLOCATE(Capture, function->upvalue_count);
+    memcpy(function->captures, function_compiler.upvalues, sizeof(Capture) * function->upvalue_count);
+  }
+
+  function_compiler.ir = NULL;
+  free_ir_program(&program);
+  current = compiler;
+
+  Node *node = new_constant_node(parser->vm, compiler->ir, OBJ_VAL((Obj *)function), parser->previous.line);
+
+  if (function->upvalue_count == 0)
+  {
+    return node;
+  }
+
+  node->type = NODE_CLOSURE;
+  Node **tail = &node->a;
+
+  for (int i = 0; i < function->upvalue_count; i++)
+  {
+    const Capture *upvalue = &function_compiler.upvalues[i];
+    Node *captured;
+
+    if (upvalue->is_local)
+    {
+      captured = new_node(compiler->ir, NODE_GET_LOCAL, node->line);
+      captured->operand = compiler->locals[upvalue->index].variable;
+      compiler->ir->variables[captured->operand].is_captured = true;
+    }
+    else
+    {
+      captured = new_node(compiler->ir, NODE_GET_UPVALUE, node->line);
+      captured->operand = upvalue->index;
+    }
+
+    Node *capture = new_node(compiler->ir, NODE_ARGUMENT, node->line);
+    capture->a = captured;
+    *tail = capture;
+    tail = &capture->b;
+  }
+
+  return node;
+}
+
+// fun α(β, γ) { ... }
+static Node *fun_declaration_node(Compiler *compiler, Parser *parser)
+{
+  consume(parser, TOKEN_IDENTIFIER);
+
+  Token name = parser->previous;
+
+  if (!is_compiling_local_scope(compiler))
+  {
+    uint16_t global = global_slot(parser, &name);
+    Node *value = function_node(compiler, parser);
+    Node *node = new_node(compiler->ir, NODE_DEFINE_GLOBAL, parser->previous.line);
+    node->operand = global;
+    node->a = value;
+    return node;
+  }
+
+  // The variable is declared first so the function can call itself.
+  int variable = add_local_variable(compiler, parser, name);
+  Node *value = function_node(compiler, parser);
+  Node *node = new_node(compiler->ir, NODE_VAR, parser->previous.line);
+  node->operand = variable;
+  node->a = value;
+  return node;
+}
+
+// return;
+// return α;
+static Node *return_statement_node(Compiler *compiler, Parser *parser)
+{
+  if (compiler->type == TYPE_SCRIPT)
+  {
+    error(parser, "Can't return from top-level code");
+  }
+
+  if (advance_if_current_token_is(parser, TOKEN_SEMICOLON))
+  {
+    return new_node(compiler->ir, NODE_RETURN, parser->previous.line);
+  }
+
+  return simple_statement_node(compiler, parser, NODE_RETURN, expression_node(compiler, parser));
+}
+
+static Node *statement_node(Compiler *compiler, Parser *parser)
+{
+  if (advance_if_current_token_is(parser, TOKEN_VAR))
+  {
+    return var_declaration_node(compiler, parser);
+  }
+
+  if (advance_if_current_token_is(parser, TOKEN_FUN))
+  {
+    return fun_declaration_node(compiler, parser);
+  }
+
+  if (advance_if_current_token_is(parser, TOKEN_RETURN))
+  {
+    return return_statement_node(compiler, parser);
+  }
+
+  if (advance_if_current_token_is(parser, TOKEN_PRINT))
+  {
+    return simple_statement_node(compiler, parser, NODE_PRINT, expression_node(compiler, parser));
+  }
+
+  if (advance_if_current_token_is(parser, TOKEN_FOR))
+  {
+    return for_statement_node(compiler, parser);
+  }
+
+  if (advance_if_current_token_is(parser, TOKEN_IF))
+  {
+    return if_statement_node(compiler, parser);
+  }
+
+  if (advance_if_current_token_is(parser, TOKEN_WHILE))
+  {
+    return while_statement_node(compiler, parser);
+  }
+
+  if (advance_if_current_token_is(parser, TOKEN_LEFT_BRACE))
+  {
+    return block_node(compiler, parser);
+  }
+
+  return simple_statement_node(compiler, parser, NODE_EXPRESSION, expression_node(compiler, parser));
+}
+
+static Node *declaration_node(Compiler *compiler, Parser *parser)
+{
+  Node *node = statement_node(compiler, parser);
+
+  if (parser->panic_mode)
+  {
+    synchronize(parser);
+  }
+
+  return node;
+}
+
+// Builds the whole program, optimizes it with `-O` and lowers it
+// to the function being compiled, to register code with `-R`.
+static void compile_tree(Compiler *compiler, Parser *parser)
+{
+  IrProgram program;
+  init_ir_program(&program);
+  compiler->ir = &program;
+
+  program.root = new_node(&program, NODE_BLOCK, 0);
+  Node **tail = &program.root->a;
+
+  while (!current_token_is(parser, TOKEN_EOF))
+  {
+    *tail = declaration_node(compiler, parser);
+
+    while (*tail != NULL)
+    {
+      tail = &(*tail)->next;
+    }
+  }
+
+  lower_tree(compiler, parser, &program);
+
+  compiler->ir = NULL;
+  free_ir_program(&program);
+}
+
 ObjFunction *compile(Vm *vm, const char *source_code)
 {
   Parser parser = new_parser(vm, source_code);
   Compiler compiler = new_compiler(vm, TYPE_SCRIPT);
+  current = &compiler;
 
   advance(&parser);
 
-  while (!current_token_is(&parser, TOKEN_EOF))
+  if (vm->optimize || vm->register_machine)
+  {
+    compiler.is_register_code = vm->register_machine;
+    compile_tree(&compiler, &parser);
+  }
+  else
   {
-    declaration(&compiler, &parser);
+    while (!current_token_is(&parser, TOKEN_EOF))
+    {
+      declaration(&compiler, &parser);
+    }
   }
 
   end_compiler(&compiler, &parser);
+  current = NULL;
 
   if (parser.had_error)
   {
@@ -1016,3 +2180,31 @@ ObjFunction *compile(Vm *vm, const char *source_code)
 
   return compiler.function;
 }
+
+void mark_compiler_roots(Vm *vm)
+{
+  for (Compiler *compiler = current; compiler != NULL; compiler = compiler->enclosing)
+  {
+    mark_object(vm, (Obj *)compiler->function);
+
+    // Constants of the optimizing tier are only in the chunk once
+    // the program is lowered.
+    if (compiler->ir != NULL)
+    {
+      mark_value_array(vm, &compiler->ir->constants);
+    }
+  }
+}
+
+void evacuate_compiler_roots(Vm *vm)
+{
+  for (Compiler *compiler = current; compiler != NULL; compiler = compiler->enclosing)
+  {
+    compiler->function = (ObjFunction *)evacuate_object(vm, (Obj *)compiler->function);
+
+    if (compiler->ir != NULL)
+    {
+      evacuate_value_array(vm, &compiler->ir->constants);
+    }
+  }
+}
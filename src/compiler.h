@@ -2,6 +2,7 @@
 #define COMPILER_H
 
 #include "vm.h"
+#include "obj.h"
 #include "scanner.h"
 
 typedef struct
@@ -16,5 +17,11 @@ typedef struct
 
 ObjFunction *compile(Vm *vm, const char *source_code);
 Parser new_parser(Vm *vm, const char *source_code);
+// Marks the functions that are being compiled
+// so the garbage collector does not free them.
+void mark_compiler_roots(Vm *vm);
+// Updates the compiler references to the functions
+// that are being compiled after a minor collection moved them.
+void evacuate_compiler_roots(Vm *vm);
 
 #endif
\ No newline at end of file
@@ -1,5 +1,229 @@
 #include "debug.h"
 
+static const char *opcode_names[UINT8_COUNT] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_NOT] = "OP_NOT",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_NOT_EQUAL] = "OP_NOT_EQUAL",
+    [OP_GREATER_EQUAL] = "OP_GREATER_EQUAL",
+    [OP_LESS_EQUAL] = "OP_LESS_EQUAL",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_POP] = "OP_POP",
+    [OP_POPN] = "OP_POPN",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_CALL] = "OP_CALL",
+    [OP_TAIL_CALL] = "OP_TAIL_CALL",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_SQRT] = "OP_SQRT",
+    [OP_FLOOR] = "OP_FLOOR",
+    [OP_ABS] = "OP_ABS",
+    [OP_MIN] = "OP_MIN",
+    [OP_MAX] = "OP_MAX",
+    [OP_POW] = "OP_POW",
+    [OP_ADD_CONSTANT] = "OP_ADD_CONSTANT",
+    [OP_SUBTRACT_CONSTANT] = "OP_SUBTRACT_CONSTANT",
+    [OP_MULTIPLY_CONSTANT] = "OP_MULTIPLY_CONSTANT",
+    [OP_DIVIDE_CONSTANT] = "OP_DIVIDE_CONSTANT",
+    [OP_LESS_CONSTANT] = "OP_LESS_CONSTANT",
+    [OP_GREATER_CONSTANT] = "OP_GREATER_CONSTANT",
+    [OP_EQUAL_CONSTANT] = "OP_EQUAL_CONSTANT",
+    [OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+    [OP_SET_GLOBAL_POP] = "OP_SET_GLOBAL_POP",
+    [OP_ADD_LOCAL_CONSTANT] = "OP_ADD_LOCAL_CONSTANT",
+    [OP_POP_JUMP_IF_FALSE] = "OP_POP_JUMP_IF_FALSE",
+    [OP_ADD_NUMBER] = "OP_ADD_NUMBER",
+    [OP_ADD_INTEGER] = "OP_ADD_INTEGER",
+    [OP_ADD_STRING] = "OP_ADD_STRING",
+    [OP_SUBTRACT_NUMBER] = "OP_SUBTRACT_NUMBER",
+    [OP_SUBTRACT_INTEGER] = "OP_SUBTRACT_INTEGER",
+    [OP_MULTIPLY_NUMBER] = "OP_MULTIPLY_NUMBER",
+    [OP_MULTIPLY_INTEGER] = "OP_MULTIPLY_INTEGER",
+    [OP_EQUAL_NUMBER] = "OP_EQUAL_NUMBER",
+    [OP_NOT_EQUAL_NUMBER] = "OP_NOT_EQUAL_NUMBER",
+    [OP_ADD_CONSTANT_NUMBER] = "OP_ADD_CONSTANT_NUMBER",
+    [OP_SUBTRACT_CONSTANT_NUMBER] = "OP_SUBTRACT_CONSTANT_NUMBER",
+    [OP_MULTIPLY_CONSTANT_NUMBER] = "OP_MULTIPLY_CONSTANT_NUMBER",
+    [OP_DIVIDE_CONSTANT_NUMBER] = "OP_DIVIDE_CONSTANT_NUMBER",
+    [OP_LESS_CONSTANT_NUMBER] = "OP_LESS_CONSTANT_NUMBER",
+    [OP_GREATER_CONSTANT_NUMBER] = "OP_GREATER_CONSTANT_NUMBER",
+    [OP_EQUAL_CONSTANT_NUMBER] = "OP_EQUAL_CONSTANT_NUMBER",
+    [OP_ADD_LOCAL_CONSTANT_NUMBER] = "OP_ADD_LOCAL_CONSTANT_NUMBER",
+    [OP_ADD_CONSTANT_INTEGER] = "OP_ADD_CONSTANT_INTEGER",
+    [OP_SUBTRACT_CONSTANT_INTEGER] = "OP_SUBTRACT_CONSTANT_INTEGER",
+    [OP_MULTIPLY_CONSTANT_INTEGER] = "OP_MULTIPLY_CONSTANT_INTEGER",
+    [OP_LESS_CONSTANT_INTEGER] = "OP_LESS_CONSTANT_INTEGER",
+    [OP_GREATER_CONSTANT_INTEGER] = "OP_GREATER_CONSTANT_INTEGER",
+    [OP_EQUAL_CONSTANT_INTEGER] = "OP_EQUAL_CONSTANT_INTEGER",
+    [OP_ADD_LOCAL_CONSTANT_INTEGER] = "OP_ADD_LOCAL_CONSTANT_INTEGER",
+};
+
+const char *opcode_name(uint8_t opcode)
+{
+  return opcode_names[opcode] != NULL ? opcode_names[opcode] : "OP_UNKNOWN";
+}
+
+static const char *register_opcode_names[UINT8_COUNT] = {
+    [ROP_MOVE] = "ROP_MOVE",
+    [ROP_CONSTANT] = "ROP_CONSTANT",
+    [ROP_NIL] = "ROP_NIL",
+    [ROP_TRUE] = "ROP_TRUE",
+    [ROP_FALSE] = "ROP_FALSE",
+    [ROP_GET_GLOBAL] = "ROP_GET_GLOBAL",
+    [ROP_SET_GLOBAL] = "ROP_SET_GLOBAL",
+    [ROP_DEFINE_GLOBAL] = "ROP_DEFINE_GLOBAL",
+    [ROP_NEGATE] = "ROP_NEGATE",
+    [ROP_NOT] = "ROP_NOT",
+    [ROP_ADD] = "ROP_ADD",
+    [ROP_SUBTRACT] = "ROP_SUBTRACT",
+    [ROP_MULTIPLY] = "ROP_MULTIPLY",
+    [ROP_DIVIDE] = "ROP_DIVIDE",
+    [ROP_EQUAL] = "ROP_EQUAL",
+    [ROP_NOT_EQUAL] = "ROP_NOT_EQUAL",
+    [ROP_GREATER] = "ROP_GREATER",
+    [ROP_GREATER_EQUAL] = "ROP_GREATER_EQUAL",
+    [ROP_LESS] = "ROP_LESS",
+    [ROP_LESS_EQUAL] = "ROP_LESS_EQUAL",
+    [ROP_ADD_CONSTANT] = "ROP_ADD_CONSTANT",
+    [ROP_SUBTRACT_CONSTANT] = "ROP_SUBTRACT_CONSTANT",
+    [ROP_MULTIPLY_CONSTANT] = "ROP_MULTIPLY_CONSTANT",
+    [ROP_DIVIDE_CONSTANT] = "ROP_DIVIDE_CONSTANT",
+    [ROP_EQUAL_CONSTANT] = "ROP_EQUAL_CONSTANT",
+    [ROP_NOT_EQUAL_CONSTANT] = "ROP_NOT_EQUAL_CONSTANT",
+    [ROP_GREATER_CONSTANT] = "ROP_GREATER_CONSTANT",
+    [ROP_GREATER_EQUAL_CONSTANT] = "ROP_GREATER_EQUAL_CONSTANT",
+    [ROP_LESS_CONSTANT] = "ROP_LESS_CONSTANT",
+    [ROP_LESS_EQUAL_CONSTANT] = "ROP_LESS_EQUAL_CONSTANT",
+    [ROP_PRINT] = "ROP_PRINT",
+    [ROP_JUMP] = "ROP_JUMP",
+    [ROP_JUMP_IF_FALSE] = "ROP_JUMP_IF_FALSE",
+    [ROP_JUMP_IF_TRUE] = "ROP_JUMP_IF_TRUE",
+    [ROP_LOOP] = "ROP_LOOP",
+    [ROP_CALL] = "ROP_CALL",
+    [ROP_TAIL_CALL] = "ROP_TAIL_CALL",
+    [ROP_CLOSURE] = "ROP_CLOSURE",
+    [ROP_GET_UPVALUE] = "ROP_GET_UPVALUE",
+    [ROP_SET_UPVALUE] = "ROP_SET_UPVALUE",
+    [ROP_CLOSE_UPVALUES] = "ROP_CLOSE_UPVALUES",
+    [ROP_RETURN] = "ROP_RETURN",
+    [ROP_RETURN_NIL] = "ROP_RETURN_NIL",
+};
+
+const char *register_opcode_name(uint8_t opcode)
+{
+  return register_opcode_names[opcode] != NULL ? register_opcode_names[opcode] : "ROP_UNKNOWN";
+}
+
+#ifdef DEBUG_PROFILE_OPCODES
+#define PROFILE_TOP_PAIRS 24
+
+// [opcode_pairs[a][b]] counts how many times [b] ran right after [a].
+static uint64_t opcode_pairs[UINT8_COUNT][UINT8_COUNT];
+static uint64_t opcode_count;
+static int previous_opcode = -1;
+// The register machine has no superinstructions to pick,
+// only how many times each opcode ran is counted.
+static uint64_t register_opcodes[UINT8_COUNT];
+static uint64_t register_opcode_count;
+
+void profile_opcode(uint8_t opcode)
+{
+  if (previous_opcode >= 0)
+  {
+    opcode_pairs[previous_opcode][opcode]++;
+  }
+
+  previous_opcode = opcode;
+  opcode_count++;
+}
+
+void profile_register_opcode(uint8_t opcode)
+{
+  register_opcodes[opcode]++;
+  register_opcode_count++;
+}
+
+static void print_register_opcode_profile(void)
+{
+  printf("== register opcodes ==\n");
+  printf("instructions %llu\n", (unsigned long long)register_opcode_count);
+
+  for (int opcode = 0; opcode < UINT8_COUNT; opcode++)
+  {
+    if (register_opcodes[opcode] > 0)
+    {
+      printf("%5.1f%% %-26s %llu\n",
+             100.0 * register_opcodes[opcode] / register_opcode_count,
+             register_opcode_name(opcode),
+             (unsigned long long)register_opcodes[opcode]);
+    }
+  }
+}
+
+void print_opcode_profile(void)
+{
+  if (register_opcode_count > 0)
+  {
+    print_register_opcode_profile();
+    return;
+  }
+
+  printf("== opcode pairs ==\n");
+  printf("instructions %llu\n", (unsigned long long)opcode_count);
+
+  // Selection of the most frequent pairs, the table is small
+  // and this only runs once.
+  for (int rank = 0; rank < PROFILE_TOP_PAIRS; rank++)
+  {
+    int best_a = 0;
+    int best_b = 0;
+
+    for (int a = 0; a < UINT8_COUNT; a++)
+    {
+      for (int b = 0; b < UINT8_COUNT; b++)
+      {
+        if (opcode_pairs[a][b] > opcode_pairs[best_a][best_b])
+        {
+          best_a = a;
+          best_b = b;
+        }
+      }
+    }
+
+    if (opcode_pairs[best_a][best_b] == 0)
+    {
+      break;
+    }
+
+    printf("%5.1f%% %-16s %-16s %llu\n",
+           100.0 * opcode_pairs[best_a][best_b] / opcode_count,
+           opcode_name(best_a), opcode_name(best_b),
+           (unsigned long long)opcode_pairs[best_a][best_b]);
+    opcode_pairs[best_a][best_b] = 0;
+  }
+}
+#endif
+
 static size_t simple_instruction(const char *name, size_t offset)
 {
   printf("%s\n", name);
@@ -9,7 +233,7 @@ static size_t simple_instruction(const char *name, size_t offset)
 static size_t constant_instruction(const char *name, Chunk *chunk, size_t offset)
 {
   uint8_t constant = chunk->code[offset + 1];
-  printf("%-16s %4d ", name, 0);
+  printf("%-16s %4d ", name, constant);
   print_value(chunk->constants.values[constant]);
   printf("\n");
   return offset + 2;
@@ -18,15 +242,33 @@ static size_t constant_instruction(const char *name, Chunk *chunk, size_t offset
 static size_t byte_instruction(const char *name, Chunk *chunk, size_t offset)
 {
   uint8_t slot = chunk->code[offset + 1];
-  printf("%-16s $d\n", name, slot);
+  printf("%-16s %4d\n", name, slot);
   return offset + 2;
 }
 
-static jump_instruction(const char *name, int sign, Chunk *chunk, int offset)
+static size_t global_instruction(const char *name, Chunk *chunk, size_t offset)
+{
+  uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+  slot |= chunk->code[offset + 2];
+  printf("%-16s %4d\n", name, slot);
+  return offset + 3;
+}
+
+static size_t local_constant_instruction(const char *name, Chunk *chunk, size_t offset)
+{
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  printf("%-16s %4d %4d ", name, slot, constant);
+  print_value(chunk->constants.values[constant]);
+  printf("\n");
+  return offset + 3;
+}
+
+static size_t jump_instruction(const char *name, int sign, Chunk *chunk, size_t offset)
 {
   uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
   jump |= chunk->code[offset + 2];
-  printf("%-16s %4d\n", name, offset, offset + 3, sign * jump);
+  printf("%-16s %4zu -> %zu\n", name, offset, offset + 3 + sign * jump);
   return offset + 3;
 }
 
@@ -73,6 +315,12 @@ size_t dissamble_instruction(Chunk *chunk, size_t offset)
     return simple_instruction("OP_GREATER", offset);
   case OP_LESS:
     return simple_instruction("OP_LESS", offset);
+  case OP_NOT_EQUAL:
+    return simple_instruction("OP_NOT_EQUAL", offset);
+  case OP_GREATER_EQUAL:
+    return simple_instruction("OP_GREATER_EQUAL", offset);
+  case OP_LESS_EQUAL:
+    return simple_instruction("OP_LESS_EQUAL", offset);
   case OP_NEGATE:
     return simple_instruction("OP_NEGATE", offset);
   case OP_ADD:
@@ -89,12 +337,14 @@ size_t dissamble_instruction(Chunk *chunk, size_t offset)
     return simple_instruction("OP_PRINT", offset);
   case OP_POP:
     return simple_instruction("OP_POP", offset);
+  case OP_POPN:
+    return byte_instruction("OP_POPN", chunk, offset);
   case OP_DEFINE_GLOBAL:
-    return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
+    return global_instruction("OP_DEFINE_GLOBAL", chunk, offset);
   case OP_GET_GLOBAL:
-    return constant_instruction("OP_GET_GLOBAL", chunk, offset);
+    return global_instruction("OP_GET_GLOBAL", chunk, offset);
   case OP_SET_GLOBAL:
-    return constant_instruction("OP_SET_GLOBAL", chunk, offset);
+    return global_instruction("OP_SET_GLOBAL", chunk, offset);
   case OP_GET_LOCAL:
     return byte_instruction("OP_GET_LOCAL", chunk, offset);
   case OP_SET_LOCAL:
@@ -105,8 +355,154 @@ size_t dissamble_instruction(Chunk *chunk, size_t offset)
     return jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
   case OP_LOOP:
     return jump_instruction("OP_LOOP", -1, chunk, offset);
+  case OP_CALL:
+    return byte_instruction("OP_CALL", chunk, offset);
+  case OP_TAIL_CALL:
+    return byte_instruction("OP_TAIL_CALL", chunk, offset);
+  case OP_CLOSURE:
+    return constant_instruction("OP_CLOSURE", chunk, offset);
+  case OP_GET_UPVALUE:
+    return byte_instruction("OP_GET_UPVALUE", chunk, offset);
+  case OP_SET_UPVALUE:
+    return byte_instruction("OP_SET_UPVALUE", chunk, offset);
+  case OP_CLOSE_UPVALUE:
+    return simple_instruction("OP_CLOSE_UPVALUE", offset);
+  case OP_SQRT:
+  case OP_FLOOR:
+  case OP_ABS:
+  case OP_MIN:
+  case OP_MAX:
+  case OP_POW:
+    return global_instruction(opcode_name(instruction), chunk, offset);
+  case OP_ADD_CONSTANT:
+  case OP_SUBTRACT_CONSTANT:
+  case OP_MULTIPLY_CONSTANT:
+  case OP_DIVIDE_CONSTANT:
+  case OP_LESS_CONSTANT:
+  case OP_GREATER_CONSTANT:
+  case OP_EQUAL_CONSTANT:
+    return constant_instruction(opcode_name(instruction), chunk, offset);
+  case OP_SET_LOCAL_POP:
+    return byte_instruction("OP_SET_LOCAL_POP", chunk, offset);
+  case OP_SET_GLOBAL_POP:
+    return global_instruction("OP_SET_GLOBAL_POP", chunk, offset);
+  case OP_ADD_LOCAL_CONSTANT:
+    return local_constant_instruction("OP_ADD_LOCAL_CONSTANT", chunk, offset);
+  case OP_POP_JUMP_IF_FALSE:
+    return jump_instruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+  case OP_ADD_NUMBER:
+  case OP_ADD_INTEGER:
+  case OP_ADD_STRING:
+  case OP_SUBTRACT_NUMBER:
+  case OP_SUBTRACT_INTEGER:
+  case OP_MULTIPLY_NUMBER:
+  case OP_MULTIPLY_INTEGER:
+  case OP_EQUAL_NUMBER:
+  case OP_NOT_EQUAL_NUMBER:
+    return simple_instruction(opcode_name(instruction), offset);
+  case OP_ADD_CONSTANT_NUMBER:
+  case OP_SUBTRACT_CONSTANT_NUMBER:
+  case OP_MULTIPLY_CONSTANT_NUMBER:
+  case OP_DIVIDE_CONSTANT_NUMBER:
+  case OP_LESS_CONSTANT_NUMBER:
+  case OP_GREATER_CONSTANT_NUMBER:
+  case OP_EQUAL_CONSTANT_NUMBER:
+  case OP_ADD_CONSTANT_INTEGER:
+  case OP_SUBTRACT_CONSTANT_INTEGER:
+  case OP_MULTIPLY_CONSTANT_INTEGER:
+  case OP_LESS_CONSTANT_INTEGER:
+  case OP_GREATER_CONSTANT_INTEGER:
+  case OP_EQUAL_CONSTANT_INTEGER:
+    return constant_instruction(opcode_name(instruction), chunk, offset);
+  case OP_ADD_LOCAL_CONSTANT_NUMBER:
+  case OP_ADD_LOCAL_CONSTANT_INTEGER:
+    return local_constant_instruction(opcode_name(instruction), chunk, offset);
   default:
     printf("Unknown opcode %d\n", instruction);
     return offset + 1;
   }
+}
+
+static size_t register_abc_instruction(const char *name, uint32_t instruction, size_t offset)
+{
+  printf("%-26s %4d %4d %4d\n", name,
+         REGISTER_A(instruction), REGISTER_B(instruction), REGISTER_C(instruction));
+  return offset + 1;
+}
+
+static size_t register_constant_instruction(const char *name, Chunk *chunk, uint32_t instruction, int constant, size_t offset)
+{
+  printf("%-26s %4d %4d %4d ", name,
+         REGISTER_A(instruction), REGISTER_B(instruction), constant);
+  print_value(chunk->constants.values[constant]);
+  printf("\n");
+  return offset + 1;
+}
+
+static size_t register_jump_instruction(const char *name, int sign, uint32_t instruction, size_t offset)
+{
+  printf("%-26s %4d %4zu -> %zu\n", name, REGISTER_A(instruction),
+         offset, offset + 1 + sign * REGISTER_BX(instruction));
+  return offset + 1;
+}
+
+void dissasamble_register_code(Chunk *chunk, const char *name)
+{
+  printf("== %s (%d registers) ==\n", name, chunk->registers.register_count);
+
+  for (size_t offset = 0; offset < chunk->registers.count;)
+  {
+    offset = dissamble_register_instruction(chunk, offset);
+  }
+}
+
+size_t dissamble_register_instruction(Chunk *chunk, size_t offset)
+{
+  RegisterCode *code = &chunk->registers;
+
+  printf("%04zu ", offset);
+
+  if (offset > 0 && code->lines[offset] == code->lines[offset - 1])
+  {
+    printf("   | ");
+  }
+  else
+  {
+    printf("%zu ", code->lines[offset]);
+  }
+
+  uint32_t instruction = code->code[offset];
+  uint8_t opcode = REGISTER_OPCODE(instruction);
+  const char *name = register_opcode_name(opcode);
+
+  switch (opcode)
+  {
+  case ROP_CONSTANT:
+  case ROP_CLOSURE:
+    return register_constant_instruction(name, chunk, instruction, REGISTER_BX(instruction), offset);
+  case ROP_GET_GLOBAL:
+  case ROP_SET_GLOBAL:
+  case ROP_DEFINE_GLOBAL:
+    printf("%-26s %4d %4d\n", name, REGISTER_A(instruction), REGISTER_BX(instruction));
+    return offset + 1;
+  case ROP_ADD_CONSTANT:
+  case ROP_SUBTRACT_CONSTANT:
+  case ROP_MULTIPLY_CONSTANT:
+  case ROP_DIVIDE_CONSTANT:
+  case ROP_EQUAL_CONSTANT:
+  case ROP_NOT_EQUAL_CONSTANT:
+  case ROP_GREATER_CONSTANT:
+  case ROP_GREATER_EQUAL_CONSTANT:
+  case ROP_LESS_CONSTANT:
+  case ROP_LESS_EQUAL_CONSTANT:
+    return register_constant_instruction(name, chunk, instruction, REGISTER_C(instruction), offset);
+  case ROP_JUMP:
+  case ROP_JUMP_IF_FALSE:
+  case ROP_JUMP_IF_TRUE:
+    return register_jump_instruction(name, 1, instruction, offset);
+  case ROP_LOOP:
+    return register_jump_instruction(name, -1, instruction, offset);
+  default:
+    return register_abc_instruction(name, instruction, offset);
+  }
 }
\ No newline at end of file
@@ -6,5 +6,16 @@
 
 void dissasamble_chunk(Chunk *chunk, const char *name);
 size_t dissamble_instruction(Chunk *chunk, size_t offset);
+const char *opcode_name(uint8_t opcode);
+void dissasamble_register_code(Chunk *chunk, const char *name);
+size_t dissamble_register_instruction(Chunk *chunk, size_t offset);
+const char *register_opcode_name(uint8_t opcode);
+
+#ifdef DEBUG_PROFILE_OPCODES
+// Called by the vm before it executes every instruction.
+void profile_opcode(uint8_t opcode);
+void profile_register_opcode(uint8_t opcode);
+void print_opcode_profile(void);
+#endif
 
 #endif
\ No newline at end of file
@@ -6,13 +6,154 @@
 #include "hash_table.h"
 #include "value.h"
 
-#define HASH_TABLE_MAX_LOAD 0.75
+#if defined(SIMD_HASH_TABLE) && defined(__SSE2__)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
+
+// A slot is full when the high bit of its control byte is 0,
+// the other 7 bits are then the low 7 bits of the hash of its key.
+#define CONTROL_EMPTY ((uint8_t)0x80)
+#define CONTROL_DELETED ((uint8_t)0xfe)
+#define IS_FULL(control) (((control)&0x80) == 0)
+
+// The low 7 bits of a hash go to the control byte
+// and the rest choose the group where probing starts.
+#define HASH_TAG(hash) ((uint8_t)((hash)&0x7f))
+#define HASH_GROUP(hash) ((hash) >> 7)
+
+// The table grows when 7/8 of its slots are full or deleted,
+// which guarantees that every probe sequence reaches an empty slot.
+#define HASH_TABLE_MAX_LOAD(capacity) ((capacity) / 8 * 7)
+
+// Bytes used by the entries and control bytes of a table.
+#define TABLE_SIZE(capacity) ((size_t)(capacity) * (sizeof(Entry) + 1))
+
+// Bit i is set if slot i of a group matches.
+typedef uint32_t GroupMask;
+
+#ifdef USE_SSE2
+
+static GroupMask match_tag(const uint8_t *group, uint8_t tag)
+{
+  __m128i control = _mm_loadu_si128((const __m128i *)group);
+  return (GroupMask)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char)tag)));
+}
+
+static GroupMask match_empty(const uint8_t *group)
+{
+  return match_tag(group, CONTROL_EMPTY);
+}
+
+static GroupMask match_empty_or_deleted(const uint8_t *group)
+{
+  // Only empty and deleted slots have the high bit set,
+  // which is the bit movemask collects.
+  return (GroupMask)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+}
+
+#else
+
+// Without SSE2 a group is handled as two 64 bit words,
+// with the same bit tricks that find a zero byte in a word.
+#define LOW_BITS 0x0101010101010101ull
+#define HIGH_BITS 0x8080808080808080ull
+
+// Reads the 8 control bytes at [bytes] with the first one
+// in the low byte of the word, whatever the byte order is.
+static uint64_t load_word(const uint8_t *bytes)
+{
+  uint64_t word = 0;
+
+  for (int i = 7; i >= 0; i--)
+  {
+    word = word << 8 | bytes[i];
+  }
+
+  return word;
+}
+
+// Gathers the high bit of every byte of [word] into the low 8 bits.
+static GroupMask pack_high_bits(uint64_t word)
+{
+  return (GroupMask)((((word & HIGH_BITS) >> 7) * 0x0102040810204080ull) >> 56);
+}
+
+// May also match a slot right after a matching one,
+// which is fine because the keys of the matches are compared anyway.
+static GroupMask match_tag(const uint8_t *group, uint8_t tag)
+{
+  GroupMask mask = 0;
+
+  for (int half = 0; half < 2; half++)
+  {
+    uint64_t word = load_word(&group[half * 8]) ^ (LOW_BITS * tag);
+    mask |= pack_high_bits((word - LOW_BITS) & ~word) << (half * 8);
+  }
+
+  return mask;
+}
+
+static GroupMask match_empty(const uint8_t *group)
+{
+  GroupMask mask = 0;
+
+  // Empty slots are the only ones with the high bit set and bit 1 clear.
+  for (int half = 0; half < 2; half++)
+  {
+    uint64_t word = load_word(&group[half * 8]);
+    mask |= pack_high_bits(word & ~(word << 6)) << (half * 8);
+  }
+
+  return mask;
+}
+
+static GroupMask match_empty_or_deleted(const uint8_t *group)
+{
+  return pack_high_bits(load_word(group)) | pack_high_bits(load_word(&group[8])) << 8;
+}
+
+#endif
+
+// Returns the index of the lowest bit set in [mask], which can't be 0.
+static int lowest_bit(GroupMask mask)
+{
+#ifdef __GNUC__
+  return __builtin_ctz(mask);
+#else
+  int bit = 0;
+
+  while ((mask & 1) == 0)
+  {
+    mask >>= 1;
+    bit++;
+  }
+
+  return bit;
+#endif
+}
+
+// Iterates over the groups a lookup for [hash] visits in a table with
+// [capacity] slots, setting [group] to the index of their first slot.
+//
+// The groups are visited in triangular order, skipping 1, 2, 3... groups
+// after each one, which visits every group when the number of groups
+// is a power of two. Every loop ends when it reaches an empty slot.
+#define FOR_EACH_PROBED_GROUP(capacity, hash, group)                                  \
+  for (size_t group_mask_ = (size_t)(capacity) / HASH_TABLE_GROUP_SIZE - 1,           \
+              group_index_ = HASH_GROUP(hash) & group_mask_, step_ = 1,               \
+              group = group_index_ * HASH_TABLE_GROUP_SIZE;                           \
+       ;                                                                              \
+       group_index_ = (group_index_ + step_++) & group_mask_,                         \
+              group = group_index_ * HASH_TABLE_GROUP_SIZE)
 
 static void init_table(HashTable *table)
 {
   table->count = 0;
+  table->tombstones = 0;
   table->capacity = 0;
-  table->entries = 0;
+  table->control = NULL;
+  table->entries = NULL;
 }
 
 HashTable new_hash_table()
@@ -26,144 +167,149 @@ HashTable new_hash_table()
 
 void free_hash_table(HashTable *table)
 {
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+  // [entries] is the start of the allocation.
+  FREE_ARRAY(uint8_t, table->entries, TABLE_SIZE(table->capacity));
   init_table(table);
 }
 
-static Entry *find_entry(Entry *entries, int capacity, ObjString *key)
+// Returns the slot of [key] in [table] or -1 if it is not there.
+static int find_slot(const HashTable *table, const ObjString *key)
 {
-  uint32_t index = key->hash % capacity;
-  Entry *tombstone = NULL;
+  if (table->count == 0)
+  {
+    return -1;
+  }
 
-  for (;;)
+  uint8_t tag = HASH_TAG(key->hash);
+
+  FOR_EACH_PROBED_GROUP(table->capacity, key->hash, group)
   {
-    Entry *entry = &entries[index];
-    if (entry->key == NULL)
+    const uint8_t *control = &table->control[group];
+
+    for (GroupMask match = match_tag(control, tag); match != 0; match &= match - 1)
     {
-      if (IS_NIL(entry->value))
-      {
-        // If we have a tombstone, we return it
-        // so [key] can be inserted in it if [find_entry]
-        // is being used in an insertion
-        return tombstone != NULL ? tombstone : entry;
-      }
-      else
+      int slot = (int)group + lowest_bit(match);
+
+      if (table->entries[slot].key == key)
       {
-        // We save the first tombstone we find to a variable
-        // so it can be returned and used for insertions
-        if (tombstone == NULL)
-        {
-          tombstone = entry;
-        }
+        return slot;
       }
     }
 
-    // TODO: [entry->key == key] is comparing two pointers,
-    // this is incorrect because we may have two different strings
-    // that have the same contents and they should be considered equal.
-    if (entry->key == key)
+    if (match_empty(control) != 0)
     {
-      return entry;
+      return -1;
     }
+  }
+}
 
-    index = (index + 1) % capacity;
+// Returns the first slot that is empty or deleted
+// in the probe sequence of [hash].
+static int find_free_slot(const uint8_t *control, int capacity, uint32_t hash)
+{
+  FOR_EACH_PROBED_GROUP(capacity, hash, group)
+  {
+    GroupMask free_slots = match_empty_or_deleted(&control[group]);
+
+    if (free_slots != 0)
+    {
+      return (int)group + lowest_bit(free_slots);
+    }
   }
 }
 
-static void adjust_capacity(HashTable *table, int new_capacity)
+static void resize(HashTable *table)
 {
-  Entry *entries = ALLOCATE(Entry, new_capacity);
+  int capacity = HASH_TABLE_GROUP_SIZE;
 
-  for (int i = 0; i < new_capacity; i++)
+  // If most of the slots that are in use are deleted,
+  // rehashing the table without growing it is enough.
+  if (table->capacity > 0)
   {
-    entries[i].key = NULL;
-    entries[i].value = NIL_VAL;
+    capacity = table->count + 1 > table->capacity / 16 * 7 ? table->capacity * 2 : table->capacity;
   }
 
-  table->count = 0;
+  uint8_t *memory = ALLOCATE(uint8_t, TABLE_SIZE(capacity));
+  Entry *entries = (Entry *)memory;
+  uint8_t *control = memory + sizeof(Entry) * capacity;
+
+  memset(control, CONTROL_EMPTY, capacity);
 
   // Rehashing every key in the hash table because
   // they end in different positions since the hash table
   // capacity changed.
   for (int i = 0; i < table->capacity; i++)
   {
-    Entry *entry = &table->entries[i];
-
-    if (entry->key == NULL)
+    if (!IS_FULL(table->control[i]))
     {
       continue;
     }
 
-    Entry *destination = find_entry(entries, new_capacity, entry->key);
-
-    destination->key = entry->key;
-    destination->value = entry->value;
-    table->count++;
+    Entry *entry = &table->entries[i];
+    int slot = find_free_slot(control, capacity, entry->key->hash);
+    control[slot] = table->control[i];
+    entries[slot] = *entry;
   }
 
-  // Free old hash table buckets
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+  FREE_ARRAY(uint8_t, table->entries, TABLE_SIZE(table->capacity));
 
-  // Hash table uses the rehashed entries and the new capacity.
   table->entries = entries;
-  table->capacity = new_capacity;
+  table->control = control;
+  table->capacity = capacity;
+  table->tombstones = 0;
 }
 
 bool hash_table_set(HashTable *table, ObjString *key, Value value)
 {
-  if (table->count + 1 > table->capacity * HASH_TABLE_MAX_LOAD)
+  int slot = find_slot(table, key);
+
+  if (slot != -1)
   {
-    int capacity = GROW_CAPACITY(table->capacity);
-    adjust_capacity(table, capacity);
+    table->entries[slot].value = value;
+    return false;
   }
 
-  Entry *entry = find_entry(table->entries, table->capacity, key);
+  if (table->count + table->tombstones + 1 > HASH_TABLE_MAX_LOAD(table->capacity))
+  {
+    resize(table);
+  }
 
-  bool is_new_key = entry->key == NULL;
+  slot = find_free_slot(table->control, table->capacity, key->hash);
 
-  // [entry->value] will not be nil if entry is a tombstone,
-  // because of that we do not increment [table-count]
-  // because [table-count] should be equal to the number of
-  // filled buckets + the number of tombstones in the buckets.
-  if (is_new_key && IS_NIL(entry->value))
+  if (table->control[slot] == CONTROL_DELETED)
   {
-    table->count++;
+    table->tombstones--;
   }
 
-  entry->key = key;
-  entry->value = value;
+  table->control[slot] = HASH_TAG(key->hash);
+  table->entries[slot].key = key;
+  table->entries[slot].value = value;
+  table->count++;
 
-  return is_new_key;
+  return true;
 }
 
 void hash_table_extend(HashTable *table, HashTable *with)
 {
   for (int i = 0; i < with->capacity; i++)
   {
-    Entry *entry = &with->entries[i];
-
-    if (entry->key != NULL)
+    if (IS_FULL(with->control[i]))
     {
-      hash_table_set(table, entry->key, entry->value);
+      hash_table_set(table, with->entries[i].key, with->entries[i].value);
     }
   }
 }
 
 Value *hash_table_get(HashTable *table, ObjString *key)
 {
-  if (table->count == 0)
-  {
-    return NULL;
-  }
+  int slot = find_slot(table, key);
 
-  Entry *entry = find_entry(table->entries, table->capacity, key);
-
-  if (entry->key == NULL)
+  if (slot == -1)
   {
     return NULL;
   }
 
-  return &entry->value;
+  return &table->entries[slot].value;
 }
 
 ObjString *hash_table_find_string(HashTable *table, const char *chars, int length, uint32_t hash)
@@ -173,49 +319,95 @@ ObjString *hash_table_find_string(HashTable *table, const char *chars, int lengt
     return NULL;
   }
 
-  uint32_t index = hash % table->capacity;
+  uint8_t tag = HASH_TAG(hash);
 
-  for (;;)
+  FOR_EACH_PROBED_GROUP(table->capacity, hash, group)
   {
-    Entry *entry = &table->entries[index];
+    const uint8_t *control = &table->control[group];
 
-    if (entry->key == NULL)
+    for (GroupMask match = match_tag(control, tag); match != 0; match &= match - 1)
     {
-      if (IS_NIL(entry->value))
+      ObjString *key = table->entries[group + lowest_bit(match)].key;
+
+      // [length] and [hash] comparisons are optimizations.
+      if (key->length == length && key->hash == hash &&
+          memcmp(key->chars, chars, length) == 0)
       {
-        return NULL;
+        return key;
       }
     }
-    // If the key we are looking at equals the key we are looking for,
-    // we return it.
-    // [length] and [hash] comparisons are optimizations.
-    else if (entry->key->length == length && entry->key->hash == hash &&
-             memcmp(entry->key->chars, chars, length) == 0)
+
+    if (match_empty(control) != 0)
     {
-      return entry->key;
+      return NULL;
     }
+  }
+}
 
-    index = (index + 1) % table->capacity;
+static void remove_slot(HashTable *table, int slot)
+{
+  // A lookup only goes past a group when the group has no empty slots.
+  // If this group has one, no lookup has ever gone past it,
+  // so the slot can be made empty instead of leaving a tombstone.
+  if (match_empty(&table->control[slot / HASH_TABLE_GROUP_SIZE * HASH_TABLE_GROUP_SIZE]) != 0)
+  {
+    table->control[slot] = CONTROL_EMPTY;
+  }
+  else
+  {
+    table->control[slot] = CONTROL_DELETED;
+    table->tombstones++;
   }
+
+  table->entries[slot].key = NULL;
+  table->count--;
 }
 
 bool hash_table_delete(HashTable *table, ObjString *key)
 {
-  if (table->count == 0)
+  int slot = find_slot(table, key);
+
+  if (slot == -1)
   {
     return false;
   }
 
-  Entry *entry = find_entry(table->entries, table->capacity, key);
+  remove_slot(table, slot);
 
-  if (entry->key == NULL)
+  return true;
+}
+
+void hash_table_replace_key(HashTable *table, ObjString *old_key, ObjString *new_key)
+{
+  int slot = find_slot(table, old_key);
+
+  // Both keys have the same hash, so [new_key]
+  // belongs in the same slot.
+  if (slot != -1)
   {
-    return false;
+    table->entries[slot].key = new_key;
   }
+}
 
-  // Tombstone the entry
-  entry->key = NULL;
-  entry->value = BOOL_VAL(true);
+void mark_hash_table(Vm *vm, HashTable *table)
+{
+  for (int i = 0; i < table->capacity; i++)
+  {
+    if (IS_FULL(table->control[i]))
+    {
+      mark_object(vm, (Obj *)table->entries[i].key);
+      mark_value(vm, table->entries[i].value);
+    }
+  }
+}
 
-  return true;
-}
\ No newline at end of file
+void hash_table_remove_white(HashTable *table)
+{
+  for (int i = 0; i < table->capacity; i++)
+  {
+    if (IS_FULL(table->control[i]) && !table->entries[i].key->obj.is_marked)
+    {
+      remove_slot(table, i);
+    }
+  }
+}
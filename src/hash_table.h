@@ -4,18 +4,38 @@
 #include "common.h"
 #include "value.h"
 
+typedef struct Vm Vm;
+
 typedef struct
 {
   ObjString *key;
   Value value;
 } Entry;
 
+// The hash table is a swiss table, an open addressing table
+// whose slots are split in groups of [HASH_TABLE_GROUP_SIZE].
+//
+// Every slot has a control byte that says if the slot is empty,
+// deleted or full, and for full slots holds 7 bits of the hash
+// of the key. A lookup compares the control bytes of a whole group
+// with the 7 bits of the hash it is looking for at once,
+// using SSE2 when it is available, and only compares
+// the keys of the slots whose bits match.
+#define HASH_TABLE_GROUP_SIZE 16
+
 typedef struct
 {
-  // The ratio of [count] to [capacity] is called
-  // the load factor of the hash table.
+  // Number of keys in the table.
   int count;
+  // Number of deleted slots, they are reused by insertions
+  // and removed when the table is rehashed.
+  int tombstones;
+  // Number of slots, zero or a power of two
+  // multiple of [HASH_TABLE_GROUP_SIZE].
   int capacity;
+  // [capacity] control bytes, they live in the same
+  // allocation as [entries], right after them.
+  uint8_t *control;
   Entry *entries;
 } HashTable;
 
@@ -40,4 +60,16 @@ ObjString *hash_table_find_string(HashTable *table, const char *chars, int lengt
 // and false otherwise.
 bool hash_table_delete(HashTable *table, ObjString *key);
 
+// Makes the entry for [old_key] use [new_key] as its key.
+// [new_key] must have the same contents as [old_key].
+// Does nothing if [old_key] is not in [table].
+void hash_table_replace_key(HashTable *table, ObjString *old_key, ObjString *new_key);
+
+// Marks every key and value in [table] as reachable.
+void mark_hash_table(Vm *vm, HashTable *table);
+
+// Removes every entry whose key has not been marked
+// by the garbage collector.
+void hash_table_remove_white(HashTable *table);
+
 #endif
\ No newline at end of file
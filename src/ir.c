@@ -0,0 +1,564 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ir.h"
+#include "memory.h"
+#include "natives.h"
+#include "vm.h"
+
+static void *allocate(size_t size)
+{
+  // Nodes are not objects, the garbage collector never sees them.
+  void *pointer = malloc(size);
+
+  if (pointer == NULL)
+  {
+    exit(1);
+  }
+
+  return pointer;
+}
+
+void init_ir_program(IrProgram *program)
+{
+  program->root = NULL;
+  init_value_array(&program->constants);
+  program->parameter_count = 0;
+  program->variable_count = 0;
+  program->variable_capacity = 0;
+  program->variables = NULL;
+  program->nodes = NULL;
+}
+
+void free_ir_program(IrProgram *program)
+{
+  Node *node = program->nodes;
+
+  while (node != NULL)
+  {
+    Node *next = node->next_allocated;
+    free(node);
+    node = next;
+  }
+
+  free_value_array(&program->constants);
+  free(program->variables);
+  init_ir_program(program);
+}
+
+Node *new_node(IrProgram *program, NodeType type, size_t line)
+{
+  Node *node = (Node *)allocate(sizeof(Node));
+  node->type = type;
+  node->line = line;
+  node->operand = 0;
+  node->a = NULL;
+  node->b = NULL;
+  node->c = NULL;
+  node->next = NULL;
+  node->next_allocated = program->nodes;
+  program->nodes = node;
+  return node;
+}
+
+Node *new_constant_node(Vm *vm, IrProgram *program, Value value, size_t line)
+{
+  // Growing [constants] may start a collection
+  // and [value] may not be reachable from any root yet.
+  push(vm, value);
+  write_value_array(&program->constants, value);
+  pop(vm);
+
+  Node *node = new_node(program, NODE_CONSTANT, line);
+  node->operand = program->constants.count - 1;
+  return node;
+}
+
+int add_variable(IrProgram *program)
+{
+  if (program->variable_capacity < program->variable_count + 1)
+  {
+    program->variable_capacity = GROW_CAPACITY(program->variable_capacity);
+    program->variables = (Variable *)realloc(program->variables, sizeof(Variable) * program->variable_capacity);
+
+    if (program->variables == NULL)
+    {
+      exit(1);
+    }
+  }
+
+  Variable *variable = &program->variables[program->variable_count];
+  variable->reads = 0;
+  variable->assignments = 0;
+  variable->is_number = false;
+  variable->is_read_uninitialized = false;
+  variable->is_captured = false;
+
+  return program->variable_count++;
+}
+
+Value constant_value(const IrProgram *program, const Node *node)
+{
+  return program->constants.values[node->operand];
+}
+
+Node *copy_node(IrProgram *program, const Node *node)
+{
+  if (node == NULL)
+  {
+    return NULL;
+  }
+
+  Node *copy = new_node(program, node->type, node->line);
+  copy->operand = node->operand;
+  copy->a = copy_node(program, node->a);
+  copy->b = copy_node(program, node->b);
+  copy->c = copy_node(program, node->c);
+  return copy;
+}
+
+void set_captures(const IrProgram *program, const Node *closure, const int *slots)
+{
+  ObjFunction *function = AS_FUNCTION(constant_value(program, closure));
+  int i = 0;
+
+  for (const Node *capture = closure->a; capture != NULL; capture = capture->b, i++)
+  {
+    if (capture->a->type == NODE_GET_LOCAL)
+    {
+      function->captures[i].index = (uint8_t)slots[capture->a->operand];
+    }
+  }
+}
+
+// Lowering
+//
+// The bytecode is the same the single pass compiler emits for the
+// same code, except that loops with an increment run it right after
+// the body instead of jumping over it.
+//
+// Lowering allocates no objects, so nothing moves [function].
+
+typedef struct
+{
+  Vm *vm;
+  IrProgram *program;
+  ObjFunction *function;
+  // Index in the chunk of every constant in [program],
+  // or -1 if the chunk does not have it yet.
+  int *constant_indices;
+  // Stack slot of every variable.
+  int *slots;
+  // Whether the local in each stack slot is captured,
+  // it is then closed instead of popped.
+  bool captured[UINT8_COUNT];
+  int local_count;
+  bool had_error;
+} Lowering;
+
+static void lowering_error(Lowering *lowering, size_t line, const char *message)
+{
+  if (!lowering->had_error)
+  {
+    fprintf(stderr, "[line %zu] %s\n", line, message);
+  }
+
+  lowering->had_error = true;
+}
+
+static Chunk *current_chunk(Lowering *lowering)
+{
+  return &lowering->function->chunk;
+}
+
+static void emit_byte(Lowering *lowering, uint8_t byte, size_t line)
+{
+  write_chunk(current_chunk(lowering), byte, line);
+}
+
+static void emit_bytes(Lowering *lowering, uint8_t a, uint8_t b, size_t line)
+{
+  emit_byte(lowering, a, line);
+  emit_byte(lowering, b, line);
+}
+
+static void emit_short(Lowering *lowering, uint8_t opcode, int operand, size_t line)
+{
+  emit_byte(lowering, opcode, line);
+  emit_byte(lowering, (operand >> 8) & 0xff, line);
+  emit_byte(lowering, operand & 0xff, line);
+}
+
+// Returns the index in the chunk of the constant of [node].
+static uint8_t constant_index(Lowering *lowering, const Node *node)
+{
+  int *index = &lowering->constant_indices[node->operand];
+
+  if (*index == -1)
+  {
+    Value value = constant_value(lowering->program, node);
+    *index = (int)add_constant(current_chunk(lowering), value);
+    write_barrier(lowering->vm, (Obj *)lowering->function, value);
+  }
+
+  if (*index > UINT8_MAX)
+  {
+    lowering_error(lowering, node->line, "Too many constants in one chunk");
+    return 0;
+  }
+
+  return (uint8_t)*index;
+}
+
+static void emit_constant(Lowering *lowering, const Node *node)
+{
+  Value value = constant_value(lowering->program, node);
+
+  if (IS_NIL(value))
+  {
+    emit_byte(lowering, OP_NIL, node->line);
+    return;
+  }
+
+  if (IS_BOOL(value))
+  {
+    emit_byte(lowering, AS_BOOL(value) ? OP_TRUE : OP_FALSE, node->line);
+    return;
+  }
+
+  emit_bytes(lowering, OP_CONSTANT, constant_index(lowering, node), node->line);
+}
+
+static int emit_jump(Lowering *lowering, uint8_t opcode, size_t line)
+{
+  emit_short(lowering, opcode, 0xffff, line);
+  return current_chunk(lowering)->count - 2;
+}
+
+static void patch_jump(Lowering *lowering, int offset, size_t line)
+{
+  Chunk *chunk = current_chunk(lowering);
+  int jump = chunk->count - offset - 2;
+
+  if (jump > UINT16_MAX)
+  {
+    lowering_error(lowering, line, "Too much code to jump over");
+  }
+
+  chunk->code[offset] = (jump >> 8) & 0xff;
+  chunk->code[offset + 1] = jump & 0xff;
+}
+
+static void emit_loop(Lowering *lowering, int loop_start, size_t line)
+{
+  int offset = current_chunk(lowering)->count - loop_start + 3;
+
+  if (offset > UINT16_MAX)
+  {
+    lowering_error(lowering, line, "loop body too large");
+  }
+
+  emit_short(lowering, OP_LOOP, offset, line);
+}
+
+static void lower_expression(Lowering *lowering, const Node *node);
+static void lower_statement(Lowering *lowering, const Node *node);
+
+static void lower_binary(Lowering *lowering, const Node *node)
+{
+  lower_expression(lowering, node->a);
+  lower_expression(lowering, node->b);
+
+  switch ((TokenType)node->operand)
+  {
+  case TOKEN_BANG_EQUAL:
+    emit_bytes(lowering, OP_EQUAL, OP_NOT, node->line);
+    break;
+  case TOKEN_EQUAL_EQUAL:
+    emit_byte(lowering, OP_EQUAL, node->line);
+    break;
+  case TOKEN_GREATER:
+    emit_byte(lowering, OP_GREATER, node->line);
+    break;
+  case TOKEN_GREATER_EQUAL:
+    emit_bytes(lowering, OP_LESS, OP_NOT, node->line);
+    break;
+  case TOKEN_LESS:
+    emit_byte(lowering, OP_LESS, node->line);
+    break;
+  case TOKEN_LESS_EQUAL:
+    emit_bytes(lowering, OP_GREATER, OP_NOT, node->line);
+    break;
+  case TOKEN_PLUS:
+    emit_byte(lowering, OP_ADD, node->line);
+    break;
+  case TOKEN_MINUS:
+    emit_byte(lowering, OP_SUBTRACT, node->line);
+    break;
+  case TOKEN_STAR:
+    emit_byte(lowering, OP_MULTIPLY, node->line);
+    break;
+  case TOKEN_SLASH:
+    emit_byte(lowering, OP_DIVIDE, node->line);
+    break;
+  default:
+    return;
+  }
+}
+
+// A call whose callee is a global named like a math native becomes
+// the instruction of the native, like [emit_intrinsic] does.
+// [opcode] is OP_CALL or OP_TAIL_CALL.
+static void lower_call(Lowering *lowering, const Node *node, uint8_t opcode)
+{
+  const Node *callee = node->a;
+  int intrinsic = -1;
+
+  if (callee->type == NODE_GET_GLOBAL)
+  {
+    ObjString *name = AS_OBJSTRING(lowering->vm->global_names.values[callee->operand]);
+    intrinsic = intrinsic_opcode(name->chars, name->length, node->operand);
+  }
+
+  if (intrinsic < 0)
+  {
+    lower_expression(lowering, callee);
+  }
+
+  for (const Node *argument = node->b; argument != NULL; argument = argument->b)
+  {
+    lower_expression(lowering, argument->a);
+  }
+
+  if (intrinsic >= 0)
+  {
+    emit_short(lowering, (uint8_t)intrinsic, callee->operand, node->line);
+    return;
+  }
+
+  emit_bytes(lowering, opcode, (uint8_t)node->operand, node->line);
+}
+
+static void lower_expression(Lowering *lowering, const Node *node)
+{
+  switch (node->type)
+  {
+  case NODE_CONSTANT:
+    emit_constant(lowering, node);
+    break;
+  case NODE_GET_LOCAL:
+    emit_bytes(lowering, OP_GET_LOCAL, lowering->slots[node->operand], node->line);
+    break;
+  case NODE_SET_LOCAL:
+    lower_expression(lowering, node->a);
+    emit_bytes(lowering, OP_SET_LOCAL, lowering->slots[node->operand], node->line);
+    break;
+  case NODE_GET_GLOBAL:
+    emit_short(lowering, OP_GET_GLOBAL, node->operand, node->line);
+    break;
+  case NODE_SET_GLOBAL:
+    lower_expression(lowering, node->a);
+    emit_short(lowering, OP_SET_GLOBAL, node->operand, node->line);
+    break;
+  case NODE_UNARY:
+    lower_expression(lowering, node->a);
+    emit_byte(lowering, node->operand == TOKEN_MINUS ? OP_NEGATE : OP_NOT, node->line);
+    break;
+  case NODE_BINARY:
+    lower_binary(lowering, node);
+    break;
+  case NODE_AND:
+  {
+    lower_expression(lowering, node->a);
+    int end_jump = emit_jump(lowering, OP_JUMP_IF_FALSE, node->line);
+    emit_byte(lowering, OP_POP, node->line);
+    lower_expression(lowering, node->b);
+    patch_jump(lowering, end_jump, node->line);
+    break;
+  }
+  case NODE_OR:
+  {
+    lower_expression(lowering, node->a);
+    int else_jump = emit_jump(lowering, OP_JUMP_IF_FALSE, node->line);
+    int end_jump = emit_jump(lowering, OP_JUMP, node->line);
+    patch_jump(lowering, else_jump, node->line);
+    emit_byte(lowering, OP_POP, node->line);
+    lower_expression(lowering, node->b);
+    patch_jump(lowering, end_jump, node->line);
+    break;
+  }
+  case NODE_CALL:
+    lower_call(lowering, node, OP_CALL);
+    break;
+  case NODE_CLOSURE:
+    set_captures(lowering->program, node, lowering->slots);
+    emit_bytes(lowering, OP_CLOSURE, constant_index(lowering, node), node->line);
+    break;
+  case NODE_GET_UPVALUE:
+    emit_bytes(lowering, OP_GET_UPVALUE, (uint8_t)node->operand, node->line);
+    break;
+  case NODE_SET_UPVALUE:
+    lower_expression(lowering, node->a);
+    emit_bytes(lowering, OP_SET_UPVALUE, (uint8_t)node->operand, node->line);
+    break;
+  default:
+    break;
+  }
+}
+
+static void lower_block(Lowering *lowering, const Node *block)
+{
+  int local_count = lowering->local_count;
+
+  for (const Node *statement = block->a; statement != NULL; statement = statement->next)
+  {
+    lower_statement(lowering, statement);
+  }
+
+  // The locals declared in the block go out of scope,
+  // the captured ones move to the heap first.
+  for (int i = lowering->local_count; i > local_count; i--)
+  {
+    emit_byte(lowering, lowering->captured[i - 1] ? OP_CLOSE_UPVALUE : OP_POP, block->line);
+  }
+
+  lowering->local_count = local_count;
+}
+
+static void lower_statement(Lowering *lowering, const Node *node)
+{
+  // The optimizer leaves out the branches and bodies that do nothing.
+  if (node == NULL)
+  {
+    return;
+  }
+
+  switch (node->type)
+  {
+  case NODE_PRINT:
+    lower_expression(lowering, node->a);
+    emit_byte(lowering, OP_PRINT, node->line);
+    break;
+  case NODE_EXPRESSION:
+    lower_expression(lowering, node->a);
+    emit_byte(lowering, OP_POP, node->line);
+    break;
+  case NODE_DEFINE_GLOBAL:
+    lower_expression(lowering, node->a);
+    emit_short(lowering, OP_DEFINE_GLOBAL, node->operand, node->line);
+    break;
+  case NODE_VAR:
+    if (lowering->local_count == UINT8_COUNT)
+    {
+      lowering_error(lowering, node->line, "Too many local variable declarations");
+      return;
+    }
+
+    // The value is left on the stack, in the slot of the variable.
+    // The slot is known before the initializer is lowered because
+    // the initializer can read the variable.
+    lowering->slots[node->operand] = lowering->local_count;
+    lowering->captured[lowering->local_count] = lowering->program->variables[node->operand].is_captured;
+    lower_expression(lowering, node->a);
+    lowering->local_count++;
+    break;
+  case NODE_BLOCK:
+    lower_block(lowering, node);
+    break;
+  case NODE_IF:
+  {
+    lower_expression(lowering, node->a);
+    int then_jump = emit_jump(lowering, OP_JUMP_IF_FALSE, node->line);
+    emit_byte(lowering, OP_POP, node->line);
+    lower_statement(lowering, node->b);
+    int else_jump = emit_jump(lowering, OP_JUMP, node->line);
+    patch_jump(lowering, then_jump, node->line);
+    emit_byte(lowering, OP_POP, node->line);
+
+    if (node->c != NULL)
+    {
+      lower_statement(lowering, node->c);
+    }
+
+    patch_jump(lowering, else_jump, node->line);
+    break;
+  }
+  case NODE_WHILE:
+  {
+    int loop_start = current_chunk(lowering)->count;
+    lower_expression(lowering, node->a);
+    int exit_jump = emit_jump(lowering, OP_JUMP_IF_FALSE, node->line);
+    emit_byte(lowering, OP_POP, node->line);
+    lower_statement(lowering, node->b);
+
+    if (node->c != NULL)
+    {
+      lower_expression(lowering, node->c);
+      emit_byte(lowering, OP_POP, node->c->line);
+    }
+
+    emit_loop(lowering, loop_start, node->line);
+    patch_jump(lowering, exit_jump, node->line);
+    emit_byte(lowering, OP_POP, node->line);
+    break;
+  }
+  case NODE_RETURN:
+    // Returning the result of a call is a tail call,
+    // the OP_RETURN is reached when the callee is a native.
+    if (node->a == NULL)
+    {
+      emit_byte(lowering, OP_NIL, node->line);
+    }
+    else if (node->a->type == NODE_CALL)
+    {
+      lower_call(lowering, node->a, OP_TAIL_CALL);
+    }
+    else
+    {
+      lower_expression(lowering, node->a);
+    }
+
+    emit_byte(lowering, OP_RETURN, node->line);
+    break;
+  default:
+    break;
+  }
+}
+
+bool lower_program(Vm *vm, IrProgram *program, ObjFunction *function)
+{
+  Lowering lowering;
+  lowering.vm = vm;
+  lowering.program = program;
+  lowering.function = function;
+  lowering.constant_indices = (int *)allocate(sizeof(int) * (program->constants.count + 1));
+  lowering.slots = (int *)allocate(sizeof(int) * (program->variable_count + 1));
+  // Slot zero belongs to the function being executed,
+  // the parameters follow it.
+  lowering.captured[0] = false;
+  lowering.local_count = 1;
+  lowering.had_error = false;
+
+  for (size_t i = 0; i < program->constants.count; i++)
+  {
+    lowering.constant_indices[i] = -1;
+  }
+
+  for (int i = 0; i < program->parameter_count; i++)
+  {
+    lowering.slots[i] = lowering.local_count;
+    lowering.captured[lowering.local_count++] = program->variables[i].is_captured;
+  }
+
+  // The locals declared at the top level live until the program ends,
+  // like the statements of a block they are not popped.
+  for (const Node *statement = program->root->a; statement != NULL; statement = statement->next)
+  {
+    lower_statement(&lowering, statement);
+  }
+
+  free(lowering.constant_indices);
+  free(lowering.slots);
+
+  return !lowering.had_error;
+}
@@ -0,0 +1,148 @@
+#ifndef IR_H
+#define IR_H
+
+#include "chunk.h"
+#include "common.h"
+#include "scanner.h"
+#include "obj.h"
+#include "value.h"
+
+// The optimizing tier compiles a program to a tree of nodes instead of
+// emitting bytecode while it parses, optimizes the tree and then
+// lowers it to a chunk, see [compile] and [optimize_program].
+typedef enum
+{
+  // Expressions.
+  NODE_CONSTANT,
+  NODE_GET_LOCAL,
+  NODE_SET_LOCAL,
+  NODE_GET_GLOBAL,
+  NODE_SET_GLOBAL,
+  NODE_UNARY,
+  NODE_BINARY,
+  NODE_AND,
+  NODE_OR,
+  NODE_CALL,
+  // An argument of a call or a variable a closure captures.
+  NODE_ARGUMENT,
+  NODE_CLOSURE,
+  NODE_GET_UPVALUE,
+  NODE_SET_UPVALUE,
+  // Statements.
+  NODE_PRINT,
+  NODE_EXPRESSION,
+  NODE_DEFINE_GLOBAL,
+  // Declares a local variable.
+  NODE_VAR,
+  NODE_BLOCK,
+  NODE_IF,
+  NODE_WHILE,
+  NODE_RETURN,
+} NodeType;
+
+// What the fields of a node mean depends on its type:
+//
+// type               | operand               | a          | b      | c
+// -------------------+-----------------------+------------+--------+----------
+// NODE_CONSTANT      | index in [constants]  |            |        |
+// NODE_GET_LOCAL     | variable              |            |        |
+// NODE_SET_LOCAL     | variable              | value      |        |
+// NODE_GET_GLOBAL    | global slot           |            |        |
+// NODE_SET_GLOBAL    | global slot           | value      |        |
+// NODE_UNARY         | operator token        | operand    |        |
+// NODE_BINARY        | operator token        | left       | right  |
+// NODE_AND, NODE_OR  |                       | left       | right  |
+// NODE_CALL          | argument count        | callee     | args   |
+// NODE_ARGUMENT      |                       | value      | next   |
+// NODE_CLOSURE       | index in [constants]  | captures   |        |
+// NODE_GET_UPVALUE   | upvalue               |            |        |
+// NODE_SET_UPVALUE   | upvalue               | value      |        |
+// NODE_PRINT         |                       | value      |        |
+// NODE_EXPRESSION    |                       | value      |        |
+// NODE_DEFINE_GLOBAL | global slot           | value      |        |
+// NODE_VAR           | variable              | value      |        |
+// NODE_BLOCK         |                       | statements |        |
+// NODE_IF            |                       | condition  | then   | else
+// NODE_WHILE         |                       | condition  | body   | increment
+// NODE_RETURN        |                       | value      |        |
+//
+// The statements of a block are linked by [next]. The locals a block
+// declares go out of scope at its end. [else] and [increment] are
+// optional, `for` loops are a block that declares the loop variable
+// and a while loop with an increment. The value of a return is
+// optional too.
+//
+// A function is a program of its own, compiled when its body ends.
+// Where it is declared it is a constant, or a closure whose captures
+// are the NODE_GET_LOCAL of the locals it captures, in the order of
+// its upvalues, or a NODE_GET_UPVALUE of the upvalues it passes on.
+typedef struct Node
+{
+  NodeType type;
+  // The line of the instruction the node is lowered to,
+  // which is where runtime errors are reported.
+  size_t line;
+  int operand;
+  struct Node *a;
+  struct Node *b;
+  struct Node *c;
+  struct Node *next;
+  // Every node of a program, to free them.
+  struct Node *next_allocated;
+} Node;
+
+// A local variable. Nodes refer to variables by their index
+// in [IrProgram.variables], they only get a stack slot when the
+// program is lowered, which lets the optimizer add and remove locals.
+typedef struct
+{
+  // Filled in by the optimizer every time it looks at the program.
+  int reads;
+  int assignments;
+  // True if every value the variable holds is a number.
+  bool is_number;
+  // True if the variable is read by its own initializer, which reads
+  // whatever happens to be on the stack. Nothing is assumed about it.
+  bool is_read_uninitialized;
+  // True if a closure captures the variable. Any call can read or
+  // assign it, nothing is assumed about it either.
+  bool is_captured;
+} Variable;
+
+typedef struct
+{
+  Node *root;
+  // Constants are kept here instead of in the chunk because folding
+  // creates and throws away many of them. The compiler marks them,
+  // only the ones the lowered code uses end up in the chunk.
+  ValueArray constants;
+  // The parameters of a function are its first variables,
+  // declared by the call instead of by a NODE_VAR.
+  int parameter_count;
+  int variable_count;
+  int variable_capacity;
+  Variable *variables;
+  Node *nodes;
+} IrProgram;
+
+void init_ir_program(IrProgram *program);
+void free_ir_program(IrProgram *program);
+
+Node *new_node(IrProgram *program, NodeType type, size_t line);
+Node *new_constant_node(Vm *vm, IrProgram *program, Value value, size_t line);
+int add_variable(IrProgram *program);
+Value constant_value(const IrProgram *program, const Node *node);
+// Returns a copy of the expression [node].
+Node *copy_node(IrProgram *program, const Node *node);
+// Points the captures of the function of the NODE_CLOSURE [closure]
+// at the stack slot or register [slots] gives each captured variable.
+void set_captures(const IrProgram *program, const Node *closure, const int *slots);
+
+// Lowers [program] to bytecode appended to the chunk of [function].
+// Returns false if the program does not fit the bytecode limits.
+bool lower_program(Vm *vm, IrProgram *program, ObjFunction *function);
+// Lowers [program] to register code in the chunk of [function],
+// see [RegisterCode].
+bool lower_program_to_registers(Vm *vm, IrProgram *program, ObjFunction *function);
+
+#endif
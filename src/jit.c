@@ -0,0 +1,1057 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "assembler.h"
+#include "jit.h"
+#include "natives.h"
+#include "obj.h"
+#include "trace.h"
+
+#ifdef USE_JIT
+
+// The registers the compiled code keeps for its whole run.
+// They are callee saved, so calling into C does not clobber them.
+#define VM_REGISTER R12
+#define STACK_TOP_REGISTER RBX
+#define CONSTANTS_REGISTER R14
+#define GLOBALS_REGISTER R15
+// The stack window of the frame, locals are addressed from it.
+#define SLOTS_REGISTER R13
+// Holds QNAN, which every type check masks values with.
+#define QNAN_REGISTER RBP
+
+typedef enum
+{
+  NUMBER_ADD,
+  NUMBER_SUBTRACT,
+  NUMBER_MULTIPLY,
+  NUMBER_DIVIDE,
+  NUMBER_EQUAL,
+  NUMBER_NOT_EQUAL,
+  NUMBER_GREATER,
+  NUMBER_GREATER_EQUAL,
+  NUMBER_LESS,
+  NUMBER_LESS_EQUAL,
+} NumberOp;
+
+typedef struct
+{
+  Vm *vm;
+  Chunk *chunk;
+  // Arity of the function the chunk belongs to.
+  int arity;
+  Assembler assembler;
+  Label return_label;
+  Label error_label;
+  // Offset of the instruction after the one being compiled,
+  // where [vm->ip] points when C is called.
+  size_t next_offset;
+} JitCompiler;
+
+// The JIT allocates with malloc instead of [reallocate], which
+// could start a collection that moves the function being compiled.
+static void *allocate(size_t size)
+{
+  void *pointer = malloc(size);
+
+  if (pointer == NULL)
+  {
+    exit(1);
+  }
+
+  return pointer;
+}
+
+// Turns the 0 or 1 in al into FALSE_VAL or TRUE_VAL in rax.
+static void emit_bool_value(Assembler *assembler)
+{
+  // movzx eax, al
+  emit_bytes(assembler, (const uint8_t[]){0x0f, 0xb6, 0xc0}, 3);
+  // lea rax, [QNAN_REGISTER + rax + TAG_FALSE]
+  emit_bytes(assembler, (const uint8_t[]){0x48, 0x8d, 0x44, 0x05, TAG_FALSE}, 5);
+}
+
+static Label bytecode_label(size_t offset)
+{
+  return (Label){SECTION_BYTECODE, offset};
+}
+
+// The vm and the stack
+
+#define VM_FIELD(field) ((int32_t)offsetof(Vm, field))
+#define LOCAL(slot) ((int32_t)sizeof(Value) * (slot))
+// The value [distance] slots below the top of the stack.
+#define STACK(distance) (-(int32_t)sizeof(Value) * ((distance) + 1))
+
+static void emit_push(JitCompiler *compiler, Register source)
+{
+  Assembler *assembler = &compiler->assembler;
+
+  emit_store(assembler, STACK_TOP_REGISTER, 0, source);
+  emit_add_immediate(assembler, STACK_TOP_REGISTER, sizeof(Value));
+}
+
+static void emit_drop(JitCompiler *compiler, int count)
+{
+  Assembler *assembler = &compiler->assembler;
+
+  emit_add_immediate(assembler, STACK_TOP_REGISTER, -(int32_t)sizeof(Value) * count);
+}
+
+// Loads constant [index] of the chunk. Numbers never move,
+// so they become immediates, other constants may be moved
+// by the garbage collector and are loaded from the array.
+//
+// The compiled code computes on doubles, integers become
+// the double with their value.
+static void emit_load_constant(JitCompiler *compiler, Register destination, uint8_t index)
+{
+  Assembler *assembler = &compiler->assembler;
+  Value constant = compiler->chunk->constants.values[index];
+
+  if (IS_NUMBER(constant))
+  {
+    emit_move_immediate(assembler, destination, NUMBER_VAL(AS_NUMBER(constant)));
+  }
+  else
+  {
+    emit_load(assembler, destination, CONSTANTS_REGISTER, (int32_t)sizeof(Value) * index);
+  }
+}
+
+static bool is_number_constant(JitCompiler *compiler, uint8_t index)
+{
+  return IS_NUMBER(compiler->chunk->constants.values[index]);
+}
+
+// Writes [vm->stack_top] and [vm->ip] back before calling C
+// so the garbage collector sees the whole stack and runtime
+// errors report the line of the instruction.
+static void emit_save_state(JitCompiler *compiler)
+{
+  Assembler *assembler = &compiler->assembler;
+
+  emit_store(assembler, VM_REGISTER, VM_FIELD(stack_top), STACK_TOP_REGISTER);
+  emit_move_immediate(assembler, RAX, (uint64_t)(uintptr_t)&compiler->chunk->code[compiler->next_offset]);
+  emit_store(assembler, VM_REGISTER, VM_FIELD(ip), RAX);
+}
+
+static void emit_reload_stack_top(JitCompiler *compiler)
+{
+  Assembler *assembler = &compiler->assembler;
+
+  emit_load(assembler, STACK_TOP_REGISTER, VM_REGISTER, VM_FIELD(stack_top));
+}
+
+// Jumps to [slow] unless [value] is a double. Clobbers rdx.
+static void emit_number_check(JitCompiler *compiler, Register value, Label slow)
+{
+  Assembler *assembler = &compiler->assembler;
+
+  emit_move(assembler, RDX, value);
+  emit_alu(assembler, ALU_AND, RDX, QNAN_REGISTER);
+  emit_alu(assembler, ALU_CMP, RDX, QNAN_REGISTER);
+  emit_jump(assembler, CONDITION_EQUAL, slow);
+}
+
+// The start of the slow path of an instruction on the numbers in rax
+// and, if [count] is 2, rcx. Integers that come from the interpreter
+// are converted to doubles, and when both operands are numbers then
+// the code goes back to [retry] to check them again. Falls through
+// when one is not a number. Clobbers rdx and xmm0.
+static void emit_integer_operands(JitCompiler *compiler, int count, Label retry)
+{
+  Assembler *assembler = &compiler->assembler;
+  const Register operands[] = {RAX, RCX};
+  int not_numbers[2];
+
+  for (int i = 0; i < count; i++)
+  {
+    emit_integer_to_double(assembler, operands[i], RDX, 0);
+  }
+
+  for (int i = 0; i < count; i++)
+  {
+    emit_move(assembler, RDX, operands[i]);
+    emit_alu(assembler, ALU_AND, RDX, QNAN_REGISTER);
+    emit_alu(assembler, ALU_CMP, RDX, QNAN_REGISTER);
+    not_numbers[i] = emit_forward_jump(assembler, CONDITION_EQUAL);
+  }
+
+  emit_jump(assembler, CONDITION_ALWAYS, retry);
+
+  for (int i = 0; i < count; i++)
+  {
+    bind_jump(assembler, not_numbers[i]);
+  }
+}
+
+// rax = rax op rcx on two numbers.
+static void emit_number_op(JitCompiler *compiler, NumberOp op)
+{
+  Assembler *assembler = &compiler->assembler;
+
+  emit_to_xmm(assembler, 0, RAX);
+  emit_to_xmm(assembler, 1, RCX);
+
+  switch (op)
+  {
+  case NUMBER_ADD:
+  case NUMBER_SUBTRACT:
+  case NUMBER_MULTIPLY:
+  case NUMBER_DIVIDE:
+  {
+    static const uint8_t opcodes[] = {
+        [NUMBER_ADD] = 0x58,
+        [NUMBER_SUBTRACT] = 0x5c,
+        [NUMBER_MULTIPLY] = 0x59,
+        [NUMBER_DIVIDE] = 0x5e,
+    };
+    // addsd, subsd, mulsd or divsd xmm0, xmm1
+    emit_bytes(assembler, (const uint8_t[]){0xf2, 0x0f, opcodes[op], 0xc1}, 4);
+    emit_from_xmm(assembler, RAX, 0);
+    return;
+  }
+  default:
+    break;
+  }
+
+  // ucomisd sets the flags like an unsigned comparison
+  // and sets them all when either operand is NaN, so `a < b`
+  // is `b > a` on flags where unordered is false.
+  const uint8_t a_b[] = {0x66, 0x0f, 0x2e, 0xc1};
+  const uint8_t b_a[] = {0x66, 0x0f, 0x2e, 0xc8};
+
+  switch (op)
+  {
+  case NUMBER_EQUAL:
+    emit_bytes(assembler, a_b, 4);
+    emit_set(assembler, CONDITION_EQUAL);
+    // setnp cl, and al, cl
+    emit_bytes(assembler, (const uint8_t[]){0x0f, 0x9b, 0xc1, 0x20, 0xc8}, 5);
+    break;
+  case NUMBER_NOT_EQUAL:
+    emit_bytes(assembler, a_b, 4);
+    emit_set(assembler, CONDITION_NOT_EQUAL);
+    // setp cl, or al, cl
+    emit_bytes(assembler, (const uint8_t[]){0x0f, 0x9a, 0xc1, 0x08, 0xc8}, 5);
+    break;
+  case NUMBER_GREATER:
+    emit_bytes(assembler, a_b, 4);
+    emit_set(assembler, CONDITION_ABOVE);
+    break;
+  case NUMBER_LESS:
+    emit_bytes(assembler, b_a, 4);
+    emit_set(assembler, CONDITION_ABOVE);
+    break;
+  // `a >= b` is `!(a < b)` and `a <= b` is `!(a > b)`, like in [run].
+  case NUMBER_GREATER_EQUAL:
+    emit_bytes(assembler, b_a, 4);
+    emit_set(assembler, CONDITION_BELOW_EQUAL);
+    break;
+  case NUMBER_LESS_EQUAL:
+    emit_bytes(assembler, a_b, 4);
+    emit_set(assembler, CONDITION_BELOW_EQUAL);
+    break;
+  default:
+    break;
+  }
+
+  emit_bool_value(assembler);
+}
+
+static void emit_runtime_error(JitCompiler *compiler, const char *message)
+{
+  Assembler *assembler = &compiler->assembler;
+
+  emit_save_state(compiler);
+  emit_move(assembler, RDI, VM_REGISTER);
+  emit_move_immediate(assembler, RSI, (uint64_t)(uintptr_t)message);
+  emit_call(assembler, (Function)vm_runtime_error);
+  emit_jump(assembler, CONDITION_ALWAYS, compiler->error_label);
+}
+
+// Calls a helper that takes the vm and works on the top of the stack.
+static void emit_stack_call(JitCompiler *compiler, Function function)
+{
+  Assembler *assembler = &compiler->assembler;
+
+  emit_save_state(compiler);
+  emit_move(assembler, RDI, VM_REGISTER);
+  emit_call(assembler, function);
+  emit_reload_stack_top(compiler);
+}
+
+// Emits the slow path of a binary instruction whose operands are
+// in rax and rcx. The right operand is on the stack unless [push_right].
+static void emit_binary_slow_path(JitCompiler *compiler, NumberOp op, bool push_right)
+{
+  Assembler *assembler = &compiler->assembler;
+
+  if (push_right)
+  {
+    emit_push(compiler, RCX);
+  }
+
+  switch (op)
+  {
+  case NUMBER_ADD:
+    emit_stack_call(compiler, (Function)vm_add);
+    // test al, al
+    emit_bytes(assembler, (const uint8_t[]){0x84, 0xc0}, 2);
+    emit_jump(assembler, CONDITION_EQUAL, compiler->error_label);
+    break;
+  case NUMBER_EQUAL:
+    emit_stack_call(compiler, (Function)vm_equal);
+    break;
+  case NUMBER_NOT_EQUAL:
+    emit_stack_call(compiler, (Function)vm_not_equal);
+    break;
+  default:
+    emit_runtime_error(compiler, "Operands must be numbers");
+    break;
+  }
+}
+
+// Two numbers on top of the stack, or the number on top
+// of the stack and constant [constant] if [is_constant].
+static void compile_binary(JitCompiler *compiler, NumberOp op, bool is_constant, uint8_t constant)
+{
+  Assembler *assembler = &compiler->assembler;
+  Label slow = cold_label(assembler);
+  Label retry;
+
+  if (is_constant)
+  {
+    emit_load(assembler, RAX, STACK_TOP_REGISTER, STACK(0));
+    emit_load_constant(compiler, RCX, constant);
+    retry = here(assembler);
+
+    if (is_number_constant(compiler, constant))
+    {
+      emit_number_check(compiler, RAX, slow);
+    }
+    else
+    {
+      emit_jump(assembler, CONDITION_ALWAYS, slow);
+    }
+
+    emit_number_op(compiler, op);
+    emit_store(assembler, STACK_TOP_REGISTER, STACK(0), RAX);
+  }
+  else
+  {
+    emit_load(assembler, RAX, STACK_TOP_REGISTER, STACK(1));
+    emit_load(assembler, RCX, STACK_TOP_REGISTER, STACK(0));
+    retry = here(assembler);
+    emit_number_check(compiler, RAX, slow);
+    emit_number_check(compiler, RCX, slow);
+    emit_number_op(compiler, op);
+    emit_store(assembler, STACK_TOP_REGISTER, STACK(1), RAX);
+    emit_drop(compiler, 1);
+  }
+
+  Label done = here(assembler);
+
+  assembler->section = SECTION_COLD;
+
+  // A constant that is not a number always takes the slow path.
+  if (!is_constant || is_number_constant(compiler, constant))
+  {
+    emit_integer_operands(compiler, is_constant ? 1 : 2, retry);
+  }
+
+  emit_binary_slow_path(compiler, op, is_constant);
+  emit_jump(assembler, CONDITION_ALWAYS, done);
+  assembler->section = SECTION_HOT;
+}
+
+// `x = x + constant` on local [slot].
+static void compile_add_local_constant(JitCompiler *compiler, uint8_t slot, uint8_t constant)
+{
+  Assembler *assembler = &compiler->assembler;
+  Label slow = cold_label(assembler);
+
+  emit_load(assembler, RAX, SLOTS_REGISTER, LOCAL(slot));
+  emit_load_constant(compiler, RCX, constant);
+
+  Label retry = here(assembler);
+
+  if (is_number_constant(compiler, constant))
+  {
+    emit_number_check(compiler, RAX, slow);
+  }
+  else
+  {
+    emit_jump(assembler, CONDITION_ALWAYS, slow);
+  }
+
+  emit_number_op(compiler, NUMBER_ADD);
+  emit_store(assembler, SLOTS_REGISTER, LOCAL(slot), RAX);
+
+  Label done = here(assembler);
+
+  assembler->section = SECTION_COLD;
+
+  if (is_number_constant(compiler, constant))
+  {
+    emit_integer_operands(compiler, 1, retry);
+  }
+
+  emit_push(compiler, RAX);
+  emit_binary_slow_path(compiler, NUMBER_ADD, true);
+  emit_load(assembler, RAX, STACK_TOP_REGISTER, STACK(0));
+  emit_drop(compiler, 1);
+  emit_store(assembler, SLOTS_REGISTER, LOCAL(slot), RAX);
+  emit_jump(assembler, CONDITION_ALWAYS, done);
+  assembler->section = SECTION_HOT;
+}
+
+// Jumps to [target] if the value in rax is falsey.
+static void compile_branch_if_false(JitCompiler *compiler, size_t target)
+{
+  Assembler *assembler = &compiler->assembler;
+  Label slow = cold_label(assembler);
+
+  // Booleans are decided here, everything else by [is_truthy].
+  emit_move_immediate(assembler, RCX, FALSE_VAL);
+  emit_alu(assembler, ALU_CMP, RAX, RCX);
+  emit_jump(assembler, CONDITION_EQUAL, bytecode_label(target));
+  emit_move_immediate(assembler, RCX, TRUE_VAL);
+  emit_alu(assembler, ALU_CMP, RAX, RCX);
+  emit_jump(assembler, CONDITION_NOT_EQUAL, slow);
+
+  Label done = here(assembler);
+
+  assembler->section = SECTION_COLD;
+  emit_move(assembler, RDI, RAX);
+  emit_call(assembler, (Function)is_truthy);
+  // test al, al
+  emit_bytes(assembler, (const uint8_t[]){0x84, 0xc0}, 2);
+  emit_jump(assembler, CONDITION_EQUAL, bytecode_label(target));
+  emit_jump(assembler, CONDITION_ALWAYS, done);
+  assembler->section = SECTION_HOT;
+}
+
+// Jumps to a slow path that reports an error
+// if global [slot] has not been defined.
+static void emit_defined_check(JitCompiler *compiler, uint16_t slot)
+{
+  Assembler *assembler = &compiler->assembler;
+  Label slow = cold_label(assembler);
+
+  emit_load(assembler, RAX, GLOBALS_REGISTER, (int32_t)sizeof(Value) * slot);
+  emit_move_immediate(assembler, RCX, UNDEFINED_VAL);
+  emit_alu(assembler, ALU_CMP, RAX, RCX);
+  emit_jump(assembler, CONDITION_EQUAL, slow);
+
+  assembler->section = SECTION_COLD;
+  emit_save_state(compiler);
+  emit_move(assembler, RDI, VM_REGISTER);
+  emit_move_immediate(assembler, RSI, slot);
+  emit_call(assembler, (Function)vm_undefined_variable);
+  emit_jump(assembler, CONDITION_ALWAYS, compiler->error_label);
+  assembler->section = SECTION_HOT;
+}
+
+// Stores the top of the stack in global [slot], which is defined.
+static void compile_set_global(JitCompiler *compiler, uint16_t slot)
+{
+  Assembler *assembler = &compiler->assembler;
+
+  emit_defined_check(compiler, slot);
+
+  Label slow = cold_label(assembler);
+
+  // Storing a value that is not an object needs no write barrier.
+  emit_load(assembler, RAX, STACK_TOP_REGISTER, STACK(0));
+  emit_move(assembler, RDX, RAX);
+  emit_move_immediate(assembler, RCX, QNAN | SIGN_BIT);
+  emit_alu(assembler, ALU_AND, RDX, RCX);
+  emit_alu(assembler, ALU_CMP, RDX, RCX);
+  emit_jump(assembler, CONDITION_EQUAL, slow);
+  emit_store(assembler, GLOBALS_REGISTER, (int32_t)sizeof(Value) * slot, RAX);
+
+  Label done = here(assembler);
+
+  assembler->section = SECTION_COLD;
+  emit_move(assembler, RDX, RAX);
+  emit_save_state(compiler);
+  emit_move(assembler, RDI, VM_REGISTER);
+  emit_move_immediate(assembler, RSI, slot);
+  emit_call(assembler, (Function)vm_store_global);
+  emit_reload_stack_top(compiler);
+  emit_jump(assembler, CONDITION_ALWAYS, done);
+  assembler->section = SECTION_HOT;
+}
+
+#ifdef USE_TRACING
+// Lets the tracing JIT count, record or run the loop the compiled
+// code is jumping back to and returns where the code carries on.
+static const uint8_t *jit_trace_loop(Vm *vm, const uint8_t *loop_end)
+{
+  JitCode *jit = vm->chunk->jit;
+
+  trace_loop(vm, loop_end);
+  return jit->code + jit->entries[vm->ip - vm->chunk->code];
+}
+
+// Leaves the loop starting at [target] to the tracing JIT
+// unless it has given up on it.
+static void emit_trace_check(JitCompiler *compiler, size_t target)
+{
+  Assembler *assembler = &compiler->assembler;
+  Trace *trace = find_trace(compiler->chunk, target, compiler->next_offset);
+  Label traced = cold_label(assembler);
+
+  emit_move_immediate(assembler, RAX, (uint64_t)(uintptr_t)&trace->state);
+  // cmp dword [rax], TRACE_BLACKLISTED
+  emit_bytes(assembler, (const uint8_t[]){0x83, 0x38, TRACE_BLACKLISTED}, 3);
+  emit_jump(assembler, CONDITION_NOT_EQUAL, traced);
+
+  assembler->section = SECTION_COLD;
+  emit_store(assembler, VM_REGISTER, VM_FIELD(stack_top), STACK_TOP_REGISTER);
+  emit_move_immediate(assembler, RAX, (uint64_t)(uintptr_t)&compiler->chunk->code[target]);
+  emit_store(assembler, VM_REGISTER, VM_FIELD(ip), RAX);
+  emit_move(assembler, RDI, VM_REGISTER);
+  emit_move_immediate(assembler, RSI, (uint64_t)(uintptr_t)&compiler->chunk->code[compiler->next_offset]);
+  emit_call(assembler, (Function)jit_trace_loop);
+  emit_reload_stack_top(compiler);
+  // jmp rax
+  emit_bytes(assembler, (const uint8_t[]){0xff, 0xe0}, 2);
+  assembler->section = SECTION_HOT;
+}
+#endif
+
+// Jumps back to [target]. Only OP_LOOP is [traced], the tracing JIT
+// does not know the loop of a function that tail calls itself.
+static void compile_loop(JitCompiler *compiler, size_t target, bool traced)
+{
+  Assembler *assembler = &compiler->assembler;
+  Label slow = cold_label(assembler);
+
+  // cmp dword [vm + gc_state], GC_IDLE
+  emit_rex(assembler, false, 0, VM_REGISTER);
+  emit_byte(assembler, 0x83);
+  emit_memory_operand(assembler, 7, VM_REGISTER, VM_FIELD(gc_state));
+  emit_byte(assembler, GC_IDLE);
+  emit_jump(assembler, CONDITION_NOT_EQUAL, slow);
+
+  Label jump = here(assembler);
+#ifdef USE_TRACING
+  if (traced)
+  {
+    emit_trace_check(compiler, target);
+  }
+#else
+  (void)traced;
+#endif
+  emit_jump(assembler, CONDITION_ALWAYS, bytecode_label(target));
+
+  // Like in [run], every iteration gives the collection
+  // in progress a chance to advance.
+  assembler->section = SECTION_COLD;
+  emit_stack_call(compiler, (Function)gc_safepoint);
+  emit_jump(assembler, CONDITION_ALWAYS, jump);
+  assembler->section = SECTION_HOT;
+}
+
+static uint16_t read_short(const uint8_t *code)
+{
+  return (uint16_t)((code[1] << 8) | code[2]);
+}
+
+// A math instruction on global [slot]. sqrt, abs, min and max are
+// single instructions on the number, floor and pow call the C function
+// of the native, and anything else is left to [vm_call_global].
+static void compile_intrinsic(JitCompiler *compiler, uint8_t opcode, uint16_t slot)
+{
+  Assembler *assembler = &compiler->assembler;
+  const Intrinsic *intrinsic = &intrinsics[opcode - OP_SQRT];
+  int arity = intrinsic->arity;
+  Label slow = cold_label(assembler);
+
+  emit_load(assembler, RAX, GLOBALS_REGISTER, (int32_t)sizeof(Value) * slot);
+  emit_load(assembler, RCX, VM_REGISTER, VM_FIELD(intrinsics[opcode - OP_SQRT]));
+  emit_alu(assembler, ALU_CMP, RAX, RCX);
+  emit_jump(assembler, CONDITION_NOT_EQUAL, slow);
+  emit_load(assembler, RAX, STACK_TOP_REGISTER, STACK(arity - 1));
+  emit_number_check(compiler, RAX, slow);
+
+  if (arity == 2)
+  {
+    emit_load(assembler, RCX, STACK_TOP_REGISTER, STACK(0));
+    emit_number_check(compiler, RCX, slow);
+    emit_to_xmm(assembler, 1, RCX);
+  }
+
+  if (opcode == OP_ABS)
+  {
+    // Clearing the sign bit of the number is fabs.
+    // btr rax, 63
+    emit_bytes(assembler, (const uint8_t[]){0x48, 0x0f, 0xba, 0xf0, 0x3f}, 5);
+  }
+  else
+  {
+    emit_to_xmm(assembler, 0, RAX);
+
+    switch (opcode)
+    {
+    case OP_SQRT:
+      // sqrtsd xmm0, xmm0
+      emit_bytes(assembler, (const uint8_t[]){0xf2, 0x0f, 0x51, 0xc0}, 4);
+      break;
+    case OP_MIN:
+      // minsd xmm0, xmm1 is `a < b ? a : b`, like min_native.
+      emit_bytes(assembler, (const uint8_t[]){0xf2, 0x0f, 0x5d, 0xc1}, 4);
+      break;
+    case OP_MAX:
+      // maxsd xmm0, xmm1
+      emit_bytes(assembler, (const uint8_t[]){0xf2, 0x0f, 0x5f, 0xc1}, 4);
+      break;
+    default:
+      emit_call(assembler, (Function)intrinsic->function);
+      break;
+    }
+
+    emit_from_xmm(assembler, RAX, 0);
+  }
+
+  emit_store(assembler, STACK_TOP_REGISTER, STACK(arity - 1), RAX);
+  emit_drop(compiler, arity - 1);
+
+  Label done = here(assembler);
+
+  assembler->section = SECTION_COLD;
+  emit_save_state(compiler);
+  emit_move(assembler, RDI, VM_REGISTER);
+  emit_move_immediate(assembler, RSI, slot);
+  emit_move_immediate(assembler, RDX, (uint64_t)arity);
+  emit_call(assembler, (Function)vm_call_global);
+  emit_reload_stack_top(compiler);
+  // test al, al
+  emit_bytes(assembler, (const uint8_t[]){0x84, 0xc0}, 2);
+  emit_jump(assembler, CONDITION_EQUAL, compiler->error_label);
+  emit_jump(assembler, CONDITION_ALWAYS, done);
+  assembler->section = SECTION_HOT;
+}
+
+// Leaves the instruction at [code] to [run].
+static void emit_leave(JitCompiler *compiler, const uint8_t *code)
+{
+  Assembler *assembler = &compiler->assembler;
+
+  emit_move_immediate(assembler, RAX, (uint64_t)(uintptr_t)code);
+  emit_store(assembler, VM_REGISTER, VM_FIELD(ip), RAX);
+  emit_jump(assembler, CONDITION_ALWAYS, compiler->return_label);
+}
+
+// A function calling itself in tail position moves the arguments to
+// its parameters and jumps back to its first instruction, so tail
+// recursion loops without leaving the machine code. The callee is the
+// function when it is the value in slot zero of the frame. Other tail
+// calls, and tail calls from a frame whose locals a closure captured,
+// are left to [run].
+static void compile_tail_call(JitCompiler *compiler, const uint8_t *code)
+{
+  Assembler *assembler = &compiler->assembler;
+  int argument_count = code[1];
+
+  if (argument_count != compiler->arity)
+  {
+    emit_leave(compiler, code);
+    return;
+  }
+
+  Label other = cold_label(assembler);
+
+  emit_load(assembler, RAX, STACK_TOP_REGISTER, STACK(argument_count));
+  emit_load(assembler, RCX, SLOTS_REGISTER, LOCAL(0));
+  emit_alu(assembler, ALU_CMP, RAX, RCX);
+  emit_jump(assembler, CONDITION_NOT_EQUAL, other);
+
+  // [other] is where the cold code is, it goes there
+  // before the labels created after it.
+  assembler->section = SECTION_COLD;
+  emit_leave(compiler, code);
+  assembler->section = SECTION_HOT;
+
+  // The open upvalues are sorted from the top of the stack down,
+  // the first one tells if any of them is in the frame.
+  Label open = cold_label(assembler);
+
+  emit_load(assembler, RAX, VM_REGISTER, VM_FIELD(open_upvalues));
+  emit_alu(assembler, ALU_TEST, RAX, RAX);
+  emit_jump(assembler, CONDITION_NOT_EQUAL, open);
+
+  Label done = here(assembler);
+
+  for (int i = 1; i <= argument_count; i++)
+  {
+    emit_load(assembler, RAX, STACK_TOP_REGISTER, STACK(argument_count - i));
+    emit_store(assembler, SLOTS_REGISTER, LOCAL(i), RAX);
+  }
+
+  emit_move(assembler, STACK_TOP_REGISTER, SLOTS_REGISTER);
+  emit_add_immediate(assembler, STACK_TOP_REGISTER, LOCAL(argument_count + 1));
+
+  assembler->section = SECTION_COLD;
+  emit_load(assembler, RAX, RAX, (int32_t)offsetof(ObjUpvalue, location));
+  emit_alu(assembler, ALU_CMP, SLOTS_REGISTER, RAX);
+  emit_jump(assembler, CONDITION_BELOW_EQUAL, other);
+  emit_jump(assembler, CONDITION_ALWAYS, done);
+  assembler->section = SECTION_HOT;
+
+  compile_loop(compiler, 0, false);
+}
+
+// Returns false if the instruction at [offset] can not be compiled.
+static bool compile_instruction(JitCompiler *compiler, size_t offset)
+{
+  Assembler *assembler = &compiler->assembler;
+  const uint8_t *code = &compiler->chunk->code[offset];
+  // The compiled code checks types itself, so quickened instructions
+  // compile like the instructions they were quickened from.
+  uint8_t opcode = unquickened_opcode(code[0]);
+
+  switch (opcode)
+  {
+  case OP_CONSTANT:
+    emit_load_constant(compiler, RAX, code[1]);
+    emit_push(compiler, RAX);
+    return true;
+  case OP_NIL:
+    emit_move_immediate(assembler, RAX, NIL_VAL);
+    emit_push(compiler, RAX);
+    return true;
+  case OP_TRUE:
+    emit_move_immediate(assembler, RAX, TRUE_VAL);
+    emit_push(compiler, RAX);
+    return true;
+  case OP_FALSE:
+    emit_move_immediate(assembler, RAX, FALSE_VAL);
+    emit_push(compiler, RAX);
+    return true;
+  case OP_RETURN:
+    // [run] pops the frame, it knows where the caller carries on.
+    emit_leave(compiler, code);
+    return true;
+  case OP_NEGATE:
+  {
+    Label slow = cold_label(assembler);
+
+    emit_load(assembler, RAX, STACK_TOP_REGISTER, STACK(0));
+
+    Label retry = here(assembler);
+
+    emit_number_check(compiler, RAX, slow);
+    // btc rax, 63
+    emit_bytes(assembler, (const uint8_t[]){0x48, 0x0f, 0xba, 0xf8, 0x3f}, 5);
+    emit_store(assembler, STACK_TOP_REGISTER, STACK(0), RAX);
+
+    assembler->section = SECTION_COLD;
+    emit_integer_operands(compiler, 1, retry);
+    emit_runtime_error(compiler, "Operand must be a number");
+    assembler->section = SECTION_HOT;
+    return true;
+  }
+  case OP_ADD:
+    compile_binary(compiler, NUMBER_ADD, false, 0);
+    return true;
+  case OP_SUBTRACT:
+    compile_binary(compiler, NUMBER_SUBTRACT, false, 0);
+    return true;
+  case OP_MULTIPLY:
+    compile_binary(compiler, NUMBER_MULTIPLY, false, 0);
+    return true;
+  case OP_DIVIDE:
+    compile_binary(compiler, NUMBER_DIVIDE, false, 0);
+    return true;
+  case OP_EQUAL:
+    compile_binary(compiler, NUMBER_EQUAL, false, 0);
+    return true;
+  case OP_NOT_EQUAL:
+    compile_binary(compiler, NUMBER_NOT_EQUAL, false, 0);
+    return true;
+  case OP_GREATER:
+    compile_binary(compiler, NUMBER_GREATER, false, 0);
+    return true;
+  case OP_GREATER_EQUAL:
+    compile_binary(compiler, NUMBER_GREATER_EQUAL, false, 0);
+    return true;
+  case OP_LESS:
+    compile_binary(compiler, NUMBER_LESS, false, 0);
+    return true;
+  case OP_LESS_EQUAL:
+    compile_binary(compiler, NUMBER_LESS_EQUAL, false, 0);
+    return true;
+  case OP_ADD_CONSTANT:
+    compile_binary(compiler, NUMBER_ADD, true, code[1]);
+    return true;
+  case OP_SUBTRACT_CONSTANT:
+    compile_binary(compiler, NUMBER_SUBTRACT, true, code[1]);
+    return true;
+  case OP_MULTIPLY_CONSTANT:
+    compile_binary(compiler, NUMBER_MULTIPLY, true, code[1]);
+    return true;
+  case OP_DIVIDE_CONSTANT:
+    compile_binary(compiler, NUMBER_DIVIDE, true, code[1]);
+    return true;
+  case OP_LESS_CONSTANT:
+    compile_binary(compiler, NUMBER_LESS, true, code[1]);
+    return true;
+  case OP_GREATER_CONSTANT:
+    compile_binary(compiler, NUMBER_GREATER, true, code[1]);
+    return true;
+  case OP_EQUAL_CONSTANT:
+    compile_binary(compiler, NUMBER_EQUAL, true, code[1]);
+    return true;
+  case OP_NOT:
+    // `!value` is true for nil and false.
+    emit_load(assembler, RAX, STACK_TOP_REGISTER, STACK(0));
+    emit_move_immediate(assembler, RCX, NIL_VAL);
+    emit_alu(assembler, ALU_CMP, RAX, RCX);
+    // sete dl
+    emit_bytes(assembler, (const uint8_t[]){0x0f, 0x94, 0xc2}, 3);
+    emit_move_immediate(assembler, RCX, FALSE_VAL);
+    emit_alu(assembler, ALU_CMP, RAX, RCX);
+    emit_set(assembler, CONDITION_EQUAL);
+    // or al, dl
+    emit_bytes(assembler, (const uint8_t[]){0x08, 0xd0}, 2);
+    emit_bool_value(assembler);
+    emit_store(assembler, STACK_TOP_REGISTER, STACK(0), RAX);
+    return true;
+  case OP_PRINT:
+    emit_stack_call(compiler, (Function)vm_print);
+    return true;
+  case OP_POP:
+    emit_drop(compiler, 1);
+    return true;
+  case OP_POPN:
+    emit_drop(compiler, code[1]);
+    return true;
+  case OP_DEFINE_GLOBAL:
+    emit_save_state(compiler);
+    emit_move(assembler, RDI, VM_REGISTER);
+    emit_move_immediate(assembler, RSI, read_short(code));
+    emit_call(assembler, (Function)vm_define_global);
+    emit_reload_stack_top(compiler);
+    return true;
+  case OP_GET_GLOBAL:
+    emit_defined_check(compiler, read_short(code));
+    emit_push(compiler, RAX);
+    return true;
+  case OP_SET_GLOBAL:
+    compile_set_global(compiler, read_short(code));
+    return true;
+  case OP_SET_GLOBAL_POP:
+    compile_set_global(compiler, read_short(code));
+    emit_drop(compiler, 1);
+    return true;
+  case OP_GET_LOCAL:
+    emit_load(assembler, RAX, SLOTS_REGISTER, LOCAL(code[1]));
+    emit_push(compiler, RAX);
+    return true;
+  case OP_SET_LOCAL:
+    emit_load(assembler, RAX, STACK_TOP_REGISTER, STACK(0));
+    emit_store(assembler, SLOTS_REGISTER, LOCAL(code[1]), RAX);
+    return true;
+  case OP_SET_LOCAL_POP:
+    emit_load(assembler, RAX, STACK_TOP_REGISTER, STACK(0));
+    emit_drop(compiler, 1);
+    emit_store(assembler, SLOTS_REGISTER, LOCAL(code[1]), RAX);
+    return true;
+  case OP_ADD_LOCAL_CONSTANT:
+    compile_add_local_constant(compiler, code[1], code[2]);
+    return true;
+  case OP_JUMP_IF_FALSE:
+    emit_load(assembler, RAX, STACK_TOP_REGISTER, STACK(0));
+    compile_branch_if_false(compiler, offset + 3 + read_short(code));
+    return true;
+  case OP_POP_JUMP_IF_FALSE:
+    emit_load(assembler, RAX, STACK_TOP_REGISTER, STACK(0));
+    emit_drop(compiler, 1);
+    compile_branch_if_false(compiler, offset + 3 + read_short(code));
+    return true;
+  case OP_JUMP:
+    emit_jump(assembler, CONDITION_ALWAYS, bytecode_label(offset + 3 + read_short(code)));
+    return true;
+  case OP_LOOP:
+    compile_loop(compiler, offset + 3 - read_short(code), true);
+    return true;
+  case OP_CALL:
+    // The callee runs to completion in [vm_call],
+    // interpreted or as machine code of its own.
+    emit_save_state(compiler);
+    emit_move(assembler, RDI, VM_REGISTER);
+    emit_move_immediate(assembler, RSI, code[1]);
+    emit_call(assembler, (Function)vm_call);
+    emit_reload_stack_top(compiler);
+    // test al, al
+    emit_bytes(assembler, (const uint8_t[]){0x84, 0xc0}, 2);
+    emit_jump(assembler, CONDITION_EQUAL, compiler->error_label);
+    return true;
+  case OP_TAIL_CALL:
+    compile_tail_call(compiler, code);
+    return true;
+  case OP_CLOSURE:
+    emit_save_state(compiler);
+    emit_move(assembler, RDI, VM_REGISTER);
+    emit_move_immediate(assembler, RSI, code[1]);
+    emit_call(assembler, (Function)vm_closure);
+    emit_reload_stack_top(compiler);
+    return true;
+  case OP_GET_UPVALUE:
+    // The closure that is running is in slot 0 of its frame.
+    emit_load(assembler, RAX, SLOTS_REGISTER, LOCAL(0));
+    emit_move_immediate(assembler, RCX, ~(SIGN_BIT | QNAN));
+    emit_alu(assembler, ALU_AND, RAX, RCX);
+    emit_load(assembler, RAX, RAX,
+              (int32_t)(offsetof(ObjClosure, upvalues) + sizeof(ObjUpvalue *) * code[1]));
+    emit_load(assembler, RAX, RAX, (int32_t)offsetof(ObjUpvalue, location));
+    emit_load(assembler, RAX, RAX, 0);
+    emit_push(compiler, RAX);
+    return true;
+  case OP_SET_UPVALUE:
+    emit_save_state(compiler);
+    emit_move(assembler, RDI, VM_REGISTER);
+    emit_move_immediate(assembler, RSI, code[1]);
+    emit_call(assembler, (Function)vm_set_upvalue);
+    emit_reload_stack_top(compiler);
+    return true;
+  case OP_CLOSE_UPVALUE:
+    emit_stack_call(compiler, (Function)vm_close_upvalue);
+    return true;
+  case OP_SQRT:
+  case OP_FLOOR:
+  case OP_ABS:
+  case OP_MIN:
+  case OP_MAX:
+  case OP_POW:
+    compile_intrinsic(compiler, opcode, read_short(code));
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Saves the callee saved registers the compiled code uses,
+// loads them and jumps to the address in rsi.
+static void emit_prologue(JitCompiler *compiler)
+{
+  Assembler *assembler = &compiler->assembler;
+
+  // push rbp, rbx, r12, r13, r14, r15 and sub rsp, 8
+  //
+  // Six pushes and eight more bytes after the return
+  // address keep the stack 16 byte aligned for calls.
+  emit_bytes(assembler, (const uint8_t[]){0x55, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57}, 10);
+  emit_bytes(assembler, (const uint8_t[]){0x48, 0x83, 0xec, 0x08}, 4);
+  emit_move(assembler, VM_REGISTER, RDI);
+  emit_move(assembler, SLOTS_REGISTER, RDX);
+  emit_reload_stack_top(compiler);
+  emit_move_immediate(assembler, QNAN_REGISTER, QNAN);
+  // The constants and the global variables are not objects,
+  // they do not move while the chunk runs.
+  emit_load(assembler, RAX, VM_REGISTER, VM_FIELD(chunk));
+  emit_load(assembler, CONSTANTS_REGISTER, RAX,
+            (int32_t)(offsetof(Chunk, constants) + offsetof(ValueArray, values)));
+  emit_load(assembler, GLOBALS_REGISTER, VM_REGISTER,
+            (int32_t)(offsetof(Vm, global_values) + offsetof(ValueArray, values)));
+  // jmp rsi
+  emit_bytes(assembler, (const uint8_t[]){0xff, 0xe6}, 2);
+
+  compiler->return_label = here(assembler);
+  emit_store(assembler, VM_REGISTER, VM_FIELD(stack_top), STACK_TOP_REGISTER);
+  emit_move_immediate(assembler, RAX, INTERPRET_OK);
+
+  Label exit = here(assembler);
+  // add rsp, 8, pop r15, r14, r13, r12, rbx, rbp and ret
+  emit_bytes(assembler, (const uint8_t[]){0x48, 0x83, 0xc4, 0x08}, 4);
+  emit_bytes(assembler, (const uint8_t[]){0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0x5d, 0xc3}, 11);
+
+  // The runtime error has already been reported.
+  compiler->error_label = here(assembler);
+  emit_move_immediate(assembler, RAX, INTERPRET_RUNTIME_ERROR);
+  emit_jump(assembler, CONDITION_ALWAYS, exit);
+}
+
+bool jit_compile(Vm *vm)
+{
+  Chunk *chunk = vm->chunk;
+  JitCompiler compiler;
+  memset(&compiler, 0, sizeof(compiler));
+  compiler.vm = vm;
+  compiler.chunk = chunk;
+  compiler.arity = vm->frames[vm->frame_count - 1].function->arity;
+  init_assembler(&compiler.assembler);
+  compiler.assembler.entries = (uint32_t *)allocate(sizeof(uint32_t) * (chunk->count + 1));
+
+  emit_prologue(&compiler);
+
+  bool compiled = true;
+
+  for (size_t offset = 0; offset < chunk->count && compiled;
+       offset = compiler.next_offset)
+  {
+    compiler.assembler.entries[offset] = (uint32_t)compiler.assembler.sections[SECTION_HOT].count;
+    compiler.next_offset = offset + instruction_length(unquickened_opcode(chunk->code[offset]));
+    compiled = compile_instruction(&compiler, offset);
+  }
+
+  size_t size = code_size(&compiler.assembler);
+  uint8_t *code = compiled ? link_code(&compiler.assembler) : NULL;
+
+  free_assembler(&compiler.assembler);
+
+  if (code == NULL)
+  {
+    free(compiler.assembler.entries);
+    return false;
+  }
+
+  JitCode *jit = (JitCode *)allocate(sizeof(JitCode));
+  jit->code = code;
+  jit->size = size;
+  jit->entries = compiler.assembler.entries;
+  chunk->jit = jit;
+
+  return true;
+}
+
+typedef InterpretResult (*JitFunction)(Vm *vm, const uint8_t *target, Value *slots);
+
+InterpretResult jit_execute(Vm *vm)
+{
+  JitCode *jit = vm->chunk->jit;
+
+  // ISO C has no conversion from a data pointer to a function pointer,
+  // POSIX guarantees copying the representation works.
+  JitFunction function;
+  uint8_t *code = jit->code;
+  memcpy(&function, &code, sizeof(function));
+
+  return function(vm, jit->code + jit->entries[vm->ip - vm->chunk->code],
+                  vm->frames[vm->frame_count - 1].slots);
+}
+
+void free_jit_code(JitCode *jit)
+{
+  if (jit == NULL)
+  {
+    return;
+  }
+
+  free_code(jit->code, jit->size);
+  free(jit->entries);
+  free(jit);
+}
+
+#else
+
+void free_jit_code(JitCode *jit)
+{
+  (void)jit;
+}
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "common.h"
+#include "chunk.h"
+#include "vm.h"
+
+// The JIT emits x86-64 code that works on NaN boxed values and gets
+// executable memory from mmap. It is also left out when tracing or
+// profiling, which need every instruction to go through [run].
+#if defined(BASELINE_JIT) && defined(NAN_BOXING) && defined(__x86_64__) && defined(__linux__) && \
+    !defined(DEBUG_TRACE_EXECUTION) && !defined(DEBUG_PROFILE_OPCODES)
+#define USE_JIT
+#endif
+
+// Number of times a chunk is entered or jumps backwards
+// before the vm compiles it to machine code.
+#ifdef DEBUG_STRESS_JIT
+#define JIT_THRESHOLD 1
+#else
+#define JIT_THRESHOLD 1000
+#endif
+
+// The baseline JIT translates every instruction of a chunk, one after
+// the other, into the machine code that does what [run] would do for it.
+// There is no dispatch between instructions, jumps are native jumps,
+// and numbers are added, compared and tested without leaving the
+// machine code.
+//
+// The compiled code uses the same stack as the interpreter,
+// [vm->stack_top] lives in a register and is written back before
+// calling into C. Calls, strings, global stores the garbage collector
+// has to know about, printing and runtime errors are left to C functions.
+//
+// A chunk only runs as machine code from its start or from the target
+// of an OP_LOOP, where [entries] says where the instruction starts.
+struct JitCode
+{
+  uint8_t *code;
+  size_t size;
+  // [entries[offset]] is where the machine code for the instruction
+  // at [offset] in the bytecode starts.
+  uint32_t *entries;
+};
+
+// Compiles [vm->chunk] and stores the code in [vm->chunk->jit].
+// Returns false if the chunk can not be compiled,
+// in which case it keeps being interpreted.
+bool jit_compile(Vm *vm);
+// Runs [vm->chunk] as machine code from [vm->ip] in the frame that
+// is running, until it gets to an OP_RETURN or a tail call to another
+// function. Both are left to the interpreter, [vm->ip] points to the
+// instruction afterwards.
+InterpretResult jit_execute(Vm *vm);
+void free_jit_code(JitCode *jit);
+
+#endif
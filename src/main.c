@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #include "./chunk.h"
 #include "./debug.h"
 #include "./vm.h"
@@ -7,12 +8,54 @@
 
 int main(int argc, const char *argv[])
 {
-  Vm vm = new_vm();
+  // [vm.stack_top] points into [vm.stack], so the vm must be
+  // initialized in place instead of being returned by value.
+  Vm vm;
+  init_vm(&vm);
+
+  // `-O` compiles with the optimizing tier and `-R`
+  // for the register machine, they can be combined.
+  // `-I` turns the JIT off.
+  // `-C output.c` writes the script to output.c as C instead of running it.
+  const char *output_path = NULL;
+
+  while (argc > 1)
+  {
+    if (strcmp(argv[1], "-O") == 0)
+    {
+      vm.optimize = true;
+    }
+    else if (strcmp(argv[1], "-R") == 0)
+    {
+      vm.register_machine = true;
+    }
+    else if (strcmp(argv[1], "-I") == 0)
+    {
+      vm.jit_enabled = false;
+    }
+    else if (strcmp(argv[1], "-C") == 0 && argc > 2)
+    {
+      output_path = argv[2];
+      argc--;
+      argv++;
+    }
+    else
+    {
+      break;
+    }
+
+    argc--;
+    argv++;
+  }
 
   if (argc == 1)
   {
     repl(&vm);
   }
+  else if (argc == 2 && output_path != NULL)
+  {
+    compile_file(&vm, argv[1], output_path);
+  }
   else if (argc == 2)
   {
     run_file(&vm, argv[1]);
@@ -21,4 +64,4 @@ int main(int argc, const char *argv[])
   free_vm(&vm);
 
   return 0;
-}
\ No newline at end of file
+}
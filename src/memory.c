@@ -1,8 +1,150 @@
-#include "memory.h"
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "memory.h"
+#include "compiler.h"
+#include "obj.h"
+#include "vm.h"
+
+#ifdef DEBUG_LOG_GC
+#include "debug.h"
+#endif
+
+// After a collection, the next one will happen when the heap
+// grows to [GC_HEAP_GROW_FACTOR] times the number of bytes
+// that survived the collection.
+//
+// This way the amount of work done by each collection
+// is proportional to the amount of memory the program allocates
+// between collections.
+#define GC_HEAP_GROW_FACTOR 2
+
+static Vm *vm_for_gc = NULL;
+
+void register_vm_for_gc(Vm *vm)
+{
+  vm_for_gc = vm;
+}
+
+static void begin_incremental_collection(Vm *vm);
+static void gc_slice(Vm *vm);
+
+static uint64_t now_ns(void)
+{
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static void begin_pause(Vm *vm)
+{
+  if (vm->gc_pause_depth == 0)
+  {
+    vm->gc_pause_start = now_ns();
+  }
+
+  vm->gc_pause_depth++;
+}
+
+static void end_pause(Vm *vm)
+{
+  vm->gc_pause_depth--;
 
-void *reallocate(void *pointer, const size_t _old_size, const size_t new_size)
+  if (vm->gc_pause_depth > 0)
+  {
+    return;
+  }
+
+  uint64_t pause = now_ns() - vm->gc_pause_start;
+  GcPauseHistogram *pauses = &vm->gc_pauses;
+  int bucket = 0;
+
+  for (uint64_t us = pause / 1000; us > 0 && bucket < GC_PAUSE_BUCKETS - 1; us >>= 1)
+  {
+    bucket++;
+  }
+
+  pauses->buckets[bucket]++;
+  pauses->count++;
+  pauses->total_ns += pause;
+
+  if (pause > pauses->max_ns)
+  {
+    pauses->max_ns = pause;
+  }
+}
+
+void print_gc_pauses(const GcPauseHistogram *pauses)
 {
+  printf("== gc pauses ==\n");
+  printf("count %llu total %.3fms max %.3fms\n",
+         (unsigned long long)pauses->count,
+         pauses->total_ns / 1e6, pauses->max_ns / 1e6);
+
+  for (int i = 0; i < GC_PAUSE_BUCKETS; i++)
+  {
+    if (pauses->buckets[i] == 0)
+    {
+      continue;
+    }
+
+    if (i == GC_PAUSE_BUCKETS - 1)
+    {
+      printf(">= %6lluus %llu\n", 1ull << (i - 1), (unsigned long long)pauses->buckets[i]);
+    }
+    else
+    {
+      printf("<  %6lluus %llu\n", 1ull << i, (unsigned long long)pauses->buckets[i]);
+    }
+  }
+}
+
+static bool should_collect_garbage(Vm *vm)
+{
+#ifdef DEBUG_STRESS_GC
+  return vm->gc_state == GC_IDLE;
+#else
+  return vm->gc_state == GC_IDLE && vm->bytes_allocated > vm->next_gc;
+#endif
+}
+
+static void start_major_collection(Vm *vm)
+{
+  if (vm->gc_incremental)
+  {
+    begin_incremental_collection(vm);
+  }
+  else
+  {
+    collect_garbage(vm);
+  }
+}
+
+void *reallocate(void *pointer, const size_t old_size, const size_t new_size)
+{
+  if (vm_for_gc != NULL)
+  {
+    vm_for_gc->bytes_allocated += new_size - old_size;
+
+    // The caller may hold pointers to young objects,
+    // so only the work that does not move objects can be done here.
+    if (new_size > old_size && vm_for_gc->gc_state != GC_IDLE)
+    {
+      begin_pause(vm_for_gc);
+      gc_slice(vm_for_gc);
+      end_pause(vm_for_gc);
+    }
+    else if (new_size > old_size && should_collect_garbage(vm_for_gc))
+    {
+      begin_pause(vm_for_gc);
+      start_major_collection(vm_for_gc);
+      end_pause(vm_for_gc);
+    }
+  }
+
   if (new_size == 0)
   {
     free(pointer);
@@ -10,4 +152,725 @@ void *reallocate(void *pointer, const size_t _old_size, const size_t new_size)
   }
 
   return realloc(pointer, new_size);
-}
\ No newline at end of file
+}
+
+// Frees the memory owned by [obj] but not [obj] itself.
+static void release_object(Obj *obj)
+{
+  switch (obj->type)
+  {
+  case OBJ_STRING:
+    // The characters are part of the string.
+    break;
+  case OBJ_ROPE:
+    break;
+  case OBJ_FUNCTION:
+  {
+    ObjFunction *function = (ObjFunction *)obj;
+    free_chunk(&function->chunk);
+    FREE_ARRAY(Capture, function->captures, function->upvalue_count);
+    break;
+  }
+  case OBJ_CLOSURE:
+    // The upvalues are part of the closure.
+    break;
+  case OBJ_UPVALUE:
+  case OBJ_NATIVE:
+    break;
+  }
+}
+
+static size_t object_size(Obj *obj)
+{
+  switch (obj->type)
+  {
+  case OBJ_STRING:
+    return sizeof(ObjString) + ((ObjString *)obj)->length + 1;
+  case OBJ_ROPE:
+    return sizeof(ObjRope);
+  case OBJ_FUNCTION:
+    return sizeof(ObjFunction);
+  case OBJ_CLOSURE:
+    return sizeof(ObjClosure) + sizeof(ObjUpvalue *) * ((ObjClosure *)obj)->upvalue_count;
+  case OBJ_UPVALUE:
+    return sizeof(ObjUpvalue);
+  case OBJ_NATIVE:
+    return sizeof(ObjNative);
+  }
+
+  return 0;
+}
+
+static void free_object(Obj *obj)
+{
+#ifdef DEBUG_LOG_GC
+  printf("%p free type %d\n", (void *)obj, obj->type);
+#endif
+
+  release_object(obj);
+  reallocate(obj, object_size(obj), 0);
+}
+
+// Objects in the nursery are aligned to 8 bytes.
+#define NURSERY_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+void init_nursery(Nursery *nursery)
+{
+  nursery->start = (uint8_t *)malloc(NURSERY_SIZE);
+
+  if (nursery->start == NULL)
+  {
+    exit(1);
+  }
+
+  nursery->top = nursery->start;
+  nursery->end = nursery->start + NURSERY_SIZE;
+}
+
+void *allocate_young(Nursery *nursery, size_t size)
+{
+  size = NURSERY_ALIGN(size);
+
+  if (nursery->top + size > nursery->end)
+  {
+    return NULL;
+  }
+
+  void *object = nursery->top;
+  nursery->top += size;
+  return object;
+}
+
+// Iterates over every object in the nursery,
+// dead, alive and forwarded.
+#define FOR_EACH_YOUNG_OBJECT(nursery, obj)                            \
+  for (Obj *obj = (Obj *)(nursery)->start; (uint8_t *)obj < (nursery)->top; \
+       obj = (Obj *)((uint8_t *)obj + NURSERY_ALIGN(object_size(obj))))
+
+void free_objects(Vm *vm)
+{
+  Obj *current = vm->objects;
+
+  while (current != NULL)
+  {
+    Obj *next = current->next;
+    free_object(current);
+    current = next;
+  }
+
+  current = vm->sweep_list;
+
+  while (current != NULL)
+  {
+    Obj *next = current->next;
+    free_object(current);
+    current = next;
+  }
+
+  FOR_EACH_YOUNG_OBJECT(&vm->nursery, obj)
+  {
+    if (!obj->is_forwarded)
+    {
+      release_object(obj);
+    }
+  }
+
+  free(vm->nursery.start);
+  free(vm->gray_stack);
+  free(vm->remembered);
+  free(vm->remembered_globals);
+}
+
+static void push_gray(Vm *vm, Obj *obj)
+{
+  if (vm->gray_capacity < vm->gray_count + 1)
+  {
+    vm->gray_capacity = GROW_CAPACITY(vm->gray_capacity);
+    // The gray stack is allocated with the system realloc
+    // instead of [reallocate] because we don't want to
+    // start a collection in the middle of a collection.
+    vm->gray_stack = (Obj **)realloc(vm->gray_stack, sizeof(Obj *) * vm->gray_capacity);
+
+    if (vm->gray_stack == NULL)
+    {
+      exit(1);
+    }
+  }
+
+  vm->gray_stack[vm->gray_count] = obj;
+  vm->gray_count++;
+}
+
+// The garbage collector is a tracing mark and sweep collector
+// that uses the tri-color abstraction:
+//
+// white: objects we have not reached yet, they are garbage
+// if they are still white when marking is done.
+// gray: objects we know are reachable but whose references
+// have not been traced yet. They live in [vm->gray_stack].
+// black: objects that are marked and whose references have been traced.
+//
+// Marking starts by making every root gray and ends when
+// there are no gray objects left.
+//
+// An incremental collection does not mark young objects,
+// they move, instead they are marked when they are promoted.
+void mark_object(Vm *vm, Obj *obj)
+{
+  if (obj == NULL || obj->is_marked)
+  {
+    return;
+  }
+
+  if (vm->gc_state == GC_MARKING && is_young(&vm->nursery, obj))
+  {
+    return;
+  }
+
+#ifdef DEBUG_LOG_GC
+  printf("%p mark ", (void *)obj);
+  print_value(OBJ_VAL(obj));
+  printf("\n");
+#endif
+
+  obj->is_marked = true;
+  push_gray(vm, obj);
+}
+
+void mark_value(Vm *vm, Value value)
+{
+  if (IS_OBJ(value))
+  {
+    mark_object(vm, AS_OBJ(value));
+  }
+}
+
+void mark_value_array(Vm *vm, ValueArray *array)
+{
+  for (size_t i = 0; i < array->count; i++)
+  {
+    mark_value(vm, array->values[i]);
+  }
+}
+
+// The roots that are not protected by a write barrier, they
+// have to be marked again before an incremental collection ends.
+static void mark_unprotected_roots(Vm *vm)
+{
+  for (Value *slot = vm->stack; slot < vm->stack_top; slot++)
+  {
+    mark_value(vm, *slot);
+  }
+
+  // Every open upvalue is in the list, the closures
+  // that captured it may be gone already.
+  for (ObjUpvalue *upvalue = vm->open_upvalues; upvalue != NULL; upvalue = upvalue->next_open)
+  {
+    mark_object(vm, (Obj *)upvalue);
+  }
+
+  // A collection can start while the compiler is running,
+  // the functions being compiled are not reachable by the vm yet.
+  mark_compiler_roots(vm);
+}
+
+static void mark_roots(Vm *vm)
+{
+  mark_unprotected_roots(vm);
+
+  mark_hash_table(vm, &vm->globals);
+  mark_value_array(vm, &vm->global_values);
+  mark_value_array(vm, &vm->global_names);
+
+  for (int i = 0; i < INTRINSIC_COUNT; i++)
+  {
+    mark_value(vm, vm->intrinsics[i]);
+  }
+
+  // The next minor collection reads the remembered objects,
+  // so they must stay alive until then.
+  for (int i = 0; i < vm->remembered_count; i++)
+  {
+    mark_object(vm, vm->remembered[i]);
+  }
+}
+
+// Marks every object referenced by [obj], turning it black.
+static void blacken_object(Vm *vm, Obj *obj)
+{
+#ifdef DEBUG_LOG_GC
+  printf("%p blacken ", (void *)obj);
+  print_value(OBJ_VAL(obj));
+  printf("\n");
+#endif
+
+  switch (obj->type)
+  {
+  case OBJ_STRING:
+  case OBJ_NATIVE:
+    // Strings and natives do not reference other objects.
+    break;
+  case OBJ_FUNCTION:
+  {
+    ObjFunction *function = (ObjFunction *)obj;
+    mark_object(vm, (Obj *)function->name);
+    mark_value_array(vm, &function->chunk.constants);
+    break;
+  }
+  case OBJ_ROPE:
+  {
+    ObjRope *rope = (ObjRope *)obj;
+    mark_object(vm, rope->left);
+    mark_object(vm, rope->right);
+    mark_object(vm, (Obj *)rope->flat);
+    break;
+  }
+  case OBJ_CLOSURE:
+  {
+    ObjClosure *closure = (ObjClosure *)obj;
+    mark_object(vm, (Obj *)closure->function);
+
+    for (int i = 0; i < closure->upvalue_count; i++)
+    {
+      mark_object(vm, (Obj *)closure->upvalues[i]);
+    }
+    break;
+  }
+  case OBJ_UPVALUE:
+    // The value of an open upvalue is on the stack.
+    mark_value(vm, ((ObjUpvalue *)obj)->closed);
+    break;
+  }
+}
+
+// Blackens at most [budget] gray objects.
+static void trace_references(Vm *vm, int budget)
+{
+  while (vm->gray_count > 0 && budget > 0)
+  {
+    vm->gray_count--;
+    Obj *obj = vm->gray_stack[vm->gray_count];
+    blacken_object(vm, obj);
+    budget--;
+  }
+}
+
+// The old objects are moved to [vm->sweep_list] before sweeping,
+// so objects allocated or promoted while the sweep is
+// in progress are not swept.
+static void begin_sweep(Vm *vm)
+{
+  vm->sweep_list = vm->objects;
+  vm->objects = NULL;
+  vm->gc_state = GC_SWEEPING;
+}
+
+// Sweeps at most [budget] objects. Frees every object that is still white
+// and makes the black objects white for the next collection.
+static void sweep(Vm *vm, int budget)
+{
+  while (vm->sweep_list != NULL && budget > 0)
+  {
+    Obj *obj = vm->sweep_list;
+    vm->sweep_list = obj->next;
+    budget--;
+
+    if (obj->is_marked)
+    {
+      obj->is_marked = false;
+      obj->next = vm->objects;
+      vm->objects = obj;
+    }
+    else
+    {
+      free_object(obj);
+    }
+  }
+
+  if (vm->sweep_list == NULL)
+  {
+    vm->gc_state = GC_IDLE;
+    vm->next_gc = vm->bytes_allocated * GC_HEAP_GROW_FACTOR;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end, next at %zu\n", vm->next_gc);
+#endif
+  }
+}
+
+// A major collection marks through young objects,
+// because old objects may only be reachable through them,
+// but only sweeps the old generation. Dead young objects are
+// reclaimed by the next minor collection.
+//
+// Major collections can start from [reallocate], where the caller may
+// be holding pointers to young objects in C variables,
+// which is why they never move objects.
+void collect_garbage(Vm *vm)
+{
+#ifdef DEBUG_LOG_GC
+  printf("-- gc begin\n");
+  size_t before = vm->bytes_allocated;
+#endif
+
+  mark_roots(vm);
+  trace_references(vm, INT_MAX);
+  // [vm->strings] does not keep strings alive,
+  // otherwise every string ever created would be reachable.
+  // Strings that are about to be freed must be removed from the table
+  // before the table ends up pointing to freed memory.
+  hash_table_remove_white(&vm->strings);
+  begin_sweep(vm);
+  sweep(vm, INT_MAX);
+
+  FOR_EACH_YOUNG_OBJECT(&vm->nursery, obj)
+  {
+    obj->is_marked = false;
+  }
+
+#ifdef DEBUG_LOG_GC
+  printf("   collected %zu bytes (from %zu to %zu)\n",
+         before - vm->bytes_allocated, before, vm->bytes_allocated);
+#endif
+}
+
+// An incremental collection marks the roots when it starts,
+// and then the objects reachable from them a slice at a time.
+//
+// Between slices the program keeps running and can store a white object
+// into an object that has already been blackened. The write barriers
+// mark the values stored into objects and global variables while marking,
+// and the stack, which is bounded by [STACK_MAX] and written
+// by almost every instruction, is marked again when marking ends instead.
+static void begin_incremental_collection(Vm *vm)
+{
+#ifdef DEBUG_LOG_GC
+  printf("-- incremental gc begin\n");
+#endif
+
+  vm->gc_state = GC_MARKING;
+  mark_roots(vm);
+}
+
+static void collect_young(Vm *vm);
+
+static void finish_marking(Vm *vm)
+{
+#ifdef DEBUG_LOG_GC
+  printf("-- incremental gc finish marking\n");
+#endif
+
+  // Promoting the live young objects marks them.
+  collect_young(vm);
+  mark_unprotected_roots(vm);
+  trace_references(vm, INT_MAX);
+  hash_table_remove_white(&vm->strings);
+  begin_sweep(vm);
+}
+
+// Does a slice of the incremental collection
+// in progress without moving objects.
+static void gc_slice(Vm *vm)
+{
+  if (vm->gc_state == GC_MARKING)
+  {
+    trace_references(vm, vm->gc_slice_budget);
+  }
+  else if (vm->gc_state == GC_SWEEPING)
+  {
+    sweep(vm, vm->gc_slice_budget);
+  }
+}
+
+void gc_safepoint(Vm *vm)
+{
+  begin_pause(vm);
+
+  if (vm->gc_state == GC_MARKING && vm->gray_count == 0)
+  {
+    finish_marking(vm);
+  }
+  else
+  {
+    gc_slice(vm);
+  }
+
+  end_pause(vm);
+}
+
+Obj *evacuate_object(Vm *vm, Obj *obj)
+{
+  if (obj == NULL || !is_young(&vm->nursery, obj))
+  {
+    return obj;
+  }
+
+  if (obj->is_forwarded)
+  {
+    return obj->next;
+  }
+
+  // The copy is allocated with the system malloc because
+  // we don't want to start a major collection in the middle
+  // of a minor one.
+  size_t size = object_size(obj);
+  Obj *copy = (Obj *)malloc(size);
+
+  if (copy == NULL)
+  {
+    exit(1);
+  }
+
+  memcpy(copy, obj, size);
+  vm->bytes_allocated += size;
+
+  // A closed upvalue points to its own [closed] field.
+  if (obj->type == OBJ_UPVALUE && ((ObjUpvalue *)obj)->location == &((ObjUpvalue *)obj)->closed)
+  {
+    ((ObjUpvalue *)copy)->location = &((ObjUpvalue *)copy)->closed;
+  }
+
+  // The copy takes over the memory owned by [obj],
+  // like the characters of a string.
+  copy->next = vm->objects;
+  vm->objects = copy;
+
+  obj->is_forwarded = true;
+  obj->next = copy;
+
+#ifdef DEBUG_LOG_GC
+  printf("%p promote to %p\n", (void *)obj, (void *)copy);
+#endif
+
+  // The objects referenced by [copy] may be young too.
+  push_gray(vm, copy);
+
+  return copy;
+}
+
+static void evacuate_value(Vm *vm, Value *value)
+{
+  if (IS_OBJ(*value))
+  {
+    *value = OBJ_VAL(evacuate_object(vm, AS_OBJ(*value)));
+  }
+}
+
+void evacuate_value_array(Vm *vm, ValueArray *array)
+{
+  for (size_t i = 0; i < array->count; i++)
+  {
+    evacuate_value(vm, &array->values[i]);
+  }
+}
+
+// Evacuates the young objects referenced by the old object [obj].
+static void evacuate_references(Vm *vm, Obj *obj)
+{
+  switch (obj->type)
+  {
+  case OBJ_STRING:
+  case OBJ_NATIVE:
+    break;
+  case OBJ_FUNCTION:
+  {
+    ObjFunction *function = (ObjFunction *)obj;
+    function->name = (ObjString *)evacuate_object(vm, (Obj *)function->name);
+    evacuate_value_array(vm, &function->chunk.constants);
+    break;
+  }
+  case OBJ_ROPE:
+  {
+    ObjRope *rope = (ObjRope *)obj;
+    rope->left = evacuate_object(vm, rope->left);
+    rope->right = evacuate_object(vm, rope->right);
+    rope->flat = (ObjString *)evacuate_object(vm, (Obj *)rope->flat);
+    break;
+  }
+  case OBJ_CLOSURE:
+  {
+    ObjClosure *closure = (ObjClosure *)obj;
+    closure->function = (ObjFunction *)evacuate_object(vm, (Obj *)closure->function);
+
+    for (int i = 0; i < closure->upvalue_count; i++)
+    {
+      closure->upvalues[i] = (ObjUpvalue *)evacuate_object(vm, (Obj *)closure->upvalues[i]);
+    }
+    break;
+  }
+  case OBJ_UPVALUE:
+    // [next_open] is fixed by [collect_young], which
+    // evacuates every open upvalue.
+    evacuate_value(vm, &((ObjUpvalue *)obj)->closed);
+    break;
+  }
+}
+
+static void collect_young(Vm *vm)
+{
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc begin\n");
+  size_t before = vm->bytes_allocated;
+#endif
+
+  // The gray stack may hold the objects an incremental collection
+  // has not blackened yet, those are left where they are.
+  int gray_base = vm->gray_count;
+  Obj *old_objects = vm->objects;
+
+  for (Value *slot = vm->stack; slot < vm->stack_top; slot++)
+  {
+    evacuate_value(vm, slot);
+  }
+
+  // The function of every frame is also in the frame's first stack
+  // slot, which has just been evacuated, so this only reads the copy.
+  for (int i = 0; i < vm->frame_count; i++)
+  {
+    CallFrame *frame = &vm->frames[i];
+    frame->function = (ObjFunction *)evacuate_object(vm, (Obj *)frame->function);
+  }
+
+  for (ObjUpvalue **upvalue = &vm->open_upvalues; *upvalue != NULL; upvalue = &(*upvalue)->next_open)
+  {
+    *upvalue = (ObjUpvalue *)evacuate_object(vm, (Obj *)*upvalue);
+  }
+
+  // [vm->chunk] points into the function being run,
+  // which moves if it is still young.
+  if (vm->chunk != NULL && is_young(&vm->nursery, (Obj *)vm->chunk))
+  {
+    ObjFunction *function = (ObjFunction *)((uint8_t *)vm->chunk - offsetof(ObjFunction, chunk));
+    function = (ObjFunction *)evacuate_object(vm, (Obj *)function);
+    vm->chunk = &function->chunk;
+  }
+
+  for (int i = 0; i < vm->remembered_global_count; i++)
+  {
+    int slot = vm->remembered_globals[i];
+    evacuate_value(vm, &vm->global_values.values[slot]);
+    evacuate_value(vm, &vm->global_names.values[slot]);
+  }
+  vm->remembered_global_count = 0;
+
+  evacuate_compiler_roots(vm);
+
+  for (int i = 0; i < vm->remembered_count; i++)
+  {
+    vm->remembered[i]->is_remembered = false;
+    evacuate_references(vm, vm->remembered[i]);
+  }
+  vm->remembered_count = 0;
+
+  // Every object copied so far is in the gray stack,
+  // and copying the objects they reference may push more.
+  while (vm->gray_count > gray_base)
+  {
+    vm->gray_count--;
+    evacuate_references(vm, vm->gray_stack[vm->gray_count]);
+  }
+
+  // The promoted objects are at the front of [vm->objects]. While marking,
+  // they become gray so the old objects they reference are marked too.
+  if (vm->gc_state == GC_MARKING)
+  {
+    for (Obj *obj = vm->objects; obj != old_objects; obj = obj->next)
+    {
+      obj->is_marked = true;
+      push_gray(vm, obj);
+    }
+  }
+
+  // The tables are keyed by the address of the strings,
+  // so the entries for strings that moved must point to the copy
+  // and the entries for strings that died must be removed.
+  FOR_EACH_YOUNG_OBJECT(&vm->nursery, obj)
+  {
+    if (obj->is_forwarded)
+    {
+      if (obj->type == OBJ_STRING && ((ObjString *)obj)->is_interned)
+      {
+        hash_table_replace_key(&vm->strings, (ObjString *)obj, (ObjString *)obj->next);
+        hash_table_replace_key(&vm->globals, (ObjString *)obj, (ObjString *)obj->next);
+      }
+      continue;
+    }
+
+    if (obj->type == OBJ_STRING && ((ObjString *)obj)->is_interned)
+    {
+      hash_table_delete(&vm->strings, (ObjString *)obj);
+    }
+
+    release_object(obj);
+  }
+
+#ifdef DEBUG_STRESS_GC
+  // Make uses of stale pointers to young objects easier to spot.
+  memset(vm->nursery.start, 0xdb, vm->nursery.top - vm->nursery.start);
+#endif
+
+  vm->nursery.top = vm->nursery.start;
+
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc end\n");
+  printf("   promoted %zu bytes\n", vm->bytes_allocated - before);
+#endif
+
+  // Promoted objects count towards the old generation size.
+  if (should_collect_garbage(vm))
+  {
+    start_major_collection(vm);
+  }
+}
+
+void collect_young_garbage(Vm *vm)
+{
+  begin_pause(vm);
+  collect_young(vm);
+  end_pause(vm);
+}
+
+void write_barrier(Vm *vm, Obj *owner, Value value)
+{
+  if (vm->gc_state == GC_MARKING)
+  {
+    mark_value(vm, value);
+  }
+
+  if (owner->is_remembered || is_young(&vm->nursery, owner) || !is_young_value(&vm->nursery, value))
+  {
+    return;
+  }
+
+  if (vm->remembered_capacity < vm->remembered_count + 1)
+  {
+    vm->remembered_capacity = GROW_CAPACITY(vm->remembered_capacity);
+    vm->remembered = (Obj **)realloc(vm->remembered, sizeof(Obj *) * vm->remembered_capacity);
+
+    if (vm->remembered == NULL)
+    {
+      exit(1);
+    }
+  }
+
+  owner->is_remembered = true;
+  vm->remembered[vm->remembered_count] = owner;
+  vm->remembered_count++;
+}
+
+void remember_global(Vm *vm, int slot)
+{
+  if (vm->remembered_global_capacity < vm->remembered_global_count + 1)
+  {
+    vm->remembered_global_capacity = GROW_CAPACITY(vm->remembered_global_capacity);
+    vm->remembered_globals = (int *)realloc(vm->remembered_globals, sizeof(int) * vm->remembered_global_capacity);
+
+    if (vm->remembered_globals == NULL)
+    {
+      exit(1);
+    }
+  }
+
+  vm->remembered_globals[vm->remembered_global_count] = slot;
+  vm->remembered_global_count++;
+}
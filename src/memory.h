@@ -2,6 +2,74 @@
 #define MEMORY_H
 
 #include "common.h"
+#include "value.h"
+
+typedef struct Vm Vm;
+
+// Size in bytes of the young generation.
+#define NURSERY_SIZE (256 * 1024)
+// Objects bigger than [LARGE_OBJECT_SIZE] bytes
+// are allocated in the old generation.
+#define LARGE_OBJECT_SIZE (NURSERY_SIZE / 16)
+
+// Objects are allocated in the nursery by bumping [top].
+//
+// Most objects die young, a string created by concatenation
+// is usually thrown away by the next statement, so instead of
+// freeing objects one by one, a minor collection copies the objects
+// in the nursery that are still reachable to the old generation
+// and resets [top] to [start].
+//
+// The cost of a minor collection is proportional to the number
+// of objects that survive it, dead objects cost nothing.
+typedef struct
+{
+  uint8_t *start;
+  uint8_t *top;
+  uint8_t *end;
+} Nursery;
+
+static inline bool is_young(const Nursery *nursery, const Obj *obj)
+{
+  return (const uint8_t *)obj >= nursery->start && (const uint8_t *)obj < nursery->end;
+}
+
+static inline bool is_young_value(const Nursery *nursery, Value value)
+{
+  return IS_OBJ(value) && is_young(nursery, AS_OBJ(value));
+}
+
+// A major collection is either stop the world, done by [collect_garbage]
+// in one go, or incremental. An incremental collection marks
+// and then sweeps the old generation in small slices
+// interleaved with the execution of the program.
+typedef enum
+{
+  GC_IDLE,
+  GC_MARKING,
+  GC_SWEEPING
+} GcState;
+
+// Number of objects an incremental slice blackens or sweeps
+// unless [vm->gc_slice_budget] says otherwise.
+#define GC_SLICE_BUDGET 128
+
+#define GC_PAUSE_BUCKETS 16
+
+// Every time the garbage collector stops the program,
+// for a minor collection, a slice or a whole major collection,
+// the length of the pause is recorded here.
+//
+// [buckets[0]] counts the pauses shorter than 1us
+// and [buckets[i]] the pauses between 2^(i-1)us and 2^i us.
+// The last bucket also counts every pause longer than that.
+typedef struct
+{
+  uint64_t buckets[GC_PAUSE_BUCKETS];
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+} GcPauseHistogram;
 
 #define GROW_CAPACITY(capacity) \
   ((capacity) < 8 ? 8 : (capacity)*2)
@@ -19,6 +87,52 @@
 #define ALLOCATE(type, count) \
   (type *)reallocate(NULL, 0, sizeof(type) * (count))
 
+// Every allocation goes through [reallocate], which makes it
+// the place where we decide if the garbage collector should run.
 void *reallocate(void *pointer, size_t old_size, size_t new_size);
 
-#endif
\ No newline at end of file
+// [reallocate] does not receive the vm, so the garbage collector
+// needs to know which vm's roots it should trace when an allocation
+// triggers a collection.
+//
+// The vm is kept by its address, it must not be copied or moved
+// until it is freed, which registers NULL again.
+void register_vm_for_gc(Vm *vm);
+
+void init_nursery(Nursery *nursery);
+// Returns NULL if [size] bytes do not fit in the nursery.
+void *allocate_young(Nursery *nursery, size_t size);
+// Copies the reachable objects in the nursery
+// to the old generation and empties the nursery.
+void collect_young_garbage(Vm *vm);
+void collect_garbage(Vm *vm);
+// Called by the vm where it is safe to move objects. Does a slice
+// of the incremental collection in progress, if there is one,
+// and finishes marking once there are no gray objects left.
+void gc_safepoint(Vm *vm);
+void print_gc_pauses(const GcPauseHistogram *pauses);
+
+// Old objects are not traced by a minor collection,
+// so a store of a young object into an old object or into
+// a global variable has to be remembered, otherwise
+// the young object would look unreachable.
+//
+// While an incremental collection is marking, the barrier also
+// marks [value] so a black object never references a white one.
+void write_barrier(Vm *vm, Obj *owner, Value value);
+//
+// The vm calls [remember_global] only when a young value replaces
+// a value that is not young, if the old value was young the slot
+// is already remembered. This keeps stores of old values cheap
+// and the remembered globals list short.
+void remember_global(Vm *vm, int slot);
+
+// Returns where [obj] lives after it has been copied out of the nursery.
+Obj *evacuate_object(Vm *vm, Obj *obj);
+void evacuate_value_array(Vm *vm, ValueArray *array);
+void mark_object(Vm *vm, Obj *obj);
+void mark_value(Vm *vm, Value value);
+void mark_value_array(Vm *vm, ValueArray *array);
+void free_objects(Vm *vm);
+
+#endif
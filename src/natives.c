@@ -0,0 +1,80 @@
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+#include "natives.h"
+#include "obj.h"
+
+static double clock_native(void)
+{
+  return (double)clock() / CLOCKS_PER_SEC;
+}
+
+static double min_native(double a, double b)
+{
+  return a < b ? a : b;
+}
+
+static double max_native(double a, double b)
+{
+  return a > b ? a : b;
+}
+
+// Ropes know their length, they are not flattened.
+static bool len_native(Vm *vm, Value *arguments)
+{
+  Value value = arguments[0];
+
+  if (IS_STRING(value))
+  {
+    arguments[-1] = INTEGER_VAL(AS_OBJSTRING(value)->length);
+  }
+  else if (IS_ROPE(value))
+  {
+    arguments[-1] = INTEGER_VAL(AS_ROPE(value)->length);
+  }
+  else
+  {
+    vm_runtime_error(vm, "Argument of len must be a string");
+    return false;
+  }
+
+  return true;
+}
+
+const Intrinsic intrinsics[INTRINSIC_COUNT] = {
+    [OP_SQRT - OP_SQRT] = {"sqrt", 1, (NumberFunction)sqrt},
+    [OP_FLOOR - OP_SQRT] = {"floor", 1, (NumberFunction)floor},
+    [OP_ABS - OP_SQRT] = {"abs", 1, (NumberFunction)fabs},
+    [OP_MIN - OP_SQRT] = {"min", 2, (NumberFunction)min_native},
+    [OP_MAX - OP_SQRT] = {"max", 2, (NumberFunction)max_native},
+    [OP_POW - OP_SQRT] = {"pow", 2, (NumberFunction)pow},
+};
+
+void define_natives(Vm *vm)
+{
+  define_number_native(vm, "clock", 0, (NumberFunction)clock_native);
+
+  for (int i = 0; i < INTRINSIC_COUNT; i++)
+  {
+    define_number_native(vm, intrinsics[i].name, intrinsics[i].arity, intrinsics[i].function);
+  }
+
+  define_native(vm, "len", 1, len_native);
+}
+
+int intrinsic_opcode(const char *name, int length, int argument_count)
+{
+  for (int i = 0; i < INTRINSIC_COUNT; i++)
+  {
+    const Intrinsic *intrinsic = &intrinsics[i];
+
+    if (intrinsic->arity == argument_count && (int)strlen(intrinsic->name) == length &&
+        memcmp(intrinsic->name, name, length) == 0)
+    {
+      return OP_SQRT + i;
+    }
+  }
+
+  return -1;
+}
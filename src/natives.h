@@ -0,0 +1,32 @@
+#ifndef NATIVES_H
+#define NATIVES_H
+
+#include "vm.h"
+
+// Defines the native functions every script can call
+// as global variables of [vm]:
+//
+// clock()      seconds of processor time the program has used
+// sqrt(x), floor(x), abs(x), min(a, b), max(a, b), pow(a, b)
+// len(string)  number of characters in [string]
+//
+// The math functions are number natives, see [define_number_native].
+void define_natives(Vm *vm);
+
+// A math native whose calls through the global of its name
+// compile to an instruction of their own, OP_SQRT to OP_POW.
+typedef struct
+{
+  const char *name;
+  int arity;
+  NumberFunction function;
+} Intrinsic;
+
+// Indexed by the opcode minus OP_SQRT.
+extern const Intrinsic intrinsics[INTRINSIC_COUNT];
+
+// Returns the instruction that calls the native [name] with
+// [argument_count] arguments, or -1 if it is not an intrinsic.
+int intrinsic_opcode(const char *name, int length, int argument_count);
+
+#endif
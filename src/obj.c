@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -14,12 +15,54 @@
 // [size] should be the size of ObjString.
 static Obj *allocate_object(Vm *vm, size_t size, ObjType type)
 {
-  Obj *object = (Obj *)reallocate(NULL, 0, size);
+  Obj *object = NULL;
+
+  // New objects are allocated in the nursery, which is just a pointer increment.
+  // Big objects would fill the nursery too fast and are expensive to copy,
+  // so they go straight to the old generation.
+  // Objects can only be moved where no C code holds pointers
+  // to young objects that are not rooted, like here,
+  // which is where marking can be finished.
+  if (vm->gc_state != GC_IDLE)
+  {
+    gc_safepoint(vm);
+  }
+
+  if (size <= LARGE_OBJECT_SIZE)
+  {
+#ifdef DEBUG_STRESS_GC
+    collect_young_garbage(vm);
+#endif
+
+    object = (Obj *)allocate_young(&vm->nursery, size);
+
+    if (object == NULL)
+    {
+      collect_young_garbage(vm);
+      object = (Obj *)allocate_young(&vm->nursery, size);
+    }
+
+    object->next = NULL;
+    object->is_marked = false;
+  }
+  else
+  {
+    object = (Obj *)reallocate(NULL, 0, size);
+    // Cons [object] into the list of old objects.
+    object->next = vm->objects;
+    vm->objects = object;
+    // Objects created while marking are black, otherwise
+    // they would be freed because nothing marks them.
+    object->is_marked = vm->gc_state == GC_MARKING;
+  }
+
   object->type = type;
+  object->is_forwarded = false;
+  object->is_remembered = false;
 
-  // Cons [object] into the list of heap allocated objects.
-  object->next = vm->objects;
-  vm->objects = object;
+#ifdef DEBUG_LOG_GC
+  printf("%p allocate %zu for %d\n", (void *)object, size, type);
+#endif
 
   return object;
 }
@@ -29,10 +72,51 @@ ObjFunction *new_function(Vm *vm)
   ObjFunction *function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
   function->arity = 0;
   function->name = NULL;
+  function->upvalue_count = 0;
+  function->captures = NULL;
+  function->aot = NULL;
   init_chunk(&function->chunk);
   return function;
 }
 
+ObjUpvalue *new_upvalue(Vm *vm, Value *slot)
+{
+  ObjUpvalue *upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
+  upvalue->location = slot;
+  upvalue->closed = NIL_VAL;
+  upvalue->next_open = NULL;
+  return upvalue;
+}
+
+ObjClosure *new_closure(Vm *vm, ObjFunction *function)
+{
+  int upvalue_count = function->upvalue_count;
+
+  push(vm, OBJ_VAL((Obj *)function));
+  ObjClosure *closure = (ObjClosure *)allocate_object(
+      vm, sizeof(ObjClosure) + sizeof(ObjUpvalue *) * upvalue_count, OBJ_CLOSURE);
+  closure->function = AS_FUNCTION(pop(vm));
+  closure->upvalue_count = upvalue_count;
+  write_barrier(vm, (Obj *)closure, OBJ_VAL((Obj *)closure->function));
+
+  for (int i = 0; i < upvalue_count; i++)
+  {
+    closure->upvalues[i] = NULL;
+  }
+
+  return closure;
+}
+
+ObjNative *new_native(Vm *vm, const char *name, int arity)
+{
+  ObjNative *native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
+  native->name = name;
+  native->arity = arity;
+  native->takes_numbers = false;
+  native->function.values = NULL;
+  return native;
+}
+
 // http://www.isthe.com/chongo/tech/comp/fnv/
 static uint32_t hash_string(const char *string, int length)
 {
@@ -47,42 +131,161 @@ static uint32_t hash_string(const char *string, int length)
   return hash;
 }
 
-static ObjString *allocate_string(Vm *vm, char *chars, int length)
+ObjString *allocate_string(Vm *vm, int length)
+{
+  // [length + 1] to take the \0 that is appended
+  // to every string into account.
+  ObjString *string = (ObjString *)allocate_object(vm, sizeof(ObjString) + length + 1, OBJ_STRING);
+  string->length = length;
+  string->hash = 0;
+  string->is_interned = false;
+  string->chars[length] = '\0';
+  return string;
+}
+
+static void intern_string(Vm *vm, ObjString *string)
+{
+  string->is_interned = true;
+
+  // [string] is pushed onto the stack because growing the
+  // table may start a collection, and [string] is not reachable
+  // from any other root yet.
+  push(vm, OBJ_VAL((Obj *)string));
+  hash_table_set(&vm->strings, string, NIL_VAL);
+  pop(vm);
+}
+
+ObjString *copy_string(Vm *vm, const char *chars, int length)
 {
   uint32_t hash = hash_string(chars, length);
   ObjString *interned_string = hash_table_find_string(&vm->strings, chars, length, hash);
 
+  // Looking the string up before allocating it means
+  // a string we already have costs no allocation at all.
   if (interned_string != NULL)
   {
-    // Freeing the string because we already have
-    // another string with the same contents in the vm.
-    //
-    // [length + 1] to take the \0 that is appended
-    // to every string into account
-    FREE_ARRAY(char, chars, length + 1);
     return interned_string;
   }
 
-  ObjString *string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
-  string->length = length;
-  string->chars = chars;
+  ObjString *string = allocate_string(vm, length);
+  memcpy(string->chars, chars, length);
   string->hash = hash;
-  // Interning the string
-  hash_table_set(&vm->strings, string, NIL_VAL);
+  intern_string(vm, string);
   return string;
 }
 
-ObjString *copy_string(Vm *vm, const char *chars, int length)
+ObjRope *new_rope(Vm *vm, int length)
+{
+  ObjRope *rope = ALLOCATE_OBJ(vm, ObjRope, OBJ_ROPE);
+  rope->length = length;
+  rope->left = NULL;
+  rope->right = NULL;
+  rope->flat = NULL;
+  return rope;
+}
+
+void write_rope_chars(const ObjRope *rope, char *chars)
+{
+  // A rope built by appending in a loop is as deep as the number
+  // of appends, so it is walked with an explicit stack instead of recursion.
+  //
+  // The characters are written from the end, right halves first,
+  // which keeps the stack short for ropes that lean to the left.
+  int count = 0;
+  int capacity = 8;
+  const Obj **stack = (const Obj **)malloc(sizeof(Obj *) * capacity);
+  int end = rope->length;
+
+  if (stack == NULL)
+  {
+    exit(1);
+  }
+
+  stack[count++] = (const Obj *)rope;
+
+  while (count > 0)
+  {
+    const Obj *node = stack[--count];
+
+    if (node->type == OBJ_ROPE && ((const ObjRope *)node)->flat != NULL)
+    {
+      node = (const Obj *)((const ObjRope *)node)->flat;
+    }
+
+    if (node->type == OBJ_STRING)
+    {
+      const ObjString *string = (const ObjString *)node;
+      end -= string->length;
+      memcpy(chars + end, string->chars, string->length);
+      continue;
+    }
+
+    if (capacity < count + 2)
+    {
+      capacity = GROW_CAPACITY(capacity);
+      // Allocated with the system realloc because
+      // [write_rope_chars] must not start a collection.
+      stack = (const Obj **)realloc(stack, sizeof(Obj *) * capacity);
+
+      if (stack == NULL)
+      {
+        exit(1);
+      }
+    }
+
+    stack[count++] = ((const ObjRope *)node)->left;
+    stack[count++] = ((const ObjRope *)node)->right;
+  }
+
+  free(stack);
+}
+
+ObjString *flatten_rope(Vm *vm, ObjRope *rope)
 {
-  // length + 1 because we will add the null terminator
-  // to the end of the string.
-  char *heapChars = ALLOCATE(char, length + 1);
-  memcpy(heapChars, chars, length);
-  heapChars[length] = '\0';
-  return allocate_string(vm, heapChars, length);
+  if (rope->flat != NULL)
+  {
+    return rope->flat;
+  }
+
+  // [rope] stays on the stack while its string is
+  // created because allocating may start a collection.
+  push(vm, OBJ_VAL((Obj *)rope));
+  ObjString *string = allocate_string(vm, rope->length);
+  rope = AS_ROPE(vm->stack_top[-1]);
+  write_rope_chars(rope, string->chars);
+  string = take_string(vm, string);
+  rope = AS_ROPE(vm->stack_top[-1]);
+
+  rope->flat = string;
+  rope->left = NULL;
+  rope->right = NULL;
+  write_barrier(vm, (Obj *)rope, OBJ_VAL((Obj *)string));
+  pop(vm);
+
+  return string;
 }
 
-ObjString *take_string(Vm *vm, const char *chars, int length)
+ObjString *take_string(Vm *vm, ObjString *string)
 {
-  return allocate_string(vm, chars, length);
+#ifdef LAZY_STRING_INTERNING
+  // Most strings created at runtime are thrown away
+  // without being compared or used as keys, so they are
+  // not worth hashing and adding to [vm->strings].
+  (void)vm;
+  return string;
+#else
+  string->hash = hash_string(string->chars, string->length);
+  ObjString *interned_string = hash_table_find_string(&vm->strings, string->chars, string->length, string->hash);
+
+  // [string] is left for the garbage collector because we already
+  // have another string with the same contents in the vm.
+  // Young strings are reclaimed by the next minor collection for free.
+  if (interned_string != NULL)
+  {
+    return interned_string;
+  }
+
+  intern_string(vm, string);
+  return string;
+#endif
 }
\ No newline at end of file
@@ -1,6 +1,8 @@
 #ifndef OBJ_H
 #define OBJ_H
 
+#include <string.h>
+
 #include "vm.h"
 #include "common.h"
 #include "value.h"
@@ -10,16 +12,28 @@ typedef enum
 {
   OBJ_FUNCTION,
   OBJ_STRING,
+  OBJ_ROPE,
+  OBJ_CLOSURE,
+  OBJ_UPVALUE,
+  OBJ_NATIVE,
 } ObjType;
 
 struct Obj
 {
   ObjType type;
-  // We don't have a garbage collector yet,
-  // so we will use a linked list to be able
-  // to reach every object thats allocated in the heap
-  // whether or not the user's program or the VM's stack
-  // still has a reference to it.
+  // [is_marked] is set by the garbage collector
+  // when the object is reachable from the roots.
+  bool is_marked;
+  // Set on a young object after it has been copied to the
+  // old generation, [next] then points to the copy.
+  bool is_forwarded;
+  // Set on an old object while it is in the remembered set.
+  bool is_remembered;
+  // Every object in the old generation is in
+  // a linked list, whether or not the user's program
+  // or the VM's stack still has a reference to it,
+  // so the garbage collector can find and free the
+  // objects that are not reachable anymore.
   Obj *next;
 };
 
@@ -32,20 +46,107 @@ struct Obj
 // and an Obj* to a ObjString* if we know it
 // is an ObjString* because of how the struct
 // will be laid out in memory.
+//
+// The characters are stored right after the header,
+// so a string is a single allocation and reading
+// its characters does not follow a pointer.
 struct ObjString
 {
   Obj obj;
   int length;
-  char *chars;
   // [hash] is pre computed to make indexing hash tables faster.
+  // Only interned strings are used as keys, so it is
+  // only computed for them.
   uint32_t hash;
+  // Set if the string is in [vm->strings].
+  bool is_interned;
+  // [length + 1] characters, every string has \0 appended to it
+  // even though we don't take \0 into account when setting
+  // the string length because it is an implementation detail
+  // that we do not want to leak to the user.
+  char chars[];
 };
 
+// Returns the interned string with the first [length] characters of [chars].
 ObjString *copy_string(Vm *vm, const char *chars, int length);
 
-ObjString *take_string(Vm *vm, const char *chars, int length);
+// Allocates a string with room for [length] characters
+// the caller has to fill before passing it to [take_string].
+//
+// Allocating may start a minor collection that moves
+// the young objects the caller is holding.
+ObjString *allocate_string(Vm *vm, int length);
+
+// Interns [string], returning the string that was already
+// interned with the same characters if there is one.
+//
+// With [LAZY_STRING_INTERNING], [string] is returned as it is.
+ObjString *take_string(Vm *vm, ObjString *string);
+
+static inline bool strings_equal(const ObjString *a, const ObjString *b)
+{
+  if (a == b)
+  {
+    return true;
+  }
+
+  // There is only one interned string with each contents.
+  if (a->is_interned && b->is_interned)
+  {
+    return false;
+  }
+
+  return a->length == b->length && memcmp(a->chars, b->chars, a->length) == 0;
+}
+
+// Concatenations shorter than [MIN_ROPE_LENGTH] characters
+// are copied right away because copying a few bytes
+// is cheaper than creating and later flattening a rope.
+#define MIN_ROPE_LENGTH 256
 
+// A rope is the result of a concatenation whose characters
+// have not been needed yet.
+//
+// Building a string in a loop by appending to it would copy
+// the whole string on every iteration. A rope only remembers
+// its two halves, and the characters are copied once,
+// when the rope is flattened.
+typedef struct
+{
+  Obj obj;
+  int length;
+  // The halves of the rope, strings or ropes.
+  // Set to NULL when the rope is flattened
+  // so they can be collected.
+  Obj *left;
+  Obj *right;
+  // The string with the characters of the rope,
+  // NULL until the rope is flattened.
+  ObjString *flat;
+} ObjRope;
+
+// Allocating may start a minor collection that moves
+// the young objects the caller is holding, [left] and [right]
+// have to be set by the caller after the rope is allocated.
+ObjRope *new_rope(Vm *vm, int length);
+
+// Copies the characters of [rope] to [chars] without allocating.
+void write_rope_chars(const ObjRope *rope, char *chars);
+
+// Returns the string with the characters of [rope]
+// and remembers it in [rope->flat].
+ObjString *flatten_rope(Vm *vm, ObjRope *rope);
+
+// Where a closure gets one of its upvalues from when it is created:
+// the local in slot [index] of the frame creating it, or upvalue
+// [index] of the closure creating it.
 typedef struct
+{
+  bool is_local;
+  uint8_t index;
+} Capture;
+
+struct ObjFunction
 {
   Obj obj;
   // [arity] is the number of parameters the function expects.
@@ -53,10 +154,87 @@ typedef struct
   // [chunk] contains the function body instructions.
   Chunk chunk;
   ObjString *name;
-} ObjFunction;
+  // A function that uses variables of the functions it is declared in
+  // runs as an ObjClosure, with one upvalue per entry in [captures].
+  int upvalue_count;
+  Capture *captures;
+  // NULL unless the function was loaded by a script
+  // compiled ahead of time, see aot.h.
+  AotFunction aot;
+};
 
 ObjFunction *new_function(Vm *vm);
 
+// A variable a closure uses from a function it is declared in.
+//
+// While that function is running the upvalue is open and
+// [location] points to the variable's stack slot. When the slot
+// goes away, the value is moved into [closed] and [location]
+// points there, so every closure that captured the variable keeps
+// sharing it.
+typedef struct ObjUpvalue
+{
+  Obj obj;
+  Value *location;
+  Value closed;
+  // The open upvalues are in a list sorted by
+  // stack slot, from the top of the stack down.
+  struct ObjUpvalue *next_open;
+} ObjUpvalue;
+
+ObjUpvalue *new_upvalue(Vm *vm, Value *slot);
+
+// A function with the upvalues it captured. Functions without
+// upvalues are called directly and never get a closure.
+typedef struct
+{
+  Obj obj;
+  ObjFunction *function;
+  int upvalue_count;
+  ObjUpvalue *upvalues[];
+} ObjClosure;
+
+// The upvalues are NULL until the caller captures them. [function]
+// is kept on the stack while the closure is allocated, because
+// allocating may start a minor collection that moves it.
+ObjClosure *new_closure(Vm *vm, ObjFunction *function);
+
+// A function of the host, see [define_native].
+typedef struct
+{
+  Obj obj;
+  // Only used to report errors, natives are defined with
+  // a string literal as their name.
+  const char *name;
+  int arity;
+  // Set if [function.numbers] is called with the arguments
+  // unboxed to doubles, which the vm checks before the call.
+  bool takes_numbers;
+  union
+  {
+    NativeFunction values;
+    NumberFunction numbers;
+  } function;
+} ObjNative;
+
+ObjNative *new_native(Vm *vm, const char *name, int arity);
+
+// Calls [native], which takes numbers, with [arguments],
+// which must be numbers.
+static inline double call_number_native(const ObjNative *native, const Value *arguments)
+{
+  switch (native->arity)
+  {
+  case 0:
+    return ((double (*)(void))native->function.numbers)();
+  case 1:
+    return ((double (*)(double))native->function.numbers)(AS_NUMBER(arguments[0]));
+  default:
+    return ((double (*)(double, double))native->function.numbers)(AS_NUMBER(arguments[0]),
+                                                                   AS_NUMBER(arguments[1]));
+  }
+}
+
 #define OBJ_TYPE(value) ((AS_OBJ(value))->type)
 
 // NOTE: Why did we create isObjType instead of
@@ -79,6 +257,9 @@ ObjFunction *new_function(Vm *vm);
 // POP() would be evaluated more than once.
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
+#define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
+#define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
 
 static inline bool isObjType(Value value, ObjType type)
 {
@@ -87,5 +268,8 @@ static inline bool isObjType(Value value, ObjType type)
 
 #define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
 #define AS_OBJSTRING(value) ((ObjString *)AS_OBJ(value))
+#define AS_ROPE(value) ((ObjRope *)AS_OBJ(value))
+#define AS_CLOSURE(value) ((ObjClosure *)AS_OBJ(value))
+#define AS_NATIVE(value) ((ObjNative *)AS_OBJ(value))
 
 #endif
\ No newline at end of file
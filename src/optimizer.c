@@ -0,0 +1,984 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "optimizer.h"
+#include "obj.h"
+#include "vm.h"
+
+// Folding
+
+// Concatenates two string constants.
+static Value concatenate_constants(Vm *vm, ObjString *a, ObjString *b)
+{
+  // Copying the characters to a buffer first because creating
+  // the string may start a collection that moves [a] and [b].
+  int length = a->length + b->length;
+  char *chars = (char *)malloc(length);
+
+  if (chars == NULL)
+  {
+    exit(1);
+  }
+
+  memcpy(chars, a->chars, a->length);
+  memcpy(chars + a->length, b->chars, b->length);
+
+  ObjString *result = copy_string(vm, chars, length);
+  free(chars);
+
+  return OBJ_VAL((Obj *)result);
+}
+
+bool fold_unary_value(TokenType operator_type, Value operand, Value *result)
+{
+  switch (operator_type)
+  {
+  case TOKEN_BANG:
+    *result = BOOL_VAL(value_not(operand));
+    return true;
+  case TOKEN_MINUS:
+    if (!IS_NUMBER(operand))
+    {
+      return false;
+    }
+
+    *result = negate_number(operand);
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool fold_binary_values(Vm *vm, TokenType operator_type, Value a, Value b, Value *result)
+{
+  bool are_numbers = IS_NUMBER(a) && IS_NUMBER(b);
+
+  switch (operator_type)
+  {
+  case TOKEN_BANG_EQUAL:
+    *result = BOOL_VAL(!values_equal(a, b));
+    return true;
+  case TOKEN_EQUAL_EQUAL:
+    *result = BOOL_VAL(values_equal(a, b));
+    return true;
+  case TOKEN_PLUS:
+    if (are_numbers)
+    {
+      *result = add_numbers(a, b);
+      return true;
+    }
+
+    if (IS_STRING(a) && IS_STRING(b))
+    {
+      *result = concatenate_constants(vm, AS_OBJSTRING(a), AS_OBJSTRING(b));
+      return true;
+    }
+
+    return false;
+  default:
+    break;
+  }
+
+  if (!are_numbers)
+  {
+    return false;
+  }
+
+  switch (operator_type)
+  {
+  // `>=` and `<=` are compiled to the negation of `<` and `>`,
+  // which is not the same thing for NaN.
+  case TOKEN_GREATER:
+    *result = BOOL_VAL(COMPARE_NUMBERS(a, >, b));
+    return true;
+  case TOKEN_GREATER_EQUAL:
+    *result = BOOL_VAL(!COMPARE_NUMBERS(a, <, b));
+    return true;
+  case TOKEN_LESS:
+    *result = BOOL_VAL(COMPARE_NUMBERS(a, <, b));
+    return true;
+  case TOKEN_LESS_EQUAL:
+    *result = BOOL_VAL(!COMPARE_NUMBERS(a, >, b));
+    return true;
+  case TOKEN_MINUS:
+    *result = subtract_numbers(a, b);
+    return true;
+  case TOKEN_STAR:
+    *result = multiply_numbers(a, b);
+    return true;
+  case TOKEN_SLASH:
+    *result = divide_numbers(a, b);
+    return true;
+  default:
+    return false;
+  }
+}
+
+typedef struct
+{
+  Vm *vm;
+  IrProgram *program;
+  // The initializer of every variable when the program was last counted.
+  Node **initializers;
+  // How many locals the program declares. No more than this
+  // many locals are in scope at once, the optimizer only adds
+  // temporaries while it stays below the limit of the vm.
+  int declaration_count;
+  bool changed;
+} Optimizer;
+
+static Variable *get_variable(Optimizer *optimizer, int variable)
+{
+  return &optimizer->program->variables[variable];
+}
+
+static bool is_constant(const Node *node)
+{
+  return node != NULL && node->type == NODE_CONSTANT;
+}
+
+// Analysis
+
+static void count_uses(Optimizer *optimizer, Node *node)
+{
+  if (node == NULL)
+  {
+    return;
+  }
+
+  switch (node->type)
+  {
+  case NODE_GET_LOCAL:
+    get_variable(optimizer, node->operand)->reads++;
+    break;
+  case NODE_SET_LOCAL:
+    get_variable(optimizer, node->operand)->assignments++;
+    break;
+  case NODE_VAR:
+    optimizer->initializers[node->operand] = node->a;
+    optimizer->declaration_count++;
+    break;
+  case NODE_BLOCK:
+    for (Node *statement = node->a; statement != NULL; statement = statement->next)
+    {
+      count_uses(optimizer, statement);
+    }
+    return;
+  default:
+    break;
+  }
+
+  count_uses(optimizer, node->a);
+  count_uses(optimizer, node->b);
+  count_uses(optimizer, node->c);
+}
+
+// Returns true if [node] evaluates to a number whenever it does not fail.
+static bool is_number_expression(Optimizer *optimizer, const Node *node)
+{
+  switch (node->type)
+  {
+  case NODE_CONSTANT:
+    return IS_NUMBER(constant_value(optimizer->program, node));
+  case NODE_GET_LOCAL:
+    return get_variable(optimizer, node->operand)->is_number;
+  case NODE_SET_LOCAL:
+    return is_number_expression(optimizer, node->a);
+  case NODE_UNARY:
+    return node->operand == TOKEN_MINUS;
+  case NODE_BINARY:
+    switch ((TokenType)node->operand)
+    {
+    case TOKEN_PLUS:
+      return is_number_expression(optimizer, node->a) && is_number_expression(optimizer, node->b);
+    case TOKEN_MINUS:
+    case TOKEN_STAR:
+    case TOKEN_SLASH:
+      return true;
+    default:
+      return false;
+    }
+  case NODE_AND:
+  case NODE_OR:
+    return is_number_expression(optimizer, node->a) && is_number_expression(optimizer, node->b);
+  default:
+    return false;
+  }
+}
+
+// Clears [is_number] of the variables that may be given
+// something that is not a number. Returns true if it cleared any.
+static bool clear_non_number_variables(Optimizer *optimizer, Node *node)
+{
+  if (node == NULL)
+  {
+    return false;
+  }
+
+  bool changed = false;
+
+  if (node->type == NODE_VAR || node->type == NODE_SET_LOCAL)
+  {
+    Variable *variable = get_variable(optimizer, node->operand);
+
+    if (variable->is_number && !is_number_expression(optimizer, node->a))
+    {
+      variable->is_number = false;
+      changed = true;
+    }
+  }
+
+  if (node->type == NODE_BLOCK)
+  {
+    for (Node *statement = node->a; statement != NULL; statement = statement->next)
+    {
+      changed |= clear_non_number_variables(optimizer, statement);
+    }
+
+    return changed;
+  }
+
+  changed |= clear_non_number_variables(optimizer, node->a);
+  changed |= clear_non_number_variables(optimizer, node->b);
+  changed |= clear_non_number_variables(optimizer, node->c);
+  return changed;
+}
+
+// Counts the reads and assignments of every variable
+// and finds out which ones only ever hold numbers.
+static void analyze_program(Optimizer *optimizer)
+{
+  IrProgram *program = optimizer->program;
+
+  free(optimizer->initializers);
+  optimizer->initializers = (Node **)calloc(program->variable_count + 1, sizeof(Node *));
+
+  if (optimizer->initializers == NULL)
+  {
+    exit(1);
+  }
+
+  // The parameters are in scope with the locals.
+  optimizer->declaration_count = program->parameter_count;
+
+  for (int i = 0; i < program->variable_count; i++)
+  {
+    Variable *variable = &program->variables[i];
+    variable->reads = 0;
+    variable->assignments = 0;
+    // Starting from every variable being a number and clearing the ones
+    // that are assigned something else until nothing changes finds
+    // loop counters, which are only assigned numbers computed from themselves.
+    // The arguments of a call can be anything.
+    variable->is_number = !variable->is_read_uninitialized && !variable->is_captured &&
+                          i >= program->parameter_count;
+  }
+
+  count_uses(optimizer, program->root);
+
+  while (clear_non_number_variables(optimizer, program->root))
+  {
+  }
+}
+
+// Returns true if evaluating [node] can not fail or have side effects,
+// so it can be removed, computed earlier or computed fewer times.
+static bool is_pure(Optimizer *optimizer, const Node *node)
+{
+  switch (node->type)
+  {
+  case NODE_CONSTANT:
+    return true;
+  case NODE_GET_LOCAL:
+  {
+    // A captured variable may be assigned by any call,
+    // the value it has is only known where it is read.
+    Variable *variable = get_variable(optimizer, node->operand);
+    return !variable->is_read_uninitialized && !variable->is_captured;
+  }
+  case NODE_UNARY:
+    return is_pure(optimizer, node->a) &&
+           (node->operand == TOKEN_BANG || is_number_expression(optimizer, node->a));
+  case NODE_BINARY:
+    if (!is_pure(optimizer, node->a) || !is_pure(optimizer, node->b))
+    {
+      return false;
+    }
+
+    if (node->operand == TOKEN_EQUAL_EQUAL || node->operand == TOKEN_BANG_EQUAL)
+    {
+      return true;
+    }
+
+    return is_number_expression(optimizer, node->a) && is_number_expression(optimizer, node->b);
+  case NODE_AND:
+  case NODE_OR:
+    return is_pure(optimizer, node->a) && is_pure(optimizer, node->b);
+  default:
+    return false;
+  }
+}
+
+// Simplification
+
+// Returns what reads of [variable] can be replaced with, if anything.
+static Node *propagated_value(Optimizer *optimizer, int variable)
+{
+  Variable *local = get_variable(optimizer, variable);
+  Node *initializer = optimizer->initializers[variable];
+
+  if (initializer == NULL || local->assignments > 0 || local->is_read_uninitialized || local->is_captured)
+  {
+    return NULL;
+  }
+
+  if (initializer->type == NODE_CONSTANT)
+  {
+    return initializer;
+  }
+
+  if (initializer->type == NODE_GET_LOCAL)
+  {
+    Variable *source = get_variable(optimizer, initializer->operand);
+
+    if (source->assignments == 0 && !source->is_read_uninitialized && !source->is_captured)
+    {
+      return initializer;
+    }
+  }
+
+  return NULL;
+}
+
+static Node *fold(Optimizer *optimizer, Node *node, Value result)
+{
+  optimizer->changed = true;
+  return new_constant_node(optimizer->vm, optimizer->program, result, node->line);
+}
+
+static Node *simplify_expression(Optimizer *optimizer, Node *node)
+{
+  if (node == NULL)
+  {
+    return NULL;
+  }
+
+  node->a = simplify_expression(optimizer, node->a);
+  node->b = simplify_expression(optimizer, node->b);
+
+  IrProgram *program = optimizer->program;
+  Value result;
+
+  switch (node->type)
+  {
+  case NODE_GET_LOCAL:
+  {
+    Node *value = propagated_value(optimizer, node->operand);
+
+    if (value == NULL)
+    {
+      return node;
+    }
+
+    optimizer->changed = true;
+    Node *copy = copy_node(program, value);
+    copy->line = node->line;
+    return copy;
+  }
+  case NODE_SET_LOCAL:
+  {
+    Variable *variable = get_variable(optimizer, node->operand);
+
+    if (variable->reads > 0 || variable->is_captured)
+    {
+      return node;
+    }
+
+    // The variable is never read, only the value matters.
+    optimizer->changed = true;
+    return node->a;
+  }
+  case NODE_UNARY:
+    if (is_constant(node->a) &&
+        fold_unary_value((TokenType)node->operand, constant_value(program, node->a), &result))
+    {
+      return fold(optimizer, node, result);
+    }
+
+    return node;
+  case NODE_BINARY:
+    if (is_constant(node->a) && is_constant(node->b) &&
+        fold_binary_values(optimizer->vm, (TokenType)node->operand,
+                           constant_value(program, node->a), constant_value(program, node->b), &result))
+    {
+      return fold(optimizer, node, result);
+    }
+
+    return node;
+  case NODE_AND:
+  case NODE_OR:
+    if (!is_constant(node->a))
+    {
+      return node;
+    }
+
+    // `false and x` is false and `true or x` is true,
+    // otherwise the result is the right operand.
+    // Conditions use [is_truthy], like OP_JUMP_IF_FALSE does.
+    optimizer->changed = true;
+    return is_truthy(constant_value(program, node->a)) == (node->type == NODE_AND) ? node->b : node->a;
+  default:
+    return node;
+  }
+}
+
+static Node *simplify_statements(Optimizer *optimizer, Node *statements);
+
+// Returns the statement [statement] simplifies to, or NULL if it does nothing.
+static Node *simplify_statement(Optimizer *optimizer, Node *statement)
+{
+  if (statement == NULL)
+  {
+    return NULL;
+  }
+
+  IrProgram *program = optimizer->program;
+
+  switch (statement->type)
+  {
+  case NODE_PRINT:
+  case NODE_DEFINE_GLOBAL:
+  case NODE_RETURN:
+    statement->a = simplify_expression(optimizer, statement->a);
+    return statement;
+  case NODE_EXPRESSION:
+    statement->a = simplify_expression(optimizer, statement->a);
+    break;
+  case NODE_VAR:
+  {
+    statement->a = simplify_expression(optimizer, statement->a);
+    Variable *variable = get_variable(optimizer, statement->operand);
+
+    if (variable->reads > 0 || variable->is_captured)
+    {
+      return statement;
+    }
+
+    // Nobody reads the variable, only the side effects
+    // of its initializer are left.
+    optimizer->changed = true;
+    statement->type = NODE_EXPRESSION;
+    break;
+  }
+  case NODE_BLOCK:
+    statement->a = simplify_statements(optimizer, statement->a);
+
+    if (statement->a != NULL)
+    {
+      return statement;
+    }
+
+    optimizer->changed = true;
+    return NULL;
+  case NODE_IF:
+    statement->a = simplify_expression(optimizer, statement->a);
+    statement->b = simplify_statement(optimizer, statement->b);
+    statement->c = simplify_statement(optimizer, statement->c);
+
+    if (is_constant(statement->a))
+    {
+      optimizer->changed = true;
+      return is_truthy(constant_value(program, statement->a)) ? statement->b : statement->c;
+    }
+
+    if (statement->b != NULL || statement->c != NULL)
+    {
+      return statement;
+    }
+
+    // Both branches are empty, only the condition is left.
+    optimizer->changed = true;
+    statement->type = NODE_EXPRESSION;
+    break;
+  case NODE_WHILE:
+    statement->a = simplify_expression(optimizer, statement->a);
+
+    if (is_constant(statement->a) && !is_truthy(constant_value(program, statement->a)))
+    {
+      optimizer->changed = true;
+      return NULL;
+    }
+
+    statement->b = simplify_statement(optimizer, statement->b);
+    statement->c = simplify_expression(optimizer, statement->c);
+
+    if (statement->c != NULL && is_pure(optimizer, statement->c))
+    {
+      optimizer->changed = true;
+      statement->c = NULL;
+    }
+
+    return statement;
+  default:
+    return statement;
+  }
+
+  // [statement] is an expression statement.
+  if (!is_pure(optimizer, statement->a))
+  {
+    return statement;
+  }
+
+  optimizer->changed = true;
+  return NULL;
+}
+
+static Node *simplify_statements(Optimizer *optimizer, Node *statements)
+{
+  Node *head = NULL;
+  Node **tail = &head;
+  Node *statement = statements;
+
+  while (statement != NULL)
+  {
+    Node *next = statement->next;
+    Node *result = simplify_statement(optimizer, statement);
+
+    if (result != NULL)
+    {
+      *tail = result;
+      tail = &result->next;
+
+      // There is no way out of a loop whose condition is always true
+      // but returning, the statements after it never run.
+      // Neither do the ones after a return.
+      if (((result->type == NODE_WHILE && is_constant(result->a)) || result->type == NODE_RETURN) &&
+          next != NULL)
+      {
+        optimizer->changed = true;
+        next = NULL;
+      }
+    }
+
+    statement = next;
+  }
+
+  *tail = NULL;
+  return head;
+}
+
+// Temporaries
+
+static bool is_trivial(const Node *node)
+{
+  return node->type == NODE_CONSTANT || node->type == NODE_GET_LOCAL;
+}
+
+// Numbers are compared by their bits, `x + 0` and `x + -0`
+// are not the same thing when [x] is -0.
+static bool constants_identical(Value a, Value b)
+{
+  if (IS_NUMBER(a) != IS_NUMBER(b))
+  {
+    return false;
+  }
+
+  if (IS_NUMBER(a))
+  {
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    return memcmp(&x, &y, sizeof(double)) == 0;
+  }
+
+  return values_equal(a, b);
+}
+
+static bool nodes_equal(Optimizer *optimizer, const Node *a, const Node *b)
+{
+  if (a == NULL || b == NULL)
+  {
+    return a == b;
+  }
+
+  if (a->type != b->type)
+  {
+    return false;
+  }
+
+  if (a->type == NODE_CONSTANT)
+  {
+    return constants_identical(constant_value(optimizer->program, a), constant_value(optimizer->program, b));
+  }
+
+  return a->operand == b->operand &&
+         nodes_equal(optimizer, a->a, b->a) &&
+         nodes_equal(optimizer, a->b, b->b);
+}
+
+// Returns true if [variable] is assigned or declared in [node].
+static bool is_modified_in(const Node *node, int variable)
+{
+  if (node == NULL)
+  {
+    return false;
+  }
+
+  if ((node->type == NODE_SET_LOCAL || node->type == NODE_VAR) && node->operand == variable)
+  {
+    return true;
+  }
+
+  if (node->type == NODE_BLOCK)
+  {
+    for (const Node *statement = node->a; statement != NULL; statement = statement->next)
+    {
+      if (is_modified_in(statement, variable))
+      {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  return is_modified_in(node->a, variable) ||
+         is_modified_in(node->b, variable) ||
+         is_modified_in(node->c, variable);
+}
+
+// Returns true if the expression [node] reads a variable
+// that is assigned or declared in [scope].
+static bool depends_on(const Node *node, const Node *scope)
+{
+  if (node == NULL)
+  {
+    return false;
+  }
+
+  if (node->type == NODE_GET_LOCAL && is_modified_in(scope, node->operand))
+  {
+    return true;
+  }
+
+  return depends_on(node->a, scope) || depends_on(node->b, scope);
+}
+
+static bool can_declare_temporary(Optimizer *optimizer)
+{
+  // Slot zero is taken by the function.
+  return optimizer->declaration_count + 1 < UINT8_COUNT;
+}
+
+// Declares a temporary initialized with a copy of [value].
+static Node *declare_temporary(Optimizer *optimizer, const Node *value)
+{
+  IrProgram *program = optimizer->program;
+  int variable = add_variable(program);
+  Node *declaration = new_node(program, NODE_VAR, value->line);
+  declaration->operand = variable;
+  declaration->a = copy_node(program, value);
+
+  get_variable(optimizer, variable)->is_number = is_number_expression(optimizer, value);
+  optimizer->declaration_count++;
+
+  return declaration;
+}
+
+static Node *read_temporary(Optimizer *optimizer, const Node *declaration, size_t line)
+{
+  Node *node = new_node(optimizer->program, NODE_GET_LOCAL, line);
+  node->operand = declaration->operand;
+  return node;
+}
+
+static void append(Node **list, Node *node)
+{
+  while (*list != NULL)
+  {
+    list = &(*list)->next;
+  }
+
+  *list = node;
+}
+
+// Common subexpression elimination
+
+static int count_occurrences(Optimizer *optimizer, const Node *node, const Node *expression)
+{
+  if (node == NULL)
+  {
+    return 0;
+  }
+
+  if (nodes_equal(optimizer, node, expression))
+  {
+    return 1;
+  }
+
+  return count_occurrences(optimizer, node->a, expression) +
+         count_occurrences(optimizer, node->b, expression);
+}
+
+static int expression_size(const Node *node)
+{
+  return node == NULL ? 0 : 1 + expression_size(node->a) + expression_size(node->b);
+}
+
+// Returns the largest subexpression of [node] that is computed
+// more than once by [expression] and can be computed once before it.
+static Node *find_common_subexpression(Optimizer *optimizer, Node *node, const Node *expression)
+{
+  if (node == NULL || is_trivial(node))
+  {
+    return NULL;
+  }
+
+  if (is_pure(optimizer, node) &&
+      !depends_on(node, expression) &&
+      count_occurrences(optimizer, expression, node) > 1)
+  {
+    return node;
+  }
+
+  Node *left = find_common_subexpression(optimizer, node->a, expression);
+  Node *right = find_common_subexpression(optimizer, node->b, expression);
+
+  if (left == NULL || (right != NULL && expression_size(right) > expression_size(left)))
+  {
+    return right;
+  }
+
+  return left;
+}
+
+// Replaces the occurrences of the initializer of [declaration]
+// in [node] by reads of the temporary.
+static Node *replace_occurrences(Optimizer *optimizer, Node *node, const Node *declaration)
+{
+  if (node == NULL)
+  {
+    return NULL;
+  }
+
+  if (nodes_equal(optimizer, node, declaration->a))
+  {
+    return read_temporary(optimizer, declaration, node->line);
+  }
+
+  node->a = replace_occurrences(optimizer, node->a, declaration);
+  node->b = replace_occurrences(optimizer, node->b, declaration);
+  return node;
+}
+
+// Moves the subexpressions the expression of [statement] computes
+// more than once to temporaries and returns their declarations.
+static Node *eliminate_common_subexpressions(Optimizer *optimizer, Node *statement)
+{
+  Node *temporaries = NULL;
+
+  while (can_declare_temporary(optimizer))
+  {
+    Node *common = find_common_subexpression(optimizer, statement->a, statement->a);
+
+    if (common == NULL)
+    {
+      break;
+    }
+
+    Node *declaration = declare_temporary(optimizer, common);
+    statement->a = replace_occurrences(optimizer, statement->a, declaration);
+    append(&temporaries, declaration);
+  }
+
+  return temporaries;
+}
+
+// Loop invariant code motion
+
+static Node *hoist_expression(Optimizer *optimizer, Node *node, const Node *loop, Node **temporaries)
+{
+  if (node == NULL || is_trivial(node))
+  {
+    return node;
+  }
+
+  if (!is_pure(optimizer, node) || depends_on(node, loop))
+  {
+    node->a = hoist_expression(optimizer, node->a, loop, temporaries);
+    node->b = hoist_expression(optimizer, node->b, loop, temporaries);
+    return node;
+  }
+
+  // The value is the same on every iteration.
+  for (Node *declaration = *temporaries; declaration != NULL; declaration = declaration->next)
+  {
+    if (nodes_equal(optimizer, declaration->a, node))
+    {
+      return read_temporary(optimizer, declaration, node->line);
+    }
+  }
+
+  if (!can_declare_temporary(optimizer))
+  {
+    return node;
+  }
+
+  Node *declaration = declare_temporary(optimizer, node);
+  append(temporaries, declaration);
+  return read_temporary(optimizer, declaration, node->line);
+}
+
+static void hoist_statement(Optimizer *optimizer, Node *statement, const Node *loop, Node **temporaries)
+{
+  if (statement == NULL)
+  {
+    return;
+  }
+
+  if (statement->type == NODE_BLOCK)
+  {
+    for (Node *inner = statement->a; inner != NULL; inner = inner->next)
+    {
+      hoist_statement(optimizer, inner, loop, temporaries);
+    }
+
+    return;
+  }
+
+  statement->a = hoist_expression(optimizer, statement->a, loop, temporaries);
+
+  if (statement->type == NODE_IF || statement->type == NODE_WHILE)
+  {
+    hoist_statement(optimizer, statement->b, loop, temporaries);
+  }
+
+  if (statement->type == NODE_IF)
+  {
+    hoist_statement(optimizer, statement->c, loop, temporaries);
+  }
+
+  if (statement->type == NODE_WHILE)
+  {
+    statement->c = hoist_expression(optimizer, statement->c, loop, temporaries);
+  }
+}
+
+// Moves the subexpressions of [loop] that compute the same value
+// on every iteration to temporaries and returns their declarations.
+static Node *hoist_loop_invariants(Optimizer *optimizer, Node *loop)
+{
+  Node *temporaries = NULL;
+  hoist_statement(optimizer, loop, loop, &temporaries);
+  return temporaries;
+}
+
+static Node *move_statements(Optimizer *optimizer, Node *statements);
+
+// Returns [statement] with its temporaries declared before it.
+static Node *move_statement(Optimizer *optimizer, Node *statement, bool is_in_list)
+{
+  if (statement == NULL)
+  {
+    return NULL;
+  }
+
+  Node *temporaries = NULL;
+
+  switch (statement->type)
+  {
+  case NODE_PRINT:
+  case NODE_EXPRESSION:
+  case NODE_DEFINE_GLOBAL:
+  case NODE_RETURN:
+    temporaries = eliminate_common_subexpressions(optimizer, statement);
+    break;
+  case NODE_VAR:
+    // The temporaries must be declared in the same block as
+    // the variable, which is only possible in a list of statements.
+    if (is_in_list)
+    {
+      temporaries = eliminate_common_subexpressions(optimizer, statement);
+    }
+    break;
+  case NODE_BLOCK:
+    statement->a = move_statements(optimizer, statement->a);
+    break;
+  case NODE_IF:
+    temporaries = eliminate_common_subexpressions(optimizer, statement);
+    statement->b = move_statement(optimizer, statement->b, false);
+    statement->c = move_statement(optimizer, statement->c, false);
+    break;
+  case NODE_WHILE:
+    // Outer loops first, so what does not change in the outer loop
+    // is computed once instead of once per iteration of the outer loop.
+    temporaries = hoist_loop_invariants(optimizer, statement);
+    statement->b = move_statement(optimizer, statement->b, false);
+    break;
+  default:
+    break;
+  }
+
+  if (temporaries == NULL)
+  {
+    return statement;
+  }
+
+  append(&temporaries, statement);
+
+  if (statement->type == NODE_VAR)
+  {
+    return temporaries;
+  }
+
+  // A block ends the scope of the temporaries right after the statement.
+  Node *block = new_node(optimizer->program, NODE_BLOCK, statement->line);
+  block->a = temporaries;
+  return block;
+}
+
+static Node *move_statements(Optimizer *optimizer, Node *statements)
+{
+  Node *head = NULL;
+  Node **tail = &head;
+  Node *statement = statements;
+
+  while (statement != NULL)
+  {
+    Node *next = statement->next;
+    statement->next = NULL;
+
+    *tail = move_statement(optimizer, statement, true);
+
+    while (*tail != NULL)
+    {
+      tail = &(*tail)->next;
+    }
+
+    statement = next;
+  }
+
+  return head;
+}
+
+void optimize_program(Vm *vm, IrProgram *program)
+{
+  Optimizer optimizer;
+  optimizer.vm = vm;
+  optimizer.program = program;
+  optimizer.initializers = NULL;
+  optimizer.declaration_count = 0;
+
+  // Every simplification can make others possible,
+  // like a folded condition removing the only read of a variable.
+  do
+  {
+    optimizer.changed = false;
+    analyze_program(&optimizer);
+    program->root->a = simplify_statements(&optimizer, program->root->a);
+  } while (optimizer.changed);
+
+  analyze_program(&optimizer);
+  program->root->a = move_statements(&optimizer, program->root->a);
+
+  free(optimizer.initializers);
+}
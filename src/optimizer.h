@@ -0,0 +1,37 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "ir.h"
+#include "scanner.h"
+#include "value.h"
+
+// Evaluates the operator [operator_type] on constant operands, like
+// the vm would, and stores the result in [result]. Returns false,
+// leaving the operator to the vm, if it would fail at runtime.
+// Both compiler tiers fold constants with these.
+bool fold_unary_value(TokenType operator_type, Value operand, Value *result);
+bool fold_binary_values(Vm *vm, TokenType operator_type, Value a, Value b, Value *result);
+
+// Rewrites [program] into an equivalent program that does less work:
+//
+// - Constant folding, including conditions of `if`, `while`,
+//   `and` and `or`.
+// - Copy propagation: reads of locals that are never assigned
+//   and are initialized with a constant or another such local
+//   are replaced by the initializer.
+// - Dead code elimination: expression statements without side effects,
+//   assignments to and declarations of locals nobody reads,
+//   and statements after a loop that never ends are removed.
+// - Common subexpression elimination: a subexpression computed more
+//   than once by a statement is computed once into a temporary.
+// - Loop invariant code motion: subexpressions of a loop that
+//   compute the same value on every iteration are computed once
+//   before the loop.
+//
+// Only subexpressions that can not fail or have side effects are moved,
+// that is arithmetic and comparisons on locals known to hold numbers.
+// Globals can be changed by anything, they are never assumed to hold
+// a known value.
+void optimize_program(Vm *vm, IrProgram *program);
+
+#endif
@@ -0,0 +1,775 @@
+#include <stdlib.h>
+
+#include "peephole.h"
+#include "value.h"
+
+// The chunk is decoded into instructions before it is optimized,
+// which lets the passes delete and replace instructions without
+// moving bytes around and fixing every jump each time.
+// Jumps point to the instruction they land on instead of an offset,
+// and the chunk is only encoded again at the end.
+typedef struct
+{
+  uint8_t opcode;
+  // The operand of instructions that have one, except jumps.
+  int operand;
+  // Index of the instruction a jump lands on.
+  int target;
+  // Offset of the instruction in the original chunk.
+  size_t offset;
+  size_t line;
+  bool is_dead;
+} Instruction;
+
+typedef struct
+{
+  Chunk *chunk;
+  int count;
+  Instruction *instructions;
+  // [is_jump_target[i]] is true if some jump lands on instruction [i].
+  bool *is_jump_target;
+  bool *is_reachable;
+  int *worklist;
+} Program;
+
+static void *allocate(size_t size)
+{
+  // Allocated with the system malloc because [optimize_chunk]
+  // must not start a collection, which could move the function
+  // that owns the chunk.
+  void *pointer = malloc(size);
+
+  if (pointer == NULL)
+  {
+    exit(1);
+  }
+
+  return pointer;
+}
+
+static bool is_conditional_jump(uint8_t opcode)
+{
+  return opcode == OP_JUMP_IF_FALSE || opcode == OP_POP_JUMP_IF_FALSE;
+}
+
+static bool is_jump(uint8_t opcode)
+{
+  return opcode == OP_JUMP || opcode == OP_LOOP || is_conditional_jump(opcode);
+}
+
+static bool is_unconditional_jump(uint8_t opcode)
+{
+  return opcode == OP_JUMP || opcode == OP_LOOP;
+}
+
+static bool is_constant_load(uint8_t opcode)
+{
+  return opcode == OP_CONSTANT || opcode == OP_NIL || opcode == OP_TRUE || opcode == OP_FALSE;
+}
+
+static void decode(Program *program, Chunk *chunk)
+{
+  // [index_at[offset]] is the index of the instruction
+  // that starts at [offset], jumps never land anywhere else.
+  int *index_at = (int *)allocate(sizeof(int) * (chunk->count + 1));
+  int count = 0;
+
+  for (size_t offset = 0; offset < chunk->count; offset += instruction_length(chunk->code[offset]))
+  {
+    index_at[offset] = count++;
+  }
+
+  program->chunk = chunk;
+  program->count = count;
+  program->instructions = (Instruction *)allocate(sizeof(Instruction) * count);
+  program->is_jump_target = (bool *)allocate(sizeof(bool) * count);
+  program->is_reachable = (bool *)allocate(sizeof(bool) * count);
+  program->worklist = (int *)allocate(sizeof(int) * count);
+
+  for (size_t offset = 0; offset < chunk->count; offset += instruction_length(chunk->code[offset]))
+  {
+    Instruction *instruction = &program->instructions[index_at[offset]];
+    const uint8_t *code = &chunk->code[offset];
+
+    instruction->opcode = code[0];
+    instruction->operand = 0;
+    instruction->target = -1;
+    instruction->offset = offset;
+    instruction->line = chunk->lines[offset];
+    instruction->is_dead = false;
+
+    switch (instruction_length(code[0]))
+    {
+    case 2:
+      instruction->operand = code[1];
+      break;
+    case 3:
+      instruction->operand = (code[1] << 8) | code[2];
+      break;
+    }
+
+    if (is_jump(code[0]))
+    {
+      size_t next = offset + 3;
+      size_t target = code[0] == OP_LOOP ? next - instruction->operand : next + instruction->operand;
+      instruction->target = index_at[target];
+    }
+  }
+
+  free(index_at);
+}
+
+static void free_program(Program *program)
+{
+  free(program->instructions);
+  free(program->is_jump_target);
+  free(program->is_reachable);
+  free(program->worklist);
+}
+
+// Returns the first instruction from [index] on that is not dead.
+// The last instruction, the OP_RETURN every chunk ends with, never dies.
+static int live(Program *program, int index)
+{
+  while (program->instructions[index].is_dead)
+  {
+    index++;
+  }
+
+  return index;
+}
+
+static int next_live(Program *program, int index)
+{
+  return index + 1 < program->count ? live(program, index + 1) : -1;
+}
+
+static int previous_live(Program *program, int index)
+{
+  do
+  {
+    index--;
+  } while (index >= 0 && program->instructions[index].is_dead);
+
+  return index;
+}
+
+static void kill(Program *program, int index)
+{
+  // Jumps to a dead instruction land on the next live one.
+  if (index < program->count - 1)
+  {
+    program->instructions[index].is_dead = true;
+
+    // [is_jump_target] is only recomputed once every instruction has
+    // been looked at, until then the next live instruction must not be
+    // mistaken for one no jump lands on.
+    if (program->is_jump_target[index])
+    {
+      program->is_jump_target[live(program, index)] = true;
+    }
+  }
+}
+
+// Points the jumps that land on dead instructions to the next
+// live instruction and finds out which instructions are jump targets.
+static void resolve_jumps(Program *program)
+{
+  for (int i = 0; i < program->count; i++)
+  {
+    program->is_jump_target[i] = false;
+  }
+
+  for (int i = 0; i < program->count; i++)
+  {
+    Instruction *instruction = &program->instructions[i];
+
+    if (!instruction->is_dead && is_jump(instruction->opcode))
+    {
+      instruction->target = live(program, instruction->target);
+      program->is_jump_target[instruction->target] = true;
+    }
+  }
+}
+
+// Whether a jump from [from] to [to] fits the 16 bit operand of
+// [opcode]. The code only gets shorter, so a jump that fits
+// in the original chunk also fits in the optimized one.
+static bool can_jump(Program *program, uint8_t opcode, int from, int to)
+{
+  size_t next = program->instructions[from].offset + 3;
+  size_t target = program->instructions[to].offset;
+
+  if (target >= next)
+  {
+    return target - next <= UINT16_MAX;
+  }
+
+  // Conditional jumps only go forward.
+  return !is_conditional_jump(opcode) && next - target <= UINT16_MAX;
+}
+
+// A jump that lands on an unconditional jump can go straight to where
+// that jump goes. A conditional jump that lands on another conditional
+// jump can skip it too, the value it tested is still on the stack
+// and still falsey.
+static bool thread_jump(Program *program, int index)
+{
+  Instruction *jump = &program->instructions[index];
+  bool changed = false;
+
+  // Bounded because jumps can form a cycle, like `while true {}`.
+  for (int hops = 0; hops < program->count; hops++)
+  {
+    const Instruction *target = &program->instructions[jump->target];
+    bool can_skip = is_unconditional_jump(target->opcode) ||
+                    (jump->opcode == OP_JUMP_IF_FALSE && target->opcode == OP_JUMP_IF_FALSE);
+
+    if (!can_skip || jump->target == index)
+    {
+      break;
+    }
+
+    int new_target = live(program, target->target);
+
+    if (new_target == jump->target || !can_jump(program, jump->opcode, index, new_target))
+    {
+      break;
+    }
+
+    jump->target = new_target;
+    changed = true;
+  }
+
+  return changed;
+}
+
+// Folds a conditional jump on a constant, which the compiler emits
+// for conditions like `while true` or `if 1 > 2`.
+static bool fold_constant_jump(Program *program, int index)
+{
+  int load_index = previous_live(program, index);
+
+  if (load_index < 0 || program->is_jump_target[index])
+  {
+    return false;
+  }
+
+  const Instruction *load = &program->instructions[load_index];
+
+  if (!is_constant_load(load->opcode))
+  {
+    return false;
+  }
+
+  Value condition;
+
+  switch (load->opcode)
+  {
+  case OP_CONSTANT:
+    condition = program->chunk->constants.values[load->operand];
+    break;
+  case OP_NIL:
+    condition = NIL_VAL;
+    break;
+  default:
+    condition = BOOL_VAL(load->opcode == OP_TRUE);
+    break;
+  }
+
+  // The condition stays on the stack either way,
+  // only the jump goes away.
+  if (is_truthy(condition))
+  {
+    kill(program, index);
+  }
+  else
+  {
+    program->instructions[index].opcode = OP_JUMP;
+  }
+
+  return true;
+}
+
+// A value that is pushed and popped right away without being looked at,
+// like the condition of `if true`, does not need to be pushed at all.
+static bool remove_unused_load(Program *program, int index)
+{
+  int load_index = previous_live(program, index);
+
+  if (load_index < 0 || program->is_jump_target[index])
+  {
+    return false;
+  }
+
+  uint8_t opcode = program->instructions[load_index].opcode;
+
+  // OP_GET_GLOBAL is not removed because it fails
+  // when the variable is not defined.
+  if (!is_constant_load(opcode) && opcode != OP_GET_LOCAL)
+  {
+    return false;
+  }
+
+  kill(program, load_index);
+  kill(program, index);
+  return true;
+}
+
+// Kills the instructions that can not be reached from the first one.
+static bool remove_unreachable_code(Program *program)
+{
+  int count = 0;
+
+  for (int i = 0; i < program->count; i++)
+  {
+    program->is_reachable[i] = false;
+  }
+
+  program->is_reachable[live(program, 0)] = true;
+  program->worklist[count++] = live(program, 0);
+
+  while (count > 0)
+  {
+    int index = program->worklist[--count];
+    const Instruction *instruction = &program->instructions[index];
+    int successors[2];
+    int successor_count = 0;
+
+    if (is_jump(instruction->opcode))
+    {
+      successors[successor_count++] = instruction->target;
+    }
+
+    if (!is_unconditional_jump(instruction->opcode) && instruction->opcode != OP_RETURN)
+    {
+      int next = next_live(program, index);
+
+      if (next >= 0)
+      {
+        successors[successor_count++] = next;
+      }
+    }
+
+    for (int i = 0; i < successor_count; i++)
+    {
+      if (!program->is_reachable[successors[i]])
+      {
+        program->is_reachable[successors[i]] = true;
+        program->worklist[count++] = successors[i];
+      }
+    }
+  }
+
+  bool changed = false;
+
+  for (int i = 0; i < program->count - 1; i++)
+  {
+    if (!program->instructions[i].is_dead && !program->is_reachable[i])
+    {
+      kill(program, i);
+      changed = true;
+    }
+  }
+
+  return changed;
+}
+
+// Removing an instruction can expose another instruction to remove,
+// so the passes run until none of them changes anything.
+static void simplify(Program *program)
+{
+  bool changed = true;
+
+  while (changed)
+  {
+    changed = false;
+    resolve_jumps(program);
+
+    for (int i = 0; i < program->count; i++)
+    {
+      Instruction *instruction = &program->instructions[i];
+
+      if (instruction->is_dead)
+      {
+        continue;
+      }
+
+      if (is_jump(instruction->opcode))
+      {
+        changed |= thread_jump(program, i);
+      }
+
+      if (instruction->opcode == OP_JUMP_IF_FALSE)
+      {
+        changed |= fold_constant_jump(program, i);
+      }
+      else if (instruction->opcode == OP_POP)
+      {
+        changed |= remove_unused_load(program, i);
+      }
+
+      // A forward jump to the next instruction does nothing,
+      // unless it pops the condition.
+      if (!instruction->is_dead && is_jump(instruction->opcode) &&
+          instruction->opcode != OP_POP_JUMP_IF_FALSE &&
+          instruction->target == next_live(program, i))
+      {
+        kill(program, i);
+        changed = true;
+      }
+    }
+
+    resolve_jumps(program);
+    changed |= remove_unreachable_code(program);
+  }
+}
+
+// Replaces an instruction followed by OP_NOT with the
+// instruction that does both, unless a jump lands on the OP_NOT.
+static void fuse_not(Program *program, int index)
+{
+  int not_index = next_live(program, index);
+
+  if (not_index < 0 || program->is_jump_target[not_index] ||
+      program->instructions[not_index].opcode != OP_NOT)
+  {
+    return;
+  }
+
+  Instruction *instruction = &program->instructions[index];
+
+  switch (instruction->opcode)
+  {
+  case OP_EQUAL:
+    instruction->opcode = OP_NOT_EQUAL;
+    break;
+  // `a >= b` is compiled to `!(a < b)` and `a <= b` to `!(a > b)`.
+  case OP_LESS:
+    instruction->opcode = OP_GREATER_EQUAL;
+    break;
+  case OP_GREATER:
+    instruction->opcode = OP_LESS_EQUAL;
+    break;
+  default:
+    return;
+  }
+
+  kill(program, not_index);
+}
+
+// Replaces a run of OP_POP, like the ones that discard the locals
+// at the end of a scope, with a single OP_POPN.
+static void fuse_pops(Program *program, int index)
+{
+  Instruction *instruction = &program->instructions[index];
+  int count = 1;
+  int next = next_live(program, index);
+
+  while (next >= 0 && count < UINT8_MAX && program->instructions[next].opcode == OP_POP &&
+         !program->is_jump_target[next])
+  {
+    kill(program, next);
+    count++;
+    next = next_live(program, next);
+  }
+
+  if (count > 1)
+  {
+    instruction->opcode = OP_POPN;
+    instruction->operand = count;
+  }
+}
+
+static void fuse_negations(Program *program)
+{
+  resolve_jumps(program);
+
+  for (int i = 0; i < program->count; i++)
+  {
+    if (!program->instructions[i].is_dead)
+    {
+      fuse_not(program, i);
+    }
+  }
+}
+
+static void fuse_pop_runs(Program *program)
+{
+  resolve_jumps(program);
+
+  for (int i = 0; i < program->count; i++)
+  {
+    if (!program->instructions[i].is_dead && program->instructions[i].opcode == OP_POP)
+    {
+      fuse_pops(program, i);
+    }
+  }
+}
+
+#ifdef SUPERINSTRUCTIONS
+// Superinstructions do the work of a sequence of instructions
+// with a single dispatch. The sequences are the most frequent
+// opcode pairs in the benchmarks, see DEBUG_PROFILE_OPCODES:
+//
+// - OP_CONSTANT followed by an arithmetic or comparison
+//   instruction, the `i + 1` and `i < 100` of every loop.
+// - OP_SET_LOCAL and OP_SET_GLOBAL followed by OP_POP,
+//   which is how every assignment statement ends.
+// - OP_JUMP_IF_FALSE followed by OP_POP, the compiler pops the
+//   condition of every if, while and for on both branches.
+// - OP_GET_LOCAL, OP_ADD_CONSTANT and OP_SET_LOCAL_POP on the same
+//   local, which is `i = i + 1`.
+
+// Returns the instruction after [index] if it has [opcode]
+// and no jump lands on it, so it can be fused with [index].
+static int fusable_next(Program *program, int index, uint8_t opcode)
+{
+  int next = next_live(program, index);
+
+  if (next < 0 || program->is_jump_target[next] || program->instructions[next].opcode != opcode)
+  {
+    return -1;
+  }
+
+  return next;
+}
+
+static uint8_t constant_operand_opcode(uint8_t opcode)
+{
+  switch (opcode)
+  {
+  case OP_ADD:
+    return OP_ADD_CONSTANT;
+  case OP_SUBTRACT:
+    return OP_SUBTRACT_CONSTANT;
+  case OP_MULTIPLY:
+    return OP_MULTIPLY_CONSTANT;
+  case OP_DIVIDE:
+    return OP_DIVIDE_CONSTANT;
+  case OP_LESS:
+    return OP_LESS_CONSTANT;
+  case OP_GREATER:
+    return OP_GREATER_CONSTANT;
+  case OP_EQUAL:
+    return OP_EQUAL_CONSTANT;
+  default:
+    return OP_CONSTANT;
+  }
+}
+
+static void fuse_pair(Program *program, int index)
+{
+  Instruction *instruction = &program->instructions[index];
+  int next = next_live(program, index);
+
+  if (next < 0 || program->is_jump_target[next])
+  {
+    return;
+  }
+
+  Instruction *next_instruction = &program->instructions[next];
+
+  switch (instruction->opcode)
+  {
+  case OP_CONSTANT:
+  {
+    uint8_t opcode = constant_operand_opcode(next_instruction->opcode);
+
+    if (opcode == OP_CONSTANT)
+    {
+      return;
+    }
+
+    // Dividing gives a double, the double of an integer divisor
+    // is not converted again every time the division runs.
+    Value *constant = &program->chunk->constants.values[instruction->operand];
+
+    if (opcode == OP_DIVIDE_CONSTANT && IS_INTEGER(*constant))
+    {
+      *constant = NUMBER_VAL(AS_INTEGER(*constant));
+    }
+
+    instruction->opcode = opcode;
+    break;
+  }
+  case OP_SET_LOCAL:
+    if (next_instruction->opcode != OP_POP)
+    {
+      return;
+    }
+
+    instruction->opcode = OP_SET_LOCAL_POP;
+    break;
+  case OP_SET_GLOBAL:
+    if (next_instruction->opcode != OP_POP)
+    {
+      return;
+    }
+
+    instruction->opcode = OP_SET_GLOBAL_POP;
+    break;
+  case OP_JUMP_IF_FALSE:
+  {
+    // The condition is popped by the OP_POP after the jump and by
+    // the OP_POP the jump lands on. Popping it in the jump means it
+    // can land after that OP_POP instead, which other jumps may still use.
+    Instruction *target = &program->instructions[instruction->target];
+
+    if (next_instruction->opcode != OP_POP || target->opcode != OP_POP)
+    {
+      return;
+    }
+
+    instruction->opcode = OP_POP_JUMP_IF_FALSE;
+    instruction->target = next_live(program, instruction->target);
+    break;
+  }
+  default:
+    return;
+  }
+
+  kill(program, next);
+}
+
+static void fuse_add_local_constant(Program *program, int index)
+{
+  Instruction *get = &program->instructions[index];
+  int add = fusable_next(program, index, OP_ADD_CONSTANT);
+  int set = add >= 0 ? fusable_next(program, add, OP_SET_LOCAL_POP) : -1;
+
+  if (set < 0 || program->instructions[set].operand != get->operand)
+  {
+    return;
+  }
+
+  // The local slot goes in the first operand byte
+  // and the constant in the second.
+  get->opcode = OP_ADD_LOCAL_CONSTANT;
+  get->operand = (get->operand << 8) | program->instructions[add].operand;
+  kill(program, add);
+  kill(program, set);
+}
+
+static void fuse_superinstructions(Program *program)
+{
+  resolve_jumps(program);
+
+  for (int i = 0; i < program->count; i++)
+  {
+    if (!program->instructions[i].is_dead)
+    {
+      fuse_pair(program, i);
+    }
+  }
+
+  // The pairs are fused first because OP_ADD_LOCAL_CONSTANT
+  // is made of two of them.
+  resolve_jumps(program);
+
+  for (int i = 0; i < program->count; i++)
+  {
+    if (!program->instructions[i].is_dead && program->instructions[i].opcode == OP_GET_LOCAL)
+    {
+      fuse_add_local_constant(program, i);
+    }
+  }
+}
+#endif
+
+static void write_instruction(Chunk *chunk, size_t offset, const Instruction *instruction, int operand)
+{
+  int length = instruction_length(instruction->opcode);
+
+  chunk->code[offset] = instruction->opcode;
+
+  if (length == 2)
+  {
+    chunk->code[offset + 1] = operand & 0xff;
+  }
+  else if (length == 3)
+  {
+    chunk->code[offset + 1] = (operand >> 8) & 0xff;
+    chunk->code[offset + 2] = operand & 0xff;
+  }
+
+  for (int i = 0; i < length; i++)
+  {
+    chunk->lines[offset + i] = instruction->line;
+  }
+}
+
+// Writes the live instructions back to the chunk. The optimized code
+// is never longer than the original, so it fits in the same arrays.
+static void encode(Program *program)
+{
+  Chunk *chunk = program->chunk;
+  size_t *offsets = (size_t *)allocate(sizeof(size_t) * program->count);
+  size_t offset = 0;
+
+  for (int i = 0; i < program->count; i++)
+  {
+    if (!program->instructions[i].is_dead)
+    {
+      offsets[i] = offset;
+      offset += instruction_length(program->instructions[i].opcode);
+    }
+  }
+
+  for (int i = 0; i < program->count; i++)
+  {
+    Instruction *instruction = &program->instructions[i];
+
+    if (instruction->is_dead)
+    {
+      continue;
+    }
+
+    int operand = instruction->operand;
+
+    if (is_jump(instruction->opcode))
+    {
+      size_t next = offsets[i] + 3;
+      size_t target = offsets[instruction->target];
+
+      // Threading can turn a forward jump into a backward one.
+      if (!is_conditional_jump(instruction->opcode))
+      {
+        instruction->opcode = target < next ? OP_LOOP : OP_JUMP;
+      }
+
+      operand = (int)(target < next ? next - target : target - next);
+    }
+
+    write_instruction(chunk, offsets[i], instruction, operand);
+  }
+
+  chunk->count = offset;
+  free(offsets);
+}
+
+void optimize_chunk(Chunk *chunk)
+{
+  if (chunk->count == 0)
+  {
+    return;
+  }
+
+  Program program;
+
+  decode(&program, chunk);
+  simplify(&program);
+  fuse_negations(&program);
+
+#ifdef SUPERINSTRUCTIONS
+  fuse_superinstructions(&program);
+  // Conditional jumps that pop now land after the OP_POP they used to
+  // land on, which is unreachable if nothing else jumps to it.
+  simplify(&program);
+#endif
+
+  // Last because a run of OP_POP could have been part of a superinstruction.
+  fuse_pop_runs(&program);
+  encode(&program);
+  free_program(&program);
+}
@@ -0,0 +1,24 @@
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+
+#include "chunk.h"
+
+// Rewrites the finished [chunk] into equivalent but shorter code.
+//
+// The compiler emits bytecode while it parses, so it never sees
+// more than the instruction it is emitting. Once the chunk is done,
+// the peephole optimizer looks at it as a whole:
+//
+// - Jumps that land on unconditional jumps go straight
+//   to the final destination.
+// - Conditional jumps on constants become unconditional jumps or disappear.
+// - Code that can not be reached is removed.
+// - Pairs like OP_EQUAL OP_NOT are replaced by a single instruction
+//   and runs of OP_POP by OP_POPN.
+// - Frequent sequences are replaced by superinstructions
+//   when SUPERINSTRUCTIONS is defined.
+//
+// Jump offsets and the [lines] table are rewritten to match the new code.
+void optimize_chunk(Chunk *chunk);
+
+#endif
@@ -0,0 +1,596 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ir.h"
+#include "memory.h"
+#include "vm.h"
+
+// Lowering to register code
+//
+// Every local gets the register that would have been its stack slot.
+// The temporaries an expression needs are allocated above the locals,
+// like a stack, and released when the expression that needs them
+// is done, so no temporary outlives its statement.
+//
+// Reads of locals use the register of the local in place instead
+// of copying it, and results are computed straight into the register
+// they are assigned to, so `a = b + c` is a single ROP_ADD.
+//
+// A call allocates the callee and its arguments as the top
+// temporaries, the window of the callee's registers starts there.
+//
+// Lowering allocates no objects, so nothing moves [function].
+
+// Instructions name registers with 8 bits. Like with the
+// [UINT8_COUNT] slots of a stack frame, [STACK_MAX] leaves room
+// for the deepest frames and for the operands of string
+// concatenation pushed above the registers.
+#define MAX_REGISTERS UINT8_COUNT
+
+typedef struct
+{
+  Vm *vm;
+  IrProgram *program;
+  ObjFunction *function;
+  // Index in the chunk of every constant in [program],
+  // or -1 if the chunk does not have it yet.
+  int *constant_indices;
+  // Register of every variable.
+  int *registers;
+  // Whether the local in each register is captured.
+  bool captured[MAX_REGISTERS];
+  // Registers below [local_count] belong to locals
+  // and the ones from there up to [next_register] to temporaries.
+  int local_count;
+  int next_register;
+  bool had_error;
+} RegisterLowering;
+
+static void *allocate(size_t size)
+{
+  void *pointer = malloc(size);
+
+  if (pointer == NULL)
+  {
+    exit(1);
+  }
+
+  return pointer;
+}
+
+static void lowering_error(RegisterLowering *lowering, size_t line, const char *message)
+{
+  if (!lowering->had_error)
+  {
+    fprintf(stderr, "[line %zu] %s\n", line, message);
+  }
+
+  lowering->had_error = true;
+}
+
+static RegisterCode *current_code(RegisterLowering *lowering)
+{
+  return &lowering->function->chunk.registers;
+}
+
+static void emit(RegisterLowering *lowering, uint32_t instruction, size_t line)
+{
+  write_register_code(current_code(lowering), instruction, line);
+}
+
+static int new_register(RegisterLowering *lowering, size_t line)
+{
+  if (lowering->next_register == MAX_REGISTERS)
+  {
+    lowering_error(lowering, line, "Too many registers");
+    return 0;
+  }
+
+  int reg = lowering->next_register++;
+  RegisterCode *code = current_code(lowering);
+
+  if (lowering->next_register > code->register_count)
+  {
+    code->register_count = lowering->next_register;
+  }
+
+  return reg;
+}
+
+static bool is_local_register(RegisterLowering *lowering, int reg)
+{
+  return reg < lowering->local_count;
+}
+
+// Returns the index in the chunk of the constant of [node].
+// The register machine computes on doubles, see [BINARY_OP]
+// in vm.c, so an integer constant becomes the double.
+static int constant_index(RegisterLowering *lowering, const Node *node)
+{
+  int *index = &lowering->constant_indices[node->operand];
+
+  if (*index == -1)
+  {
+    Value value = constant_value(lowering->program, node);
+
+    if (IS_INTEGER(value))
+    {
+      value = NUMBER_VAL(AS_INTEGER(value));
+    }
+
+    *index = (int)add_constant(&lowering->function->chunk, value);
+    write_barrier(lowering->vm, (Obj *)lowering->function, value);
+  }
+
+  if (*index > UINT16_MAX)
+  {
+    lowering_error(lowering, node->line, "Too many constants in one chunk");
+    return 0;
+  }
+
+  return *index;
+}
+
+static void emit_constant(RegisterLowering *lowering, const Node *node, int target)
+{
+  Value value = constant_value(lowering->program, node);
+
+  if (IS_NIL(value))
+  {
+    emit(lowering, REGISTER_ABC(ROP_NIL, target, 0, 0), node->line);
+  }
+  else if (IS_BOOL(value))
+  {
+    emit(lowering, REGISTER_ABC(AS_BOOL(value) ? ROP_TRUE : ROP_FALSE, target, 0, 0), node->line);
+  }
+  else
+  {
+    emit(lowering, REGISTER_ABX(ROP_CONSTANT, target, constant_index(lowering, node)), node->line);
+  }
+}
+
+static int emit_jump(RegisterLowering *lowering, RegisterOpCode opcode, int reg, size_t line)
+{
+  emit(lowering, REGISTER_ABX(opcode, reg, 0), line);
+  return current_code(lowering)->count - 1;
+}
+
+static void patch_jump(RegisterLowering *lowering, int jump, size_t line)
+{
+  RegisterCode *code = current_code(lowering);
+  int offset = code->count - jump - 1;
+
+  if (offset > UINT16_MAX)
+  {
+    lowering_error(lowering, line, "Too much code to jump over");
+  }
+
+  code->code[jump] = REGISTER_ABX(REGISTER_OPCODE(code->code[jump]), REGISTER_A(code->code[jump]), offset);
+}
+
+static void emit_loop(RegisterLowering *lowering, int loop_start, size_t line)
+{
+  int offset = current_code(lowering)->count - loop_start + 1;
+
+  if (offset > UINT16_MAX)
+  {
+    lowering_error(lowering, line, "loop body too large");
+  }
+
+  emit(lowering, REGISTER_ABX(ROP_LOOP, 0, offset), line);
+}
+
+// Returns true if [node] assigns to the local in register [reg].
+// A call may assign it if it is captured.
+static bool assigns_register(RegisterLowering *lowering, const Node *node, int reg)
+{
+  if (node == NULL)
+  {
+    return false;
+  }
+
+  if (node->type == NODE_SET_LOCAL && lowering->registers[node->operand] == reg)
+  {
+    return true;
+  }
+
+  if (node->type == NODE_CALL && lowering->captured[reg])
+  {
+    return true;
+  }
+
+  return assigns_register(lowering, node->a, reg) ||
+         assigns_register(lowering, node->b, reg) ||
+         assigns_register(lowering, node->c, reg);
+}
+
+static void lower_into(RegisterLowering *lowering, const Node *node, int target);
+
+// Lowers the callee and the arguments of [node] to new temporaries
+// and returns the one of the callee, where the result ends up.
+// [opcode] is ROP_CALL or ROP_TAIL_CALL.
+static int lower_call(RegisterLowering *lowering, const Node *node, RegisterOpCode opcode)
+{
+  int callee = new_register(lowering, node->line);
+  lower_into(lowering, node->a, callee);
+
+  for (const Node *argument = node->b; argument != NULL; argument = argument->b)
+  {
+    lower_into(lowering, argument->a, new_register(lowering, node->line));
+  }
+
+  emit(lowering, REGISTER_ABC(opcode, callee, node->operand, 0), node->line);
+  return callee;
+}
+
+// Returns the register that holds the value of [node].
+// Locals are read in place, anything else is computed
+// into a new temporary.
+static int lower_to_register(RegisterLowering *lowering, const Node *node)
+{
+  switch (node->type)
+  {
+  case NODE_GET_LOCAL:
+    return lowering->registers[node->operand];
+  case NODE_SET_LOCAL:
+  {
+    int reg = lowering->registers[node->operand];
+    lower_into(lowering, node->a, reg);
+    return reg;
+  }
+  case NODE_CALL:
+    return lower_call(lowering, node, ROP_CALL);
+  default:
+  {
+    int reg = new_register(lowering, node->line);
+    lower_into(lowering, node, reg);
+    return reg;
+  }
+  }
+}
+
+static RegisterOpCode binary_opcode(TokenType operator_type)
+{
+  switch (operator_type)
+  {
+  case TOKEN_BANG_EQUAL:
+    return ROP_NOT_EQUAL;
+  case TOKEN_EQUAL_EQUAL:
+    return ROP_EQUAL;
+  case TOKEN_GREATER:
+    return ROP_GREATER;
+  case TOKEN_GREATER_EQUAL:
+    return ROP_GREATER_EQUAL;
+  case TOKEN_LESS:
+    return ROP_LESS;
+  case TOKEN_LESS_EQUAL:
+    return ROP_LESS_EQUAL;
+  case TOKEN_PLUS:
+    return ROP_ADD;
+  case TOKEN_MINUS:
+    return ROP_SUBTRACT;
+  case TOKEN_STAR:
+    return ROP_MULTIPLY;
+  default:
+    return ROP_DIVIDE;
+  }
+}
+
+static void lower_binary(RegisterLowering *lowering, const Node *node, int target)
+{
+  RegisterOpCode opcode = binary_opcode((TokenType)node->operand);
+  int left = lower_to_register(lowering, node->a);
+
+  // The left operand is evaluated first, if it is a local that
+  // the right operand assigns to, the local is copied before that.
+  if (is_local_register(lowering, left) && assigns_register(lowering, node->b, left))
+  {
+    int copy = new_register(lowering, node->line);
+    emit(lowering, REGISTER_ABC(ROP_MOVE, copy, left, 0), node->line);
+    left = copy;
+  }
+
+  if (node->b->type == NODE_CONSTANT)
+  {
+    int constant = constant_index(lowering, node->b);
+
+    if (constant <= UINT8_MAX)
+    {
+      // The constant variants follow the register variants
+      // in the same order.
+      opcode = (RegisterOpCode)(opcode + ROP_ADD_CONSTANT - ROP_ADD);
+      emit(lowering, REGISTER_ABC(opcode, target, left, constant), node->line);
+      return;
+    }
+  }
+
+  int right = lower_to_register(lowering, node->b);
+  emit(lowering, REGISTER_ABC(opcode, target, left, right), node->line);
+}
+
+// `and` and `or` write [target] before they evaluate their right
+// operand, which may read it, so a local target gets its value
+// through a temporary.
+static void lower_logical(RegisterLowering *lowering, const Node *node, int target)
+{
+  int result = is_local_register(lowering, target) ? new_register(lowering, node->line) : target;
+
+  lower_into(lowering, node->a, result);
+  RegisterOpCode opcode = node->type == NODE_AND ? ROP_JUMP_IF_FALSE : ROP_JUMP_IF_TRUE;
+  int end_jump = emit_jump(lowering, opcode, result, node->line);
+  lower_into(lowering, node->b, result);
+  patch_jump(lowering, end_jump, node->line);
+
+  if (result != target)
+  {
+    emit(lowering, REGISTER_ABC(ROP_MOVE, target, result, 0), node->line);
+  }
+}
+
+// Lowers [node] so its value ends up in [target].
+static void lower_into(RegisterLowering *lowering, const Node *node, int target)
+{
+  // The temporaries of [node] are released once it is done.
+  int next_register = lowering->next_register;
+
+  switch (node->type)
+  {
+  case NODE_CONSTANT:
+    emit_constant(lowering, node, target);
+    break;
+  case NODE_GET_LOCAL:
+  {
+    int source = lowering->registers[node->operand];
+
+    if (source != target)
+    {
+      emit(lowering, REGISTER_ABC(ROP_MOVE, target, source, 0), node->line);
+    }
+    break;
+  }
+  case NODE_SET_LOCAL:
+  {
+    int reg = lower_to_register(lowering, node);
+
+    if (reg != target)
+    {
+      emit(lowering, REGISTER_ABC(ROP_MOVE, target, reg, 0), node->line);
+    }
+    break;
+  }
+  case NODE_GET_GLOBAL:
+    emit(lowering, REGISTER_ABX(ROP_GET_GLOBAL, target, node->operand), node->line);
+    break;
+  case NODE_SET_GLOBAL:
+    lower_into(lowering, node->a, target);
+    emit(lowering, REGISTER_ABX(ROP_SET_GLOBAL, target, node->operand), node->line);
+    break;
+  case NODE_UNARY:
+  {
+    int operand = lower_to_register(lowering, node->a);
+    RegisterOpCode opcode = node->operand == TOKEN_MINUS ? ROP_NEGATE : ROP_NOT;
+    emit(lowering, REGISTER_ABC(opcode, target, operand, 0), node->line);
+    break;
+  }
+  case NODE_BINARY:
+    lower_binary(lowering, node, target);
+    break;
+  case NODE_AND:
+  case NODE_OR:
+    lower_logical(lowering, node, target);
+    break;
+  case NODE_CALL:
+  {
+    int result = lower_call(lowering, node, ROP_CALL);
+    emit(lowering, REGISTER_ABC(ROP_MOVE, target, result, 0), node->line);
+    break;
+  }
+  case NODE_CLOSURE:
+    set_captures(lowering->program, node, lowering->registers);
+    emit(lowering, REGISTER_ABX(ROP_CLOSURE, target, constant_index(lowering, node)), node->line);
+    break;
+  case NODE_GET_UPVALUE:
+    emit(lowering, REGISTER_ABC(ROP_GET_UPVALUE, target, node->operand, 0), node->line);
+    break;
+  case NODE_SET_UPVALUE:
+    lower_into(lowering, node->a, target);
+    emit(lowering, REGISTER_ABC(ROP_SET_UPVALUE, target, node->operand, 0), node->line);
+    break;
+  default:
+    break;
+  }
+
+  lowering->next_register = next_register;
+}
+
+// Lowers [node] for its side effects, its value is not used.
+static void lower_effect(RegisterLowering *lowering, const Node *node)
+{
+  switch (node->type)
+  {
+  case NODE_SET_LOCAL:
+    lower_into(lowering, node->a, lowering->registers[node->operand]);
+    break;
+  case NODE_SET_GLOBAL:
+  {
+    int value = lower_to_register(lowering, node->a);
+    emit(lowering, REGISTER_ABX(ROP_SET_GLOBAL, value, node->operand), node->line);
+    break;
+  }
+  case NODE_SET_UPVALUE:
+  {
+    int value = lower_to_register(lowering, node->a);
+    emit(lowering, REGISTER_ABC(ROP_SET_UPVALUE, value, node->operand, 0), node->line);
+    break;
+  }
+  default:
+    // Reading a global or adding a number to a string
+    // can fail, the expression still has to run.
+    lower_to_register(lowering, node);
+    break;
+  }
+}
+
+static void lower_statement(RegisterLowering *lowering, const Node *node);
+
+static void lower_block(RegisterLowering *lowering, const Node *block)
+{
+  int local_count = lowering->local_count;
+
+  for (const Node *statement = block->a; statement != NULL; statement = statement->next)
+  {
+    lower_statement(lowering, statement);
+  }
+
+  // The registers of the locals declared in the block are free again,
+  // the captured ones move to the heap first.
+  for (int reg = local_count; reg < lowering->local_count; reg++)
+  {
+    if (lowering->captured[reg])
+    {
+      emit(lowering, REGISTER_ABC(ROP_CLOSE_UPVALUES, local_count, 0, 0), block->line);
+      break;
+    }
+  }
+
+  lowering->local_count = local_count;
+}
+
+static void lower_statement(RegisterLowering *lowering, const Node *node)
+{
+  // The optimizer leaves out the branches and bodies that do nothing.
+  if (node == NULL)
+  {
+    return;
+  }
+
+  // No temporary outlives the statement that needs it.
+  lowering->next_register = lowering->local_count;
+
+  switch (node->type)
+  {
+  case NODE_PRINT:
+    emit(lowering, REGISTER_ABC(ROP_PRINT, lower_to_register(lowering, node->a), 0, 0), node->line);
+    break;
+  case NODE_EXPRESSION:
+    lower_effect(lowering, node->a);
+    break;
+  case NODE_DEFINE_GLOBAL:
+  {
+    int value = lower_to_register(lowering, node->a);
+    emit(lowering, REGISTER_ABX(ROP_DEFINE_GLOBAL, value, node->operand), node->line);
+    break;
+  }
+  case NODE_VAR:
+  {
+    if (lowering->local_count == UINT8_COUNT)
+    {
+      lowering_error(lowering, node->line, "Too many local variable declarations");
+      return;
+    }
+
+    // The register is known before the initializer is lowered
+    // because the initializer can read the variable.
+    int reg = new_register(lowering, node->line);
+    lowering->registers[node->operand] = reg;
+    lowering->captured[reg] = lowering->program->variables[node->operand].is_captured;
+    lowering->local_count = lowering->next_register;
+    lower_into(lowering, node->a, reg);
+    break;
+  }
+  case NODE_BLOCK:
+    lower_block(lowering, node);
+    break;
+  case NODE_IF:
+  {
+    int condition = lower_to_register(lowering, node->a);
+    int then_jump = emit_jump(lowering, ROP_JUMP_IF_FALSE, condition, node->line);
+    lower_statement(lowering, node->b);
+
+    if (node->c == NULL)
+    {
+      patch_jump(lowering, then_jump, node->line);
+      break;
+    }
+
+    int else_jump = emit_jump(lowering, ROP_JUMP, 0, node->line);
+    patch_jump(lowering, then_jump, node->line);
+    lower_statement(lowering, node->c);
+    patch_jump(lowering, else_jump, node->line);
+    break;
+  }
+  case NODE_WHILE:
+  {
+    int loop_start = current_code(lowering)->count;
+    int condition = lower_to_register(lowering, node->a);
+    int exit_jump = emit_jump(lowering, ROP_JUMP_IF_FALSE, condition, node->line);
+    lower_statement(lowering, node->b);
+
+    if (node->c != NULL)
+    {
+      lowering->next_register = lowering->local_count;
+      lower_effect(lowering, node->c);
+    }
+
+    emit_loop(lowering, loop_start, node->line);
+    patch_jump(lowering, exit_jump, node->line);
+    break;
+  }
+  case NODE_RETURN:
+    if (node->a == NULL)
+    {
+      emit(lowering, REGISTER_ABC(ROP_RETURN_NIL, 0, 0, 0), node->line);
+    }
+    else if (node->a->type == NODE_CALL)
+    {
+      // Reached when the callee is a native, see ROP_TAIL_CALL.
+      int result = lower_call(lowering, node->a, ROP_TAIL_CALL);
+      emit(lowering, REGISTER_ABC(ROP_RETURN, result, 0, 0), node->line);
+    }
+    else
+    {
+      emit(lowering, REGISTER_ABC(ROP_RETURN, lower_to_register(lowering, node->a), 0, 0), node->line);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+bool lower_program_to_registers(Vm *vm, IrProgram *program, ObjFunction *function)
+{
+  RegisterLowering lowering;
+  lowering.vm = vm;
+  lowering.program = program;
+  lowering.function = function;
+  lowering.constant_indices = (int *)allocate(sizeof(int) * (program->constants.count + 1));
+  lowering.registers = (int *)allocate(sizeof(int) * (program->variable_count + 1));
+  // Register zero is the stack slot of the function being executed,
+  // the parameters follow it.
+  lowering.captured[0] = false;
+  lowering.local_count = 1 + program->parameter_count;
+  lowering.next_register = lowering.local_count;
+  lowering.had_error = false;
+  function->chunk.registers.register_count = lowering.local_count;
+
+  for (size_t i = 0; i < program->constants.count; i++)
+  {
+    lowering.constant_indices[i] = -1;
+  }
+
+  for (int i = 0; i < program->parameter_count; i++)
+  {
+    lowering.registers[i] = 1 + i;
+    lowering.captured[1 + i] = program->variables[i].is_captured;
+  }
+
+  for (const Node *statement = program->root->a; statement != NULL; statement = statement->next)
+  {
+    lower_statement(&lowering, statement);
+  }
+
+  free(lowering.constant_indices);
+  free(lowering.registers);
+
+  return !lowering.had_error;
+}
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 
 #include "./vm.h"
+#include "./aot.h"
 
 static char *read_file(const char *path)
 {
@@ -42,4 +43,27 @@ static void run_file(Vm *vm, const char *path)
   {
     exit(70);
   }
-}
\ No newline at end of file
+}
+
+// Writes the script at [path] to [output_path] as C, see aot.h.
+static void compile_file(Vm *vm, const char *path, const char *output_path)
+{
+  char *source_code = read_file(path);
+  FILE *output = fopen(output_path, "w");
+
+  if (output == NULL)
+  {
+    fprintf(stderr, "File %s can not be written\n", output_path);
+    exit(74);
+  }
+
+  bool compiled = aot_compile(vm, source_code, path, output);
+
+  fclose(output);
+  free(source_code);
+
+  if (!compiled)
+  {
+    exit(65);
+  }
+}
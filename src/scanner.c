@@ -173,7 +173,7 @@ static bool is_alpha(const char c)
 
 static TokenType check_keyword(const Scanner *scanner, size_t start, size_t length, const char *rest, const TokenType type)
 {
-  if (scanner->current - scanner->start == start + length &&
+  if ((size_t)(scanner->current - scanner->start) == start + length &&
       memcmp(scanner->start + start, rest, length) == 0)
   {
     return type;
@@ -403,4 +403,6 @@ const char *token_type_to_string(TokenType type)
   case TOKEN_EOF:
     return "eof";
   }
+
+  return "unknown";
 }
\ No newline at end of file
@@ -0,0 +1,1735 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "assembler.h"
+#include "memory.h"
+#include "natives.h"
+#include "obj.h"
+#include "trace.h"
+
+#ifdef USE_TRACING
+
+// Limits of a single recording, longer loops are not traced.
+#define TRACE_MAX_LENGTH 256
+#define TRACE_MAX_INSTRUCTIONS 1024
+#define TRACE_MAX_SNAPSHOTS 256
+#define TRACE_MAX_SNAPSHOT_SLOTS 4096
+#define TRACE_MAX_VARIABLES 64
+
+// The instructions of a trace. They are in the order the recorder saw
+// them and each is referred to by its index, which also names the
+// value it produces.
+typedef enum
+{
+  TRACE_OP_CONSTANT,
+  // Reads a local below the depth of the header or a global variable.
+  TRACE_OP_LOAD_LOCAL,
+  TRACE_OP_LOAD_GLOBAL,
+  TRACE_OP_ADD,
+  TRACE_OP_SUBTRACT,
+  TRACE_OP_MULTIPLY,
+  TRACE_OP_DIVIDE,
+  TRACE_OP_NEGATE,
+  // The math natives that are a single instruction, on [a] and [b].
+  TRACE_OP_SQRT,
+  TRACE_OP_ABS,
+  TRACE_OP_MIN,
+  TRACE_OP_MAX,
+  // Calls the number native [value] with the numbers [a] and [b],
+  // -1 for the arguments it does not take.
+  TRACE_OP_CALL,
+  // Leaves the trace through [snapshot] unless [condition]
+  // holds for `ucomisd a, b`.
+  TRACE_OP_GUARD,
+  TRACE_OP_STORE_LOCAL,
+  TRACE_OP_STORE_GLOBAL,
+} TraceOp;
+
+typedef struct
+{
+  TraceOp op;
+  // Numbers are unboxed doubles in xmm registers. Every other value
+  // is a constant, the guards made sure of it, and needs no register.
+  bool is_number;
+  // CONDITION_ABOVE, CONDITION_BELOW_EQUAL, CONDITION_EQUAL (and
+  // ordered) or CONDITION_NOT_EQUAL (or unordered).
+  Condition condition;
+  int a;
+  int b;
+  // The variable of loads and stores.
+  int slot;
+  int snapshot;
+  Value value;
+} TraceInstruction;
+
+// What the interpreter needs to carry on when a guard fails: the
+// instruction to resume at and the values of the stack slots above
+// the depth of the header. Everything below is written as it changes.
+typedef struct
+{
+  size_t offset;
+  int count;
+  int first;
+} Snapshot;
+
+// A local below the depth of the header or a global the trace uses.
+typedef struct
+{
+  bool is_global;
+  int slot;
+  // Read before it is assigned, the trace checks what it holds
+  // before the loop: a number, or [value] if not [is_number].
+  bool is_loaded;
+  bool is_number;
+  Value value;
+  bool is_stored;
+  // The load of a number read before it is assigned, or -1.
+  int load;
+  // The instruction whose value it holds at this point of the
+  // recording, -1 until it is read or assigned.
+  int current;
+} TracedVariable;
+
+typedef enum
+{
+  RECORD_CONTINUE,
+  RECORD_ABORT,
+} RecordResult;
+
+typedef struct
+{
+  Vm *vm;
+  Trace *trace;
+  // The stack window of the frame the loop runs in,
+  // locals and depths are relative to it.
+  Value *slots;
+  // Offsets of the instructions recorded so far, to abort
+  // when the recording goes around a loop inside the loop.
+  uint8_t *visited;
+  int length;
+  int count;
+  TraceInstruction instructions[TRACE_MAX_INSTRUCTIONS];
+  int snapshot_count;
+  Snapshot snapshots[TRACE_MAX_SNAPSHOTS];
+  int snapshot_slot_count;
+  int snapshot_slots[TRACE_MAX_SNAPSHOT_SLOTS];
+  int variable_count;
+  TracedVariable variables[TRACE_MAX_VARIABLES];
+  // The instruction each stack slot of the frame at or above
+  // the depth of the header holds.
+  int stack[STACK_MAX];
+} Recorder;
+
+static void *allocate(size_t size)
+{
+  void *pointer = calloc(1, size);
+
+  if (pointer == NULL)
+  {
+    exit(1);
+  }
+
+  return pointer;
+}
+
+// Recording
+//
+// The recorder runs one iteration of the loop the way [run] would,
+// on the real stack and variables, and adds an instruction to the
+// trace for everything that depends on values that can change. An
+// instruction it can not trace aborts the recording before it runs,
+// so the interpreter carries on from there as if nothing happened.
+
+static int stack_depth(Recorder *recorder)
+{
+  return (int)(recorder->vm->stack_top - recorder->slots);
+}
+
+static int add_instruction(Recorder *recorder, TraceOp op, bool is_number, int a, int b)
+{
+  TraceInstruction *instruction = &recorder->instructions[recorder->count];
+  instruction->op = op;
+  instruction->is_number = is_number;
+  instruction->condition = CONDITION_ALWAYS;
+  instruction->a = a;
+  instruction->b = b;
+  instruction->slot = 0;
+  instruction->snapshot = -1;
+  instruction->value = NIL_VAL;
+  return recorder->count++;
+}
+
+static bool is_constant(Recorder *recorder, int ref)
+{
+  return recorder->instructions[ref].op == TRACE_OP_CONSTANT;
+}
+
+static int constant(Recorder *recorder, Value value)
+{
+  // The trace computes on doubles, see [emit_preheader].
+  if (IS_INTEGER(value))
+  {
+    value = NUMBER_VAL(AS_NUMBER(value));
+  }
+
+  for (int i = 0; i < recorder->count; i++)
+  {
+    TraceInstruction *instruction = &recorder->instructions[i];
+
+    // Compared by their bits, 0 and -0 are different constants.
+    if (instruction->op == TRACE_OP_CONSTANT && instruction->value == value)
+    {
+      return i;
+    }
+  }
+
+  int ref = add_instruction(recorder, TRACE_OP_CONSTANT, IS_NUMBER(value), -1, -1);
+  recorder->instructions[ref].value = value;
+  return ref;
+}
+
+// Natives are old, they never move, and the trace calls
+// the C function of the ones that take numbers directly.
+static bool is_number_native(Value value)
+{
+  return IS_NATIVE(value) && AS_NATIVE(value)->takes_numbers;
+}
+
+static bool is_traceable(Value value)
+{
+  return IS_NUMBER(value) || IS_NIL(value) || IS_BOOL(value) || is_number_native(value);
+}
+
+static void push_ref(Recorder *recorder, int ref, Value value)
+{
+  recorder->stack[stack_depth(recorder)] = ref;
+  *recorder->vm->stack_top++ = value;
+}
+
+static int top_ref(Recorder *recorder, int distance)
+{
+  return recorder->stack[stack_depth(recorder) - 1 - distance];
+}
+
+static Value top_value(Recorder *recorder, int distance)
+{
+  return recorder->vm->stack_top[-1 - distance];
+}
+
+static void drop(Recorder *recorder, int count)
+{
+  recorder->vm->stack_top -= count;
+}
+
+static TracedVariable *find_variable(Recorder *recorder, bool is_global, int slot)
+{
+  for (int i = 0; i < recorder->variable_count; i++)
+  {
+    TracedVariable *variable = &recorder->variables[i];
+
+    if (variable->is_global == is_global && variable->slot == slot)
+    {
+      return variable;
+    }
+  }
+
+  TracedVariable *variable = &recorder->variables[recorder->variable_count++];
+  memset(variable, 0, sizeof(TracedVariable));
+  variable->is_global = is_global;
+  variable->slot = slot;
+  variable->load = -1;
+  variable->current = -1;
+  return variable;
+}
+
+static Value *variable_address(Recorder *recorder, bool is_global, int slot)
+{
+  return is_global ? &recorder->vm->global_values.values[slot] : &recorder->slots[slot];
+}
+
+// Returns the instruction a local below the header or a global holds,
+// or -1 if its value can not be traced.
+static int read_variable(Recorder *recorder, bool is_global, int slot)
+{
+  TracedVariable *variable = find_variable(recorder, is_global, slot);
+
+  if (variable->current >= 0)
+  {
+    return variable->current;
+  }
+
+  Value value = *variable_address(recorder, is_global, slot);
+
+  if (!is_traceable(value))
+  {
+    return -1;
+  }
+
+  variable->is_loaded = true;
+  variable->is_number = IS_NUMBER(value);
+  variable->value = value;
+
+  if (variable->is_number)
+  {
+    TraceOp op = is_global ? TRACE_OP_LOAD_GLOBAL : TRACE_OP_LOAD_LOCAL;
+    variable->load = add_instruction(recorder, op, true, -1, -1);
+    recorder->instructions[variable->load].slot = slot;
+    variable->current = variable->load;
+  }
+  else
+  {
+    variable->current = constant(recorder, value);
+  }
+
+  return variable->current;
+}
+
+// Stores are written through as they happen, so a guard that fails
+// later leaves the variables as the interpreter expects them.
+static void write_variable(Recorder *recorder, bool is_global, int slot, int ref, Value value)
+{
+  TracedVariable *variable = find_variable(recorder, is_global, slot);
+  variable->is_stored = true;
+  variable->current = ref;
+
+  TraceOp op = is_global ? TRACE_OP_STORE_GLOBAL : TRACE_OP_STORE_LOCAL;
+  int store = add_instruction(recorder, op, false, ref, -1);
+  recorder->instructions[store].slot = slot;
+
+  // Objects are not stored, see [record_instruction],
+  // the garbage collector does not need to know.
+  *variable_address(recorder, is_global, slot) = value;
+}
+
+// Reads local [slot], which lives on the abstract stack
+// if it was declared inside the loop.
+static int read_local(Recorder *recorder, int slot)
+{
+  if (slot >= recorder->trace->depth)
+  {
+    return recorder->stack[slot];
+  }
+
+  return read_variable(recorder, false, slot);
+}
+
+static void write_local(Recorder *recorder, int slot, int ref, Value value)
+{
+  if (slot >= recorder->trace->depth)
+  {
+    recorder->stack[slot] = ref;
+    recorder->slots[slot] = value;
+    return;
+  }
+
+  write_variable(recorder, false, slot, ref, value);
+}
+
+// Takes a snapshot of the stack above the header to resume at
+// [offset]. The top of the stack is replaced by [top] unless it is -1.
+static int take_snapshot(Recorder *recorder, size_t offset, int top)
+{
+  Snapshot *snapshot = &recorder->snapshots[recorder->snapshot_count];
+  snapshot->offset = offset;
+  snapshot->count = stack_depth(recorder) - recorder->trace->depth;
+  snapshot->first = recorder->snapshot_slot_count;
+
+  for (int i = 0; i < snapshot->count; i++)
+  {
+    recorder->snapshot_slots[snapshot->first + i] = recorder->stack[recorder->trace->depth + i];
+  }
+
+  if (top >= 0)
+  {
+    recorder->snapshot_slots[snapshot->first + snapshot->count - 1] = top;
+  }
+
+  recorder->snapshot_slot_count += snapshot->count;
+  return recorder->snapshot_count++;
+}
+
+static void add_guard(Recorder *recorder, Condition condition, int a, int b, int snapshot)
+{
+  int guard = add_instruction(recorder, TRACE_OP_GUARD, false, a, b);
+  recorder->instructions[guard].condition = condition;
+  recorder->instructions[guard].snapshot = snapshot;
+}
+
+// `a op b` on the two numbers [a] and [b] that [left] and [right] hold.
+static RecordResult record_arithmetic(Recorder *recorder, TraceOp op, int left, int right,
+                                      Value a, Value b, int pop_count)
+{
+  if (!IS_NUMBER(a) || !IS_NUMBER(b))
+  {
+    return RECORD_ABORT;
+  }
+
+  double x = AS_NUMBER(a);
+  double y = AS_NUMBER(b);
+  double result;
+
+  switch (op)
+  {
+  case TRACE_OP_ADD:
+    result = x + y;
+    break;
+  case TRACE_OP_SUBTRACT:
+    result = x - y;
+    break;
+  case TRACE_OP_MULTIPLY:
+    result = x * y;
+    break;
+  default:
+    result = x / y;
+    break;
+  }
+
+  int ref = is_constant(recorder, left) && is_constant(recorder, right)
+                ? constant(recorder, NUMBER_VAL(result))
+                : add_instruction(recorder, op, true, left, right);
+
+  drop(recorder, pop_count);
+  push_ref(recorder, ref, NUMBER_VAL(result));
+  return RECORD_CONTINUE;
+}
+
+static uint16_t read_short(const uint8_t *code)
+{
+  return (uint16_t)((code[1] << 8) | code[2]);
+}
+
+// The comparison instructions, in terms of `ucomisd` on the
+// operands in the order the flags are read.
+typedef enum
+{
+  COMPARE_EQUAL,
+  COMPARE_NOT_EQUAL,
+  COMPARE_GREATER,
+  COMPARE_GREATER_EQUAL,
+  COMPARE_LESS,
+  COMPARE_LESS_EQUAL,
+} Comparison;
+
+// Pushes the result of comparing [a] and [b] as a constant. If it
+// depends on numbers the trace computes, a guard checks that it comes
+// out the same way and otherwise exits with the other boolean.
+static RecordResult record_comparison(Recorder *recorder, Comparison comparison, int left, int right,
+                                      Value a, Value b, int pop_count, size_t next)
+{
+  bool numbers = IS_NUMBER(a) && IS_NUMBER(b);
+  bool result;
+
+  switch (comparison)
+  {
+  case COMPARE_EQUAL:
+    result = values_equal(a, b);
+    break;
+  case COMPARE_NOT_EQUAL:
+    result = !values_equal(a, b);
+    break;
+  default:
+    // The other comparisons are runtime errors on anything else.
+    if (!numbers)
+    {
+      return RECORD_ABORT;
+    }
+
+    switch (comparison)
+    {
+    case COMPARE_GREATER:
+      result = AS_NUMBER(a) > AS_NUMBER(b);
+      break;
+    case COMPARE_GREATER_EQUAL:
+      result = !(AS_NUMBER(a) < AS_NUMBER(b));
+      break;
+    case COMPARE_LESS:
+      result = AS_NUMBER(a) < AS_NUMBER(b);
+      break;
+    default:
+      result = !(AS_NUMBER(a) > AS_NUMBER(b));
+      break;
+    }
+    break;
+  }
+
+  drop(recorder, pop_count);
+  push_ref(recorder, constant(recorder, BOOL_VAL(result)), BOOL_VAL(result));
+
+  // A number is never equal to anything else, and values
+  // that are not numbers are constants in the trace.
+  if (!numbers || (is_constant(recorder, left) && is_constant(recorder, right)))
+  {
+    return RECORD_CONTINUE;
+  }
+
+  // `ucomisd x, y` sets the flags of an unsigned comparison of x and
+  // y, and all of them if either is NaN. `a < b` is `b above a`,
+  // `a >= b` is `!(a < b)` and `a <= b` is `!(a > b)`, like in [run].
+  int x = left;
+  int y = right;
+  bool above = result;
+  Condition condition;
+
+  switch (comparison)
+  {
+  case COMPARE_EQUAL:
+    condition = result ? CONDITION_EQUAL : CONDITION_NOT_EQUAL;
+    break;
+  case COMPARE_NOT_EQUAL:
+    condition = result ? CONDITION_NOT_EQUAL : CONDITION_EQUAL;
+    break;
+  default:
+    if (comparison == COMPARE_LESS || comparison == COMPARE_GREATER_EQUAL)
+    {
+      x = right;
+      y = left;
+    }
+
+    if (comparison == COMPARE_GREATER_EQUAL || comparison == COMPARE_LESS_EQUAL)
+    {
+      above = !result;
+    }
+
+    condition = above ? CONDITION_ABOVE : CONDITION_BELOW_EQUAL;
+    break;
+  }
+
+  // The exit has the other boolean on top of the stack. When a branch
+  // on it comes next, the exit goes straight to where the branch goes,
+  // so leaving the loop through its condition is not a side exit.
+  const uint8_t *branch = recorder->vm->chunk->code + next;
+  int snapshot;
+
+  if (branch[0] == OP_JUMP_IF_FALSE || branch[0] == OP_POP_JUMP_IF_FALSE)
+  {
+    size_t after = next + 3;
+    size_t exit = result ? after + read_short(branch) : after;
+
+    if (branch[0] == OP_POP_JUMP_IF_FALSE)
+    {
+      drop(recorder, 1);
+      snapshot = take_snapshot(recorder, exit, -1);
+      push_ref(recorder, constant(recorder, BOOL_VAL(result)), BOOL_VAL(result));
+    }
+    else
+    {
+      snapshot = take_snapshot(recorder, exit, constant(recorder, BOOL_VAL(!result)));
+    }
+  }
+  else
+  {
+    snapshot = take_snapshot(recorder, next, constant(recorder, BOOL_VAL(!result)));
+  }
+
+  add_guard(recorder, condition, x, y, snapshot);
+  return RECORD_CONTINUE;
+}
+
+// Follows the branch the condition [ref] takes. Only numbers can go
+// either way, 0 is false and every other number, NaN included, true.
+static RecordResult record_branch(Recorder *recorder, int ref, Value value, bool pop,
+                                  size_t next, size_t target)
+{
+  bool truthy = is_truthy(value);
+
+  if (pop)
+  {
+    drop(recorder, 1);
+  }
+
+  if (recorder->instructions[ref].is_number && !is_constant(recorder, ref))
+  {
+    int snapshot = take_snapshot(recorder, truthy ? target : next, -1);
+    add_guard(recorder, truthy ? CONDITION_NOT_EQUAL : CONDITION_EQUAL,
+              ref, constant(recorder, NUMBER_VAL(0)), snapshot);
+  }
+
+  recorder->vm->ip = recorder->vm->chunk->code + (truthy ? next : target);
+  return RECORD_CONTINUE;
+}
+
+// Calls [callee] with the [argument_count] values on top of the stack
+// and replaces the top [pop_count] with the result. Only natives that
+// take numbers are traced, everything else pushes a frame or may
+// allocate.
+static RecordResult record_native_call(Recorder *recorder, Value callee, int argument_count,
+                                       int pop_count)
+{
+  if (!is_number_native(callee) || AS_NATIVE(callee)->arity != argument_count)
+  {
+    return RECORD_ABORT;
+  }
+
+  int arguments[NUMBER_NATIVE_MAX_ARITY] = {-1, -1};
+  bool constants = true;
+
+  for (int i = 0; i < argument_count; i++)
+  {
+    int distance = argument_count - 1 - i;
+
+    if (!IS_NUMBER(top_value(recorder, distance)))
+    {
+      return RECORD_ABORT;
+    }
+
+    arguments[i] = top_ref(recorder, distance);
+    constants = constants && is_constant(recorder, arguments[i]);
+  }
+
+  // The math natives that are a single instruction get one of their
+  // own and are folded on constants. The others are never folded,
+  // natives like clock return something else every time.
+  Value *intrinsics = recorder->vm->intrinsics;
+  TraceOp op = callee == intrinsics[OP_SQRT - OP_SQRT]  ? TRACE_OP_SQRT
+               : callee == intrinsics[OP_ABS - OP_SQRT] ? TRACE_OP_ABS
+               : callee == intrinsics[OP_MIN - OP_SQRT] ? TRACE_OP_MIN
+               : callee == intrinsics[OP_MAX - OP_SQRT] ? TRACE_OP_MAX
+                                                        : TRACE_OP_CALL;
+
+  Value value = NUMBER_VAL(call_number_native(AS_NATIVE(callee), recorder->vm->stack_top - argument_count));
+  int ref;
+
+  if (op != TRACE_OP_CALL && constants)
+  {
+    ref = constant(recorder, value);
+  }
+  else
+  {
+    ref = add_instruction(recorder, op, true, arguments[0], arguments[1]);
+    recorder->instructions[ref].value = callee;
+  }
+
+  drop(recorder, pop_count);
+  push_ref(recorder, ref, value);
+  return RECORD_CONTINUE;
+}
+
+static RecordResult record_instruction(Recorder *recorder)
+{
+  Vm *vm = recorder->vm;
+  Chunk *chunk = vm->chunk;
+  const uint8_t *code = vm->ip;
+  size_t offset = (size_t)(code - chunk->code);
+  size_t next = offset + instruction_length(code[0]);
+
+  // Moving on is the default, jumps set [vm->ip] themselves.
+  RecordResult result = RECORD_CONTINUE;
+  uint8_t *resume = chunk->code + next;
+
+  switch (unquickened_opcode(code[0]))
+  {
+  case OP_CONSTANT:
+  {
+    Value value = chunk->constants.values[code[1]];
+
+    if (!is_traceable(value))
+    {
+      return RECORD_ABORT;
+    }
+
+    push_ref(recorder, constant(recorder, value), value);
+    break;
+  }
+  case OP_NIL:
+    push_ref(recorder, constant(recorder, NIL_VAL), NIL_VAL);
+    break;
+  case OP_TRUE:
+    push_ref(recorder, constant(recorder, TRUE_VAL), TRUE_VAL);
+    break;
+  case OP_FALSE:
+    push_ref(recorder, constant(recorder, FALSE_VAL), FALSE_VAL);
+    break;
+  case OP_NEGATE:
+  {
+    int ref = top_ref(recorder, 0);
+    Value value = top_value(recorder, 0);
+
+    if (!IS_NUMBER(value))
+    {
+      return RECORD_ABORT;
+    }
+
+    Value negated = NUMBER_VAL(-AS_NUMBER(value));
+    int negate = is_constant(recorder, ref)
+                     ? constant(recorder, negated)
+                     : add_instruction(recorder, TRACE_OP_NEGATE, true, ref, -1);
+    drop(recorder, 1);
+    push_ref(recorder, negate, negated);
+    break;
+  }
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  {
+    static const TraceOp ops[] = {
+        [OP_ADD] = TRACE_OP_ADD,
+        [OP_SUBTRACT] = TRACE_OP_SUBTRACT,
+        [OP_MULTIPLY] = TRACE_OP_MULTIPLY,
+        [OP_DIVIDE] = TRACE_OP_DIVIDE,
+    };
+    result = record_arithmetic(recorder, ops[unquickened_opcode(code[0])],
+                               top_ref(recorder, 1), top_ref(recorder, 0),
+                               top_value(recorder, 1), top_value(recorder, 0), 2);
+    break;
+  }
+  case OP_ADD_CONSTANT:
+  case OP_SUBTRACT_CONSTANT:
+  case OP_MULTIPLY_CONSTANT:
+  case OP_DIVIDE_CONSTANT:
+  {
+    static const TraceOp ops[] = {
+        [OP_ADD_CONSTANT] = TRACE_OP_ADD,
+        [OP_SUBTRACT_CONSTANT] = TRACE_OP_SUBTRACT,
+        [OP_MULTIPLY_CONSTANT] = TRACE_OP_MULTIPLY,
+        [OP_DIVIDE_CONSTANT] = TRACE_OP_DIVIDE,
+    };
+    Value b = chunk->constants.values[code[1]];
+
+    if (!IS_NUMBER(b))
+    {
+      return RECORD_ABORT;
+    }
+
+    result = record_arithmetic(recorder, ops[unquickened_opcode(code[0])],
+                               top_ref(recorder, 0), constant(recorder, b),
+                               top_value(recorder, 0), b, 1);
+    break;
+  }
+  case OP_ADD_LOCAL_CONSTANT:
+  {
+    int slot = code[1];
+    Value b = chunk->constants.values[code[2]];
+
+    if (slot >= stack_depth(recorder) || !IS_NUMBER(b) || !IS_NUMBER(recorder->slots[slot]))
+    {
+      return RECORD_ABORT;
+    }
+
+    int left = read_local(recorder, slot);
+
+    if (left < 0)
+    {
+      return RECORD_ABORT;
+    }
+
+    // Computed on the stack and stored like `x = x + constant`.
+    result = record_arithmetic(recorder, TRACE_OP_ADD, left, constant(recorder, b),
+                               recorder->slots[slot], b, 0);
+    write_local(recorder, slot, top_ref(recorder, 0), top_value(recorder, 0));
+    drop(recorder, 1);
+    break;
+  }
+  case OP_EQUAL:
+  case OP_NOT_EQUAL:
+  case OP_GREATER:
+  case OP_GREATER_EQUAL:
+  case OP_LESS:
+  case OP_LESS_EQUAL:
+  {
+    static const Comparison comparisons[] = {
+        [OP_EQUAL] = COMPARE_EQUAL,
+        [OP_NOT_EQUAL] = COMPARE_NOT_EQUAL,
+        [OP_GREATER] = COMPARE_GREATER,
+        [OP_GREATER_EQUAL] = COMPARE_GREATER_EQUAL,
+        [OP_LESS] = COMPARE_LESS,
+        [OP_LESS_EQUAL] = COMPARE_LESS_EQUAL,
+    };
+    result = record_comparison(recorder, comparisons[unquickened_opcode(code[0])],
+                               top_ref(recorder, 1), top_ref(recorder, 0),
+                               top_value(recorder, 1), top_value(recorder, 0), 2, next);
+    break;
+  }
+  case OP_EQUAL_CONSTANT:
+  case OP_LESS_CONSTANT:
+  case OP_GREATER_CONSTANT:
+  {
+    static const Comparison comparisons[] = {
+        [OP_EQUAL_CONSTANT] = COMPARE_EQUAL,
+        [OP_LESS_CONSTANT] = COMPARE_LESS,
+        [OP_GREATER_CONSTANT] = COMPARE_GREATER,
+    };
+    Value b = chunk->constants.values[code[1]];
+
+    if (!is_traceable(b))
+    {
+      return RECORD_ABORT;
+    }
+
+    result = record_comparison(recorder, comparisons[unquickened_opcode(code[0])],
+                               top_ref(recorder, 0), constant(recorder, b),
+                               top_value(recorder, 0), b, 1, next);
+    break;
+  }
+  case OP_NOT:
+  {
+    // Numbers are never nil or false.
+    Value value = BOOL_VAL(value_not(top_value(recorder, 0)));
+    drop(recorder, 1);
+    push_ref(recorder, constant(recorder, value), value);
+    break;
+  }
+  case OP_POP:
+  case OP_POPN:
+  {
+    int count = code[0] == OP_POP ? 1 : code[1];
+
+    // Popping a local the header can see leaves the scope of the loop,
+    // on the way back to it through an enclosing loop. The local is
+    // declared again in a slot the trace already loaded or assigned.
+    if (stack_depth(recorder) - count < recorder->trace->depth)
+    {
+      return RECORD_ABORT;
+    }
+
+    drop(recorder, count);
+    break;
+  }
+  case OP_GET_LOCAL:
+  {
+    int slot = code[1];
+
+    // Reading a local in its own initializer reads past the top.
+    if (slot >= stack_depth(recorder) || !is_traceable(recorder->slots[slot]))
+    {
+      return RECORD_ABORT;
+    }
+
+    int ref = read_local(recorder, slot);
+
+    if (ref < 0)
+    {
+      return RECORD_ABORT;
+    }
+
+    push_ref(recorder, ref, recorder->slots[slot]);
+    break;
+  }
+  case OP_SET_LOCAL:
+  case OP_SET_LOCAL_POP:
+  {
+    int slot = code[1];
+
+    // Storing an object below the header needs a write barrier.
+    if (slot >= stack_depth(recorder) ||
+        (slot < recorder->trace->depth && IS_OBJ(top_value(recorder, 0))))
+    {
+      return RECORD_ABORT;
+    }
+
+    write_local(recorder, slot, top_ref(recorder, 0), top_value(recorder, 0));
+
+    if (code[0] == OP_SET_LOCAL_POP)
+    {
+      drop(recorder, 1);
+    }
+    break;
+  }
+  case OP_GET_GLOBAL:
+  {
+    int ref = read_variable(recorder, true, read_short(code));
+
+    if (ref < 0)
+    {
+      return RECORD_ABORT;
+    }
+
+    push_ref(recorder, ref, vm->global_values.values[read_short(code)]);
+    break;
+  }
+  case OP_SET_GLOBAL:
+  case OP_SET_GLOBAL_POP:
+  {
+    int slot = read_short(code);
+
+    // Assigning an undefined variable is a runtime error
+    // and storing an object needs a write barrier.
+    if (IS_UNDEFINED(vm->global_values.values[slot]) || IS_OBJ(top_value(recorder, 0)))
+    {
+      return RECORD_ABORT;
+    }
+
+    write_variable(recorder, true, slot, top_ref(recorder, 0), top_value(recorder, 0));
+
+    if (code[0] == OP_SET_GLOBAL_POP)
+    {
+      drop(recorder, 1);
+    }
+    break;
+  }
+  case OP_CALL:
+  {
+    int argument_count = code[1];
+    result = record_native_call(recorder, top_value(recorder, argument_count), argument_count,
+                                argument_count + 1);
+    break;
+  }
+  case OP_SQRT:
+  case OP_FLOOR:
+  case OP_ABS:
+  case OP_MIN:
+  case OP_MAX:
+  case OP_POW:
+  {
+    int slot = read_short(code);
+    Value callee = vm->global_values.values[slot];
+
+    // The checks before the loop make sure the global
+    // still holds the native.
+    if (callee != vm->intrinsics[code[0] - OP_SQRT] || read_variable(recorder, true, slot) < 0)
+    {
+      return RECORD_ABORT;
+    }
+
+    int argument_count = intrinsics[code[0] - OP_SQRT].arity;
+    result = record_native_call(recorder, callee, argument_count, argument_count);
+    break;
+  }
+  case OP_JUMP_IF_FALSE:
+    return record_branch(recorder, top_ref(recorder, 0), top_value(recorder, 0), false,
+                         next, next + read_short(code));
+  case OP_POP_JUMP_IF_FALSE:
+    return record_branch(recorder, top_ref(recorder, 0), top_value(recorder, 0), true,
+                         next, next + read_short(code));
+  case OP_JUMP:
+    resume = chunk->code + next + read_short(code);
+    break;
+  case OP_LOOP:
+    resume = chunk->code + next - read_short(code);
+    break;
+  default:
+    return RECORD_ABORT;
+  }
+
+  if (result == RECORD_CONTINUE)
+  {
+    vm->ip = resume;
+  }
+
+  return result;
+}
+
+// The loop carries the values of the variables it assigns to the next
+// iteration through memory. The trace is only valid if they have the
+// type the next iteration expects when it reads them.
+static bool is_type_stable(Recorder *recorder)
+{
+  for (int i = 0; i < recorder->variable_count; i++)
+  {
+    TracedVariable *variable = &recorder->variables[i];
+
+    if (!variable->is_loaded || !variable->is_stored)
+    {
+      continue;
+    }
+
+    TraceInstruction *stored = &recorder->instructions[variable->current];
+
+    if (variable->is_number ? !stored->is_number
+                            : stored->op != TRACE_OP_CONSTANT || stored->value != variable->value)
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Records one iteration of the loop starting at [vm->ip].
+// The iteration runs to the end or up to the instruction
+// the recording was aborted at.
+static bool record(Recorder *recorder)
+{
+  Vm *vm = recorder->vm;
+  Trace *trace = recorder->trace;
+  trace->depth = stack_depth(recorder);
+  trace->start = trace->header;
+
+  for (;;)
+  {
+    size_t offset = (size_t)(vm->ip - vm->chunk->code);
+
+    // Every instruction needs at most a few trace instructions, one
+    // snapshot of the stack above the header, which is never deeper
+    // than before the instruction, and one variable. Checking for room
+    // up front means none of them has to fail halfway through.
+    if (recorder->length++ == TRACE_MAX_LENGTH ||
+        recorder->count + 4 > TRACE_MAX_INSTRUCTIONS ||
+        recorder->snapshot_count == TRACE_MAX_SNAPSHOTS ||
+        recorder->snapshot_slot_count + stack_depth(recorder) - trace->depth >
+            TRACE_MAX_SNAPSHOT_SLOTS ||
+        recorder->variable_count == TRACE_MAX_VARIABLES ||
+        recorder->visited[offset])
+    {
+      return false;
+    }
+
+    recorder->visited[offset] = 1;
+
+    if (offset < trace->start)
+    {
+      trace->start = offset;
+    }
+
+    if (record_instruction(recorder) == RECORD_ABORT)
+    {
+      return false;
+    }
+
+    if (vm->ip == vm->chunk->code + trace->header)
+    {
+      return stack_depth(recorder) == trace->depth && is_type_stable(recorder);
+    }
+  }
+}
+
+// Code generation
+//
+// The trace is compiled to a function that takes the vm and the stack
+// window of the frame the loop runs in, and returns the instruction the
+// interpreter resumes at, with [vm->stack_top] written back. It never
+// calls into C.
+//
+// Before the loop, the variables the trace reads are checked to hold
+// what they held when it was recorded. Variables it never assigns and
+// the constants it uses are loaded into registers once. Inside the
+// loop, every instruction is translated in order; values are allocated
+// an xmm register at their definition and give it back at their last
+// use, which is their last use in the iteration: anything the next
+// iteration needs has been stored to memory.
+
+#define VM_REGISTER R12
+#define ITERATIONS_REGISTER R13
+// The stack window of the frame, locals are addressed from it.
+#define SLOTS_REGISTER R14
+#define GLOBALS_REGISTER R15
+
+#define VM_FIELD(field) ((int32_t)offsetof(Vm, field))
+#define LOCAL(slot) ((int32_t)sizeof(Value) * (slot))
+#define GLOBAL(slot) ((int32_t)sizeof(Value) * (slot))
+
+#define XMM_COUNT 16
+
+typedef struct
+{
+  Recorder *recorder;
+  Assembler assembler;
+  // Register of every instruction while it is live, or -1.
+  int registers[TRACE_MAX_INSTRUCTIONS];
+  // Index of the last instruction that uses each one, -1 if unused.
+  int last_uses[TRACE_MAX_INSTRUCTIONS];
+  // Whether it keeps its register for the whole trace.
+  bool pinned[TRACE_MAX_INSTRUCTIONS];
+  uint16_t free_registers;
+  Label exit_label;
+  Label header_exit;
+} TraceCompiler;
+
+static void use(TraceCompiler *compiler, int ref, int at)
+{
+  if (ref >= 0 && compiler->last_uses[ref] < at)
+  {
+    compiler->last_uses[ref] = at;
+  }
+}
+
+static bool is_live(TraceCompiler *compiler, int index)
+{
+  TraceOp op = compiler->recorder->instructions[index].op;
+  return op == TRACE_OP_GUARD || op == TRACE_OP_STORE_LOCAL || op == TRACE_OP_STORE_GLOBAL ||
+         compiler->last_uses[index] >= 0;
+}
+
+// Goes backwards so values only used by dead instructions are dead too.
+static void find_last_uses(TraceCompiler *compiler)
+{
+  Recorder *recorder = compiler->recorder;
+
+  for (int i = 0; i < recorder->count; i++)
+  {
+    compiler->last_uses[i] = -1;
+  }
+
+  for (int i = recorder->count - 1; i >= 0; i--)
+  {
+    if (!is_live(compiler, i))
+    {
+      continue;
+    }
+
+    TraceInstruction *instruction = &recorder->instructions[i];
+    use(compiler, instruction->a, i);
+    use(compiler, instruction->b, i);
+
+    if (instruction->snapshot >= 0)
+    {
+      Snapshot *snapshot = &recorder->snapshots[instruction->snapshot];
+
+      for (int j = 0; j < snapshot->count; j++)
+      {
+        use(compiler, recorder->snapshot_slots[snapshot->first + j], i);
+      }
+    }
+  }
+}
+
+// Returns a register nothing uses, without taking it.
+static int free_register(TraceCompiler *compiler)
+{
+  for (int xmm = 0; xmm < XMM_COUNT; xmm++)
+  {
+    if (compiler->free_registers & (1 << xmm))
+    {
+      return xmm;
+    }
+  }
+
+  return -1;
+}
+
+static int allocate_register(TraceCompiler *compiler, int ref)
+{
+  int xmm = free_register(compiler);
+
+  if (xmm >= 0)
+  {
+    compiler->free_registers &= (uint16_t) ~(1 << xmm);
+    compiler->registers[ref] = xmm;
+  }
+
+  return xmm;
+}
+
+static void release(TraceCompiler *compiler, int ref, int at)
+{
+  if (ref < 0 || compiler->pinned[ref] || compiler->last_uses[ref] != at ||
+      compiler->registers[ref] < 0)
+  {
+    return;
+  }
+
+  compiler->free_registers |= (uint16_t)(1 << compiler->registers[ref]);
+  compiler->registers[ref] = -1;
+}
+
+static void emit_stack_top(TraceCompiler *compiler, int depth)
+{
+  Assembler *assembler = &compiler->assembler;
+
+  // lea rcx, [slots + depth]
+  emit_rex(assembler, true, RCX, SLOTS_REGISTER);
+  emit_byte(assembler, 0x8d);
+  emit_memory_operand(assembler, RCX, SLOTS_REGISTER, LOCAL(depth));
+  emit_store(assembler, VM_REGISTER, VM_FIELD(stack_top), RCX);
+}
+
+static void emit_resume(TraceCompiler *compiler, size_t offset)
+{
+  Assembler *assembler = &compiler->assembler;
+
+  emit_move_immediate(assembler, RAX, (uint64_t)(uintptr_t)&compiler->recorder->vm->chunk->code[offset]);
+  emit_jump(assembler, CONDITION_ALWAYS, compiler->exit_label);
+}
+
+// Stores the value of [ref] to [base + displacement].
+static void emit_store_value(TraceCompiler *compiler, Register base, int32_t displacement, int ref)
+{
+  Assembler *assembler = &compiler->assembler;
+  TraceInstruction *instruction = &compiler->recorder->instructions[ref];
+
+  if (instruction->is_number)
+  {
+    emit_sse_memory(assembler, SSE_STORE, compiler->registers[ref], base, displacement);
+  }
+  else
+  {
+    emit_move_immediate(assembler, RAX, instruction->value);
+    emit_store(assembler, base, displacement, RAX);
+  }
+}
+
+// Emits the exit of a guard to the cold section.
+static Label emit_snapshot_exit(TraceCompiler *compiler, int index)
+{
+  Assembler *assembler = &compiler->assembler;
+  Recorder *recorder = compiler->recorder;
+  Snapshot *snapshot = &recorder->snapshots[index];
+  int depth = recorder->trace->depth;
+  Label exit = cold_label(assembler);
+
+  assembler->section = SECTION_COLD;
+
+  for (int i = 0; i < snapshot->count; i++)
+  {
+    emit_store_value(compiler, SLOTS_REGISTER, LOCAL(depth + i),
+                     recorder->snapshot_slots[snapshot->first + i]);
+  }
+
+  emit_stack_top(compiler, depth + snapshot->count);
+  emit_resume(compiler, snapshot->offset);
+  assembler->section = SECTION_HOT;
+
+  return exit;
+}
+
+static void emit_guard(TraceCompiler *compiler, TraceInstruction *guard)
+{
+  Assembler *assembler = &compiler->assembler;
+  Label exit = emit_snapshot_exit(compiler, guard->snapshot);
+
+  emit_sse(assembler, SSE_COMPARE, compiler->registers[guard->a], compiler->registers[guard->b]);
+
+  // Jumps out when the condition does not hold. Unordered sets every
+  // flag, so only equality needs the parity flag to tell it apart.
+  switch (guard->condition)
+  {
+  case CONDITION_ABOVE:
+    emit_jump(assembler, CONDITION_BELOW_EQUAL, exit);
+    break;
+  case CONDITION_BELOW_EQUAL:
+    emit_jump(assembler, CONDITION_ABOVE, exit);
+    break;
+  case CONDITION_EQUAL:
+    emit_jump(assembler, CONDITION_NOT_EQUAL, exit);
+    emit_jump(assembler, CONDITION_PARITY, exit);
+    break;
+  default:
+    // jp over the je
+    emit_bytes(assembler, (const uint8_t[]){0x7a, 0x06}, 2);
+    emit_jump(assembler, CONDITION_EQUAL, exit);
+    break;
+  }
+}
+
+// Calls the C function of a number native and leaves the result in
+// rax. Every xmm register is caller saved, the ones in use are
+// spilled below the stack pointer, which is 16 byte aligned after the
+// pushes on entry, and the arguments are loaded from there.
+static void emit_native_call(TraceCompiler *compiler, TraceInstruction *call)
+{
+  Assembler *assembler = &compiler->assembler;
+  const ObjNative *native = AS_NATIVE(call->value);
+  int arguments[NUMBER_NATIVE_MAX_ARITY] = {call->a, call->b};
+
+  emit_add_immediate(assembler, RSP, -(int32_t)sizeof(double) * XMM_COUNT);
+
+  for (int xmm = 0; xmm < XMM_COUNT; xmm++)
+  {
+    if (!(compiler->free_registers & (1 << xmm)))
+    {
+      emit_sse_memory(assembler, SSE_STORE, xmm, RSP, (int32_t)sizeof(double) * xmm);
+    }
+  }
+
+  for (int i = 0; i < native->arity; i++)
+  {
+    emit_sse_memory(assembler, SSE_LOAD, i, RSP,
+                    (int32_t)sizeof(double) * compiler->registers[arguments[i]]);
+  }
+
+  emit_call(assembler, (Function)native->function.numbers);
+  emit_from_xmm(assembler, RAX, 0);
+
+  for (int xmm = 0; xmm < XMM_COUNT; xmm++)
+  {
+    if (!(compiler->free_registers & (1 << xmm)))
+    {
+      emit_sse_memory(assembler, SSE_LOAD, xmm, RSP, (int32_t)sizeof(double) * xmm);
+    }
+  }
+
+  emit_add_immediate(assembler, RSP, (int32_t)sizeof(double) * XMM_COUNT);
+}
+
+// Checks that the variables the trace reads hold the type or the
+// constant they held when it was recorded, and loads the ones that
+// do not change into registers.
+//
+// The trace computes on doubles. A number variable that holds an
+// integer is converted and written back first, so the loads in the
+// loop only ever see doubles.
+static bool emit_preheader(TraceCompiler *compiler)
+{
+  Assembler *assembler = &compiler->assembler;
+  Recorder *recorder = compiler->recorder;
+
+  emit_move_immediate(assembler, RDX, QNAN);
+
+  for (int i = 0; i < recorder->variable_count; i++)
+  {
+    TracedVariable *variable = &recorder->variables[i];
+
+    if (!variable->is_loaded)
+    {
+      continue;
+    }
+
+    if (variable->is_global)
+    {
+      emit_load(assembler, RAX, GLOBALS_REGISTER, GLOBAL(variable->slot));
+    }
+    else
+    {
+      emit_load(assembler, RAX, SLOTS_REGISTER, LOCAL(variable->slot));
+    }
+
+    if (variable->is_number)
+    {
+      int scratch = free_register(compiler);
+
+      if (scratch < 0)
+      {
+        return false;
+      }
+
+      emit_integer_to_double(assembler, RAX, RCX, scratch);
+
+      if (variable->is_global)
+      {
+        emit_store(assembler, GLOBALS_REGISTER, GLOBAL(variable->slot), RAX);
+      }
+      else
+      {
+        emit_store(assembler, SLOTS_REGISTER, LOCAL(variable->slot), RAX);
+      }
+
+      emit_move(assembler, RCX, RAX);
+      emit_alu(assembler, ALU_AND, RCX, RDX);
+      emit_alu(assembler, ALU_CMP, RCX, RDX);
+      emit_jump(assembler, CONDITION_EQUAL, compiler->header_exit);
+    }
+    else
+    {
+      emit_move_immediate(assembler, RCX, variable->value);
+      emit_alu(assembler, ALU_CMP, RAX, RCX);
+      emit_jump(assembler, CONDITION_NOT_EQUAL, compiler->header_exit);
+    }
+
+    int load = variable->load;
+
+    if (load >= 0 && !variable->is_stored && compiler->last_uses[load] >= 0)
+    {
+      if (allocate_register(compiler, load) < 0)
+      {
+        return false;
+      }
+
+      compiler->pinned[load] = true;
+      emit_to_xmm(assembler, compiler->registers[load], RAX);
+    }
+  }
+
+  for (int i = 0; i < recorder->count; i++)
+  {
+    TraceInstruction *instruction = &recorder->instructions[i];
+
+    if (instruction->op != TRACE_OP_CONSTANT || !instruction->is_number ||
+        compiler->last_uses[i] < 0)
+    {
+      continue;
+    }
+
+    if (allocate_register(compiler, i) < 0)
+    {
+      return false;
+    }
+
+    compiler->pinned[i] = true;
+    emit_move_immediate(assembler, RAX, instruction->value);
+    emit_to_xmm(assembler, compiler->registers[i], RAX);
+  }
+
+  return true;
+}
+
+static bool compile_body(TraceCompiler *compiler)
+{
+  Assembler *assembler = &compiler->assembler;
+  Recorder *recorder = compiler->recorder;
+
+  for (int i = 0; i < recorder->count; i++)
+  {
+    TraceInstruction *instruction = &recorder->instructions[i];
+
+    if (!is_live(compiler, i) || compiler->pinned[i])
+    {
+      continue;
+    }
+
+    switch (instruction->op)
+    {
+    case TRACE_OP_CONSTANT:
+      break;
+    case TRACE_OP_LOAD_LOCAL:
+    case TRACE_OP_LOAD_GLOBAL:
+    {
+      // The variable is assigned in the loop and its type
+      // was checked before it, there is nothing to guard.
+      if (allocate_register(compiler, i) < 0)
+      {
+        return false;
+      }
+
+      bool is_global = instruction->op == TRACE_OP_LOAD_GLOBAL;
+      emit_sse_memory(assembler, SSE_LOAD, compiler->registers[i],
+                      is_global ? GLOBALS_REGISTER : SLOTS_REGISTER,
+                      is_global ? GLOBAL(instruction->slot) : LOCAL(instruction->slot));
+      break;
+    }
+    case TRACE_OP_ADD:
+    case TRACE_OP_SUBTRACT:
+    case TRACE_OP_MULTIPLY:
+    case TRACE_OP_DIVIDE:
+    case TRACE_OP_MIN:
+    case TRACE_OP_MAX:
+    {
+      static const uint8_t opcodes[] = {
+          [TRACE_OP_ADD] = 0x58,
+          [TRACE_OP_SUBTRACT] = 0x5c,
+          [TRACE_OP_MULTIPLY] = 0x59,
+          [TRACE_OP_DIVIDE] = 0x5e,
+          // minsd and maxsd are `a < b ? a : b` and `a > b ? a : b`.
+          [TRACE_OP_MIN] = 0x5d,
+          [TRACE_OP_MAX] = 0x5f,
+      };
+      int a = instruction->a;
+      int b = instruction->b;
+
+      // The result takes the register of the left
+      // operand if this is its last use.
+      if (!compiler->pinned[a] && compiler->last_uses[a] == i && a != b)
+      {
+        compiler->registers[i] = compiler->registers[a];
+        compiler->registers[a] = -1;
+      }
+      else
+      {
+        if (allocate_register(compiler, i) < 0)
+        {
+          return false;
+        }
+
+        emit_sse(assembler, SSE_MOVE, compiler->registers[i], compiler->registers[a]);
+      }
+
+      // addsd, subsd, mulsd, divsd, minsd or maxsd
+      emit_sse(assembler, 0xf2, opcodes[instruction->op], compiler->registers[i], compiler->registers[b]);
+      release(compiler, a, i);
+      release(compiler, b, i);
+      break;
+    }
+    case TRACE_OP_NEGATE:
+    case TRACE_OP_ABS:
+    {
+      if (allocate_register(compiler, i) < 0)
+      {
+        return false;
+      }
+
+      emit_from_xmm(assembler, RAX, compiler->registers[instruction->a]);
+      // btc rax, 63 flips the sign bit and btr rax, 63 clears it.
+      uint8_t extension = instruction->op == TRACE_OP_NEGATE ? 0xf8 : 0xf0;
+      emit_bytes(assembler, (const uint8_t[]){0x48, 0x0f, 0xba, extension, 0x3f}, 5);
+      emit_to_xmm(assembler, compiler->registers[i], RAX);
+      release(compiler, instruction->a, i);
+      break;
+    }
+    case TRACE_OP_SQRT:
+      if (allocate_register(compiler, i) < 0)
+      {
+        return false;
+      }
+
+      // sqrtsd
+      emit_sse(assembler, 0xf2, 0x51, compiler->registers[i], compiler->registers[instruction->a]);
+      release(compiler, instruction->a, i);
+      break;
+    case TRACE_OP_CALL:
+      emit_native_call(compiler, instruction);
+      release(compiler, instruction->a, i);
+      release(compiler, instruction->b, i);
+
+      if (allocate_register(compiler, i) < 0)
+      {
+        return false;
+      }
+
+      emit_to_xmm(assembler, compiler->registers[i], RAX);
+      break;
+    case TRACE_OP_GUARD:
+    {
+      emit_guard(compiler, instruction);
+      release(compiler, instruction->a, i);
+      release(compiler, instruction->b, i);
+
+      Snapshot *snapshot = &recorder->snapshots[instruction->snapshot];
+
+      for (int j = 0; j < snapshot->count; j++)
+      {
+        release(compiler, recorder->snapshot_slots[snapshot->first + j], i);
+      }
+      break;
+    }
+    case TRACE_OP_STORE_LOCAL:
+      emit_store_value(compiler, SLOTS_REGISTER, LOCAL(instruction->slot), instruction->a);
+      release(compiler, instruction->a, i);
+      break;
+    case TRACE_OP_STORE_GLOBAL:
+      emit_store_value(compiler, GLOBALS_REGISTER, GLOBAL(instruction->slot), instruction->a);
+      release(compiler, instruction->a, i);
+      break;
+    }
+  }
+
+  return true;
+}
+
+static bool compile_trace(Recorder *recorder)
+{
+  Trace *trace = recorder->trace;
+  TraceCompiler *compiler = (TraceCompiler *)allocate(sizeof(TraceCompiler));
+  Assembler *assembler = &compiler->assembler;
+  compiler->recorder = recorder;
+  compiler->free_registers = (uint16_t)((1 << XMM_COUNT) - 1);
+  init_assembler(assembler);
+
+  for (int i = 0; i < recorder->count; i++)
+  {
+    compiler->registers[i] = -1;
+  }
+
+  find_last_uses(compiler);
+
+  // push r12, r13, r14, r15 and sub rsp, 8
+  //
+  // Four pushes and eight more bytes after the return
+  // address keep the stack 16 byte aligned for calls.
+  emit_bytes(assembler, (const uint8_t[]){0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57}, 8);
+  emit_bytes(assembler, (const uint8_t[]){0x48, 0x83, 0xec, 0x08}, 4);
+  emit_move(assembler, VM_REGISTER, RDI);
+  emit_move(assembler, SLOTS_REGISTER, RSI);
+  // The global variables can not move while the trace runs,
+  // it does not define any.
+  emit_load(assembler, GLOBALS_REGISTER, VM_REGISTER,
+            (int32_t)(offsetof(Vm, global_values) + offsetof(ValueArray, values)));
+  emit_move_immediate(assembler, ITERATIONS_REGISTER, 0);
+
+  // Every exit ends up here with the instruction to resume at in rax.
+  compiler->exit_label = cold_label(assembler);
+  assembler->section = SECTION_COLD;
+  // add [vm + trace_stats.iterations], r13
+  emit_rex(assembler, true, ITERATIONS_REGISTER, VM_REGISTER);
+  emit_byte(assembler, 0x01);
+  emit_memory_operand(assembler, ITERATIONS_REGISTER, VM_REGISTER, VM_FIELD(trace_stats.iterations));
+  // add rsp, 8, pop r15, r14, r13, r12 and ret
+  emit_bytes(assembler, (const uint8_t[]){0x48, 0x83, 0xc4, 0x08}, 4);
+  emit_bytes(assembler, (const uint8_t[]){0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0xc3}, 9);
+
+  // Leaves at the header with the stack it had on entry,
+  // when the checks before the loop fail or the garbage
+  // collector needs to run.
+  compiler->header_exit = cold_label(assembler);
+  assembler->section = SECTION_COLD;
+  emit_stack_top(compiler, trace->depth);
+  emit_resume(compiler, trace->header);
+  assembler->section = SECTION_HOT;
+
+  bool compiled = emit_preheader(compiler);
+  Label loop = here(assembler);
+
+  compiled = compiled && compile_body(compiler);
+
+  // Every iteration gives the collection in progress a chance to
+  // advance, which the interpreter does at the header.
+  emit_add_immediate(assembler, ITERATIONS_REGISTER, 1);
+  // cmp dword [vm + gc_state], GC_IDLE
+  emit_rex(assembler, false, 0, VM_REGISTER);
+  emit_byte(assembler, 0x83);
+  emit_memory_operand(assembler, 7, VM_REGISTER, VM_FIELD(gc_state));
+  emit_byte(assembler, GC_IDLE);
+  emit_jump(assembler, CONDITION_NOT_EQUAL, compiler->header_exit);
+  emit_jump(assembler, CONDITION_ALWAYS, loop);
+
+  uint8_t *code = compiled ? link_code(assembler) : NULL;
+
+  if (code != NULL)
+  {
+    trace->code = code;
+    trace->size = code_size(assembler);
+  }
+
+  free_assembler(assembler);
+  free(compiler);
+  return code != NULL;
+}
+
+// Running traces
+
+typedef const uint8_t *(*TraceFunction)(Vm *vm, Value *slots);
+
+static void blacklist(Vm *vm, Trace *trace)
+{
+  if (trace->code != NULL)
+  {
+    free_code(trace->code, trace->size);
+    trace->code = NULL;
+  }
+
+  trace->state = TRACE_BLACKLISTED;
+  vm->trace_stats.blacklisted += 1;
+}
+
+static void run_trace(Vm *vm, Trace *trace, Value *slots)
+{
+  // ISO C has no conversion from a data pointer to a function pointer,
+  // POSIX guarantees copying the representation works.
+  TraceFunction function;
+  memcpy(&function, &trace->code, sizeof(function));
+
+  vm->ip = (uint8_t *)function(vm, slots);
+  vm->trace_stats.entries += 1;
+  trace->counter += 1;
+
+  // Leaving anywhere but after the loop is a side exit.
+  size_t offset = (size_t)(vm->ip - vm->chunk->code);
+
+  if (offset >= trace->start && offset < trace->loop_end)
+  {
+    vm->trace_stats.side_exits += 1;
+    trace->side_exits += 1;
+  }
+
+  if (trace->counter == TRACE_TRIAL && trace->side_exits * 2 > trace->counter)
+  {
+    blacklist(vm, trace);
+  }
+}
+
+static void record_trace(Vm *vm, Trace *trace, Value *slots)
+{
+  Recorder *recorder = (Recorder *)allocate(sizeof(Recorder));
+  recorder->vm = vm;
+  recorder->trace = trace;
+  recorder->slots = slots;
+  recorder->visited = (uint8_t *)allocate(vm->chunk->count);
+
+  if (record(recorder) && compile_trace(recorder))
+  {
+    trace->state = TRACE_COMPILED;
+    trace->counter = 0;
+    vm->trace_stats.recorded += 1;
+  }
+  else
+  {
+    vm->trace_stats.aborted += 1;
+    trace->aborts += 1;
+    trace->counter = 0;
+
+    if (trace->aborts == TRACE_MAX_ABORTS)
+    {
+      blacklist(vm, trace);
+    }
+  }
+
+  free(recorder->visited);
+  free(recorder);
+}
+
+Trace *find_trace(Chunk *chunk, size_t header, size_t loop_end)
+{
+  for (Trace *trace = chunk->traces; trace != NULL; trace = trace->next)
+  {
+    if (trace->header == header)
+    {
+      return trace;
+    }
+  }
+
+  // Traces live outside of the heap the garbage
+  // collector manages, like the code of the JIT.
+  Trace *trace = (Trace *)allocate(sizeof(Trace));
+  trace->header = header;
+  trace->start = header;
+  trace->loop_end = loop_end;
+  trace->state = TRACE_COUNTING;
+  trace->next = chunk->traces;
+  chunk->traces = trace;
+  return trace;
+}
+
+bool trace_loop(Vm *vm, const uint8_t *loop_end)
+{
+  Chunk *chunk = vm->chunk;
+  Trace *trace = find_trace(chunk, (size_t)(vm->ip - chunk->code), (size_t)(loop_end - chunk->code));
+  // Traces address locals from the frame's window, the same loop
+  // can run in frames that start anywhere on the stack.
+  Value *slots = vm->frames[vm->frame_count - 1].slots;
+
+  switch (trace->state)
+  {
+  case TRACE_COUNTING:
+    if (++trace->counter < TRACE_THRESHOLD)
+    {
+      return false;
+    }
+
+    record_trace(vm, trace, slots);
+
+    // The iteration the recorder ran ended at an OP_LOOP.
+    if (vm->ip == chunk->code + trace->header && vm->gc_state != GC_IDLE)
+    {
+      gc_safepoint(vm);
+    }
+
+    return true;
+  case TRACE_COMPILED:
+    // The same loop always starts with the same locals in its frame.
+    if (vm->stack_top - slots != trace->depth)
+    {
+      return false;
+    }
+
+    run_trace(vm, trace, slots);
+    return true;
+  default:
+    return false;
+  }
+}
+
+void free_traces(Trace *trace)
+{
+  while (trace != NULL)
+  {
+    Trace *next = trace->next;
+
+    if (trace->code != NULL)
+    {
+      free_code(trace->code, trace->size);
+    }
+
+    free(trace);
+    trace = next;
+  }
+}
+
+#else
+
+void free_traces(Trace *trace)
+{
+  (void)trace;
+}
+
+#endif
+
+void print_trace_stats(const TraceStats *stats)
+{
+  printf("== traces ==\n");
+  printf("recorded %llu aborted %llu blacklisted %llu\n",
+         (unsigned long long)stats->recorded, (unsigned long long)stats->aborted,
+         (unsigned long long)stats->blacklisted);
+  printf("entries %llu side exits %llu (%.1f%%) iterations %llu\n",
+         (unsigned long long)stats->entries, (unsigned long long)stats->side_exits,
+         stats->entries == 0 ? 0.0 : 100.0 * (double)stats->side_exits / (double)stats->entries,
+         (unsigned long long)stats->iterations);
+}
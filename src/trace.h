@@ -0,0 +1,94 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "common.h"
+#include "chunk.h"
+#include "vm.h"
+#include "jit.h"
+
+// Traces share the assembler of the baseline JIT.
+#if defined(TRACING_JIT) && defined(USE_JIT)
+#define USE_TRACING
+#endif
+
+// Number of times a loop jumps back to its header
+// before the vm records a trace of its body.
+#ifdef DEBUG_STRESS_JIT
+#define TRACE_THRESHOLD 1
+#else
+#define TRACE_THRESHOLD 50
+#endif
+
+// A loop whose recording is aborted this many times is left
+// to the interpreter and the baseline JIT.
+#define TRACE_MAX_ABORTS 4
+
+// A trace is dropped if more than half of its first TRACE_TRIAL
+// entries leave it through a side exit, it is not the path the loop
+// usually takes.
+#define TRACE_TRIAL 64
+
+typedef enum
+{
+  TRACE_COUNTING,
+  TRACE_COMPILED,
+  // Recording failed too often or the trace kept exiting early.
+  TRACE_BLACKLISTED,
+} TraceState;
+
+// The tracing JIT compiles the path a hot loop actually takes instead
+// of the whole chunk.
+//
+// Once a loop has jumped back to its header TRACE_THRESHOLD times, the
+// vm runs one iteration through a recorder that executes the same
+// instructions [run] would and writes down what they did on the types
+// it saw: numbers become unboxed doubles, branches become guards that
+// the comparison goes the same way and loads of variables the loop
+// never assigns are hoisted out of it. The recording is compiled to a
+// loop of machine code that keeps running until a guard fails, then
+// writes the values the interpreter expects back to the stack and
+// returns the instruction to carry on from.
+//
+// Only numbers, nil, booleans and natives that take numbers are traced,
+// calls to those natives call their C function with the unboxed
+// arguments, or are a single instruction for sqrt, abs, min and max.
+// Strings, printing, other calls and everything that can
+// call into the garbage collector abort the recording before the
+// instruction runs.
+//
+// Locals are addressed from the stack window of the frame the loop
+// runs in, so the loops of functions are traced like the script's.
+struct Trace
+{
+  // Offset of the first instruction of the loop body
+  // and of the instruction after its OP_LOOP.
+  size_t header;
+  size_t loop_end;
+  // Lowest offset the trace goes through, a `for` loop jumps back
+  // to its condition before its body. Leaving the trace anywhere
+  // between [start] and [loop_end] is a side exit.
+  size_t start;
+  TraceState state;
+  // Back jumps while counting, entries once compiled.
+  int counter;
+  int aborts;
+  int side_exits;
+  // Number of values in the frame's window at the header.
+  int depth;
+  uint8_t *code;
+  size_t size;
+  struct Trace *next;
+};
+
+// Called when the loop ending at [loop_end] jumps back to [vm->ip].
+// Counts the jump, records the loop once it is hot and runs its trace
+// once it is compiled. Returns true if [vm->ip] and the stack have
+// moved on, false if the loop is not traced yet or will never be.
+bool trace_loop(Vm *vm, const uint8_t *loop_end);
+// Returns the trace of the loop starting at [header] in [chunk],
+// adding one that is still counting if the loop has none.
+Trace *find_trace(Chunk *chunk, size_t header, size_t loop_end);
+void free_traces(Trace *trace);
+void print_trace_stats(const TraceStats *stats);
+
+#endif
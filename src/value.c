@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -48,6 +49,29 @@ static void print_function(ObjFunction *function)
   printf("<fn %s>", function->name->chars);
 }
 
+static void print_rope(ObjRope *rope)
+{
+  if (rope->flat != NULL)
+  {
+    printf("%s", rope->flat->chars);
+    return;
+  }
+
+  // Printing a value cannot start a collection,
+  // so the rope is not flattened here.
+  char *chars = (char *)malloc(rope->length + 1);
+
+  if (chars == NULL)
+  {
+    exit(1);
+  }
+
+  write_rope_chars(rope, chars);
+  chars[rope->length] = '\0';
+  printf("%s", chars);
+  free(chars);
+}
+
 void print_object(Value obj)
 {
   switch (OBJ_TYPE(obj))
@@ -57,32 +81,100 @@ void print_object(Value obj)
     break;
   case OBJ_FUNCTION:
     print_function(AS_FUNCTION(obj));
+    break;
+  case OBJ_ROPE:
+    print_rope(AS_ROPE(obj));
+    break;
+  case OBJ_CLOSURE:
+    print_function(AS_CLOSURE(obj)->function);
+    break;
+  case OBJ_UPVALUE:
+    printf("upvalue");
+    break;
+  case OBJ_NATIVE:
+    printf("<native fn>");
+    break;
   }
 }
 
+bool value_not(const Value value)
+{
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+bool is_truthy(const Value value)
+{
+  if (IS_NIL(value))
+  {
+    return false;
+  }
+
+  if (IS_BOOL(value))
+  {
+    return AS_BOOL(value);
+  }
+
+  if (IS_NUMBER(value))
+  {
+    return AS_NUMBER(value) != 0;
+  }
+
+  if (IS_STRING(value))
+  {
+    return AS_OBJSTRING(value)->length > 0;
+  }
+
+  return true;
+}
+
 void print_value(const Value value)
 {
-  switch (value.type)
+  if (IS_BOOL(value))
   {
-  case VAL_BOOL:
     printf(AS_BOOL(value) ? "true" : "false");
-    break;
-  case VAL_NIL:
+  }
+  else if (IS_NIL(value))
+  {
     printf("nil");
-    break;
-  case VAL_NUMBER:
+  }
+  else if (IS_NUMBER(value))
+  {
     printf("%g", AS_NUMBER(value));
-    break;
-  case VAL_OBJ:
+  }
+  else if (IS_OBJ(value))
+  {
     print_object(value);
-    break;
-  default:
-    break;
   }
 }
 
 bool values_equal(const Value a, const Value b)
 {
+#ifdef NAN_BOXING
+  // Numbers are compared as doubles because NaN is not equal to itself,
+  // 0 is equal to -0 even though their bits are different, and an
+  // integer is equal to the double with the same value.
+  if (IS_NUMBER(a) && IS_NUMBER(b))
+  {
+    return AS_NUMBER(a) == AS_NUMBER(b);
+  }
+
+#ifdef LAZY_STRING_INTERNING
+  if (IS_STRING(a) && IS_STRING(b))
+  {
+    return strings_equal(AS_OBJSTRING(a), AS_OBJSTRING(b));
+  }
+#endif
+
+  // Every other value is equal only to itself.
+  // Strings are interned, so two strings with the same contents
+  // are always the same Obj*.
+  return a == b;
+#else
+  if (IS_NUMBER(a) && IS_NUMBER(b))
+  {
+    return AS_NUMBER(a) == AS_NUMBER(b);
+  }
+
   if (a.type != b.type)
   {
     return false;
@@ -93,9 +185,12 @@ bool values_equal(const Value a, const Value b)
   case VAL_BOOL:
     return AS_BOOL(a) == AS_BOOL(b);
   case VAL_NIL:
+  case VAL_UNDEFINED:
     return true;
   case VAL_NUMBER:
-    return AS_NUMBER(a) == AS_NUMBER(b);
+  case VAL_INTEGER:
+    // Numbers are compared above.
+    break;
   case VAL_OBJ:
   {
     if (OBJ_TYPE(a) != OBJ_TYPE(b))
@@ -107,14 +202,18 @@ bool values_equal(const Value a, const Value b)
       OBJ_TYPE(a)
       {
       case OBJ_STRING:
-        // We can just compare pointers here
-        // because every string is interned,
-        // we only have one ObjString* for each
-        // possible string.
-        //
-        // This means string comparison is O(1).
+        // Interned strings are compared by their pointers,
+        // we only have one interned ObjString* for each
+        // possible string, so the comparison is O(1).
+        return strings_equal(AS_OBJSTRING(a), AS_OBJSTRING(b));
+      default:
+        // Every other object is only equal to itself,
+        // like the NaN boxed values compare their bits.
         return AS_OBJ(a) == AS_OBJ(b);
       }
   }
   }
-}
\ No newline at end of file
+
+  return false;
+#endif
+}
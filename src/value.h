@@ -3,19 +3,117 @@
 
 #include "common.h"
 
+typedef struct Obj Obj;
+typedef struct ObjString ObjString;
+typedef struct ObjFunction ObjFunction;
+
+#ifdef NAN_BOXING
+
+#include <string.h>
+
+// A double has 52 mantissa bits, 11 exponent bits and a sign bit.
+// A double is NaN when every exponent bit is set, and a quiet NaN
+// also has the highest mantissa bit set. The arithmetic instructions
+// only ever produce one quiet NaN bit pattern, which leaves the other
+// 51 bits of every other quiet NaN unused.
+//
+// We use those bits to store every value that is not a double:
+//
+// double: any double that is not a quiet NaN with the bits in [QNAN] set
+// nil, true and false: [QNAN] with a small tag in the lowest bits
+// integer: [QNAN] with [INTEGER_BIT] set and the int32_t in the lowest 32 bits
+// Obj*: [QNAN] with the sign bit set and the pointer in the lowest 48 bits
+//
+// ┌─┬───────────┬──┬───────────────────────────────────────────────────┐
+// │S│ exponent  │QI│ payload                                           │
+// └─┴───────────┴──┴───────────────────────────────────────────────────┘
+//
+// Every Value is 8 bytes instead of the 16 bytes the tagged union needs,
+// which halves the size of the vm stack, constant arrays and hash table entries.
+typedef uint64_t Value;
+
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+#define TAG_UNDEFINED 4
+
+// The lowest bit [QNAN] leaves free. An integer is the only value
+// whose upper 32 bits are those of [QNAN | INTEGER_BIT], and no
+// pointer reaches it, so a value with [QNAN] set is only a number
+// when it is set too.
+#define INTEGER_BIT ((uint64_t)0x0001000000000000)
+#define INTEGER_HIGH_BITS ((uint32_t)((QNAN | INTEGER_BIT) >> 32))
+
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_INTEGER(value) ((uint32_t)((value) >> 32) == INTEGER_HIGH_BITS)
+#define IS_NUMBER(value) (((value) & (QNAN | INTEGER_BIT)) != QNAN)
+#define IS_DOUBLE(value) (((value) & QNAN) != QNAN)
+#define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_INTEGER(value) ((int32_t)(uint32_t)(value))
+#define AS_NUMBER(value) value_to_number(value)
+#define AS_DOUBLE(value) value_to_double(value)
+#define AS_OBJ(value) ((Obj *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define INTEGER_VAL(integer) ((Value)(QNAN | INTEGER_BIT | (uint32_t)(int32_t)(integer)))
+#define NUMBER_VAL(number) number_to_value(number)
+#define OBJ_VAL(obj) (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+
+// memcpy is the well defined way of reinterpreting the bits
+// of a double as an integer and vice versa, compilers turn it into a move.
+static inline double value_to_double(Value value)
+{
+  double number;
+  memcpy(&number, &value, sizeof(Value));
+  return number;
+}
+
+// Integers are converted, the other numbers are the bits of a double.
+static inline double value_to_number(Value value)
+{
+  if (IS_INTEGER(value))
+  {
+    return AS_INTEGER(value);
+  }
+
+  return value_to_double(value);
+}
+
+static inline Value number_to_value(double number)
+{
+  Value value;
+  memcpy(&value, &number, sizeof(double));
+  return value;
+}
+
+#else
+
 typedef enum
 {
   VAL_BOOL,
   VAL_NIL,
   VAL_NUMBER,
+  // A number that fits in an int32_t, see [add_numbers].
+  VAL_INTEGER,
   // Values that live on the heap have
   // a ValueType of VAL_OBJ.
   VAL_OBJ,
+  // Marks global variable slots that have not been defined yet.
+  // Never visible to the user's program.
+  VAL_UNDEFINED,
 } ValueType;
 
-typedef struct Obj Obj;
-typedef struct ObjString ObjString;
-
 // Small, fixed-size types will
 // be stored directly inside the Value struct itself.
 //
@@ -63,6 +161,7 @@ typedef struct
   {
     bool boolean;
     double number;
+    int32_t integer;
     // Values that live on the heap are represented by Obj.
     Obj *obj;
   } as;
@@ -70,17 +169,144 @@ typedef struct
 
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
-#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#define IS_INTEGER(value) ((value).type == VAL_INTEGER)
+#define IS_NUMBER(value) ((value).type == VAL_NUMBER || IS_INTEGER(value))
+#define IS_DOUBLE(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 #define AS_BOOL(value) ((value).as.boolean)
-#define AS_NUMBER(value) ((value).as.number)
+#define AS_INTEGER(value) ((value).as.integer)
+#define AS_NUMBER(value) value_to_number(value)
+#define AS_DOUBLE(value) ((value).as.number)
 #define AS_OBJ(value) ((value).as.obj)
 
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
+#define UNDEFINED_VAL ((Value){VAL_UNDEFINED, {.number = 0}})
+#define INTEGER_VAL(value) ((Value){VAL_INTEGER, {.integer = value}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
-#define OBJ_VAL(value) ((Value){VAL_OBJ, {.obj = value}})
+#define OBJ_VAL(value) ((Value){VAL_OBJ, {.obj = (Obj *)(value)}})
+
+static inline double value_to_number(Value value)
+{
+  return IS_INTEGER(value) ? value.as.integer : value.as.number;
+}
+
+#endif
+
+// Integers
+//
+// Whole numbers that fit in an int32_t are integers, the compiler makes
+// one of every literal without a fraction that fits. They are numbers
+// like doubles are, IS_NUMBER is true and AS_NUMBER is their value as a
+// double, so code that only needs the value does not tell them apart.
+//
+// Arithmetic on two integers is done on integers. A result that is
+// not an integer is computed on doubles instead: one that overflows,
+// any division and -0. Every int32_t is exact as a double, so it is
+// the double the operation would have given on doubles and no
+// program can tell whether a number is an integer.
+//
+// Not every instruction checks for integers. The generic ones of the
+// stack machine check for two doubles first and only come here for
+// other numbers, and quickening gives the ones that run on integers,
+// like loop counters, _INTEGER variants. The register machine has no
+// quickening, it computes on doubles and its constants are doubles.
+
+// The hints keep the path of the kind of number an instruction
+// expects in line with it and the conversions out of it.
+#ifdef __GNUC__
+#define LIKELY(condition) __builtin_expect((condition), 1)
+#else
+#define LIKELY(condition) (condition)
+#endif
+#define BOTH_INTEGERS(a, b) LIKELY(IS_INTEGER(a) && IS_INTEGER(b))
+#define BOTH_DOUBLES(a, b) LIKELY(IS_DOUBLE(a) && IS_DOUBLE(b))
+
+// Whether `a op b` fits in an int32_t, which is then stored in [result].
+#ifdef __GNUC__
+#define ADD_FITS(a, b, result) (!__builtin_add_overflow((a), (b), (result)))
+#define SUBTRACT_FITS(a, b, result) (!__builtin_sub_overflow((a), (b), (result)))
+#define MULTIPLY_FITS(a, b, result) (!__builtin_mul_overflow((a), (b), (result)))
+#else
+// The product of two int32_t fits in an int64_t, so does every sum.
+static inline bool integer_fits(int64_t value, int32_t *result)
+{
+  if (value < INT32_MIN || value > INT32_MAX)
+  {
+    return false;
+  }
+
+  *result = (int32_t)value;
+  return true;
+}
+
+#define ADD_FITS(a, b, result) integer_fits((int64_t)(a) + (b), (result))
+#define SUBTRACT_FITS(a, b, result) integer_fits((int64_t)(a) - (b), (result))
+#define MULTIPLY_FITS(a, b, result) integer_fits((int64_t)(a) * (b), (result))
+#endif
+
+static inline Value add_numbers(Value a, Value b)
+{
+  int32_t result;
+
+  if (BOTH_INTEGERS(a, b) && ADD_FITS(AS_INTEGER(a), AS_INTEGER(b), &result))
+  {
+    return INTEGER_VAL(result);
+  }
+
+  return NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+}
+
+static inline Value subtract_numbers(Value a, Value b)
+{
+  int32_t result;
+
+  if (BOTH_INTEGERS(a, b) && SUBTRACT_FITS(AS_INTEGER(a), AS_INTEGER(b), &result))
+  {
+    return INTEGER_VAL(result);
+  }
+
+  return NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b));
+}
+
+static inline Value multiply_numbers(Value a, Value b)
+{
+  int32_t result;
+
+  // `0 * -1` is -0 on doubles.
+  if (BOTH_INTEGERS(a, b) && MULTIPLY_FITS(AS_INTEGER(a), AS_INTEGER(b), &result) &&
+      (result != 0 || (AS_INTEGER(a) | AS_INTEGER(b)) >= 0))
+  {
+    return INTEGER_VAL(result);
+  }
+
+  return NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b));
+}
+
+static inline Value divide_numbers(Value a, Value b)
+{
+  return NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b));
+}
+
+static inline Value negate_number(Value value)
+{
+  int32_t result;
+
+  // `-0` is -0 on doubles.
+  if (IS_INTEGER(value) && AS_INTEGER(value) != 0 && SUBTRACT_FITS(0, AS_INTEGER(value), &result))
+  {
+    return INTEGER_VAL(result);
+  }
+
+  return NUMBER_VAL(-AS_NUMBER(value));
+}
+
+// `a op b` for a comparison op on two numbers.
+#define COMPARE_NUMBERS(a, op, b) \
+  (BOTH_INTEGERS(a, b) ? AS_INTEGER(a) op AS_INTEGER(b) : AS_NUMBER(a) op AS_NUMBER(b))
+
 typedef struct
 {
   size_t capacity;
@@ -94,5 +320,13 @@ void free_value_array(ValueArray *array);
 bool is_value_array_full(ValueArray *array);
 void print_value(Value value);
 bool values_equal(const Value a, const Value b);
+// The result of `!value`.
+//
+// [value_not] and [is_truthy] are not opposites,
+// `!` only treats nil and false as false while conditions
+// also treat 0 and empty strings as false.
+bool value_not(const Value value);
+// Whether [value] makes a condition true.
+bool is_truthy(const Value value);
 
 #endif
\ No newline at end of file
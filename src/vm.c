@@ -1,3 +1,4 @@
+#include <math.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
@@ -7,403 +8,2325 @@
 #include "obj.h"
 #include "memory.h"
 #include "debug.h"
+#include "jit.h"
+#include "trace.h"
+#include "natives.h"
 
-Vm new_vm()
-{
-  Vm vm;
-  init_vm(&vm);
-  return vm;
-}
+// Computed gotos (labels as values) are a GNU extension
+// supported by gcc and clang.
+//
+// We fall back to switch dispatch when tracing or profiling execution
+// because the trace is printed at the top of the dispatch loop,
+// which threaded dispatch skips.
+#if defined(DIRECT_THREADED_DISPATCH) && defined(__GNUC__) && \
+    !defined(DEBUG_TRACE_EXECUTION) && !defined(DEBUG_PROFILE_OPCODES)
+#define USE_COMPUTED_GOTO
+#endif
 
 static void reset_stack(Vm *vm)
 {
   vm->stack_top = vm->stack;
+  vm->frame_count = 0;
+  vm->open_upvalues = NULL;
 }
 
 void init_vm(Vm *vm)
 {
   reset_stack(vm);
+  vm->chunk = NULL;
+  vm->ip = NULL;
   vm->objects = NULL;
+  init_nursery(&vm->nursery);
+  vm->remembered_count = 0;
+  vm->remembered_capacity = 0;
+  vm->remembered = NULL;
+  vm->remembered_global_count = 0;
+  vm->remembered_global_capacity = 0;
+  vm->remembered_globals = NULL;
+  vm->bytes_allocated = 0;
+  vm->next_gc = 1024 * 1024;
+  vm->gray_count = 0;
+  vm->gray_capacity = 0;
+  vm->gray_stack = NULL;
+  vm->gc_state = GC_IDLE;
+#ifdef INCREMENTAL_GC
+  vm->gc_incremental = true;
+#else
+  vm->gc_incremental = false;
+#endif
+  vm->gc_slice_budget = GC_SLICE_BUDGET;
+  vm->sweep_list = NULL;
+  vm->gc_pause_depth = 0;
+  vm->gc_pause_start = 0;
+  memset(&vm->gc_pauses, 0, sizeof(vm->gc_pauses));
+  memset(&vm->trace_stats, 0, sizeof(vm->trace_stats));
+  vm->optimize = false;
+  vm->register_machine = false;
+#ifdef BASELINE_JIT
+  vm->jit_enabled = true;
+#else
+  vm->jit_enabled = false;
+#endif
+  register_vm_for_gc(vm);
   vm->strings = new_hash_table();
   vm->globals = new_hash_table();
+  init_value_array(&vm->global_values);
+  init_value_array(&vm->global_names);
+
+  for (int i = 0; i < INTRINSIC_COUNT; i++)
+  {
+    vm->intrinsics[i] = NIL_VAL;
+  }
+
+  define_natives(vm);
+  // Traces call number natives by their address,
+  // so they are promoted before any trace is recorded.
+  collect_young_garbage(vm);
+
+  for (int i = 0; i < INTRINSIC_COUNT; i++)
+  {
+    const char *name = intrinsics[i].name;
+    int slot = resolve_global(vm, copy_string(vm, name, (int)strlen(name)));
+    vm->intrinsics[i] = vm->global_values.values[slot];
+  }
+}
+
+void free_vm(Vm *vm)
+{
+#ifdef DEBUG_PRINT_GC_PAUSES
+  print_gc_pauses(&vm->gc_pauses);
+#endif
+
+#ifdef DEBUG_PROFILE_OPCODES
+  print_opcode_profile();
+#endif
+
+#ifdef DEBUG_PRINT_TRACE_STATS
+  print_trace_stats(&vm->trace_stats);
+#endif
+
+  free_hash_table(&vm->strings);
+  free_hash_table(&vm->globals);
+  free_value_array(&vm->global_values);
+  free_value_array(&vm->global_names);
+  free_objects(vm);
+  register_vm_for_gc(NULL);
+}
+
+static Value peek(Vm *vm, size_t distance)
+{
+  return vm->stack_top[-1 - distance];
+}
+
+// The line of the instruction before the ip saved in [frame].
+static size_t frame_line(const CallFrame *frame)
+{
+  const Chunk *chunk = &frame->function->chunk;
+
+  if (chunk->registers.count > 0)
+  {
+    return chunk->registers.lines[frame->register_ip - chunk->registers.code - 1];
+  }
+
+  return chunk->lines[frame->ip - chunk->code - 1];
+}
+
+// [line] is where the frame that is running failed,
+// the frames below it are at the calls they made.
+static void report_runtime_error(Vm *vm, size_t line, const char *format, va_list args)
+{
+  vfprintf(stderr, format, args);
+  fputs("\n", stderr);
+
+  for (int i = vm->frame_count - 1; i >= 0; i--)
+  {
+    const CallFrame *frame = &vm->frames[i];
+
+    if (i < vm->frame_count - 1)
+    {
+      line = frame_line(frame);
+    }
+
+    if (frame->function->name == NULL)
+    {
+      fprintf(stderr, "[line %zu] in script\n", line);
+    }
+    else
+    {
+      fprintf(stderr, "[line %zu] in %s()\n", line, frame->function->name->chars);
+    }
+  }
+
+  reset_stack(vm);
+}
+
+static void runtime_error(Vm *vm, const char *format, ...)
+{
+  // Register code has saved its ip in its frame.
+  size_t line = vm->chunk->registers.count > 0 ? frame_line(&vm->frames[vm->frame_count - 1])
+                                               : vm->chunk->lines[vm->ip - vm->chunk->code - 1];
+
+  va_list args;
+  va_start(args, format);
+  report_runtime_error(vm, line, format, args);
+  va_end(args);
+}
+
+// [ip] points after the register instruction that failed.
+static void register_runtime_error(Vm *vm, const uint32_t *ip, const char *format, ...)
+{
+  CallFrame *frame = &vm->frames[vm->frame_count - 1];
+  frame->register_ip = ip;
+
+  va_list args;
+  va_start(args, format);
+  report_runtime_error(vm, frame_line(frame), format, args);
+  va_end(args);
+}
+
+static int string_length(Value value)
+{
+  return IS_ROPE(value) ? AS_ROPE(value)->length : AS_OBJSTRING(value)->length;
+}
+
+// Replaces the rope [distance] slots from the top of the stack,
+// if there is one, with its flattened string.
+static void flatten_stack_slot(Vm *vm, int distance)
+{
+  Value value = peek(vm, distance);
+
+  if (IS_ROPE(value))
+  {
+    ObjString *string = flatten_rope(vm, AS_ROPE(value));
+    vm->stack_top[-1 - distance] = OBJ_VAL((Obj *)string);
+  }
+}
+
+static void concatenate_strings(Vm *vm)
+{
+  int length = string_length(peek(vm, 0)) + string_length(peek(vm, 1));
+
+  if (length >= MIN_ROPE_LENGTH)
+  {
+    ObjRope *rope = new_rope(vm, length);
+    // The rope is young, so storing into it needs no write barrier.
+    rope->right = AS_OBJ(pop(vm));
+    rope->left = AS_OBJ(pop(vm));
+    push(vm, OBJ_VAL((Obj *)rope));
+    return;
+  }
+
+  // Ropes are never shorter than [MIN_ROPE_LENGTH],
+  // so both operands are strings.
+
+  // [a] and [b] stay on the stack until the result has been
+  // allocated because allocating may start a collection,
+  // which may also move them, so they are read after allocating.
+  ObjString *result = allocate_string(vm, length);
+  ObjString *b = AS_OBJSTRING(peek(vm, 0));
+  ObjString *a = AS_OBJSTRING(peek(vm, 1));
+
+  // Copies every [a] character to [result]
+  // starting from the beginning of [result]
+  memcpy(result->chars, a->chars, a->length);
+  // Copies every [b] character to [result]
+  // starting from the position after the last
+  // [a] character that was just copied.
+  memcpy(result->chars + a->length, b->chars, b->length);
+
+  result = take_string(vm, result);
+
+  pop(vm);
+  pop(vm);
+  push(vm, OBJ_VAL((Obj *)result));
+}
+
+static bool is_string_value(Value value)
+{
+  return IS_STRING(value) || IS_ROPE(value);
+}
+
+// Adds the two numbers or concatenates the two strings
+// on top of the stack. Returns false after reporting
+// a runtime error if they are neither.
+static bool add_values(Vm *vm)
+{
+  Value b = peek(vm, 0);
+  Value a = peek(vm, 1);
+
+  if (is_string_value(a) && is_string_value(b))
+  {
+    concatenate_strings(vm);
+  }
+  else if (IS_NUMBER(a) && IS_NUMBER(b))
+  {
+    vm->stack_top -= 1;
+    vm->stack_top[-1] = add_numbers(a, b);
+  }
+  else
+  {
+    runtime_error(vm, "unexpected operands in with + operator");
+    return false;
+  }
+
+  return true;
+}
+
+// Global variables are not traced by minor collections,
+// so the slot is remembered when it starts holding a young object.
+//
+// Global variables are only marked when an incremental collection
+// starts, so a value stored while it is marking is marked by the store.
+static inline void store_global(Vm *vm, int slot, Value value)
+{
+  Value *global = &vm->global_values.values[slot];
+
+  if (is_young_value(&vm->nursery, value) && !is_young_value(&vm->nursery, *global))
+  {
+    remember_global(vm, slot);
+  }
+
+  if (vm->gc_state == GC_MARKING)
+  {
+    mark_value(vm, value);
+  }
+
+  *global = value;
+}
+
+bool vm_add(Vm *vm)
+{
+  return add_values(vm);
+}
+
+void vm_equal(Vm *vm)
+{
+  flatten_stack_slot(vm, 0);
+  flatten_stack_slot(vm, 1);
+  Value b = pop(vm);
+  Value a = pop(vm);
+  push(vm, BOOL_VAL(values_equal(a, b)));
+}
+
+void vm_not_equal(Vm *vm)
+{
+  vm_equal(vm);
+  vm->stack_top[-1] = BOOL_VAL(!AS_BOOL(peek(vm, 0)));
 }
 
-void free_object(Obj *obj)
-{
-  switch (obj->type)
-  {
-  case OBJ_STRING:
-  {
-    ObjString *string = (ObjString *)obj;
-    // [string->length + 1] because every string has
-    // \0 appended to it even though we don't take \0
-    // into account when setting the string length because
-    // it is an implementation detail that we do not want
-    // to leak to the user.
-    FREE_ARRAY(char, string->chars, string->length + 1);
-    FREE(ObjString, obj);
-    break;
-  }
-  case OBJ_FUNCTION:
-  {
-    ObjFunction *function = (ObjFunction *)obj;
-    free_chunk(&function->chunk);
-    FREE(ObjFunction, obj);
-    break;
+void vm_print(Vm *vm)
+{
+  flatten_stack_slot(vm, 0);
+  print_value(pop(vm));
+  printf("\n");
+}
+
+void vm_define_global(Vm *vm, int slot)
+{
+  store_global(vm, slot, peek(vm, 0));
+  pop(vm);
+}
+
+void vm_store_global(Vm *vm, int slot, Value value)
+{
+  store_global(vm, slot, value);
+}
+
+void vm_runtime_error(Vm *vm, const char *message)
+{
+  runtime_error(vm, "%s", message);
+}
+
+void vm_undefined_variable(Vm *vm, int slot)
+{
+  runtime_error(vm, "undefined variable '%s'", AS_OBJSTRING(vm->global_names.values[slot])->chars);
+}
+
+// Returns the open upvalue of [local], creating it
+// if no closure has captured the local yet.
+static ObjUpvalue *capture_upvalue(Vm *vm, Value *local)
+{
+  ObjUpvalue *upvalue = vm->open_upvalues;
+
+  while (upvalue != NULL && upvalue->location > local)
+  {
+    upvalue = upvalue->next_open;
+  }
+
+  if (upvalue != NULL && upvalue->location == local)
+  {
+    return upvalue;
+  }
+
+  ObjUpvalue *created = new_upvalue(vm, local);
+
+  // Allocating may have moved the open upvalues,
+  // so the list is walked again to insert [created].
+  ObjUpvalue **link = &vm->open_upvalues;
+
+  while (*link != NULL && (*link)->location > local)
+  {
+    link = &(*link)->next_open;
+  }
+
+  created->next_open = *link;
+  *link = created;
+  return created;
+}
+
+// Closes the open upvalues of [last] and the slots above it,
+// which are about to go away.
+static void close_upvalues(Vm *vm, Value *last)
+{
+  while (vm->open_upvalues != NULL && vm->open_upvalues->location >= last)
+  {
+    ObjUpvalue *upvalue = vm->open_upvalues;
+    upvalue->closed = *upvalue->location;
+    upvalue->location = &upvalue->closed;
+    // An old upvalue can now hold a young object.
+    write_barrier(vm, (Obj *)upvalue, upvalue->closed);
+    vm->open_upvalues = upvalue->next_open;
+  }
+}
+
+void vm_closure(Vm *vm, int constant)
+{
+  ObjFunction *function = AS_FUNCTION(vm->chunk->constants.values[constant]);
+  int upvalue_count = function->upvalue_count;
+  Capture *captures = function->captures;
+  Value *slots = vm->frames[vm->frame_count - 1].slots;
+
+  push(vm, OBJ_VAL((Obj *)new_closure(vm, function)));
+
+  for (int i = 0; i < upvalue_count; i++)
+  {
+    ObjUpvalue *upvalue = captures[i].is_local
+                              ? capture_upvalue(vm, slots + captures[i].index)
+                              : AS_CLOSURE(slots[0])->upvalues[captures[i].index];
+    // Capturing may have moved the closure.
+    ObjClosure *closure = AS_CLOSURE(peek(vm, 0));
+    closure->upvalues[i] = upvalue;
+    write_barrier(vm, (Obj *)closure, OBJ_VAL((Obj *)upvalue));
+  }
+}
+
+void vm_set_upvalue(Vm *vm, int index)
+{
+  ObjUpvalue *upvalue = AS_CLOSURE(vm->frames[vm->frame_count - 1].slots[0])->upvalues[index];
+  *upvalue->location = peek(vm, 0);
+  write_barrier(vm, (Obj *)upvalue, peek(vm, 0));
+}
+
+void vm_close_upvalue(Vm *vm)
+{
+  close_upvalues(vm, vm->stack_top - 1);
+  pop(vm);
+}
+
+// Calls [native] with the [argument_count] values on top of the
+// stack, the result takes the place of the callee and the arguments.
+// Natives run to completion without a frame of their own.
+static bool call_native(Vm *vm, ObjNative *native, int argument_count)
+{
+  if (argument_count != native->arity)
+  {
+    runtime_error(vm, "Expected %d arguments but got %d", native->arity, argument_count);
+    return false;
+  }
+
+  Value *arguments = vm->stack_top - argument_count;
+
+  if (!native->takes_numbers)
+  {
+    if (!native->function.values(vm, arguments))
+    {
+      return false;
+    }
+
+    vm->stack_top = arguments;
+    return true;
+  }
+
+  for (int i = 0; i < argument_count; i++)
+  {
+    if (!IS_NUMBER(arguments[i]))
+    {
+      runtime_error(vm, "Arguments of %s must be numbers", native->name);
+      return false;
+    }
+  }
+
+  double result = call_number_native(native, arguments);
+
+  arguments[-1] = NUMBER_VAL(result);
+  vm->stack_top = arguments;
+  return true;
+}
+
+// Returns the function a closure runs, or the callee itself if it
+// is a function, or NULL if [callee] can not be called.
+static inline ObjFunction *called_function(Value callee)
+{
+  if (IS_FUNCTION(callee))
+  {
+    return AS_FUNCTION(callee);
+  }
+
+  if (IS_CLOSURE(callee))
+  {
+    return AS_CLOSURE(callee)->function;
+  }
+
+  return NULL;
+}
+
+// Pushes the frame of [callee], whose arguments are the
+// [argument_count] values on top of the stack, and makes it
+// the frame that is running. The caller returns to [vm->ip].
+// Returns false after reporting a runtime error if [callee]
+// can not be called with that many arguments.
+//
+// A native callee is called right away and no frame is pushed.
+static bool call_value(Vm *vm, Value callee, int argument_count)
+{
+  if (IS_NATIVE(callee))
+  {
+    return call_native(vm, AS_NATIVE(callee), argument_count);
+  }
+
+  ObjFunction *function = called_function(callee);
+
+  if (function == NULL)
+  {
+    runtime_error(vm, "Can only call functions");
+    return false;
+  }
+
+  if (argument_count != function->arity)
+  {
+    runtime_error(vm, "Expected %d arguments but got %d", function->arity, argument_count);
+    return false;
+  }
+
+  if (vm->frame_count == FRAMES_MAX)
+  {
+    runtime_error(vm, "Stack overflow");
+    return false;
+  }
+
+  vm->frames[vm->frame_count - 1].ip = vm->ip;
+
+  CallFrame *frame = &vm->frames[vm->frame_count++];
+  frame->function = function;
+  frame->slots = vm->stack_top - argument_count - 1;
+
+  vm->chunk = &function->chunk;
+  vm->ip = function->chunk.code;
+  return true;
+}
+
+// Like [call_value], but a function callee takes over the frame that
+// is running instead of pushing one. The callee and its arguments are
+// moved to the bottom of the frame's window, so a chain of tail calls
+// runs in the same frame and stack space however long it is, and the
+// callee returns straight to the caller of the frame.
+static bool tail_call_value(Vm *vm, Value callee, int argument_count)
+{
+  // Anything else is called like by OP_CALL,
+  // which reports the errors.
+  ObjFunction *function = called_function(callee);
+
+  if (function == NULL || function->arity != argument_count)
+  {
+    return call_value(vm, callee, argument_count);
+  }
+
+  // The locals of the frame are overwritten.
+  CallFrame *frame = &vm->frames[vm->frame_count - 1];
+  close_upvalues(vm, frame->slots);
+  memmove(frame->slots, vm->stack_top - argument_count - 1, sizeof(Value) * (argument_count + 1));
+  vm->stack_top = frame->slots + argument_count + 1;
+
+  frame->function = function;
+  vm->chunk = &frame->function->chunk;
+  vm->ip = frame->function->chunk.code;
+  return true;
+}
+
+static InterpretResult run(Vm *vm);
+
+// Runs the frame that is running until it returns, as the C the
+// ahead-of-time compiler wrote for its function if it has some.
+// Compiled code leaves a tail call to another function for the loop
+// to run in the same frame, so a chain of tail calls does not grow
+// the C stack.
+static bool run_frame(Vm *vm)
+{
+  int base = vm->frame_count - 1;
+
+  while (vm->frame_count > base)
+  {
+    AotFunction aot = vm->frames[vm->frame_count - 1].function->aot;
+
+    if (aot == NULL)
+    {
+      return run(vm) == INTERPRET_OK;
+    }
+
+    if (!aot(vm))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool vm_call(Vm *vm, int argument_count)
+{
+  Value callee = peek(vm, argument_count);
+
+  // Natives are done once they return, there is no frame to run.
+  if (IS_NATIVE(callee))
+  {
+    return call_native(vm, AS_NATIVE(callee), argument_count);
+  }
+
+  if (!call_value(vm, callee, argument_count))
+  {
+    return false;
+  }
+
+  return run_frame(vm);
+}
+
+bool vm_tail_call(Vm *vm, int argument_count)
+{
+  return tail_call_value(vm, peek(vm, argument_count), argument_count);
+}
+
+void vm_return(Vm *vm)
+{
+  CallFrame *frame = &vm->frames[vm->frame_count - 1];
+  Value result = pop(vm);
+
+  close_upvalues(vm, frame->slots);
+  vm->stack_top = frame->slots;
+  vm->frame_count--;
+
+  if (vm->frame_count == 0)
+  {
+    return;
+  }
+
+  push(vm, result);
+  vm->chunk = &vm->frames[vm->frame_count - 1].function->chunk;
+  vm->ip = vm->frames[vm->frame_count - 1].ip;
+}
+
+// The callee goes below the arguments, where OP_CALL expects it.
+// The global of a math instruction is never undefined, the vm
+// defines it before any script runs.
+bool vm_call_global(Vm *vm, int slot, int argument_count)
+{
+  Value *arguments = vm->stack_top - argument_count;
+
+  memmove(arguments + 1, arguments, sizeof(Value) * argument_count);
+  arguments[0] = vm->global_values.values[slot];
+  vm->stack_top += 1;
+  return vm_call(vm, argument_count);
+}
+
+#ifdef USE_JIT
+// Counts an entry or a backward jump of the chunk being run.
+// Returns true once the chunk has been compiled to machine code,
+// which then runs it from [vm->ip].
+static bool is_hot(Vm *vm)
+{
+  Chunk *chunk = vm->chunk;
+
+  if (!vm->jit_enabled)
+  {
+    return false;
+  }
+
+  if (chunk->jit != NULL)
+  {
+    return true;
+  }
+
+  // A chunk the JIT fails to compile keeps counting
+  // past the threshold and is not tried again.
+  chunk->hotness += 1;
+  return chunk->hotness == JIT_THRESHOLD && jit_compile(vm);
+}
+#endif
+
+#ifdef USE_COMPUTED_GOTO
+// -Wpedantic warns about every label address and computed goto in [run].
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+// gcc merges the identical `goto *dispatch_table[...]` at the end
+// of every handler back into a few shared jumps (cross jumping and gcse),
+// which would give us switch dispatch again.
+#if defined(USE_COMPUTED_GOTO) && !defined(__clang__)
+__attribute__((optimize("no-gcse", "no-crossjumping")))
+#endif
+static InterpretResult run(Vm *vm)
+{
+  // The ip and the stack window of the frame that is running are kept
+  // in locals, which the compiler can keep in registers. [vm->ip] is
+  // only brought up to date when the code [run] calls needs it,
+  // for runtime errors, calls and the JITs.
+  uint8_t *ip = vm->ip;
+  Value *slots = vm->frames[vm->frame_count - 1].slots;
+  // [run] returns when the frame it started with returns.
+  int base = vm->frame_count - 1;
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (vm->chunk->constants.values[READ_BYTE()])
+#define READ_STRING() AS_OBJSTRING(READ_CONSTANT())
+#define READ_GLOBAL_NAME(slot) AS_OBJSTRING(vm->global_names.values[slot])
+#define SAVE_IP() (vm->ip = ip)
+#define LOAD_FRAME()                                  \
+  do                                                  \
+  {                                                   \
+    ip = vm->ip;                                      \
+    slots = vm->frames[vm->frame_count - 1].slots;    \
+  } while (false)
+#define RUNTIME_ERROR(...)                            \
+  do                                                  \
+  {                                                   \
+    SAVE_IP();                                        \
+    runtime_error(vm, __VA_ARGS__);                   \
+    return INTERPRET_RUNTIME_ERROR;                   \
+  } while (false)
+// Replaces the two numbers [a] and [b] on top of the stack with
+// `value_type(a op b)`. Two doubles are computed on right away,
+// any other numbers give [result], like `subtract_numbers(a, b)`.
+#define BINARY_OP(value_type, op, result)                           \
+  do                                                                \
+  {                                                                 \
+    Value b = peek(vm, 0);                                          \
+    Value a = peek(vm, 1);                                          \
+    if (BOTH_DOUBLES(a, b))                                         \
+    {                                                               \
+      vm->stack_top[-2] = value_type(AS_DOUBLE(a) op AS_DOUBLE(b)); \
+    }                                                               \
+    else if (IS_NUMBER(a) && IS_NUMBER(b))                          \
+    {                                                               \
+      vm->stack_top[-2] = (result);                                 \
+    }                                                               \
+    else                                                            \
+    {                                                               \
+      RUNTIME_ERROR("Operands must be numbers");                    \
+    }                                                               \
+    vm->stack_top -= 1;                                             \
+  } while (false)
+// Like [BINARY_OP] but the right operand is the constant that
+// follows the instruction. The instruction is quickened into
+// [integer_variant] for two integers or else [number_variant].
+#define BINARY_OP_CONSTANT(value_type, op, result, integer_variant, number_variant) \
+  do                                                                               \
+  {                                                                                \
+    Value b = READ_CONSTANT();                                                     \
+    Value a = peek(vm, 0);                                                         \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b))                                            \
+    {                                                                              \
+      RUNTIME_ERROR("Operands must be numbers");                                   \
+    }                                                                              \
+    if (IS_INTEGER(a) && IS_INTEGER(b))                                            \
+    {                                                                              \
+      QUICKEN(2, integer_variant);                                                 \
+      vm->stack_top[-1] = (result);                                                \
+    }                                                                              \
+    else                                                                           \
+    {                                                                              \
+      QUICKEN(2, number_variant);                                                  \
+      vm->stack_top[-1] = value_type(AS_NUMBER(a) op AS_NUMBER(b));                \
+    }                                                                              \
+  } while (false)
+// `a >= b` means `!(a < b)`, which unlike `a >= b` in C
+// is true when either operand is NaN.
+#define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
+
+// Quickening
+//
+// A generic instruction like OP_ADD checks the types of its operands
+// every time it runs, even though most instructions only ever see
+// one type. Once a generic instruction has run, it rewrites itself
+// in the chunk into the variant for the types it saw, OP_ADD becomes
+// OP_ADD_NUMBER or OP_ADD_STRING.
+//
+// The variant only checks that its guess still holds. When it does not,
+// the instruction is rewritten back into the generic one, which runs
+// again from the start and may pick another variant.
+//
+// [length] is the length of the instruction being executed, whose
+// operands have been read. Quickened instructions have the length
+// of their generic instruction.
+#ifdef QUICKENING
+#define QUICKEN(length, opcode) (ip[-(length)] = (opcode))
+#else
+#define QUICKEN(length, opcode) ((void)0)
+#endif
+// The guess of a quickened instruction almost always holds,
+// the hint keeps the path for it in line with the instruction.
+#define GUESS_HOLDS(condition) LIKELY(condition)
+#define DEQUICKEN(length, generic) \
+  do                               \
+  {                                \
+    ip -= (length);                \
+    *ip = (generic);               \
+  } while (false)
+// Replaces the two numbers [a] and [b] on top of the stack with [result].
+#define NUMBER_OP(result)                                           \
+  vm->stack_top -= 1;                                               \
+  vm->stack_top[-1] = (result)
+// Makes the operands [a] and [b] of a _NUMBER variant of [length]
+// doubles, an integer is converted. Two doubles need nothing and
+// are checked for first. Turns the instruction back into [generic]
+// when either is not a number.
+#define DOUBLE_OPERANDS(a, b, length, generic) \
+  if (!BOTH_DOUBLES(a, b))                     \
+  {                                            \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b))        \
+    {                                          \
+      DEQUICKEN(length, generic);              \
+      DISPATCH();                              \
+    }                                          \
+    a = NUMBER_VAL(AS_NUMBER(a));              \
+    b = NUMBER_VAL(AS_NUMBER(b));              \
+  }
+// Quickens an arithmetic instruction of length 1 into [integer_variant]
+// when its two operands are integers, or [number_variant] for other numbers.
+#define QUICKEN_NUMBERS(integer_variant, number_variant)       \
+  do                                                           \
+  {                                                            \
+    if (IS_INTEGER(peek(vm, 0)) && IS_INTEGER(peek(vm, 1)))    \
+    {                                                          \
+      QUICKEN(1, integer_variant);                             \
+    }                                                          \
+    else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) \
+    {                                                          \
+      QUICKEN(1, number_variant);                              \
+    }                                                          \
+  } while (false)
+
+// With switch dispatch, every instruction handler jumps back
+// to the top of the loop and goes through the same indirect
+// branch in the switch, which makes the branch predictor's life
+// hard because that single branch has as many targets as we have opcodes.
+//
+// With direct threaded dispatch, every handler ends with its own
+// indirect jump to the next handler, so the predictor can learn
+// which opcode tends to follow which:
+//
+// TARGET_OP_GET_LOCAL: ... goto *dispatch_table[*ip++];
+// TARGET_OP_CONSTANT:  ... goto *dispatch_table[*ip++];
+// TARGET_OP_ADD:       ... goto *dispatch_table[*ip++];
+//
+// The switch is still there, it is used to dispatch the first instruction
+// and as the portable fallback when computed gotos are not available.
+#ifdef USE_COMPUTED_GOTO
+  // Every opcode must have an entry in this table.
+  static void *dispatch_table[] = {
+      [OP_CONSTANT] = &&TARGET_OP_CONSTANT,
+      [OP_NIL] = &&TARGET_OP_NIL,
+      [OP_TRUE] = &&TARGET_OP_TRUE,
+      [OP_FALSE] = &&TARGET_OP_FALSE,
+      [OP_RETURN] = &&TARGET_OP_RETURN,
+      [OP_NEGATE] = &&TARGET_OP_NEGATE,
+      [OP_ADD] = &&TARGET_OP_ADD,
+      [OP_SUBTRACT] = &&TARGET_OP_SUBTRACT,
+      [OP_MULTIPLY] = &&TARGET_OP_MULTIPLY,
+      [OP_DIVIDE] = &&TARGET_OP_DIVIDE,
+      [OP_NOT] = &&TARGET_OP_NOT,
+      [OP_EQUAL] = &&TARGET_OP_EQUAL,
+      [OP_GREATER] = &&TARGET_OP_GREATER,
+      [OP_LESS] = &&TARGET_OP_LESS,
+      [OP_NOT_EQUAL] = &&TARGET_OP_NOT_EQUAL,
+      [OP_GREATER_EQUAL] = &&TARGET_OP_GREATER_EQUAL,
+      [OP_LESS_EQUAL] = &&TARGET_OP_LESS_EQUAL,
+      [OP_PRINT] = &&TARGET_OP_PRINT,
+      [OP_POP] = &&TARGET_OP_POP,
+      [OP_POPN] = &&TARGET_OP_POPN,
+      [OP_DEFINE_GLOBAL] = &&TARGET_OP_DEFINE_GLOBAL,
+      [OP_GET_GLOBAL] = &&TARGET_OP_GET_GLOBAL,
+      [OP_SET_GLOBAL] = &&TARGET_OP_SET_GLOBAL,
+      [OP_GET_LOCAL] = &&TARGET_OP_GET_LOCAL,
+      [OP_SET_LOCAL] = &&TARGET_OP_SET_LOCAL,
+      [OP_JUMP_IF_FALSE] = &&TARGET_OP_JUMP_IF_FALSE,
+      [OP_JUMP] = &&TARGET_OP_JUMP,
+      [OP_LOOP] = &&TARGET_OP_LOOP,
+      [OP_CALL] = &&TARGET_OP_CALL,
+      [OP_TAIL_CALL] = &&TARGET_OP_TAIL_CALL,
+      [OP_CLOSURE] = &&TARGET_OP_CLOSURE,
+      [OP_GET_UPVALUE] = &&TARGET_OP_GET_UPVALUE,
+      [OP_SET_UPVALUE] = &&TARGET_OP_SET_UPVALUE,
+      [OP_CLOSE_UPVALUE] = &&TARGET_OP_CLOSE_UPVALUE,
+      [OP_SQRT] = &&TARGET_OP_SQRT,
+      [OP_FLOOR] = &&TARGET_OP_FLOOR,
+      [OP_ABS] = &&TARGET_OP_ABS,
+      [OP_MIN] = &&TARGET_OP_MIN,
+      [OP_MAX] = &&TARGET_OP_MAX,
+      [OP_POW] = &&TARGET_OP_POW,
+      [OP_ADD_CONSTANT] = &&TARGET_OP_ADD_CONSTANT,
+      [OP_SUBTRACT_CONSTANT] = &&TARGET_OP_SUBTRACT_CONSTANT,
+      [OP_MULTIPLY_CONSTANT] = &&TARGET_OP_MULTIPLY_CONSTANT,
+      [OP_DIVIDE_CONSTANT] = &&TARGET_OP_DIVIDE_CONSTANT,
+      [OP_LESS_CONSTANT] = &&TARGET_OP_LESS_CONSTANT,
+      [OP_GREATER_CONSTANT] = &&TARGET_OP_GREATER_CONSTANT,
+      [OP_EQUAL_CONSTANT] = &&TARGET_OP_EQUAL_CONSTANT,
+      [OP_SET_LOCAL_POP] = &&TARGET_OP_SET_LOCAL_POP,
+      [OP_SET_GLOBAL_POP] = &&TARGET_OP_SET_GLOBAL_POP,
+      [OP_ADD_LOCAL_CONSTANT] = &&TARGET_OP_ADD_LOCAL_CONSTANT,
+      [OP_POP_JUMP_IF_FALSE] = &&TARGET_OP_POP_JUMP_IF_FALSE,
+      [OP_ADD_NUMBER] = &&TARGET_OP_ADD_NUMBER,
+      [OP_ADD_INTEGER] = &&TARGET_OP_ADD_INTEGER,
+      [OP_ADD_STRING] = &&TARGET_OP_ADD_STRING,
+      [OP_SUBTRACT_NUMBER] = &&TARGET_OP_SUBTRACT_NUMBER,
+      [OP_SUBTRACT_INTEGER] = &&TARGET_OP_SUBTRACT_INTEGER,
+      [OP_MULTIPLY_NUMBER] = &&TARGET_OP_MULTIPLY_NUMBER,
+      [OP_MULTIPLY_INTEGER] = &&TARGET_OP_MULTIPLY_INTEGER,
+      [OP_EQUAL_NUMBER] = &&TARGET_OP_EQUAL_NUMBER,
+      [OP_NOT_EQUAL_NUMBER] = &&TARGET_OP_NOT_EQUAL_NUMBER,
+      [OP_ADD_CONSTANT_NUMBER] = &&TARGET_OP_ADD_CONSTANT_NUMBER,
+      [OP_SUBTRACT_CONSTANT_NUMBER] = &&TARGET_OP_SUBTRACT_CONSTANT_NUMBER,
+      [OP_MULTIPLY_CONSTANT_NUMBER] = &&TARGET_OP_MULTIPLY_CONSTANT_NUMBER,
+      [OP_DIVIDE_CONSTANT_NUMBER] = &&TARGET_OP_DIVIDE_CONSTANT_NUMBER,
+      [OP_LESS_CONSTANT_NUMBER] = &&TARGET_OP_LESS_CONSTANT_NUMBER,
+      [OP_GREATER_CONSTANT_NUMBER] = &&TARGET_OP_GREATER_CONSTANT_NUMBER,
+      [OP_EQUAL_CONSTANT_NUMBER] = &&TARGET_OP_EQUAL_CONSTANT_NUMBER,
+      [OP_ADD_LOCAL_CONSTANT_NUMBER] = &&TARGET_OP_ADD_LOCAL_CONSTANT_NUMBER,
+      [OP_ADD_CONSTANT_INTEGER] = &&TARGET_OP_ADD_CONSTANT_INTEGER,
+      [OP_SUBTRACT_CONSTANT_INTEGER] = &&TARGET_OP_SUBTRACT_CONSTANT_INTEGER,
+      [OP_MULTIPLY_CONSTANT_INTEGER] = &&TARGET_OP_MULTIPLY_CONSTANT_INTEGER,
+      [OP_LESS_CONSTANT_INTEGER] = &&TARGET_OP_LESS_CONSTANT_INTEGER,
+      [OP_GREATER_CONSTANT_INTEGER] = &&TARGET_OP_GREATER_CONSTANT_INTEGER,
+      [OP_EQUAL_CONSTANT_INTEGER] = &&TARGET_OP_EQUAL_CONSTANT_INTEGER,
+      [OP_ADD_LOCAL_CONSTANT_INTEGER] = &&TARGET_OP_ADD_LOCAL_CONSTANT_INTEGER,
+  };
+
+#define TARGET(opcode) \
+  TARGET_##opcode:     \
+  case opcode
+#define DISPATCH() goto *dispatch_table[READ_BYTE()]
+#else
+#define TARGET(opcode) case opcode
+#define DISPATCH() break
+#endif
+
+#ifdef USE_JIT
+// Runs the frame as machine code from [ip] once its chunk is hot.
+// The machine code stops at the OP_RETURN that ends the frame
+// and leaves it to [run], which knows where to return to.
+#define RUN_IF_HOT()                                  \
+  do                                                  \
+  {                                                   \
+    if (is_hot(vm))                                   \
+    {                                                 \
+      SAVE_IP();                                      \
+      if (jit_execute(vm) != INTERPRET_OK)            \
+      {                                               \
+        return INTERPRET_RUNTIME_ERROR;               \
+      }                                               \
+      ip = vm->ip;                                    \
+    }                                                 \
+  } while (false)
+
+  RUN_IF_HOT();
+#endif
+
+  for (;;)
+  {
+#ifdef DEBUG_TRACE_EXECUTION
+    printf("[START] Stack\n");
+
+    for (Value *slot = vm->stack; slot < vm->stack_top; slot += 1)
+    {
+      printf("[ ");
+      print_value(*slot);
+      printf(" ]");
+    }
+
+    printf("[END] Stack\n");
+
+    dissamble_instruction(vm->chunk, ip - vm->chunk->code);
+#endif
+
+#ifdef DEBUG_PROFILE_OPCODES
+    profile_opcode(*ip);
+#endif
+
+    uint8_t instruction;
+
+    switch (instruction = READ_BYTE())
+    {
+    TARGET(OP_CONSTANT) :
+    {
+      Value constant = READ_CONSTANT();
+      push(vm, constant);
+      DISPATCH();
+    }
+    TARGET(OP_NIL) :
+    {
+      push(vm, NIL_VAL);
+      DISPATCH();
+    }
+    TARGET(OP_TRUE) :
+    {
+      push(vm, BOOL_VAL(true));
+      DISPATCH();
+    }
+    TARGET(OP_FALSE) :
+    {
+      push(vm, BOOL_VAL(false));
+      DISPATCH();
+    }
+    TARGET(OP_EQUAL) :
+    {
+      if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1)))
+      {
+        QUICKEN(1, OP_EQUAL_NUMBER);
+      }
+
+      // [values_equal] compares strings, not ropes,
+      // so ropes are flattened first.
+      flatten_stack_slot(vm, 0);
+      flatten_stack_slot(vm, 1);
+      const Value b = pop(vm);
+      const Value a = pop(vm);
+      push(vm, BOOL_VAL(values_equal(a, b)));
+      DISPATCH();
+    }
+    TARGET(OP_GREATER) :
+    {
+      BINARY_OP(BOOL_VAL, >, BOOL_VAL(COMPARE_NUMBERS(a, >, b)));
+      DISPATCH();
+    }
+    TARGET(OP_LESS) :
+    {
+      BINARY_OP(BOOL_VAL, <, BOOL_VAL(COMPARE_NUMBERS(a, <, b)));
+      DISPATCH();
+    }
+    TARGET(OP_NOT_EQUAL) :
+    {
+      if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1)))
+      {
+        QUICKEN(1, OP_NOT_EQUAL_NUMBER);
+      }
+
+      flatten_stack_slot(vm, 0);
+      flatten_stack_slot(vm, 1);
+      const Value b = pop(vm);
+      const Value a = pop(vm);
+      push(vm, BOOL_VAL(!values_equal(a, b)));
+      DISPATCH();
+    }
+    TARGET(OP_GREATER_EQUAL) :
+    {
+      BINARY_OP(NOT_BOOL_VAL, <, NOT_BOOL_VAL(COMPARE_NUMBERS(a, <, b)));
+      DISPATCH();
+    }
+    TARGET(OP_LESS_EQUAL) :
+    {
+      BINARY_OP(NOT_BOOL_VAL, >, NOT_BOOL_VAL(COMPARE_NUMBERS(a, >, b)));
+      DISPATCH();
+    }
+    TARGET(OP_NEGATE) :
+    {
+      if (!IS_NUMBER(peek(vm, 0)))
+      {
+        RUNTIME_ERROR("Operand must be a number");
+      }
+      push(vm, negate_number(pop(vm)));
+      DISPATCH();
+    }
+    TARGET(OP_ADD) :
+    {
+      if (IS_INTEGER(peek(vm, 0)) && IS_INTEGER(peek(vm, 1)))
+      {
+        QUICKEN(1, OP_ADD_INTEGER);
+      }
+      else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1)))
+      {
+        QUICKEN(1, OP_ADD_NUMBER);
+      }
+      else if (is_string_value(peek(vm, 0)) && is_string_value(peek(vm, 1)))
+      {
+        QUICKEN(1, OP_ADD_STRING);
+      }
+
+      SAVE_IP();
+
+      if (!add_values(vm))
+      {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DISPATCH();
+    }
+    TARGET(OP_SUBTRACT) :
+    {
+      QUICKEN_NUMBERS(OP_SUBTRACT_INTEGER, OP_SUBTRACT_NUMBER);
+      BINARY_OP(NUMBER_VAL, -, subtract_numbers(a, b));
+      DISPATCH();
+    }
+    TARGET(OP_MULTIPLY) :
+    {
+      QUICKEN_NUMBERS(OP_MULTIPLY_INTEGER, OP_MULTIPLY_NUMBER);
+      BINARY_OP(NUMBER_VAL, *, multiply_numbers(a, b));
+      DISPATCH();
+    }
+    TARGET(OP_DIVIDE) :
+    {
+      BINARY_OP(NUMBER_VAL, /, divide_numbers(a, b));
+      DISPATCH();
+    }
+    TARGET(OP_NOT) :
+    {
+      push(vm, BOOL_VAL(value_not(pop(vm))));
+      DISPATCH();
+    }
+    TARGET(OP_PRINT) :
+    {
+      // Flattening the rope here instead of letting [print_value]
+      // copy its characters means printing it again is cheap.
+      flatten_stack_slot(vm, 0);
+      print_value(pop(vm));
+      printf("\n");
+      DISPATCH();
+    }
+    TARGET(OP_POP) :
+    {
+      pop(vm);
+      DISPATCH();
+    }
+    TARGET(OP_POPN) :
+    {
+      vm->stack_top -= READ_BYTE();
+      DISPATCH();
+    }
+    TARGET(OP_DEFINE_GLOBAL) :
+    {
+      uint16_t slot = READ_SHORT();
+      store_global(vm, slot, peek(vm, 0));
+      pop(vm);
+      DISPATCH();
+    }
+    TARGET(OP_GET_GLOBAL) :
+    {
+      uint16_t slot = READ_SHORT();
+      Value value = vm->global_values.values[slot];
+
+      // The compiler gives a slot to every global name it sees,
+      // even if the variable is never defined.
+      if (IS_UNDEFINED(value))
+      {
+        RUNTIME_ERROR("undefined variable '%s'", READ_GLOBAL_NAME(slot)->chars);
+      }
+
+      push(vm, value);
+      DISPATCH();
+    }
+    TARGET(OP_SET_GLOBAL) :
+    {
+      uint16_t slot = READ_SHORT();
+
+      // Assignment does not define a variable.
+      if (IS_UNDEFINED(vm->global_values.values[slot]))
+      {
+        RUNTIME_ERROR("undefined variable '%s'", READ_GLOBAL_NAME(slot)->chars);
+      }
+
+      // We leave the value on the stack because the
+      // expression statement that wraps the assignment
+      // emits an OP_POP to discard it.
+      store_global(vm, slot, peek(vm, 0));
+      DISPATCH();
+    }
+    TARGET(OP_GET_LOCAL) :
+    {
+      // We push the value onto the stack because
+      // other operations expect values to always be at the top
+      // of the stack.
+      uint8_t slot = READ_BYTE();
+
+      push(vm, slots[slot]);
+      DISPATCH();
+    }
+    TARGET(OP_SET_LOCAL) :
+    {
+      uint8_t slot = READ_BYTE();
+
+      // Like OP_SET_GLOBAL, the value stays on the stack
+      // and is discarded by the OP_POP that follows the assignment.
+      slots[slot] = peek(vm, 0);
+      DISPATCH();
+    }
+    TARGET(OP_JUMP_IF_FALSE) :
+    {
+      uint16_t offset = READ_SHORT();
+      if (!is_truthy(peek(vm, 0)))
+      {
+        ip += offset;
+      }
+      DISPATCH();
+    }
+    TARGET(OP_JUMP) :
+    {
+      uint16_t offset = READ_SHORT();
+      ip += offset;
+      DISPATCH();
+    }
+    TARGET(OP_LOOP) :
+    {
+      uint16_t offset = READ_SHORT();
+#ifdef USE_TRACING
+      const uint8_t *loop_end = ip;
+#endif
+      ip -= offset;
+
+      // A program can loop for a long time without allocating,
+      // every iteration gives the collection in progress a chance to advance.
+      if (vm->gc_state != GC_IDLE)
+      {
+        gc_safepoint(vm);
+      }
+
+#ifdef USE_TRACING
+      // A loop that runs as a trace does not make the chunk any hotter,
+      // only the loops that can not be traced get it compiled.
+      SAVE_IP();
+
+      if (vm->jit_enabled && trace_loop(vm, loop_end))
+      {
+        ip = vm->ip;
+        DISPATCH();
+      }
+#endif
+
+#ifdef USE_JIT
+      // The loop carries on in machine code from its first instruction.
+      RUN_IF_HOT();
+#endif
+
+      DISPATCH();
+    }
+    TARGET(OP_ADD_CONSTANT) :
+    {
+      Value b = READ_CONSTANT();
+      Value a = peek(vm, 0);
+
+      if (IS_INTEGER(a) && IS_INTEGER(b))
+      {
+        QUICKEN(2, OP_ADD_CONSTANT_INTEGER);
+        vm->stack_top[-1] = add_numbers(a, b);
+      }
+      else if (IS_NUMBER(a) && IS_NUMBER(b))
+      {
+        QUICKEN(2, OP_ADD_CONSTANT_NUMBER);
+        vm->stack_top[-1] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+      }
+      else
+      {
+        push(vm, b);
+
+        SAVE_IP();
+
+        if (!add_values(vm))
+        {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+      }
+      DISPATCH();
+    }
+    TARGET(OP_SUBTRACT_CONSTANT) :
+    {
+      BINARY_OP_CONSTANT(NUMBER_VAL, -, subtract_numbers(a, b),
+                         OP_SUBTRACT_CONSTANT_INTEGER, OP_SUBTRACT_CONSTANT_NUMBER);
+      DISPATCH();
+    }
+    TARGET(OP_MULTIPLY_CONSTANT) :
+    {
+      BINARY_OP_CONSTANT(NUMBER_VAL, *, multiply_numbers(a, b),
+                         OP_MULTIPLY_CONSTANT_INTEGER, OP_MULTIPLY_CONSTANT_NUMBER);
+      DISPATCH();
+    }
+    TARGET(OP_DIVIDE_CONSTANT) :
+    {
+      // Dividing two integers gives a double too.
+      BINARY_OP_CONSTANT(NUMBER_VAL, /, divide_numbers(a, b),
+                         OP_DIVIDE_CONSTANT_NUMBER, OP_DIVIDE_CONSTANT_NUMBER);
+      DISPATCH();
+    }
+    TARGET(OP_LESS_CONSTANT) :
+    {
+      BINARY_OP_CONSTANT(BOOL_VAL, <, BOOL_VAL(COMPARE_NUMBERS(a, <, b)),
+                         OP_LESS_CONSTANT_INTEGER, OP_LESS_CONSTANT_NUMBER);
+      DISPATCH();
+    }
+    TARGET(OP_GREATER_CONSTANT) :
+    {
+      BINARY_OP_CONSTANT(BOOL_VAL, >, BOOL_VAL(COMPARE_NUMBERS(a, >, b)),
+                         OP_GREATER_CONSTANT_INTEGER, OP_GREATER_CONSTANT_NUMBER);
+      DISPATCH();
+    }
+    TARGET(OP_EQUAL_CONSTANT) :
+    {
+      // Constants are never ropes.
+      flatten_stack_slot(vm, 0);
+      Value b = READ_CONSTANT();
+
+      if (IS_INTEGER(peek(vm, 0)) && IS_INTEGER(b))
+      {
+        QUICKEN(2, OP_EQUAL_CONSTANT_INTEGER);
+      }
+      else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(b))
+      {
+        QUICKEN(2, OP_EQUAL_CONSTANT_NUMBER);
+      }
+
+      vm->stack_top[-1] = BOOL_VAL(values_equal(peek(vm, 0), b));
+      DISPATCH();
+    }
+    TARGET(OP_SET_LOCAL_POP) :
+    {
+      uint8_t slot = READ_BYTE();
+      slots[slot] = pop(vm);
+      DISPATCH();
+    }
+    TARGET(OP_SET_GLOBAL_POP) :
+    {
+      uint16_t slot = READ_SHORT();
+
+      if (IS_UNDEFINED(vm->global_values.values[slot]))
+      {
+        RUNTIME_ERROR("undefined variable '%s'", READ_GLOBAL_NAME(slot)->chars);
+      }
+
+      store_global(vm, slot, peek(vm, 0));
+      pop(vm);
+      DISPATCH();
+    }
+    TARGET(OP_ADD_LOCAL_CONSTANT) :
+    {
+      uint8_t slot = READ_BYTE();
+      Value b = READ_CONSTANT();
+      Value a = slots[slot];
+
+      if (IS_INTEGER(a) && IS_INTEGER(b))
+      {
+        QUICKEN(3, OP_ADD_LOCAL_CONSTANT_INTEGER);
+        slots[slot] = add_numbers(a, b);
+      }
+      else if (IS_NUMBER(a) && IS_NUMBER(b))
+      {
+        QUICKEN(3, OP_ADD_LOCAL_CONSTANT_NUMBER);
+        slots[slot] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+      }
+      else
+      {
+        push(vm, a);
+        push(vm, b);
+
+        SAVE_IP();
+
+        if (!add_values(vm))
+        {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+
+        slots[slot] = pop(vm);
+      }
+      DISPATCH();
+    }
+    TARGET(OP_POP_JUMP_IF_FALSE) :
+    {
+      uint16_t offset = READ_SHORT();
+      if (!is_truthy(pop(vm)))
+      {
+        ip += offset;
+      }
+      DISPATCH();
+    }
+    TARGET(OP_ADD_NUMBER) :
+    {
+      Value b = peek(vm, 0);
+      Value a = peek(vm, 1);
+      DOUBLE_OPERANDS(a, b, 1, OP_ADD);
+      NUMBER_OP(NUMBER_VAL(AS_DOUBLE(a) + AS_DOUBLE(b)));
+      DISPATCH();
+    }
+    TARGET(OP_ADD_INTEGER) :
+    {
+      Value b = peek(vm, 0);
+      Value a = peek(vm, 1);
+
+      if (!GUESS_HOLDS(IS_INTEGER(a) && IS_INTEGER(b)))
+      {
+        DEQUICKEN(1, OP_ADD);
+        DISPATCH();
+      }
+
+      NUMBER_OP(add_numbers(a, b));
+      DISPATCH();
+    }
+    TARGET(OP_SUBTRACT_NUMBER) :
+    {
+      Value b = peek(vm, 0);
+      Value a = peek(vm, 1);
+      DOUBLE_OPERANDS(a, b, 1, OP_SUBTRACT);
+      NUMBER_OP(NUMBER_VAL(AS_DOUBLE(a) - AS_DOUBLE(b)));
+      DISPATCH();
+    }
+    TARGET(OP_SUBTRACT_INTEGER) :
+    {
+      Value b = peek(vm, 0);
+      Value a = peek(vm, 1);
+
+      if (!GUESS_HOLDS(IS_INTEGER(a) && IS_INTEGER(b)))
+      {
+        DEQUICKEN(1, OP_SUBTRACT);
+        DISPATCH();
+      }
+
+      NUMBER_OP(subtract_numbers(a, b));
+      DISPATCH();
+    }
+    TARGET(OP_MULTIPLY_NUMBER) :
+    {
+      Value b = peek(vm, 0);
+      Value a = peek(vm, 1);
+      DOUBLE_OPERANDS(a, b, 1, OP_MULTIPLY);
+      NUMBER_OP(NUMBER_VAL(AS_DOUBLE(a) * AS_DOUBLE(b)));
+      DISPATCH();
+    }
+    TARGET(OP_MULTIPLY_INTEGER) :
+    {
+      Value b = peek(vm, 0);
+      Value a = peek(vm, 1);
+
+      if (!GUESS_HOLDS(IS_INTEGER(a) && IS_INTEGER(b)))
+      {
+        DEQUICKEN(1, OP_MULTIPLY);
+        DISPATCH();
+      }
+
+      NUMBER_OP(multiply_numbers(a, b));
+      DISPATCH();
+    }
+    TARGET(OP_ADD_STRING) :
+    {
+      if (!is_string_value(peek(vm, 0)) || !is_string_value(peek(vm, 1)))
+      {
+        DEQUICKEN(1, OP_ADD);
+        DISPATCH();
+      }
+
+      concatenate_strings(vm);
+      DISPATCH();
+    }
+    TARGET(OP_EQUAL_NUMBER) :
+    {
+      Value b = peek(vm, 0);
+      Value a = peek(vm, 1);
+      DOUBLE_OPERANDS(a, b, 1, OP_EQUAL);
+      NUMBER_OP(BOOL_VAL(AS_DOUBLE(a) == AS_DOUBLE(b)));
+      DISPATCH();
+    }
+    TARGET(OP_NOT_EQUAL_NUMBER) :
+    {
+      Value b = peek(vm, 0);
+      Value a = peek(vm, 1);
+      DOUBLE_OPERANDS(a, b, 1, OP_NOT_EQUAL);
+      NUMBER_OP(BOOL_VAL(AS_DOUBLE(a) != AS_DOUBLE(b)));
+      DISPATCH();
+    }
+#define CONSTANT_NUMBER_OP(value_type, op, generic)                         \
+  {                                                                         \
+    Value b = READ_CONSTANT();                                              \
+    Value a = peek(vm, 0);                                                  \
+    DOUBLE_OPERANDS(a, b, 2, generic);                                      \
+    vm->stack_top[-1] = value_type(AS_DOUBLE(a) op AS_DOUBLE(b));           \
+    DISPATCH();                                                             \
   }
+    TARGET(OP_ADD_CONSTANT_NUMBER) :
+      CONSTANT_NUMBER_OP(NUMBER_VAL, +, OP_ADD_CONSTANT)
+    TARGET(OP_SUBTRACT_CONSTANT_NUMBER) :
+      CONSTANT_NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT_CONSTANT)
+    TARGET(OP_MULTIPLY_CONSTANT_NUMBER) :
+      CONSTANT_NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY_CONSTANT)
+    TARGET(OP_DIVIDE_CONSTANT_NUMBER) :
+      CONSTANT_NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE_CONSTANT)
+    TARGET(OP_LESS_CONSTANT_NUMBER) :
+      CONSTANT_NUMBER_OP(BOOL_VAL, <, OP_LESS_CONSTANT)
+    TARGET(OP_GREATER_CONSTANT_NUMBER) :
+      CONSTANT_NUMBER_OP(BOOL_VAL, >, OP_GREATER_CONSTANT)
+    TARGET(OP_EQUAL_CONSTANT_NUMBER) :
+      CONSTANT_NUMBER_OP(BOOL_VAL, ==, OP_EQUAL_CONSTANT)
+#undef CONSTANT_NUMBER_OP
+    TARGET(OP_ADD_LOCAL_CONSTANT_NUMBER) :
+    {
+      uint8_t slot = READ_BYTE();
+      Value b = READ_CONSTANT();
+      Value a = slots[slot];
+      DOUBLE_OPERANDS(a, b, 3, OP_ADD_LOCAL_CONSTANT);
+      slots[slot] = NUMBER_VAL(AS_DOUBLE(a) + AS_DOUBLE(b));
+      DISPATCH();
+    }
+// The constant of an _INTEGER variant is an integer,
+// only the operand has to be checked.
+#define CONSTANT_INTEGER_OP(result, generic)                                \
+  {                                                                         \
+    Value b = READ_CONSTANT();                                              \
+    Value a = peek(vm, 0);                                                  \
+                                                                            \
+    if (!GUESS_HOLDS(IS_INTEGER(a)))                                        \
+    {                                                                       \
+      DEQUICKEN(2, generic);                                                \
+      DISPATCH();                                                           \
+    }                                                                       \
+                                                                            \
+    vm->stack_top[-1] = (result);                                           \
+    DISPATCH();                                                             \
   }
-}
+    TARGET(OP_ADD_CONSTANT_INTEGER) :
+      CONSTANT_INTEGER_OP(add_numbers(a, b), OP_ADD_CONSTANT)
+    TARGET(OP_SUBTRACT_CONSTANT_INTEGER) :
+      CONSTANT_INTEGER_OP(subtract_numbers(a, b), OP_SUBTRACT_CONSTANT)
+    TARGET(OP_MULTIPLY_CONSTANT_INTEGER) :
+      CONSTANT_INTEGER_OP(multiply_numbers(a, b), OP_MULTIPLY_CONSTANT)
+    TARGET(OP_LESS_CONSTANT_INTEGER) :
+      CONSTANT_INTEGER_OP(BOOL_VAL(AS_INTEGER(a) < AS_INTEGER(b)), OP_LESS_CONSTANT)
+    TARGET(OP_GREATER_CONSTANT_INTEGER) :
+      CONSTANT_INTEGER_OP(BOOL_VAL(AS_INTEGER(a) > AS_INTEGER(b)), OP_GREATER_CONSTANT)
+    TARGET(OP_EQUAL_CONSTANT_INTEGER) :
+      CONSTANT_INTEGER_OP(BOOL_VAL(AS_INTEGER(a) == AS_INTEGER(b)), OP_EQUAL_CONSTANT)
+#undef CONSTANT_INTEGER_OP
+    TARGET(OP_ADD_LOCAL_CONSTANT_INTEGER) :
+    {
+      uint8_t slot = READ_BYTE();
+      Value b = READ_CONSTANT();
+      Value a = slots[slot];
 
-void free_objects(Vm *vm)
-{
-  Obj *current = vm->objects;
+      if (!GUESS_HOLDS(IS_INTEGER(a)))
+      {
+        DEQUICKEN(3, OP_ADD_LOCAL_CONSTANT);
+        DISPATCH();
+      }
 
-  while (current != NULL)
-  {
-    Obj *next = current->next;
-    free_object(current);
-    current = next;
-  }
-}
+      slots[slot] = add_numbers(a, b);
+      DISPATCH();
+    }
+    TARGET(OP_CALL) :
+    {
+      int argument_count = READ_BYTE();
+      Value callee = peek(vm, argument_count);
+      SAVE_IP();
 
-void free_vm(Vm *vm)
-{
-  free_hash_table(&vm->strings);
-  free_hash_table(&vm->globals);
-  free_objects(vm);
-}
+      // Natives return before the next instruction,
+      // the frame that is running does not change.
+      if (IS_NATIVE(callee))
+      {
+        if (!call_native(vm, AS_NATIVE(callee), argument_count))
+        {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        DISPATCH();
+      }
 
-static Value peek(Vm *vm, size_t distance)
-{
-  return vm->stack_top[-1 - distance];
-}
+      if (!call_value(vm, callee, argument_count))
+      {
+        return INTERPRET_RUNTIME_ERROR;
+      }
 
-static void runtime_error(Vm *vm, const char *format, ...)
-{
-  va_list args;
-  va_start(args, format);
-  vfprintf(stderr, format, args);
-  va_end(args);
-  fputs("\n", stderr);
+      LOAD_FRAME();
+#ifdef USE_JIT
+      RUN_IF_HOT();
+#endif
+      DISPATCH();
+    }
+    TARGET(OP_TAIL_CALL) :
+    {
+      int argument_count = READ_BYTE();
+      SAVE_IP();
 
-  size_t instruction = vm->ip - vm->chunk->code - 1;
-  size_t line = vm->chunk->lines[instruction];
-  fprintf(stderr, "[line %zu] in script\n", line);
+      if (!tail_call_value(vm, peek(vm, argument_count), argument_count))
+      {
+        return INTERPRET_RUNTIME_ERROR;
+      }
 
-  reset_stack(vm);
-}
+      LOAD_FRAME();
+#ifdef USE_JIT
+      RUN_IF_HOT();
+#endif
+      DISPATCH();
+    }
+    TARGET(OP_CLOSURE) :
+    {
+      int constant = READ_BYTE();
+      SAVE_IP();
+      vm_closure(vm, constant);
+      DISPATCH();
+    }
+    // The closure that is running is in slot 0 of its frame.
+    TARGET(OP_GET_UPVALUE) :
+    {
+      uint8_t index = READ_BYTE();
+      push(vm, *AS_CLOSURE(slots[0])->upvalues[index]->location);
+      DISPATCH();
+    }
+    TARGET(OP_SET_UPVALUE) :
+    {
+      uint8_t index = READ_BYTE();
 
-static bool not(const Value value)
-{
-  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
-}
+      // Storing a value that is not an object needs no write barrier.
+      if (IS_OBJ(peek(vm, 0)))
+      {
+        vm_set_upvalue(vm, index);
+      }
+      else
+      {
+        *AS_CLOSURE(slots[0])->upvalues[index]->location = peek(vm, 0);
+      }
+      DISPATCH();
+    }
+    TARGET(OP_CLOSE_UPVALUE) :
+    {
+      vm_close_upvalue(vm);
+      DISPATCH();
+    }
+// Computes the native of a math instruction on its arguments [a] and,
+// if it takes two, [b]. When the global holds anything else or an
+// argument is not a number, the callee runs to completion in
+// [vm_call_global], like it does for the JIT.
+#define MATH_OP(opcode, arity, result)                                          \
+  {                                                                             \
+    uint16_t slot = READ_SHORT();                                               \
+    Value callee = vm->global_values.values[slot];                              \
+    Value a = peek(vm, (arity) - 1);                                            \
+    Value b = peek(vm, 0);                                                      \
+                                                                                \
+    if (!IS_OBJ(callee) ||                                                      \
+        AS_OBJ(callee) != AS_OBJ(vm->intrinsics[(opcode) - OP_SQRT]) ||         \
+        !IS_NUMBER(a) || !IS_NUMBER(b))                                         \
+    {                                                                           \
+      SAVE_IP();                                                                \
+      if (!vm_call_global(vm, slot, arity))                                     \
+      {                                                                         \
+        return INTERPRET_RUNTIME_ERROR;                                         \
+      }                                                                         \
+      DISPATCH();                                                               \
+    }                                                                           \
+                                                                                \
+    vm->stack_top -= (arity) - 1;                                               \
+    vm->stack_top[-1] = NUMBER_VAL(result);                                     \
+    DISPATCH();                                                                 \
+  }
+    TARGET(OP_SQRT) :
+      MATH_OP(OP_SQRT, 1, sqrt(AS_NUMBER(a)))
+    TARGET(OP_FLOOR) :
+      MATH_OP(OP_FLOOR, 1, floor(AS_NUMBER(a)))
+    TARGET(OP_ABS) :
+      MATH_OP(OP_ABS, 1, fabs(AS_NUMBER(a)))
+    TARGET(OP_MIN) :
+      MATH_OP(OP_MIN, 2, AS_NUMBER(a) < AS_NUMBER(b) ? AS_NUMBER(a) : AS_NUMBER(b))
+    TARGET(OP_MAX) :
+      MATH_OP(OP_MAX, 2, AS_NUMBER(a) > AS_NUMBER(b) ? AS_NUMBER(a) : AS_NUMBER(b))
+    TARGET(OP_POW) :
+      MATH_OP(OP_POW, 2, pow(AS_NUMBER(a), AS_NUMBER(b)))
+#undef MATH_OP
+    TARGET(OP_RETURN) :
+    {
+      Value result = pop(vm);
 
-static bool is_truthy(const Value value)
-{
-  if (IS_NIL(value))
-  {
-    return false;
+      // The callee and its arguments go away with the frame,
+      // the result takes the place of the callee.
+      close_upvalues(vm, slots);
+      vm->stack_top = slots;
+      vm->frame_count--;
+
+      if (vm->frame_count == 0)
+      {
+        return INTERPRET_OK;
+      }
+
+      push(vm, result);
+      vm->chunk = &vm->frames[vm->frame_count - 1].function->chunk;
+      vm->ip = vm->frames[vm->frame_count - 1].ip;
+      LOAD_FRAME();
+
+      if (vm->frame_count == base)
+      {
+        return INTERPRET_OK;
+      }
+      DISPATCH();
+    }
+    }
   }
 
-  if (IS_BOOL(value))
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_CONSTANT
+#undef READ_STRING
+#undef READ_GLOBAL_NAME
+#undef SAVE_IP
+#undef LOAD_FRAME
+#undef RUNTIME_ERROR
+#undef RUN_IF_HOT
+#undef BINARY_OP
+#undef BINARY_OP_CONSTANT
+#undef NOT_BOOL_VAL
+#undef QUICKEN
+#undef DEQUICKEN
+#undef GUESS_HOLDS
+#undef NUMBER_OP
+#undef DOUBLE_OPERANDS
+#undef QUICKEN_NUMBERS
+#undef TARGET
+#undef DISPATCH
+}
+
+// Replaces the rope in [reg], if there is one, with its flattened string.
+static void flatten_register(Vm *vm, Value *reg)
+{
+  if (IS_ROPE(*reg))
   {
-    return AS_BOOL(value);
+    *reg = OBJ_VAL((Obj *)flatten_rope(vm, AS_ROPE(*reg)));
   }
+}
 
-  if (IS_NUMBER(value))
+// Stores [a] + [b] in [result], which is a register.
+// Returns false after reporting a runtime error if [a] and [b]
+// are not two numbers or two strings.
+static bool add_to_register(Vm *vm, const uint32_t *ip, Value a, Value b, Value *result)
+{
+  if (IS_NUMBER(a) && IS_NUMBER(b))
   {
-    return AS_NUMBER(value) != 0;
+    *result = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+    return true;
   }
 
-  if (IS_STRING(value))
+  if ((IS_STRING(a) || IS_ROPE(a)) && (IS_STRING(b) || IS_ROPE(b)))
   {
-    return AS_OBJSTRING(value)->length > 0;
+    // The operands are pushed above the registers because
+    // [concatenate_strings] works on the top of the stack.
+    push(vm, a);
+    push(vm, b);
+    concatenate_strings(vm);
+    *result = pop(vm);
+    return true;
   }
 
-  return true;
+  register_runtime_error(vm, ip, "unexpected operands in with + operator");
+  return false;
 }
 
-static void concatenate_strings(Vm *vm)
+#if defined(USE_COMPUTED_GOTO) && !defined(__clang__)
+__attribute__((optimize("no-gcse", "no-crossjumping")))
+#endif
+static InterpretResult run_registers(Vm *vm)
 {
-  ObjString *b = AS_OBJSTRING(pop(vm));
-  ObjString *a = AS_OBJSTRING(pop(vm));
-
-  int length = a->length + b->length;
+  // The ip, registers and constants of the frame that is running.
+  // The code and constants arrays are not objects, they stay
+  // where they are when a collection moves the function.
+  const uint32_t *ip;
+  const Value *constants;
+  Value *registers;
 
-  // [length + 1] because we will add \0 to the end of the string.
-  char *chars = ALLOCATE(char, length + 1);
+#define SAVE_IP() (vm->frames[vm->frame_count - 1].register_ip = ip)
+// Registers are stack slots, the stack covers all of them so the
+// garbage collector sees their values. The ones from [from] up start
+// as nil: they belonged to the callee of a call that is done, which
+// may have left anything there, or to no frame at all.
+#define COVER_REGISTERS(from)                                           \
+  do                                                                    \
+  {                                                                     \
+    Value *top = registers + vm->chunk->registers.register_count;       \
+    for (Value *reg = (from); reg < top; reg++)                         \
+    {                                                                   \
+      *reg = NIL_VAL;                                                   \
+    }                                                                   \
+    vm->stack_top = top;                                                \
+  } while (false)
+// Starts running the function of the frame on top,
+// whose callee and arguments are in place.
+#define ENTER_FRAME()                                                   \
+  do                                                                    \
+  {                                                                     \
+    CallFrame *frame = &vm->frames[vm->frame_count - 1];                \
+    ip = vm->chunk->registers.code;                                     \
+    constants = vm->chunk->constants.values;                            \
+    registers = frame->slots;                                           \
+    COVER_REGISTERS(registers + frame->function->arity + 1);            \
+  } while (false)
+// Returns [value] from the frame that is running. The result
+// takes the place of the callee in the registers of the caller.
+#define RETURN(value)                                                   \
+  do                                                                    \
+  {                                                                     \
+    Value result = (value);                                             \
+    close_upvalues(vm, registers);                                      \
+    vm->frame_count--;                                                  \
+                                                                        \
+    if (vm->frame_count == 0)                                           \
+    {                                                                   \
+      return INTERPRET_OK;                                              \
+    }                                                                   \
+                                                                        \
+    Value *callee = registers;                                          \
+    *callee = result;                                                   \
+    CallFrame *frame = &vm->frames[vm->frame_count - 1];                \
+    vm->chunk = &frame->function->chunk;                                \
+    ip = frame->register_ip;                                            \
+    constants = vm->chunk->constants.values;                            \
+    registers = frame->slots;                                           \
+    COVER_REGISTERS(callee + 1);                                        \
+  } while (false)
 
-  // Copies every [a] character to [chars]
-  // starting from the beginning of [chars]
-  memcpy(chars, a->chars, a->length);
-  // Copies every [b] character to [chars]
-  // starting from the position after the last
-  // [a] character that was just copied.
-  memcpy(chars + a->length, b->chars, b->length);
+  ENTER_FRAME();
 
-  // Adding \0 to the end of the string because
-  // C functions expect strings to terminate in \0.
-  chars[length] = '\0';
+#define RA registers[REGISTER_A(instruction)]
+#define RB registers[REGISTER_B(instruction)]
+#define RC registers[REGISTER_C(instruction)]
+#define KC constants[REGISTER_C(instruction)]
+#define READ_GLOBAL_NAME(slot) AS_OBJSTRING(vm->global_names.values[slot])
+// R[A] = R[B] op [b] when both are numbers. The register machine
+// computes on doubles, an integer, which only a native returns,
+// is converted.
+#define BINARY_OP(value_type, op, b_value)                                  \
+  do                                                                        \
+  {                                                                         \
+    Value a = RB;                                                           \
+    Value b = (b_value);                                                    \
+    if (!BOTH_DOUBLES(a, b))                                                \
+    {                                                                       \
+      if (!IS_NUMBER(a) || !IS_NUMBER(b))                                   \
+      {                                                                     \
+        register_runtime_error(vm, ip, "Operands must be numbers");         \
+        return INTERPRET_RUNTIME_ERROR;                                     \
+      }                                                                     \
+      a = NUMBER_VAL(AS_NUMBER(a));                                         \
+      b = NUMBER_VAL(AS_NUMBER(b));                                         \
+    }                                                                       \
+    RA = value_type(AS_DOUBLE(a) op AS_DOUBLE(b));                          \
+  } while (false)
+// `a >= b` means `!(a < b)`, like on the stack machine.
+#define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
 
-  ObjString *result = take_string(vm, chars, length);
+#ifdef USE_COMPUTED_GOTO
+  // Every opcode must have an entry in this table.
+  static void *dispatch_table[] = {
+      [ROP_MOVE] = &&TARGET_ROP_MOVE,
+      [ROP_CONSTANT] = &&TARGET_ROP_CONSTANT,
+      [ROP_NIL] = &&TARGET_ROP_NIL,
+      [ROP_TRUE] = &&TARGET_ROP_TRUE,
+      [ROP_FALSE] = &&TARGET_ROP_FALSE,
+      [ROP_GET_GLOBAL] = &&TARGET_ROP_GET_GLOBAL,
+      [ROP_SET_GLOBAL] = &&TARGET_ROP_SET_GLOBAL,
+      [ROP_DEFINE_GLOBAL] = &&TARGET_ROP_DEFINE_GLOBAL,
+      [ROP_NEGATE] = &&TARGET_ROP_NEGATE,
+      [ROP_NOT] = &&TARGET_ROP_NOT,
+      [ROP_ADD] = &&TARGET_ROP_ADD,
+      [ROP_SUBTRACT] = &&TARGET_ROP_SUBTRACT,
+      [ROP_MULTIPLY] = &&TARGET_ROP_MULTIPLY,
+      [ROP_DIVIDE] = &&TARGET_ROP_DIVIDE,
+      [ROP_EQUAL] = &&TARGET_ROP_EQUAL,
+      [ROP_NOT_EQUAL] = &&TARGET_ROP_NOT_EQUAL,
+      [ROP_GREATER] = &&TARGET_ROP_GREATER,
+      [ROP_GREATER_EQUAL] = &&TARGET_ROP_GREATER_EQUAL,
+      [ROP_LESS] = &&TARGET_ROP_LESS,
+      [ROP_LESS_EQUAL] = &&TARGET_ROP_LESS_EQUAL,
+      [ROP_ADD_CONSTANT] = &&TARGET_ROP_ADD_CONSTANT,
+      [ROP_SUBTRACT_CONSTANT] = &&TARGET_ROP_SUBTRACT_CONSTANT,
+      [ROP_MULTIPLY_CONSTANT] = &&TARGET_ROP_MULTIPLY_CONSTANT,
+      [ROP_DIVIDE_CONSTANT] = &&TARGET_ROP_DIVIDE_CONSTANT,
+      [ROP_EQUAL_CONSTANT] = &&TARGET_ROP_EQUAL_CONSTANT,
+      [ROP_NOT_EQUAL_CONSTANT] = &&TARGET_ROP_NOT_EQUAL_CONSTANT,
+      [ROP_GREATER_CONSTANT] = &&TARGET_ROP_GREATER_CONSTANT,
+      [ROP_GREATER_EQUAL_CONSTANT] = &&TARGET_ROP_GREATER_EQUAL_CONSTANT,
+      [ROP_LESS_CONSTANT] = &&TARGET_ROP_LESS_CONSTANT,
+      [ROP_LESS_EQUAL_CONSTANT] = &&TARGET_ROP_LESS_EQUAL_CONSTANT,
+      [ROP_PRINT] = &&TARGET_ROP_PRINT,
+      [ROP_JUMP] = &&TARGET_ROP_JUMP,
+      [ROP_JUMP_IF_FALSE] = &&TARGET_ROP_JUMP_IF_FALSE,
+      [ROP_JUMP_IF_TRUE] = &&TARGET_ROP_JUMP_IF_TRUE,
+      [ROP_LOOP] = &&TARGET_ROP_LOOP,
+      [ROP_CALL] = &&TARGET_ROP_CALL,
+      [ROP_TAIL_CALL] = &&TARGET_ROP_TAIL_CALL,
+      [ROP_CLOSURE] = &&TARGET_ROP_CLOSURE,
+      [ROP_GET_UPVALUE] = &&TARGET_ROP_GET_UPVALUE,
+      [ROP_SET_UPVALUE] = &&TARGET_ROP_SET_UPVALUE,
+      [ROP_CLOSE_UPVALUES] = &&TARGET_ROP_CLOSE_UPVALUES,
+      [ROP_RETURN] = &&TARGET_ROP_RETURN,
+      [ROP_RETURN_NIL] = &&TARGET_ROP_RETURN_NIL,
+  };
 
-  push(vm, OBJ_VAL(result));
-}
+#define TARGET(opcode) \
+  TARGET_##opcode:     \
+  case opcode
+#define DISPATCH()        \
+  instruction = *ip++;    \
+  goto *dispatch_table[REGISTER_OPCODE(instruction)]
+#else
+#define TARGET(opcode) case opcode
+#define DISPATCH() break
+#endif
 
-static InterpretResult run(Vm *vm)
-{
-#define READ_BYTE() (*vm->ip++)
-#define READ_SHORT() (vm->ip += 2, (uint16_t)((vm->ip[-2] << 8) | vm->ip[-1]))
-#define READ_CONSTANT() (vm->chunk->constants.values[READ_BYTE()])
-#define READ_STRING() AS_OBJSTRING(READ_CONSTANT())
-#define BINARY_OP(value_type, op)                           \
-  do                                                        \
-  {                                                         \
-    if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) \
-    {                                                       \
-      runtime_error(vm, "Operands must be numbers");        \
-      return INTERPRET_RUNTIME_ERROR;                       \
-    }                                                       \
-    double b = AS_NUMBER(pop(vm));                          \
-    double a = AS_NUMBER(pop(vm));                          \
-    push(vm, value_type(a op b));                           \
-  } while (false)
+  uint32_t instruction;
 
   for (;;)
   {
 #ifdef DEBUG_TRACE_EXECUTION
-    printf("[START] Stack\n");
+    printf("[START] Registers\n");
 
-    for (Value *slot = vm->stack; slot < vm->stack_top; slot += 1)
+    for (int i = 0; i < vm->chunk->registers.register_count; i++)
     {
       printf("[ ");
-      print_value(*slot);
+      print_value(registers[i]);
       printf(" ]");
     }
 
-    printf("[END] Stack\n");
+    printf("[END] Registers\n");
 
-    dissamble_instruction(vm->chunk, vm->ip - vm->chunk->code);
+    dissamble_register_instruction(vm->chunk, ip - vm->chunk->registers.code);
 #endif
 
-    uint8_t instruction;
+#ifdef DEBUG_PROFILE_OPCODES
+    profile_register_opcode(REGISTER_OPCODE(*ip));
+#endif
 
-    switch (instruction = READ_BYTE())
+    instruction = *ip++;
+
+    switch (REGISTER_OPCODE(instruction))
     {
-    case OP_CONSTANT:
+    TARGET(ROP_MOVE) :
     {
-      Value constant = READ_CONSTANT();
-      push(vm, constant);
-      break;
+      RA = RB;
+      DISPATCH();
     }
-    case OP_NIL:
+    TARGET(ROP_CONSTANT) :
     {
-      push(vm, NIL_VAL);
-      break;
+      RA = constants[REGISTER_BX(instruction)];
+      DISPATCH();
     }
-    case OP_TRUE:
+    TARGET(ROP_NIL) :
     {
-      push(vm, BOOL_VAL(true));
-      break;
+      RA = NIL_VAL;
+      DISPATCH();
     }
-    case OP_FALSE:
+    TARGET(ROP_TRUE) :
     {
-      push(vm, BOOL_VAL(false));
-      break;
+      RA = BOOL_VAL(true);
+      DISPATCH();
     }
-    case OP_EQUAL:
+    TARGET(ROP_FALSE) :
     {
-      const Value b = pop(vm);
-      const Value a = pop(vm);
-      push(vm, BOOL_VAL(values_equal(a, b)));
-      break;
+      RA = BOOL_VAL(false);
+      DISPATCH();
+    }
+    TARGET(ROP_GET_GLOBAL) :
+    {
+      uint16_t slot = REGISTER_BX(instruction);
+      Value value = vm->global_values.values[slot];
+
+      if (IS_UNDEFINED(value))
+      {
+        register_runtime_error(vm, ip, "undefined variable '%s'", READ_GLOBAL_NAME(slot)->chars);
+        return INTERPRET_RUNTIME_ERROR;
+      }
+
+      RA = value;
+      DISPATCH();
     }
-    case OP_GREATER:
+    TARGET(ROP_SET_GLOBAL) :
     {
-      BINARY_OP(BOOL_VAL, >);
-      break;
+      uint16_t slot = REGISTER_BX(instruction);
+
+      if (IS_UNDEFINED(vm->global_values.values[slot]))
+      {
+        register_runtime_error(vm, ip, "undefined variable '%s'", READ_GLOBAL_NAME(slot)->chars);
+        return INTERPRET_RUNTIME_ERROR;
+      }
+
+      store_global(vm, slot, RA);
+      DISPATCH();
     }
-    case OP_LESS:
+    TARGET(ROP_DEFINE_GLOBAL) :
     {
-      BINARY_OP(BOOL_VAL, <);
-      break;
+      store_global(vm, REGISTER_BX(instruction), RA);
+      DISPATCH();
     }
-    case OP_NEGATE:
+    TARGET(ROP_NEGATE) :
     {
-      if (!IS_NUMBER(peek(vm, 0)))
+      if (!IS_NUMBER(RB))
       {
-        runtime_error(vm, "Operand must be a number");
+        register_runtime_error(vm, ip, "Operand must be a number");
         return INTERPRET_RUNTIME_ERROR;
       }
-      push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
-      break;
+      RA = NUMBER_VAL(-AS_NUMBER(RB));
+      DISPATCH();
     }
-    case OP_ADD:
+    TARGET(ROP_NOT) :
     {
-      Value a = peek(vm, 0);
-      Value b = peek(vm, 0);
-
-      if (IS_STRING(a) && IS_STRING(b))
+      RA = BOOL_VAL(value_not(RB));
+      DISPATCH();
+    }
+    TARGET(ROP_ADD) :
+    {
+      if (!add_to_register(vm, ip, RB, RC, &RA))
       {
-        concatenate_strings(vm);
+        return INTERPRET_RUNTIME_ERROR;
       }
-      else if (IS_NUMBER(a) && IS_NUMBER(b))
-        BINARY_OP(NUMBER_VAL, +);
-      else
+      DISPATCH();
+    }
+    TARGET(ROP_SUBTRACT) :
+    {
+      BINARY_OP(NUMBER_VAL, -, RC);
+      DISPATCH();
+    }
+    TARGET(ROP_MULTIPLY) :
+    {
+      BINARY_OP(NUMBER_VAL, *, RC);
+      DISPATCH();
+    }
+    TARGET(ROP_DIVIDE) :
+    {
+      BINARY_OP(NUMBER_VAL, /, RC);
+      DISPATCH();
+    }
+    TARGET(ROP_EQUAL) :
+    {
+      // [values_equal] compares strings, not ropes.
+      flatten_register(vm, &RB);
+      flatten_register(vm, &RC);
+      RA = BOOL_VAL(values_equal(RB, RC));
+      DISPATCH();
+    }
+    TARGET(ROP_NOT_EQUAL) :
+    {
+      flatten_register(vm, &RB);
+      flatten_register(vm, &RC);
+      RA = BOOL_VAL(!values_equal(RB, RC));
+      DISPATCH();
+    }
+    TARGET(ROP_GREATER) :
+    {
+      BINARY_OP(BOOL_VAL, >, RC);
+      DISPATCH();
+    }
+    TARGET(ROP_GREATER_EQUAL) :
+    {
+      BINARY_OP(NOT_BOOL_VAL, <, RC);
+      DISPATCH();
+    }
+    TARGET(ROP_LESS) :
+    {
+      BINARY_OP(BOOL_VAL, <, RC);
+      DISPATCH();
+    }
+    TARGET(ROP_LESS_EQUAL) :
+    {
+      BINARY_OP(NOT_BOOL_VAL, >, RC);
+      DISPATCH();
+    }
+    TARGET(ROP_ADD_CONSTANT) :
+    {
+      if (!add_to_register(vm, ip, RB, KC, &RA))
       {
-        runtime_error(vm, "unexpected operands in with + operator");
         return INTERPRET_RUNTIME_ERROR;
       }
-      break;
+      DISPATCH();
     }
-    case OP_SUBTRACT:
+    TARGET(ROP_SUBTRACT_CONSTANT) :
     {
-      BINARY_OP(NUMBER_VAL, -);
-      break;
+      BINARY_OP(NUMBER_VAL, -, KC);
+      DISPATCH();
     }
-    case OP_MULTIPLY:
+    TARGET(ROP_MULTIPLY_CONSTANT) :
     {
-      BINARY_OP(NUMBER_VAL, *);
-      break;
+      BINARY_OP(NUMBER_VAL, *, KC);
+      DISPATCH();
     }
-    case OP_DIVIDE:
+    TARGET(ROP_DIVIDE_CONSTANT) :
     {
-      BINARY_OP(NUMBER_VAL, /);
-      break;
+      BINARY_OP(NUMBER_VAL, /, KC);
+      DISPATCH();
     }
-    case OP_NOT:
+    TARGET(ROP_EQUAL_CONSTANT) :
     {
-      push(vm, BOOL_VAL(not(pop(vm))));
-      break;
+      // Constants are never ropes.
+      flatten_register(vm, &RB);
+      RA = BOOL_VAL(values_equal(RB, KC));
+      DISPATCH();
     }
-    case OP_PRINT:
+    TARGET(ROP_NOT_EQUAL_CONSTANT) :
     {
-      print_value(pop(vm));
+      flatten_register(vm, &RB);
+      RA = BOOL_VAL(!values_equal(RB, KC));
+      DISPATCH();
+    }
+    TARGET(ROP_GREATER_CONSTANT) :
+    {
+      BINARY_OP(BOOL_VAL, >, KC);
+      DISPATCH();
+    }
+    TARGET(ROP_GREATER_EQUAL_CONSTANT) :
+    {
+      BINARY_OP(NOT_BOOL_VAL, <, KC);
+      DISPATCH();
+    }
+    TARGET(ROP_LESS_CONSTANT) :
+    {
+      BINARY_OP(BOOL_VAL, <, KC);
+      DISPATCH();
+    }
+    TARGET(ROP_LESS_EQUAL_CONSTANT) :
+    {
+      BINARY_OP(NOT_BOOL_VAL, >, KC);
+      DISPATCH();
+    }
+    TARGET(ROP_PRINT) :
+    {
+      flatten_register(vm, &RA);
+      print_value(RA);
       printf("\n");
-      break;
+      DISPATCH();
     }
-    case OP_POP:
+    TARGET(ROP_JUMP) :
     {
-      pop(vm);
-      break;
+      ip += REGISTER_BX(instruction);
+      DISPATCH();
     }
-    case OP_DEFINE_GLOBAL:
+    TARGET(ROP_JUMP_IF_FALSE) :
     {
-      // NOTE: could we use an array and index into it
-      // instead of a hash table?
-      ObjString *identifier = READ_STRING();
-      hash_table_set(&vm->globals, identifier, peek(vm, 0));
-      // We pop the value after we added it to the vm global variables
-      // because the garbage collector may run while we are adding the
-      // identifier and its value to the globals table.
-      pop(vm);
-      break;
+      if (!is_truthy(RA))
+      {
+        ip += REGISTER_BX(instruction);
+      }
+      DISPATCH();
+    }
+    TARGET(ROP_JUMP_IF_TRUE) :
+    {
+      if (is_truthy(RA))
+      {
+        ip += REGISTER_BX(instruction);
+      }
+      DISPATCH();
+    }
+    TARGET(ROP_LOOP) :
+    {
+      ip -= REGISTER_BX(instruction);
+
+      if (vm->gc_state != GC_IDLE)
+      {
+        gc_safepoint(vm);
+      }
+      DISPATCH();
     }
-    case OP_GET_GLOBAL:
+    TARGET(ROP_CALL) :
     {
-      ObjString *identifier = READ_STRING();
+      Value *callee = &RA;
+      int argument_count = REGISTER_B(instruction);
+      vm->stack_top = callee + argument_count + 1;
+      SAVE_IP();
 
-      Value *value = hash_table_get(&vm->globals, identifier);
+      // Natives return before the next instruction,
+      // the frame that is running does not change.
+      if (IS_NATIVE(*callee))
+      {
+        if (!call_native(vm, AS_NATIVE(*callee), argument_count))
+        {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+
+        COVER_REGISTERS(callee + 1);
+        DISPATCH();
+      }
 
-      if (value == NULL)
+      if (!call_value(vm, *callee, argument_count))
       {
-        runtime_error(vm, "undefined variable '%s'", identifier->chars);
         return INTERPRET_RUNTIME_ERROR;
       }
 
-      push(vm, *value);
-      break;
+      ENTER_FRAME();
+      DISPATCH();
     }
-    case OP_SET_GLOBAL:
+    TARGET(ROP_TAIL_CALL) :
     {
-      ObjString *identifier = READ_STRING();
-      Value value = peek(vm, 0);
+      Value *callee = &RA;
+      int argument_count = REGISTER_B(instruction);
+      vm->stack_top = callee + argument_count + 1;
+      SAVE_IP();
 
-      bool variable_wasnt_in_table = hash_table_set(&vm->globals, identifier, value);
+      // The ROP_RETURN that follows returns the result of a native.
+      if (IS_NATIVE(*callee))
+      {
+        if (!call_native(vm, AS_NATIVE(*callee), argument_count))
+        {
+          return INTERPRET_RUNTIME_ERROR;
+        }
 
-      // Remove [value] from the stack because
-      // assignment is not an expression.
-      pop(vm);
+        COVER_REGISTERS(callee + 1);
+        DISPATCH();
+      }
 
-      if (variable_wasnt_in_table)
+      if (!tail_call_value(vm, *callee, argument_count))
       {
-        hash_table_delete(&vm->globals, identifier);
-        runtime_error("undefined variable '%s'", identifier->chars);
         return INTERPRET_RUNTIME_ERROR;
       }
 
-      break;
+      ENTER_FRAME();
+      DISPATCH();
     }
-    case OP_GET_LOCAL:
+    TARGET(ROP_CLOSURE) :
     {
-      // We push the value onto the stack because
-      // other operations expect values to always be at the top
-      // of the stack.
-      uint8_t slot = READ_BYTE();
-
-      push(vm, vm->stack[slot]);
-      break;
+      vm_closure(vm, REGISTER_BX(instruction));
+      RA = pop(vm);
+      DISPATCH();
     }
-    case OP_SET_LOCAL:
+    TARGET(ROP_GET_UPVALUE) :
     {
-      uint8_t slot = READ_BYTE();
-
-      vm->stack[slot] = pop(vm);
-      break;
+      RA = *AS_CLOSURE(registers[0])->upvalues[REGISTER_B(instruction)]->location;
+      DISPATCH();
     }
-    case OP_JUMP_IF_FALSE:
+    TARGET(ROP_SET_UPVALUE) :
     {
-      int16_t offset = READ_SHORT();
-      if (!is_truthy(peek(vm, 0)))
+      ObjUpvalue *upvalue = AS_CLOSURE(registers[0])->upvalues[REGISTER_B(instruction)];
+      *upvalue->location = RA;
+
+      // Storing a value that is not an object needs no write barrier.
+      if (IS_OBJ(RA))
       {
-        vm->ip += offset;
+        write_barrier(vm, (Obj *)upvalue, RA);
       }
-      break;
+      DISPATCH();
     }
-    case OP_JUMP:
+    TARGET(ROP_CLOSE_UPVALUES) :
     {
-      uint16_t offset = READ_SHORT();
-      vm->ip += offset;
-      break;
+      close_upvalues(vm, &RA);
+      DISPATCH();
     }
-    case OP_LOOP:
+    TARGET(ROP_RETURN) :
     {
-      uint16_t offset = READ_SHORT();
-      vm->ip -= offset;
-      break;
+      RETURN(RA);
+      DISPATCH();
+    }
+    TARGET(ROP_RETURN_NIL) :
+    {
+      RETURN(NIL_VAL);
+      DISPATCH();
     }
-    case OP_RETURN:
-      return INTERPRET_OK;
     }
   }
 
-#undef READ_BYTE
-#undef READ_SHORT
-#undef READ_CONSTANT
-#undef READ_STRING
+#undef SAVE_IP
+#undef COVER_REGISTERS
+#undef ENTER_FRAME
+#undef RETURN
+#undef RA
+#undef RB
+#undef RC
+#undef KC
+#undef READ_GLOBAL_NAME
 #undef BINARY_OP
+#undef NOT_BOOL_VAL
+#undef TARGET
+#undef DISPATCH
 }
 
+#ifdef USE_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
 InterpretResult interpret(Vm *vm, const char *source_code)
 {
-  Chunk chunk = new_chunk();
+  ObjFunction *function = compile(vm, source_code);
 
-  if (!compile(vm, source_code, &chunk))
+  if (function == NULL)
   {
-    free_chunk(&chunk);
     return INTERPRET_COMPILE_ERROR;
   }
 
-  vm->chunk = &chunk;
+  // The compiler reserves stack slot zero for the function
+  // that is being executed, so locals start at slot one.
+  push(vm, OBJ_VAL((Obj *)function));
+
+  CallFrame *frame = &vm->frames[vm->frame_count++];
+  frame->function = function;
+  frame->slots = vm->stack;
+
+  vm->chunk = &function->chunk;
   vm->ip = vm->chunk->code;
 
-  InterpretResult result = run(vm);
+  InterpretResult result = vm->chunk->registers.count > 0 ? run_registers(vm) : run(vm);
 
-  free_chunk(&chunk);
+  // The function will be freed by the garbage collector,
+  // we only need to release its stack slot.
+  reset_stack(vm);
+  vm->chunk = NULL;
+  vm->ip = NULL;
 
   return result;
 }
 
+int resolve_global(Vm *vm, ObjString *name)
+{
+  Value *slot = hash_table_get(&vm->globals, name);
+
+  if (slot != NULL)
+  {
+    return AS_INTEGER(*slot);
+  }
+
+  int new_slot = vm->global_values.count;
+
+  // [name] may not be reachable from any root
+  // until it has been added to [global_names].
+  push(vm, OBJ_VAL((Obj *)name));
+  write_value_array(&vm->global_values, UNDEFINED_VAL);
+  write_value_array(&vm->global_names, OBJ_VAL((Obj *)name));
+  hash_table_set(&vm->globals, name, INTEGER_VAL(new_slot));
+  pop(vm);
+
+  if (is_young(&vm->nursery, (Obj *)name))
+  {
+    remember_global(vm, new_slot);
+  }
+
+  if (vm->gc_state == GC_MARKING)
+  {
+    mark_object(vm, (Obj *)name);
+  }
+
+  return new_slot;
+}
+
+static ObjNative *define_native_global(Vm *vm, const char *name, int arity)
+{
+  ObjString *string = copy_string(vm, name, (int)strlen(name));
+  int slot = resolve_global(vm, string);
+  ObjNative *native = new_native(vm, name, arity);
+  store_global(vm, slot, OBJ_VAL((Obj *)native));
+  return native;
+}
+
+void define_native(Vm *vm, const char *name, int arity, NativeFunction function)
+{
+  define_native_global(vm, name, arity)->function.values = function;
+}
+
+void define_number_native(Vm *vm, const char *name, int arity, NumberFunction function)
+{
+  ObjNative *native = define_native_global(vm, name, arity);
+  native->takes_numbers = true;
+  native->function.numbers = function;
+}
+
 void push(Vm *vm, Value value)
 {
   *vm->stack_top = value;
@@ -4,17 +4,68 @@
 #include "chunk.h"
 #include "value.h"
 #include "hash_table.h"
+#include "memory.h"
 
-#define STACK_MAX 256
+// Calls can nest [FRAMES_MAX] deep and every frame
+// can use the [UINT8_COUNT] slots a chunk can address.
+#define FRAMES_MAX 64
+#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
 
+// A function call that is running.
+//
+// The frames are an array in the vm instead of being allocated
+// per call, and the arguments are not copied: the caller pushes the
+// callee and then the arguments, and the callee's window of stack
+// slots starts at the callee, so the arguments already are
+// its locals one and up.
 typedef struct
 {
+  ObjFunction *function;
+  // Where the caller carries on once the frame it called returns.
+  // The frame that is running keeps its ip in [Vm.ip].
+  uint8_t *ip;
+  // The same for register code, but the frame that is running also
+  // saves its ip here before anything that can fail, see [run_registers].
+  const uint32_t *register_ip;
+  Value *slots;
+} CallFrame;
+
+// What the tracing JIT has done so far, see trace.h.
+typedef struct
+{
+  uint64_t recorded;
+  uint64_t aborted;
+  uint64_t blacklisted;
+  uint64_t entries;
+  // Entries that left the trace before the loop was done.
+  uint64_t side_exits;
+  uint64_t iterations;
+} TraceStats;
+
+typedef struct Vm
+{
+  // The chunk of the frame that is running and where in it.
   Chunk *chunk;
   uint8_t *ip;
+  CallFrame frames[FRAMES_MAX];
+  int frame_count;
   Value stack[STACK_MAX];
   Value *stack_top;
-  // Linked list of every heap allocated object.
+  // The upvalues that still point into [stack], see ObjUpvalue.
+  struct ObjUpvalue *open_upvalues;
+  // Linked list of every object in the old generation.
   Obj *objects;
+  // Young objects are allocated in the [nursery]
+  // and are not in [objects] until they survive a minor collection.
+  Nursery nursery;
+  // Old objects that may reference young objects.
+  int remembered_count;
+  int remembered_capacity;
+  Obj **remembered;
+  // Slots of the global variables that may hold young objects.
+  int remembered_global_count;
+  int remembered_global_capacity;
+  int *remembered_globals;
   // [strings] is used for string interning.
   //
   // String interning is a process of deduplication.
@@ -29,10 +80,77 @@ typedef struct
   // Since we will always have the same pointer for strings
   // with the same contents, string comparison is O(1).
   HashTable strings;
-  // [globals] stores global variables.
+  // [globals] maps the name of every global variable
+  // the compiler has seen to its slot in [global_values].
+  //
+  // Names are resolved to slots at compile time,
+  // so the vm never hashes a name when a global is accessed.
   HashTable globals;
+  // [global_values] is indexed by the global variable slot.
+  // A slot holds UNDEFINED_VAL until the variable is defined.
+  ValueArray global_values;
+  // [global_names] is indexed by the global variable slot
+  // and is used to report errors.
+  ValueArray global_names;
+  // The natives the math instructions compute inline, indexed by the
+  // opcode minus OP_SQRT. An instruction whose global holds anything
+  // else calls it instead. They are old and kept alive, so no other
+  // object ever takes their address.
+  Value intrinsics[INTRINSIC_COUNT];
+  // [bytes_allocated] is the number of bytes
+  // the vm has allocated and not freed yet.
+  size_t bytes_allocated;
+  // The garbage collector runs when [bytes_allocated]
+  // goes past [next_gc].
+  size_t next_gc;
+  // Objects that have been marked by the garbage collector
+  // but whose references have not been traced yet.
+  int gray_count;
+  int gray_capacity;
+  Obj **gray_stack;
+  // State of the incremental collection in progress, if any.
+  GcState gc_state;
+  bool gc_incremental;
+  int gc_slice_budget;
+  // Old objects an incremental collection has not swept yet.
+  // Survivors are moved back to [objects].
+  Obj *sweep_list;
+  // The collector can be entered again while it is running,
+  // only the outermost entry counts as a pause.
+  int gc_pause_depth;
+  uint64_t gc_pause_start;
+  GcPauseHistogram gc_pauses;
+  // Compile with the optimizing tier, which takes longer
+  // to compile but produces faster code. Set by `-O`.
+  bool optimize;
+  // Compile to code for the register machine instead of
+  // the stack machine, see [RegisterCode]. Set by `-R`.
+  bool register_machine;
+  // Compile hot chunks to machine code, see jit.h.
+  // Cleared by `-I` to only interpret.
+  bool jit_enabled;
+  TraceStats trace_stats;
 } Vm;
 
+// A native function that works on values. [arguments] points to
+// its arguments on the stack and the result is stored in
+// [arguments[-1]], the slot of the callee.
+// Returns false after reporting a runtime error.
+typedef bool (*NativeFunction)(Vm *vm, Value *arguments);
+// A native function that takes [arity] doubles and returns a double,
+// like `double sqrt(double)`. It is stored as this type and called
+// as the type it has, like the C functions the JIT calls.
+typedef void (*NumberFunction)(void);
+
+// The C the ahead-of-time compiler wrote for the chunk of a function,
+// see aot.h. Runs the frame that is running until it returns or until
+// a tail call hands the frame to another function.
+// Returns false after reporting a runtime error.
+typedef bool (*AotFunction)(Vm *vm);
+
+// Number natives can take up to this many arguments.
+#define NUMBER_NATIVE_MAX_ARITY 2
+
 typedef enum
 {
   INTERPRET_OK,
@@ -40,11 +158,63 @@ typedef enum
   INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-Vm new_vm();
+// Initializes [vm] where it lives and registers it with the garbage
+// collector, see [register_vm_for_gc]. The vm must stay there until
+// [free_vm], a copy would point into the stack of the original.
 void init_vm(Vm *vm);
 void free_vm(Vm *vm);
 InterpretResult interpret(Vm *vm, const char *source_code);
 void push(Vm *vm, Value value);
 Value pop(Vm *vm);
+// Returns the slot of the global variable called [name],
+// creating an undefined slot if the variable has not been seen before.
+int resolve_global(Vm *vm, ObjString *name);
+// Defines the global variable [name] as a native function
+// called with [arity] arguments. [name] must outlive the vm.
+void define_native(Vm *vm, const char *name, int arity, NativeFunction function);
+// Like [define_native] for a C function that takes [arity] doubles
+// and returns a double. The vm checks that the arguments are numbers
+// and passes them straight from the stack, unboxed, so the
+// function does not have to know about values.
+void define_number_native(Vm *vm, const char *name, int arity, NumberFunction function);
+
+// The C functions code compiled from the bytecode calls, by the JIT
+// and by the ahead-of-time compiler. They work on the stack like the
+// instructions in [run] and expect [vm->stack_top] and [vm->ip]
+// to be up to date.
+//
+// Returns false after reporting a runtime error.
+bool vm_add(Vm *vm);
+void vm_equal(Vm *vm);
+void vm_not_equal(Vm *vm);
+void vm_print(Vm *vm);
+void vm_define_global(Vm *vm, int slot);
+void vm_store_global(Vm *vm, int slot, Value value);
+void vm_runtime_error(Vm *vm, const char *message);
+void vm_undefined_variable(Vm *vm, int slot);
+// Calls the value below the [argument_count] arguments on top
+// of the stack and runs it until it returns. The result takes
+// the place of the callee and the arguments.
+bool vm_call(Vm *vm, int argument_count);
+// Like [vm_call] for OP_TAIL_CALL, a function callee takes over the
+// frame that is running and is left for the caller to run, with
+// [vm->ip] at the start of its chunk. Anything else is called and
+// done when it returns.
+bool vm_tail_call(Vm *vm, int argument_count);
+// Returns the value on top of the stack from the frame that is running,
+// like OP_RETURN.
+void vm_return(Vm *vm);
+// Calls what global [slot] holds with the [argument_count] arguments
+// on top of the stack, for a math instruction that can not compute
+// its native inline. The result takes the place of the arguments.
+bool vm_call_global(Vm *vm, int slot, int argument_count);
+// Pushes a closure of the function in [constant] of [vm->chunk],
+// capturing its upvalues from the frame that is running.
+void vm_closure(Vm *vm, int constant);
+// Stores the top of the stack in upvalue [index] of the closure
+// that is running.
+void vm_set_upvalue(Vm *vm, int index);
+// Closes the upvalue of the local on top of the stack and pops it.
+void vm_close_upvalue(Vm *vm);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,163 @@
+#!/bin/bash
+# Runs the test scripts and checks that every way of running them agrees.
+#
+# Every tests/**/*.lang is run with the interpreter (-I), which must print
+# what the .out file next to it holds: stdout, then stderr, then
+# `exit: N` when the script does not exit with 0. Then it must print the
+# same when it runs
+#
+# - with the JIT, -O, -R and -O -R,
+# - in builds with DEBUG_STRESS_JIT, with DEBUG_STRESS_GC, with
+#   INCREMENTAL_GC, with the baseline JIT but no TRACING_JIT, without
+#   LAZY_STRING_INTERNING and with the tagged union instead of NaN boxing,
+# - in a build with AddressSanitizer and UndefinedBehaviorSanitizer,
+# - as the C program `-C` writes, built against the default build and
+#   against the tagged union build.
+#
+# The benchmarks have no .out file, they are only compared to the
+# interpreter in the default build.
+#
+# Usage: tests/run.sh [--update] [script.lang...]
+# --update rewrites the .out files from the interpreter.
+# CC and CFLAGS pick the C compiler, a build with warnings fails.
+
+set -u
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+cc=${CC:-gcc}
+cflags=${CFLAGS:-"-O2 -Wall -Wextra -Wpedantic"}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+update=false
+if [ "${1:-}" = "--update" ]; then
+  update=true
+  shift
+fi
+
+if [ $# -gt 0 ]; then
+  tests=("$@")
+else
+  mapfile -t tests < <(find "$root/tests" -name '*.lang' | sort)
+fi
+
+failures=0
+
+fail() {
+  echo "FAIL $*"
+  failures=$((failures + 1))
+}
+
+# build <name> <sed expression for common.h> [extra cflags]
+build() {
+  local dir="$work/$1"
+  mkdir -p "$dir"
+  cp "$root"/src/*.c "$root"/src/*.h "$dir/"
+  sed -i -e 's|^#define DEBUG_PRINT_CODE|// #define DEBUG_PRINT_CODE|' -e "$2" "$dir/common.h"
+
+  local flags="$cflags ${3:-}"
+
+  if ! (cd "$dir" && $cc $flags -c *.c 2>"$dir/warnings" && $cc $flags *.o -lm -o clox 2>>"$dir/warnings") ||
+    [ -s "$dir/warnings" ]; then
+    fail "build $1"
+    cat "$dir/warnings"
+  fi
+}
+
+# run <command...> prints what the command prints in the .out format.
+run() {
+  "$@" >"$work/stdout" 2>"$work/stderr"
+  local status=$?
+  cat "$work/stdout"
+  cat "$work/stderr"
+  if [ $status -ne 0 ]; then
+    echo "exit: $status"
+  fi
+}
+
+# check <description> <expected> <actual>
+check() {
+  if [ "$2" != "$3" ]; then
+    fail "$1"
+    diff <(echo "$2") <(echo "$3") | head -10
+  fi
+}
+
+build default ''
+build stress_jit 's|^// #define DEBUG_STRESS_JIT|#define DEBUG_STRESS_JIT|'
+build stress_gc 's|^// #define DEBUG_STRESS_GC|#define DEBUG_STRESS_GC|'
+build incremental_gc 's|^// #define INCREMENTAL_GC|#define INCREMENTAL_GC|'
+build baseline_jit 's|^#define TRACING_JIT|// #define TRACING_JIT|'
+build eager_interning 's|^#define LAZY_STRING_INTERNING|// #define LAZY_STRING_INTERNING|'
+build union 's|^#define NAN_BOXING|// #define NAN_BOXING|'
+build sanitize '' '-g -fsanitize=address,undefined -fno-sanitize-recover=undefined'
+
+builds=(default stress_jit stress_gc incremental_gc baseline_jit eager_interning union sanitize)
+
+if [ $failures -ne 0 ]; then
+  exit 1
+fi
+
+clox="timeout 60 $work/default/clox"
+# The C the compiler writes is built against the headers and the
+# objects of these builds.
+aot_builds=(default union)
+
+for test in "${tests[@]}"; do
+  name=${test#"$root"/}
+  out=${test%.lang}.out
+  actual=$(run $clox -I "$test")
+
+  if $update; then
+    echo "$actual" >"$out"
+    continue
+  fi
+
+  if [ ! -f "$out" ]; then
+    fail "$name has no .out file"
+    continue
+  fi
+
+  expected=$(cat "$out")
+  check "$name -I" "$expected" "$actual"
+
+  for build in "${builds[@]}"; do
+    for mode in "" "-I" "-O" "-R" "-O -R"; do
+      check "$name $build $mode" "$expected" "$(run timeout 60 "$work/$build/clox" $mode "$test")"
+    done
+  done
+
+  for build in "${aot_builds[@]}"; do
+    runtime=$(ls "$work/$build"/*.o | grep -v '/main\.o$')
+
+    for mode in "" "-O"; do
+      program="$work/aot_program"
+      compiled=$(run timeout 60 "$work/$build/clox" $mode -C "$program.c" "$test")
+
+      if [ -n "$compiled" ]; then
+        check "$name $build -C $mode" "$expected" "$compiled"
+      elif $cc -O2 -I "$work/$build" "$program.c" $runtime -lm -o "$program"; then
+        check "$name $build -C $mode" "$expected" "$(run timeout 60 "$program")"
+      else
+        fail "$name $build -C $mode does not compile"
+      fi
+    done
+  done
+done
+
+if [ $# -eq 0 ] && ! $update; then
+  for benchmark in "$root"/benchmarks/*.lang; do
+    expected=$(run $clox -I "$benchmark")
+
+    for mode in "" "-O" "-R" "-O -R"; do
+      check "${benchmark#"$root"/} $mode" "$expected" "$(run $clox $mode "$benchmark")"
+    done
+  done
+fi
+
+if [ $failures -ne 0 ]; then
+  echo "$failures failed"
+  exit 1
+fi
+
+echo "all passed"